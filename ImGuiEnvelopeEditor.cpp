@@ -3,7 +3,17 @@
 #include <SDL2/SDL.h>
 #include <GL/glew.h>
 #include "ImGuiEnvelopeEditor.h"
+#include "envelope_polyline.h"
 #include <iostream>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <map>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 
 void calculatePlotDerivatives ( float *plotdata, float *derivs, int width )
@@ -39,19 +49,18 @@ uint32_t packRGB ( ImColor col )
 #define CLAMP(x, min, max) x = ( x < min ? min : ( x > max ? max : x ) )
 
 
-ImTextureID sdlImpl_drawEnvelopePlot ( float *plotData, float *plotDerivatives, int width, int height, ImColor bgColour,
-        ImColor fgColour, float lineWidth )
+/* Rasterises a plot into plot, which must hold width * height pixels. Doesn't touch the GPU so it is safe to call
+ * from the tile worker */
+void rasterizeEnvelopePlot ( float *plotData, float *plotDerivatives, int width, int height, ImColor bgColour,
+        ImColor fgColour, float lineWidth, uint32_t *plot )
 {
-    uint32_t fgColourPacked, bgColourPacked, *plot;
+    uint32_t fgColourPacked, bgColourPacked;
     int i, x, y, xmax, ymax;
     float theta, k, hypot, costheta, sintheta, j;
-    GLuint tex;
 
     xmax = width - 1;
     ymax = height - 1;
 
-    plot = (uint32_t*) malloc ( sizeof ( uint32_t ) * width * height );
-
     // Convert float colours into packed RGB form
     fgColourPacked = packRGB ( fgColour );
     bgColourPacked = packRGB ( bgColour );
@@ -89,6 +98,11 @@ ImTextureID sdlImpl_drawEnvelopePlot ( float *plotData, float *plotDerivatives,
             }
         }
     }
+}
+
+ImTextureID sdlImpl_uploadPlotImage ( uint32_t *plot, int width, int height )
+{
+    GLuint tex;
 
     glGenTextures ( 1, &tex );
     glBindTexture ( GL_TEXTURE_2D, tex );
@@ -100,9 +114,23 @@ ImTextureID sdlImpl_drawEnvelopePlot ( float *plotData, float *plotDerivatives,
 
     glBindTexture(GL_TEXTURE_2D, 0);
 
+    return (ImTextureID)(intptr_t)tex;
+}
+
+ImTextureID sdlImpl_drawEnvelopePlot ( float *plotData, float *plotDerivatives, int width, int height, ImColor bgColour,
+        ImColor fgColour, float lineWidth )
+{
+    uint32_t *plot;
+    ImTextureID tex;
+
+    plot = (uint32_t*) malloc ( sizeof ( uint32_t ) * width * height );
+
+    rasterizeEnvelopePlot ( plotData, plotDerivatives, width, height, bgColour, fgColour, lineWidth, plot );
+    tex = sdlImpl_uploadPlotImage ( plot, width, height );
+
     free ( plot );
 
-    return (ImTextureID)(intptr_t)tex;
+    return tex;
 }
 
 void sdlImpl_free_image ( ImTextureID img )
@@ -114,27 +142,593 @@ void sdlImpl_free_image ( ImTextureID img )
 ImTextureID ( *drawEnvelopePlot )( float* plotData, float* plotDerivatives, int width, int height, ImColor bgColour,
         ImColor fgColour, float lineWidth ) = &sdlImpl_drawEnvelopePlot;
 
+ImTextureID ( *uploadPlotImage )( uint32_t *plot, int width, int height ) = &sdlImpl_uploadPlotImage;
+
 void (*free_image) ( ImTextureID img ) = &sdlImpl_free_image;
 
+/* Called from the tile worker when a tile is ready, set by the app so an idle main loop draws it */
+void (*wakeEditor) ( ) = nullptr;
+
+
+/***********************************************************************************************************************
+ * Tile cache
+ *
+ * The plot is split into EDITOR_TILE_WIDTH pixel wide tiles keyed by zoom level and tile index. Tiles are plotted and
+ * rasterised by a worker thread from a snapshot of the envelope, then uploaded on the UI thread. Edits only invalidate
+ * the tiles covering the time range that changed.
+ **********************************************************************************************************************/
+
+#define EDITOR_TILE_WIDTH 256
+#define EDITOR_MAX_TILES  512
+#define EDITOR_MAX_ZOOM   64
+
+typedef struct EditorTile
+{
+    ImTextureID tex     = NULL;
+    bool dirty          = true;
+    bool queued         = false;
+    int lastVisibleFrame = 0;
+} EditorTile;
+
+typedef struct EditorTileJob
+{
+    int64_t key;
+    double start;
+    double end;
+    int height;
+    int generation;
+    ImColor bgColour;
+    ImColor fgColour;
+    float lineWidth;
+    std::shared_ptr<envelope> snapshot;
+} EditorTileJob;
+
+typedef struct EditorTileResult
+{
+    int64_t key;
+    std::vector<uint32_t> pixels;
+    int generation;
+} EditorTileResult;
+
+struct ImGui::Ext::EnvelopeEditorTileCache
+{
+    std::map<int64_t, EditorTile> tiles;
+    std::deque<EditorTileJob> jobs;
+    std::vector<EditorTileResult> results;
+    std::shared_ptr<envelope> snapshot;
+    bool snapshotDirty = true;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread worker;
+    bool stop = false;
+    int frame = 0;
+    int generation = 0;
+    double baseScale = 0;
+    float height = 0;
+    double minVal = 0;
+    double maxVal = 0;
+};
+
+static inline int64_t tileKey ( int zoomLevel, int64_t index )
+{
+    return ( (int64_t) zoomLevel << 48 ) | ( index & 0xFFFFFFFFFFFF );
+}
+
+static inline int tileZoomLevel ( int64_t key )
+{
+    return (int) ( key >> 48 );
+}
+
+static inline int64_t tileIndex ( int64_t key )
+{
+    return key & 0xFFFFFFFFFFFF;
+}
+
+/* The time range of a tile, zoom level 0 is baseScale pixels per second and each level zooms in by 2^(1/4) */
+static inline void tileRange ( double baseScale, int zoomLevel, int64_t index, double *start, double *end )
+{
+    double duration = EDITOR_TILE_WIDTH / ( baseScale * pow ( 2, zoomLevel / 4.0 ) );
+
+    *start = index * duration;
+    *end   = *start + duration;
+}
+
+static void tileWorker ( ImGui::Ext::EnvelopeEditorTileCache *cache )
+{
+    EditorTileJob job;
+    EditorTileResult result;
+    std::vector<float> plotData, plotDerivatives;
+    std::vector<uint32_t> plot;
+    int pad, width, row;
+    double padTime;
+
+    for ( ;; )
+    {
+        {
+            std::unique_lock<std::mutex> guard ( cache->lock );
+
+            cache->wake.wait ( guard, [cache] { return cache->stop || ! cache->jobs.empty ( ); } );
+
+            if ( cache->stop )
+            {
+                return;
+            }
+
+            job = cache->jobs.front ( );
+            cache->jobs.pop_front ( );
+        }
+
+        /* Plot a little either side of the tile so the line isn't cut off at the edges */
+        pad     = (int) ceilf ( job.lineWidth ) + 1;
+        width   = EDITOR_TILE_WIDTH + 2 * pad;
+        padTime = ( job.end - job.start ) * pad / EDITOR_TILE_WIDTH;
+
+        plotData.resize ( width );
+        plotDerivatives.resize ( width );
+        plot.resize ( width * job.height );
+
+        plot_envelope_range ( job.snapshot.get ( ), job.start - padTime, job.end + padTime, width, job.height,
+                plotData.data ( ) );
+        calculatePlotDerivatives ( plotData.data ( ), plotDerivatives.data ( ), width );
+        rasterizeEnvelopePlot ( plotData.data ( ), plotDerivatives.data ( ), width, job.height, job.bgColour,
+                job.fgColour, job.lineWidth, plot.data ( ) );
+
+        result.key        = job.key;
+        result.generation = job.generation;
+        result.pixels.resize ( EDITOR_TILE_WIDTH * job.height );
+
+        for ( row = 0; row < job.height; row++ )
+        {
+            memcpy ( &result.pixels [ row * EDITOR_TILE_WIDTH ], &plot [ row * width + pad ],
+                    EDITOR_TILE_WIDTH * sizeof ( uint32_t ) );
+        }
+
+        {
+            std::lock_guard<std::mutex> guard ( cache->lock );
+            cache->results.push_back ( std::move ( result ) );
+        }
+
+        if ( wakeEditor )
+        {
+            (*wakeEditor) ( );
+        }
+    }
+}
+
+static void flushTiles ( ImGui::Ext::EnvelopeEditorTileCache *cache )
+{
+    std::lock_guard<std::mutex> guard ( cache->lock );
+
+    for ( auto &tile : cache->tiles )
+    {
+        if ( tile.second.tex )
+        {
+            free_image ( tile.second.tex );
+        }
+    }
+
+    cache->tiles.clear ( );
+    cache->jobs.clear ( );
+    cache->results.clear ( );
+    cache->generation++;
+}
+
+/* Marks the tiles at every zoom level that overlap [start, end] as needing a re-plot */
+static void invalidateTiles ( ImGui::Ext::EnvelopeEditorContext *context, double start, double end )
+{
+    ImGui::Ext::EnvelopeEditorTileCache *cache = context->_tiles;
+    double tileStart, tileEnd;
+
+    if ( ! cache )
+    {
+        return;
+    }
+
+    for ( auto &tile : cache->tiles )
+    {
+        tileRange ( cache->baseScale, tileZoomLevel ( tile.first ), tileIndex ( tile.first ), &tileStart, &tileEnd );
+
+        if ( tileStart <= end && tileEnd >= start )
+        {
+            tile.second.dirty = true;
+        }
+    }
+
+    cache->snapshotDirty = true;
+}
+
+/* Listens to the envelope being edited so that any change to it, from here or elsewhere, re-plots what it touched */
+static void envelopeChanged ( envelope *env, double start, double end, void *user )
+{
+    (void) env;
+    invalidateTiles ( (ImGui::Ext::EnvelopeEditorContext*) user, start, end );
+}
+
+/* Uploads finished tiles, requests any visible tiles that are missing or dirty and draws them. Tiles are kept for
+ * every zoom level, so zooming back out reuses them. Returns false while any visible tile is missing or being
+ * re-plotted */
+static bool drawTiles ( ImGui::Ext::EnvelopeEditorContext *context, ImVec2 windowOffset, ImVec2 plotArea,
+        double panOffset )
+{
+    ImGui::Ext::EnvelopeEditorTileCache *cache = context->_tiles;
+    std::vector<EditorTileResult> results;
+    EditorTileJob job;
+    int64_t first, last, index;
+    double x, baseScale = plotArea.x / context->_viewMaxTime;
+    bool ready = true;
+
+    if ( ! cache )
+    {
+        cache = context->_tiles = new ImGui::Ext::EnvelopeEditorTileCache ( );
+        cache->worker = std::thread ( tileWorker, cache );
+    }
+
+    if ( context->_updatePlot || cache->baseScale != baseScale || cache->height != plotArea.y
+    ||   cache->minVal != context->_viewMinVal || cache->maxVal != context->_viewMaxVal )
+    {
+        flushTiles ( cache );
+
+        cache->baseScale     = baseScale;
+        cache->height        = plotArea.y;
+        cache->minVal        = context->_viewMinVal;
+        cache->maxVal        = context->_viewMaxVal;
+        cache->snapshotDirty = true;
+
+        context->_updatePlot = false;
+    }
+
+    if ( cache->snapshotDirty )
+    {
+        cache->snapshot      = std::shared_ptr<envelope> ( copy_envelope ( context->env ), free_env );
+        cache->snapshotDirty = false;
+
+        // Plotted against the editor's range rather than the envelope's own bounds
+        cache->snapshot->minVal = cache->minVal;
+        cache->snapshot->maxVal = cache->maxVal;
+    }
+
+    cache->frame++;
+
+    {
+        std::lock_guard<std::mutex> guard ( cache->lock );
+        results.swap ( cache->results );
+    }
+
+    for ( EditorTileResult &result : results )
+    {
+        auto tile = cache->tiles.find ( result.key );
+
+        if ( tile == cache->tiles.end ( ) || result.generation != cache->generation )
+        {
+            continue;
+        }
+
+        if ( tile->second.tex )
+        {
+            free_image ( tile->second.tex );
+        }
+
+        tile->second.tex    = (*uploadPlotImage) ( result.pixels.data ( ), EDITOR_TILE_WIDTH, (int) plotArea.y );
+        tile->second.queued = false;
+    }
+
+    ImGui::GetWindowDrawList ( )->AddRectFilled ( windowOffset,
+            ImVec2 ( windowOffset.x + plotArea.x, windowOffset.y + plotArea.y ), packRGB ( context->bgColour ) );
+
+    first = (int64_t) floor ( panOffset / EDITOR_TILE_WIDTH );
+    last  = (int64_t) floor ( ( panOffset + plotArea.x ) / EDITOR_TILE_WIDTH );
+
+    std::lock_guard<std::mutex> guard ( cache->lock );
+
+    for ( index = first; index <= last; index++ )
+    {
+        EditorTile &tile = cache->tiles [ tileKey ( context->_zoomLevel, index ) ];
+
+        tile.lastVisibleFrame = cache->frame;
+
+        if ( tile.dirty && ! tile.queued )
+        {
+            job.key        = tileKey ( context->_zoomLevel, index );
+            job.height     = plotArea.y;
+            job.generation = cache->generation;
+            job.bgColour   = context->bgColour;
+            job.fgColour   = context->fgColour;
+            job.lineWidth  = context->lineThickness * context->dpi;
+            job.snapshot   = cache->snapshot;
+
+            tileRange ( baseScale, context->_zoomLevel, index, &job.start, &job.end );
+
+            cache->jobs.push_back ( job );
+
+            tile.dirty  = false;
+            tile.queued = true;
+        }
+
+        ready = ready && tile.tex && ! tile.queued;
+
+        if ( tile.tex )
+        {
+            x = windowOffset.x + index * EDITOR_TILE_WIDTH - panOffset;
+
+            ImGui::GetWindowDrawList ( )->AddImage ( tile.tex, ImVec2 ( x, windowOffset.y ),
+                    ImVec2 ( x + EDITOR_TILE_WIDTH, windowOffset.y + plotArea.y ) );
+        }
+    }
+
+    /* Drop requests for tiles that have scrolled out of view, they'll be requested again if they come back */
+    for ( auto job = cache->jobs.begin ( ); job != cache->jobs.end ( ); )
+    {
+        EditorTile &tile = cache->tiles [ job->key ];
+
+        if ( tile.lastVisibleFrame != cache->frame )
+        {
+            tile.queued = false;
+            tile.dirty  = true;
+            job = cache->jobs.erase ( job );
+        }
+        else
+        {
+            job++;
+        }
+    }
+
+    if ( cache->tiles.size ( ) > EDITOR_MAX_TILES )
+    {
+        for ( auto tile = cache->tiles.begin ( ); tile != cache->tiles.end ( ); )
+        {
+            if ( ! tile->second.queued && tile->second.lastVisibleFrame != cache->frame )
+            {
+                if ( tile->second.tex )
+                {
+                    free_image ( tile->second.tex );
+                }
+                tile = cache->tiles.erase ( tile );
+            }
+            else
+            {
+                tile++;
+            }
+        }
+    }
+
+    cache->wake.notify_one ( );
+
+    return ready;
+}
+
 #define impl_LCTRL SDL_SCANCODE_LCTRL
 #define impl_RCTRL SDL_SCANCODE_RCTRL
 
+
+static bool hasControlPoints ( breakpoint *bp )
+{
+    return bp->nInterp_params > 0 && bp->nInterp_params % 2 == 0
+        && bp->interpType != LINEAR && bp->interpType != NEAREST_NEIGHBOUR;
+}
+
+static inline int64_t nodeGridKey ( int cx, int cy )
+{
+    return ( (int64_t) cx << 32 ) | (uint32_t) cy;
+}
+
+static inline int64_t nodeGridKeyAt ( ImGui::Ext::EnvelopeEditorContext *context, float x, float y )
+{
+    return nodeGridKey ( (int) floorf ( x / context->_nodeGridCellSize ),
+                         (int) floorf ( y / context->_nodeGridCellSize ) );
+}
+
+static void nodeGridInsert ( ImGui::Ext::EnvelopeEditorContext *context, int node )
+{
+    ImGui::Ext::EnvelopeEditorNode *n = &context->_nodes [ node ];
+
+    context->_nodeGrid [ nodeGridKeyAt ( context, n->x, n->y ) ].push_back ( node );
+}
+
+static void nodeGridRemove ( ImGui::Ext::EnvelopeEditorContext *context, int node )
+{
+    ImGui::Ext::EnvelopeEditorNode *n = &context->_nodes [ node ];
+    auto cell = context->_nodeGrid.find ( nodeGridKeyAt ( context, n->x, n->y ) );
+
+    if ( cell == context->_nodeGrid.end ( ) )
+    {
+        return;
+    }
+
+    cell->second.erase ( std::remove ( cell->second.begin ( ), cell->second.end ( ), node ), cell->second.end ( ) );
+
+    if ( cell->second.empty ( ) )
+    {
+        context->_nodeGrid.erase ( cell );
+    }
+}
+
+/* Node positions are kept unpanned, in pixels from time 0 at the current zoom, so panning doesn't move the index */
+static void placeNode ( ImGui::Ext::EnvelopeEditorContext *context, ImGui::Ext::EnvelopeEditorNode *node,
+        ImVec2 plotArea, double scale )
+{
+    double time, value;
+
+    if ( node->param < 0 )
+    {
+        time  = node->bp->time;
+        value = node->bp->value;
+    }
+    else
+    {
+        time  = INTERP_PARAMS ( node->bp ) [ node->param ];
+        value = INTERP_PARAMS ( node->bp ) [ node->param + 1 ];
+    }
+
+    node->x = time * scale;
+    node->y = plotArea.y - ( ( value - context->_viewMinVal ) / ( context->_viewMaxVal - context->_viewMinVal ) ) * plotArea.y;
+}
+
+/* Rebuilds the node list and the spatial hash used for hit testing. Only needed when the structure of the
+ * envelope or the scale of the plot changes, dragging a node just moves that node within the index */
+static void buildNodeIndex ( ImGui::Ext::EnvelopeEditorContext *context, ImVec2 plotArea, double scale, float radius )
+{
+    ImGui::Ext::EnvelopeEditorNode node;
+    breakpoint *bp;
+    int i, j;
+
+    context->_nodes.clear ( );
+    context->_nodeGrid.clear ( );
+    context->_nodeGridCellSize = fmax ( 2 * radius, 1 );
+
+    for ( bp = context->env->first; bp; bp = bp->next )
+    {
+        node.bp    = bp;
+        node.param = -1;
+        placeNode ( context, &node, plotArea, scale );
+        node.ownerX = node.x;
+
+        context->_nodes.push_back ( node );
+
+        if ( hasControlPoints ( bp ) )
+        {
+            for ( j = 0; j < bp->nInterp_params; j += 2 )
+            {
+                node.param = j;
+                placeNode ( context, &node, plotArea, scale );
+                context->_nodes.push_back ( node );
+            }
+        }
+    }
+
+    for ( i = 0; i < (int) context->_nodes.size ( ); i++ )
+    {
+        nodeGridInsert ( context, i );
+    }
+
+    context->_nodesPlotArea = plotArea;
+    context->_nodesScale    = scale;
+    context->_nodesMinVal   = context->_viewMinVal;
+    context->_nodesMaxVal   = context->_viewMaxVal;
+    context->_nodesEnv      = context->env;
+    context->_nodesFirst    = context->env->first;
+    context->_updateNodes   = false;
+}
+
+/* Returns the nearest node within radius of pos by only checking the grid cells around it, -1 if there isn't one */
+static int hitTestNodes ( ImGui::Ext::EnvelopeEditorContext *context, ImVec2 pos, float radius )
+{
+    int cx, cy, x, y, nearest = -1;
+    float dist, best = radius * radius;
+
+    cx = (int) floorf ( pos.x / context->_nodeGridCellSize );
+    cy = (int) floorf ( pos.y / context->_nodeGridCellSize );
+
+    for ( x = cx - 1; x <= cx + 1; x++ )
+    {
+        for ( y = cy - 1; y <= cy + 1; y++ )
+        {
+            auto cell = context->_nodeGrid.find ( nodeGridKey ( x, y ) );
+
+            if ( cell == context->_nodeGrid.end ( ) )
+            {
+                continue;
+            }
+
+            for ( int node : cell->second )
+            {
+                dist = powf ( pos.x - context->_nodes [ node ].x, 2 ) + powf ( pos.y - context->_nodes [ node ].y, 2 );
+
+                if ( dist <= best )
+                {
+                    best    = dist;
+                    nearest = node;
+                }
+            }
+        }
+    }
+
+    return nearest;
+}
+
+/* Nodes are sorted by the x position of the breakpoint that owns them so the visible range can be binary searched */
+static int firstVisibleNode ( ImGui::Ext::EnvelopeEditorContext *context, float minX )
+{
+    int i = std::lower_bound ( context->_nodes.begin ( ), context->_nodes.end ( ), minX,
+            [] ( const ImGui::Ext::EnvelopeEditorNode &n, float x ) { return n.ownerX < x; } )
+            - context->_nodes.begin ( );
+
+    /* The breakpoint before the window owns the segment running into it, so its control points may be visible */
+    if ( i > 0 )
+    {
+        i--;
+
+        while ( i > 0 && context->_nodes [ i ].param >= 0 )
+        {
+            i--;
+        }
+    }
+
+    return i;
+}
+
+static int lastVisibleNode ( ImGui::Ext::EnvelopeEditorContext *context, float maxX )
+{
+    return std::upper_bound ( context->_nodes.begin ( ), context->_nodes.end ( ), maxX,
+            [] ( float x, const ImGui::Ext::EnvelopeEditorNode &n ) { return x < n.ownerX; } )
+            - context->_nodes.begin ( );
+}
+
+/* The range shown starts as the envelope's bounds and grows with them, but doesn't shrink while the same envelope is
+ * being edited, so dragging the highest breakpoint down doesn't rescale the plot under the mouse */
+static void updateViewRange ( ImGui::Ext::EnvelopeEditorContext *context )
+{
+    envelope *env = context->env;
+
+    if ( context->_viewEnv != env )
+    {
+        context->_viewEnv     = env;
+        context->_viewMaxTime = env->maxTime;
+        context->_viewMinVal  = fmin ( env->minVal, 0 );
+        context->_viewMaxVal  = env->maxVal;
+    }
+    else
+    {
+        context->_viewMaxTime = fmax ( context->_viewMaxTime, env->maxTime );
+        context->_viewMinVal  = fmin ( context->_viewMinVal,  env->minVal  );
+        context->_viewMaxVal  = fmax ( context->_viewMaxVal,  env->maxVal  );
+    }
+
+    if ( context->_viewMaxTime <= 0 )
+    {
+        context->_viewMaxTime = 1;
+    }
+
+    if ( context->_viewMaxVal <= context->_viewMinVal )
+    {
+        context->_viewMaxVal = context->_viewMinVal + 1;
+    }
+}
+
 IMGUI_API bool ImGui::Ext::EnvelopeEditor ( EnvelopeEditorContext *context )
 {
-    ImVec2 plotArea, windowOffset, mousePos;
-    int i = 0, j;
-    float x, y, dx, dy;
-    double nodeClampX, nodeClampXMax, time, value;
-    breakpoint* newbp;
+    ImVec2 plotArea, windowOffset, mousePos, contentMousePos, clipMin, clipMax, centre;
+    int i, j, first, last, hovered, cols, rows, cell, type;
+    float x, y, dx, dy, radius;
+    double nodeClampX, nodeClampXMax, time, value, scale, panOffset, minVal, maxVal, *params;
+    bool hot;
+    breakpoint *newbp, *bp;
+    EnvelopeEditorNode *node;
+    std::vector<bool> occupied;
 
-    ImU32 bgColourPacked  = packRGB ( context->bgColour ), fgColourPacked = packRGB ( context->fgColour ),
-          fgColour2Packed = packRGB ( context->fgColour2 );
+    ImU32 fgColourPacked = packRGB ( context->fgColour ), fgColour2Packed = packRGB ( context->fgColour2 );
 
     if ( ! context->env )
     {
         return false;
     }
 
+    // Does nothing if already listening, the envelope may have been swapped for another
+    env_add_listener ( context->env, envelopeChanged, context );
+
+    updateViewRange ( context );
+
+    radius = 2 * context->lineThickness * context->dpi;
+
     ImGui::PushID ( "EnvelopeEditor" );
     ImGui::PushStyleVar ( ImGuiStyleVar_WindowPadding, ImVec2 ( 0, 0) );
     ImGui::BeginChild ( "EnvelopeEditor", context->dimensions, true, ImGuiWindowFlags_NoScrollbar );
@@ -152,43 +746,61 @@ IMGUI_API bool ImGui::Ext::EnvelopeEditor ( EnvelopeEditorContext *context )
         context->_draggingPoint = -1;
     }
 
-    if ( context->_updatePlot )
+    /* Pixels per second, zoom level 0 fits the whole envelope in the window and each level zooms in by 2^(1/4) */
+    scale = plotArea.x / context->_viewMaxTime * pow ( 2, context->_zoomLevel / 4.0 );
+
+    if ( ImGui::IsWindowHovered ( ) && ImGui::GetIO ( ).MouseWheel != 0 )
     {
-        if ( ! context->_plotData )
-        {
-            context->_plotData        = (float*) calloc ( plotArea.x, sizeof ( float ) );
-            context->_plotDerivatives = (float*) calloc ( plotArea.x, sizeof ( float ) );
-        }
-        else
-        {
-            free ( context->_plotData );
-            free ( context->_plotDerivatives );
-            free_image ( context->_plotImg );
-            context->_plotData        = (float*) calloc ( plotArea.x, sizeof ( float ) );
-            context->_plotDerivatives = (float*) calloc ( plotArea.x, sizeof ( float ) );
-        }
+        // Zoom around the time under the mouse
+        time = context->_viewStart + mousePos.x / scale;
 
-        plot_envelope ( context->env, (int)plotArea.x, (int)plotArea.y, context->_plotData );
-        calculatePlotDerivatives ( context->_plotData, context->_plotDerivatives, plotArea.x );
+        context->_zoomLevel += ImGui::GetIO ( ).MouseWheel > 0 ? 1 : -1;
+        CLAMP ( context->_zoomLevel, 0, EDITOR_MAX_ZOOM );
 
-        context->_plotImg =
-                (*drawEnvelopePlot)( context->_plotData, context->_plotDerivatives,
-                        plotArea.x, plotArea.y, context->bgColour, context->fgColour,
-                        context->lineThickness * context->dpi );
+        scale = plotArea.x / context->_viewMaxTime * pow ( 2, context->_zoomLevel / 4.0 );
+        context->_viewStart = time - mousePos.x / scale;
+    }
 
-        context->_updatePlot = false;
+    if ( ImGui::IsWindowHovered ( ) && ImGui::IsMouseDragging ( 2 ) )
+    {
+        context->_viewStart -= ImGui::GetIO ( ).MouseDelta.x / scale;
     }
 
-    ImGui::Image ( context->_plotImg, plotArea );
+    context->_viewStart = fmin ( context->_viewStart, context->_viewMaxTime - plotArea.x / scale );
+    context->_viewStart = fmax ( context->_viewStart, 0 );
+
+    /* Whole pixels keep the tiles crisp */
+    panOffset = floor ( context->_viewStart * scale );
+
+    contentMousePos = ImVec2 ( mousePos.x + panOffset, mousePos.y );
+
+    if ( drawTiles ( context, windowOffset, plotArea, panOffset ) )
+    {
+        ImGui::Dummy ( plotArea );
+    }
+    else
+    {
+        /* A draft of the line over the tiles until they catch up, plotted against the editor's range as they are */
+        minVal = context->env->minVal;
+        maxVal = context->env->maxVal;
+        context->env->minVal = context->_viewMinVal;
+        context->env->maxVal = context->_viewMaxVal;
+
+        EnvelopeLine ( context->env, &context->_line, panOffset / scale, ( panOffset + plotArea.x ) / scale, plotArea,
+                       fgColourPacked, context->lineThickness * context->dpi );
+
+        context->env->minVal = minVal;
+        context->env->maxVal = maxVal;
+    }
 
     if ( ( ImGui::IsKeyDown ( impl_LCTRL ) || ImGui::IsKeyDown ( impl_RCTRL ) )
          &&   mousePos.x >= 0          && mousePos.x <=  plotArea.x
          &&   mousePos.y <= plotArea.y && mousePos.y >= 0 )
     {
-        time  = ( mousePos.x / plotArea.x ) * context->env->maxTime;
+        time  = contentMousePos.x / scale;
         value = value_at ( context->env, time );
 
-        y = ( value / context->env->maxVal ) * plotArea.y;
+        y = ( ( value - context->_viewMinVal ) / ( context->_viewMaxVal - context->_viewMinVal ) ) * plotArea.y;
         y = plotArea.y - y;
         x = mousePos.x;
 
@@ -196,8 +808,7 @@ IMGUI_API bool ImGui::Ext::EnvelopeEditor ( EnvelopeEditorContext *context )
         CLAMP ( x, 0, plotArea.x );
 
         ImGui::GetWindowDrawList ( )->AddCircle ( ImVec2 ( windowOffset.x + x, windowOffset.y + y ),
-                                                  2 * context->lineThickness * context->dpi, context->fgColour2, 30,
-                                                  2 * context->lineThickness * context->dpi / 4 );
+                                                  radius, context->fgColour2, 30, radius / 4 );
 
         ImGui::BeginTooltip ( );
         ImGui::LabelText ( "time",  "%f", time  );
@@ -210,8 +821,9 @@ IMGUI_API bool ImGui::Ext::EnvelopeEditor ( EnvelopeEditorContext *context )
             newbp->time           = time;
             newbp->value          = value;
             newbp->interpType     = LINEAR;
-            newbp->interpCallback = interp_functions [ LINEAR ];
             insert_breakpoint ( context->env, newbp );
+
+            context->_updateNodes = true;
         }
     }
 
@@ -229,147 +841,200 @@ IMGUI_API bool ImGui::Ext::EnvelopeEditor ( EnvelopeEditorContext *context )
                 ImVec2 ( windowOffset.x + plotArea.x, y + windowOffset.y ), context->fgColour2, 1 );
     }
 
-    nodeClampX = context->env->minTime;
+    if ( context->_updateNodes
+    ||   context->_nodesEnv      != context->env
+    ||   context->_nodesFirst    != context->env->first
+    ||   context->_nodesScale    != scale
+    ||   context->_nodesMinVal   != context->_viewMinVal
+    ||   context->_nodesMaxVal   != context->_viewMaxVal
+    ||   context->_nodesPlotArea.x != plotArea.x || context->_nodesPlotArea.y != plotArea.y )
+    {
+        buildNodeIndex ( context, plotArea, scale, radius );
+        context->_draggingPoint = -1;
+        context->_popupNode     = -1;
+    }
+
+    /* Only nodes inside the clip rect are drawn */
+    clipMin = ImGui::GetWindowDrawList ( )->GetClipRectMin ( );
+    clipMax = ImGui::GetWindowDrawList ( )->GetClipRectMax ( );
 
-    context->env->current = context->env->first;
+    clipMin.x += panOffset - windowOffset.x;
+    clipMax.x += panOffset - windowOffset.x;
 
-    while ( context->env->current )
+    first = firstVisibleNode ( context, clipMin.x - radius );
+    last  = lastVisibleNode  ( context, clipMax.x + radius );
+
+    hovered = context->_draggingPoint >= 0
+            ? context->_draggingPoint
+            : hitTestNodes ( context, contentMousePos, radius );
+
+    /* When nodes overlap only the first one in each radius sized cell is drawn */
+    cols = (int) ( plotArea.x / radius ) + 1;
+    rows = (int) ( plotArea.y / radius ) + 1;
+    occupied.assign ( cols * rows, false );
+
+    for ( i = first; i < last; i++ )
     {
-        ImGui::PushID ( i );
+        node = &context->_nodes [ i ];
+        hot  = i == hovered || i == context->_popupNode;
+
+        if ( ! hot )
+        {
+            if ( node->x < clipMin.x - radius || node->x > clipMax.x + radius )
+            {
+                continue;
+            }
+
+            x = ( node->x - panOffset ) / radius;
+            y = node->y / radius;
+
+            CLAMP ( x, 0, cols - 1 );
+            CLAMP ( y, 0, rows - 1 );
+
+            cell = (int) y * cols + (int) x;
+
+            if ( occupied [ cell ] )
+            {
+                continue;
+            }
+
+            occupied [ cell ] = true;
+        }
 
-        if ( context->env->current->next )
+        centre = ImVec2 ( windowOffset.x + node->x - panOffset, windowOffset.y + node->y );
+
+        if ( node->param < 0 )
         {
-            nodeClampXMax = context->env->current->next->time;
+            ImGui::GetWindowDrawList ( )->AddCircleFilled ( centre, radius,
+                    hot ? fgColour2Packed : fgColourPacked, 30 );
         }
         else
         {
-            nodeClampXMax = context->env->maxTime;
+            ImGui::GetWindowDrawList ( )->AddCircle ( centre, radius,
+                    hot ? fgColour2Packed : fgColourPacked, 30, radius / 4 );
         }
+    }
 
-        x = ( context->env->current->time  / context->env->maxTime ) * plotArea.x;
-        y = ( context->env->current->value / context->env->maxVal  ) * plotArea.y;
-        y = plotArea.y - y;
+    if ( hovered >= 0 && context->_draggingPoint < 0 )
+    {
+        if ( ImGui::IsMouseClicked ( 1, false ) && context->_nodes [ hovered ].param < 0 )
+        {
+            context->_popupNode = hovered;
 
-        ImGui::GetWindowDrawList ( )->AddCircleFilled ( ImVec2 ( windowOffset.x + x, windowOffset.y + y ),
-                2 * context->lineThickness * context->dpi, fgColourPacked, 30 );
+            ImGui::PushID ( hovered );
+            ImGui::OpenPopup ( "NodeOptions" );
+            ImGui::PopID ( );
+        }
 
-        if ( sqrt ( pow ( mousePos.x - x, 2 ) + pow ( mousePos.y - y, 2 ) )
-             <= 2 * context->lineThickness  * context->dpi )
+        if ( ImGui::IsMouseClicked ( 0, false ) )
         {
-            ImGui::GetWindowDrawList ( )->AddCircleFilled ( ImVec2 ( windowOffset.x + x, windowOffset.y + y ),
-                    2 * context->lineThickness * context->dpi, fgColour2Packed, 30 );
-
-            if ( ImGui::IsMouseClicked ( 1, false ) )
-            {
-                ImGui::OpenPopup ( "NodeOptions" );
-            }
+            // Set flag to start moving this node
+            // When position is updated don't forget to invalidate the plot drawing
+            context->_draggingPoint = hovered;
+            context->_mousePosition = mousePos;
+        }
+    }
 
-            if ( ImGui::IsMouseClicked ( 0, false ) )
-            {
-                // Set flag to start moving this node
-                // When position is updated don't forget to invalidate the plot drawing
-                context->_draggingPoint = i;
-                context->_mousePosition = mousePos;
-            }
+    if ( context->_popupNode >= 0 )
+    {
+        bp = context->_nodes [ context->_popupNode ].bp;
 
-            // Maybe use IsMouseDragging?
-        }
+        ImGui::PushID ( context->_popupNode );
 
         if ( ImGui::BeginPopup ( "NodeOptions" ) )
         {
             // Listbox with interpolation types and any other parameters, e.g manually set value
-            if ( ImGui::ListBox ( "Segment type", (int*)&context->env->current->interpType, context->interpTypeStrings,
-                    4 ) )
+            type = bp->interpType;
+
+            if ( ImGui::ListBox ( "Segment type", &type, context->interpTypeStrings, 4 ) )
             {
-                context->env->current->interpCallback = interp_functions [ context->env->current->interpType ];
+                bp->interpType = (uint8_t) type;
 
                 // If the user selected Quadratic bezier we must supply a control point in the interp params
-                if ( context->env->current->interpType == QUADRATIC_BEZIER && context->env->current->nInterp_params < 2)
+                if ( bp->interpType == QUADRATIC_BEZIER && bp->nInterp_params < 2 )
                 {
-                    context->env->current->nInterp_params      = 2;
-                    context->env->current->interp_params       = (double*) malloc ( sizeof ( double ) * 2 );
-                    context->env->current->interp_params [ 0 ] = (context->env->current->time +
-                                                                  context->env->current->next->time) / 2;
-                    context->env->current->interp_params [ 1 ] = (context->env->current->value +
-                                                                  context->env->current->next->value) / 2;
+                    set_interp_params ( bp, 2 );
+                    INTERP_PARAMS ( bp ) [ 0 ] = ( bp->time  + bp->next->time  ) / 2;
+                    INTERP_PARAMS ( bp ) [ 1 ] = ( bp->value + bp->next->value ) / 2;
                 }
 
-                context->_updatePlot = true;
+                env_changed ( context->env, bp->time, bp->next ? bp->next->time : context->env->maxTime );
+
+                // Control points may have appeared or disappeared
+                context->_updateNodes = true;
             }
             ImGui::EndPopup ( );
         }
-
-        if ( context->_draggingPoint == i )
+        else
         {
-            dx = mousePos.x - context->_mousePosition.x;
-            dy = mousePos.y - context->_mousePosition.y;
-
-            context->env->current->time  += context->env->maxTime * ( dx / plotArea.x );
-            context->env->current->value -= context->env->maxVal  * ( dy / plotArea.y );
+            context->_popupNode = -1;
+        }
 
-            CLAMP ( context->env->current->value, context->env->minVal,  context->env->maxVal  );
-            CLAMP ( context->env->current->time,  nodeClampX,            nodeClampXMax         );
+        ImGui::PopID ( );
+    }
 
-            context->_mousePosition = mousePos;
+    if ( context->_draggingPoint >= 0 && context->_draggingPoint < (int) context->_nodes.size ( ) )
+    {
+        i    = context->_draggingPoint;
+        node = &context->_nodes [ i ];
+        bp   = node->bp;
 
-            context->_updatePlot = true;
-        }
+        dx = mousePos.x - context->_mousePosition.x;
+        dy = mousePos.y - context->_mousePosition.y;
 
-        if ( context->env->current->nInterp_params > 0 && context->env->current->nInterp_params % 2 == 0
-        &&  context->env->current->interpType != LINEAR && context->env->current->interpType != NEAREST_NEIGHBOUR )
+        if ( node->param < 0 )
         {
-            for ( j = 0; j < context->env->current->nInterp_params; j += 2 )
-            {
-                i++;
-                x = ( context->env->current->interp_params [ j ]     / context->env->maxTime ) * plotArea.x;
-                y = ( context->env->current->interp_params [ j + 1 ] / context->env->maxVal  ) * plotArea.y;
-                y = plotArea.y - y;
+            nodeClampX    = 0;
+            nodeClampXMax = bp->next ? bp->next->time : context->_viewMaxTime;
 
-                ImGui::GetWindowDrawList ( )->AddCircle ( ImVec2 ( windowOffset.x + x, windowOffset.y + y ),
-                                                        2 * context->lineThickness * context->dpi, fgColourPacked, 30,
-                                                        2 * context->lineThickness * context->dpi / 4 );
-
-                if ( sqrt ( pow ( mousePos.x - x, 2 ) + pow ( mousePos.y - y, 2 ) )
-                     <= 2 * context->lineThickness  * context->dpi )
+            for ( j = i - 1; j >= 0; j-- )
+            {
+                if ( context->_nodes [ j ].param < 0 )
                 {
-                    ImGui::GetWindowDrawList ( )->AddCircle ( ImVec2 ( windowOffset.x + x, windowOffset.y + y ),
-                            2 * context->lineThickness * context->dpi, fgColour2Packed, 30,
-                                                              2 * context->lineThickness * context->dpi / 4 );
-
-                    if ( ImGui::IsMouseClicked ( 0, false ) )
-                    {
-                        // Set flag to start moving this node
-                        context->_draggingPoint = i;
-                        context->_mousePosition = mousePos;
-                    }
+                    nodeClampX = context->_nodes [ j ].bp->time;
+                    break;
                 }
+            }
 
-                if ( context->_draggingPoint == i )
-                {
-                    dx = mousePos.x - context->_mousePosition.x;
-                    dy = mousePos.y - context->_mousePosition.y;
+            time  = bp->time  + dx / scale;
+            value = bp->value - ( context->_viewMaxVal - context->_viewMinVal ) * ( dy / plotArea.y );
 
-                    context->env->current->interp_params [ j ]     += context->env->maxTime * ( dx / plotArea.x );
-                    context->env->current->interp_params [ j + 1 ] -= context->env->maxVal  * ( dy / plotArea.y );
+            CLAMP ( value, context->_viewMinVal,  context->_viewMaxVal  );
+            CLAMP ( time,  nodeClampX,            nodeClampXMax         );
 
-                    CLAMP ( context->env->current->interp_params [ j ], context->env->minTime, context->env->maxTime );
-                    CLAMP ( context->env->current->interp_params [ j + 1 ], context->env->minVal, context->env->maxVal);
+            move_breakpoint ( context->env, bp, time, value );
+        }
+        else
+        {
+            j      = node->param;
+            params = INTERP_PARAMS ( bp );
 
-                    context->_mousePosition = mousePos;
+            params [ j ]     += dx / scale;
+            params [ j + 1 ] -= ( context->_viewMaxVal - context->_viewMinVal ) * ( dy / plotArea.y );
 
-                    context->_updatePlot = true;
-                }
-            }
+            CLAMP ( params [ j ],     0,                     context->_viewMaxTime );
+            CLAMP ( params [ j + 1 ], context->_viewMinVal,  context->_viewMaxVal  );
+
+            env_changed ( context->env, bp->time, bp->next ? bp->next->time : context->env->maxTime );
         }
 
-        nodeClampX = context->env->current->time;
+        /* Move just this node within the index, a breakpoint can't pass its neighbours so the order is kept */
+        nodeGridRemove ( context, i );
+        placeNode ( context, node, plotArea, scale );
+        nodeGridInsert ( context, i );
 
-        ImGui::PopID ( );
-        context->env->current = context->env->current->next;
-        i++;
-    }
+        if ( node->param < 0 )
+        {
+            node->ownerX = node->x;
 
-    context->env->current = context->env->first;
+            for ( j = i + 1; j < (int) context->_nodes.size ( ) && context->_nodes [ j ].param >= 0; j++ )
+            {
+                context->_nodes [ j ].ownerX = node->x;
+            }
+        }
+
+        context->_mousePosition = mousePos;
+    }
 
     ImGui::EndChild ( );
 
@@ -379,20 +1044,69 @@ IMGUI_API bool ImGui::Ext::EnvelopeEditor ( EnvelopeEditorContext *context )
     return false;
 }
 
-IMGUI_API void ImGui::Ext::EnvelopeEditorFreeContext ( EnvelopeEditorContext *ctx )
+IMGUI_API bool ImGui::Ext::EnvelopeThumbnail ( const std::string &path, int size, uint32_t *pixels )
+{
+    envelope *env = ( envelope* ) calloc ( 1, sizeof ( envelope ) );
+    std::vector<float> plotData ( size ), plotDerivatives ( size );
+    bool ok;
+
+    ok = load_breakpoints ( path.c_str ( ), env ) == 0 && env->first
+      && env->maxTime > env->minTime && env->maxVal > env->minVal;
+
+    if ( ok )
+    {
+        plot_envelope ( env, size, size, plotData.data ( ) );
+        calculatePlotDerivatives ( plotData.data ( ), plotDerivatives.data ( ), size );
+        rasterizeEnvelopePlot ( plotData.data ( ), plotDerivatives.data ( ), size, size,
+                ImColor ( 0.1f, 0.1f, 0.1f, 1.0f ), ImColor ( 0.9f, 0.9f, 0.9f, 1.0f ), 1 + size / 48.0f, pixels );
+    }
+
+    free_env ( env );
+
+    return ok;
+}
+
+IMGUI_API void ImGui::Ext::EnvelopeLine ( envelope *env, env_polyline *line, double start, double end,
+                                         const ImVec2 &size, ImU32 colour, float thickness, float tolerance )
 {
-    if ( ctx->_plotDerivatives )
+    ImVec2 position = ImGui::GetCursorScreenPos ( );
+
+    ImGui::Dummy ( size );
+
+    if ( ! ImGui::IsItemVisible ( ) )
     {
-        free ( ctx->_plotDerivatives );
+        return;
     }
 
-    if ( ctx->_plotData )
+    if ( tessellate_envelope ( env, start, end, position.x, position.y, size.x, size.y, tolerance, line ) > 1 )
     {
-        free ( ctx->_plotData );
+        ImGui::GetWindowDrawList ( )->AddPolyline ( (const ImVec2*) line->points, line->n, colour, false, thickness );
     }
+}
+
+IMGUI_API void ImGui::Ext::EnvelopeEditorFreeContext ( EnvelopeEditorContext *ctx )
+{
+    if ( ctx->_tiles )
+    {
+        {
+            std::lock_guard<std::mutex> guard ( ctx->_tiles->lock );
+            ctx->_tiles->stop = true;
+        }
+
+        ctx->_tiles->wake.notify_all ( );
+        ctx->_tiles->worker.join ( );
+
+        flushTiles ( ctx->_tiles );
+
+        delete ctx->_tiles;
+        ctx->_tiles = NULL;
+    }
+
+    free_polyline ( &ctx->_line );
 
     if ( ctx->env )
     {
-        free ( ctx->env );
+        free_env ( ctx->env );
+        ctx->env = NULL;
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,147 @@
+
+#pragma once
+
+#ifndef ENVELOPE_IMGUIENVELOPEEDITOR_H
+#define ENVELOPE_IMGUIENVELOPEEDITOR_H
+
+#include <imgui.h>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "envelope.h"
+#include "envelope_polyline.h"
+
+namespace ImGui
+{
+    namespace Ext
+    {
+
+        struct EnvelopeEditorTileCache;
+
+        /**
+         * @struct EnvelopeEditorNode
+         *
+         * A draggable node in the envelope editor, either a breakpoint or one of its control points
+         *
+         * @var EnvelopeEditorNode::bp the breakpoint this node belongs to
+         * @var EnvelopeEditorNode::param -1 for the breakpoint itself, otherwise the index of the control point's time
+         * in INTERP_PARAMS ( bp )
+         * @var EnvelopeEditorNode::x the x position of the node relative to the editor window
+         * @var EnvelopeEditorNode::y the y position of the node relative to the editor window
+         * @var EnvelopeEditorNode::ownerX the x position of the owning breakpoint, nodes are sorted on this
+         */
+        typedef struct EnvelopeEditorNode
+        {
+            breakpoint *bp;
+            int param;
+            float x;
+            float y;
+            float ownerX;
+        } EnvelopeEditorNode;
+
+        /**
+         * @struct EnvelopeEditorContext
+         *
+         * Holds the current context for an EnvelopeEditor
+         *
+         * ALWAYS ZERO INITIALISE ( i.e new EnvelopeEditorContext() NOT new EnvelopeEditorContext )
+         *
+         * @var EnvelopeEditorContext::env the envelope being edited
+         * @var EnvelopeEditorContext::dimensions the width and height of the EnvelopeEditor child window
+         * @var EnvelopeEditorContext::bgColour the background colour of the plot
+         * @var EnvelopeEditorContext::fgColour the colour of the plot line and nodes
+         * @var EnvelopeEditorContext::fgColour2 the colour of highlighted nodes and the axis
+         * @var EnvelopeEditorContext::lineThickness the thickness of the plot line in inches
+         * @var EnvelopeEditorContext::dpi the screen dpi
+         * @var EnvelopeEditorContext::axisHeight the height of the x axis as a fraction of the plot height, < 0 to hide
+         * @var EnvelopeEditorContext::interpTypeStrings the names shown for each interpolation type
+         *
+         * Scroll over the editor to zoom the time axis and drag with the middle mouse button to pan
+         */
+        typedef struct EnvelopeEditorContext
+        {
+            envelope *env = NULL;
+            ImVec2 dimensions = ImVec2 ( 0.0f, 400 );
+            ImColor bgColour  = ImColor ( 0.1f, 0.1f, 0.1f, 1.0f );
+            ImColor fgColour  = ImColor ( 0.9f, 0.9f, 0.9f, 1.0f );
+            ImColor fgColour2 = ImColor ( 0.9f, 0.5f, 0.1f, 1.0f );
+            float lineThickness = 1.0/96;
+            float dpi = 96;
+            float axisHeight = 0;
+            const char* interpTypeStrings [ 4 ] = { "Linear", "Nearest neighbour", "Quadratic bezier", "Exponential" };
+            bool _updatePlot = true;
+            bool _updateNodes = true;
+            EnvelopeEditorTileCache *_tiles = NULL;
+            int _zoomLevel = 0;
+            double _viewStart = 0;
+            double _viewMaxTime = 1;
+            double _viewMinVal = 0;
+            double _viewMaxVal = 1;
+            envelope *_viewEnv = NULL;
+            int _draggingPoint = -1;
+            int _popupNode = -1;
+            ImVec2 _mousePosition;
+            std::vector<EnvelopeEditorNode> _nodes;
+            std::unordered_map<int64_t, std::vector<int>> _nodeGrid;
+            float _nodeGridCellSize = 0;
+            ImVec2 _nodesPlotArea;
+            double _nodesScale = 0;
+            double _nodesMinVal = 0;
+            double _nodesMaxVal = 0;
+            envelope *_nodesEnv = NULL;
+            breakpoint *_nodesFirst = NULL;
+            env_polyline _line = { NULL, 0, 0 };
+        } EnvelopeEditorContext;
+
+        /**
+         * Displays an EnvelopeEditor and updates the supplied ImGui::Ext::EnvelopeEditorContext as necessary
+         *
+         * @param context The current state of the envelope editor
+         * @returns false
+         */
+        IMGUI_API bool EnvelopeEditor ( EnvelopeEditorContext *context );
+
+        /**
+         * Renders a size x size preview of a .bp file, for use as a FileBrowser thumbnailer
+         *
+         * @param path The .bp file to preview
+         * @param size The width and height of the preview in pixels
+         * @param pixels Where to write the RGBA preview
+         * @returns false if the file couldn't be loaded
+         */
+        IMGUI_API bool EnvelopeThumbnail ( const std::string &path, int size, uint32_t *pixels );
+
+        /**
+         * Draws an envelope as a line at the cursor with ImDrawList::AddPolyline, for previews that should stay sharp
+         * at any size. Straight segments are drawn from their ends and curves with as few vertices as tolerance allows
+         *
+         * @param env The envelope to draw
+         * @param line Where the vertices are traced, zero initialised and kept between calls so drawing doesn't
+         * allocate once it has grown. Free it with free_polyline
+         * @param start The time at the left edge
+         * @param end The time at the right edge
+         * @param size The width and height of the line's area in pixels, maxVal at the top and minVal at the bottom
+         * @param colour The colour of the line
+         * @param thickness The thickness of the line in pixels
+         * @param tolerance How far in pixels the line may stray from the envelope
+         */
+        IMGUI_API void EnvelopeLine ( envelope *env, env_polyline *line, double start, double end, const ImVec2 &size,
+                                      ImU32 colour, float thickness = 1.0f, float tolerance = 0.25f );
+
+        /**
+         * Frees everything allocated by the EnvelopeEditor including the envelope
+         *
+         * @param ctx The context to free
+         */
+        IMGUI_API void EnvelopeEditorFreeContext ( EnvelopeEditorContext *ctx );
+    }
+}
+
+/**
+ * Called from the tile worker when a tile has been drawn. An app that waits for events before drawing a frame
+ * should point this at a function that wakes it. Any thread may call it
+ */
+extern void (*wakeEditor) ( );
+
+#endif
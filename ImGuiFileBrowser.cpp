@@ -5,6 +5,18 @@
 #include <iostream>
 #include <filesystem>
 #include <cstdio>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 
 #include <SDL2/SDL.h>
 #include <GL/gl.h>
@@ -64,6 +76,9 @@ std::map<std::string, ImTextureID> sdlImpl_constructDefaultIconMap ( float iconS
 
 std::map<std::string, ImTextureID> (*constructDefaultIconMap)( float, float ) = &sdlImpl_constructDefaultIconMap;
 
+/* Called from the background workers when a listing or thumbnail changes, set by the app so an idle main loop redraws */
+void (*wakeFileBrowser) ( ) = nullptr;
+
 
 bool createFolder ( std::string path )
 {
@@ -91,6 +106,641 @@ bool createFile ( std::string path )
     return false;
 }
 
+/***********************************************************************************************************************
+ * Directory cache
+ *
+ * Folders are listed on a background thread and kept, sorted, per folder so the UI thread only has to draw them.
+ * On Linux each cached folder is watched with inotify and marked stale when it changes.
+ **********************************************************************************************************************/
+
+#define FILEBROWSER_MAX_CACHED_FOLDERS 64
+
+typedef struct FolderListing
+{
+    std::shared_ptr<const std::vector<ImGui::Ext::FileBrowserEntry>> entries;
+    bool scanning = false;
+    bool stale    = true;
+    bool failed   = false;
+    int watch     = -1;
+    uint64_t lastUsed = 0;
+} FolderListing;
+
+typedef struct DirectoryCache
+{
+    std::map<std::string, FolderListing> folders;
+    std::deque<std::string> queue;
+    std::map<int, std::string> watches;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::thread worker;
+    bool stop = false;
+    int inotifyFd = -1;
+    uint64_t clock = 0;
+
+    ~DirectoryCache ( );
+} DirectoryCache;
+
+DirectoryCache _FileBrowserDirectoryCache;
+
+DirectoryCache::~DirectoryCache ( )
+{
+    if ( worker.joinable ( ) )
+    {
+        {
+            std::lock_guard<std::mutex> guard ( lock );
+            stop = true;
+        }
+
+        wake.notify_all ( );
+        worker.join ( );
+    }
+
+#ifdef __linux__
+    if ( inotifyFd >= 0 )
+    {
+        close ( inotifyFd );
+    }
+#endif
+}
+
+static std::string normaliseFolder ( std::string folder )
+{
+    while ( folder.length ( ) > 1 && folder.back ( ) == '/' )
+    {
+        folder.pop_back ( );
+    }
+
+    return folder;
+}
+
+static std::shared_ptr<const std::vector<ImGui::Ext::FileBrowserEntry>> scanFolder ( const std::string &folder,
+        bool *failed )
+{
+    auto entries = std::make_shared<std::vector<ImGui::Ext::FileBrowserEntry>> ( );
+    ImGui::Ext::FileBrowserEntry entry;
+    std::error_code err;
+
+    *failed = false;
+
+    std::filesystem::directory_iterator it ( folder, err ), end;
+
+    if ( err )
+    {
+        *failed = true;
+        return entries;
+    }
+
+    for ( ; it != end; it.increment ( err ) )
+    {
+        if ( err )
+        {
+            break;
+        }
+
+        entry.name        = it->path ( ).filename ( ).generic_string ( );
+        entry.path        = it->path ( ).generic_string ( );
+        entry.isDirectory = it->is_directory ( err );
+        entry.mtime       = it->last_write_time ( err ).time_since_epoch ( ).count ( );
+        entry.size        = entry.isDirectory ? 0 : it->file_size ( err );
+        entry.ext         = it->path ( ).extension ( ).generic_string ( );
+
+        if ( entry.ext.length ( ) > 0 )
+        {
+            entry.ext = entry.ext.substr ( 1 );
+
+            /* Extensions in the icon map are lowercase so lowercase this extension */
+            std::for_each ( entry.ext.begin ( ), entry.ext.end ( ), [] ( char & c )
+            {
+                c = std::tolower ( c );
+            });
+        }
+
+        entries->push_back ( entry );
+    }
+
+    /* Folders first, then by name */
+    std::sort ( entries->begin ( ), entries->end ( ),
+            [] ( const ImGui::Ext::FileBrowserEntry &a, const ImGui::Ext::FileBrowserEntry &b )
+            {
+                return a.isDirectory != b.isDirectory ? a.isDirectory : a.name < b.name;
+            });
+
+    return entries;
+}
+
+/* Marks folders that inotify reports as changed as stale, they're rescanned when next drawn. Call with the lock held */
+static void pollWatches ( DirectoryCache *cache )
+{
+#ifdef __linux__
+    char buffer [ 4096 ] __attribute__ ( ( aligned ( __alignof__ ( struct inotify_event ) ) ) );
+    const struct inotify_event *event;
+    ssize_t len;
+    char *ptr;
+
+    if ( cache->inotifyFd < 0 )
+    {
+        return;
+    }
+
+    while ( ( len = read ( cache->inotifyFd, buffer, sizeof ( buffer ) ) ) > 0 )
+    {
+        for ( ptr = buffer; ptr < buffer + len; ptr += sizeof ( struct inotify_event ) + event->len )
+        {
+            event = (const struct inotify_event*) ptr;
+
+            auto watch = cache->watches.find ( event->wd );
+
+            if ( watch != cache->watches.end ( ) )
+            {
+                cache->folders [ watch->second ].stale = true;
+                if ( wakeFileBrowser )
+                {
+                    (*wakeFileBrowser) ( );
+                }
+            }
+        }
+    }
+#endif
+}
+
+static void watchFolder ( DirectoryCache *cache, const std::string &folder, FolderListing *listing )
+{
+#ifdef __linux__
+    if ( cache->inotifyFd < 0 || listing->watch >= 0 )
+    {
+        return;
+    }
+
+    listing->watch = inotify_add_watch ( cache->inotifyFd, folder.c_str ( ),
+            IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF );
+
+    if ( listing->watch >= 0 )
+    {
+        cache->watches [ listing->watch ] = folder;
+    }
+#endif
+}
+
+static void unwatchFolder ( DirectoryCache *cache, FolderListing *listing )
+{
+#ifdef __linux__
+    if ( listing->watch >= 0 )
+    {
+        inotify_rm_watch ( cache->inotifyFd, listing->watch );
+        cache->watches.erase ( listing->watch );
+        listing->watch = -1;
+    }
+#endif
+}
+
+static void directoryWorker ( DirectoryCache *cache )
+{
+    std::shared_ptr<const std::vector<ImGui::Ext::FileBrowserEntry>> entries;
+    std::string folder;
+    bool failed;
+
+    for ( ;; )
+    {
+        {
+            std::unique_lock<std::mutex> guard ( cache->lock );
+
+            cache->wake.wait_for ( guard, std::chrono::milliseconds ( 250 ),
+                    [cache] { return cache->stop || ! cache->queue.empty ( ); } );
+
+            if ( cache->stop )
+            {
+                return;
+            }
+
+            pollWatches ( cache );
+
+            if ( cache->queue.empty ( ) )
+            {
+                continue;
+            }
+
+            folder = cache->queue.front ( );
+            cache->queue.pop_front ( );
+        }
+
+        entries = scanFolder ( folder, &failed );
+
+        std::lock_guard<std::mutex> guard ( cache->lock );
+
+        auto listing = cache->folders.find ( folder );
+
+        if ( listing == cache->folders.end ( ) )
+        {
+            // Evicted while we were scanning
+            continue;
+        }
+
+        listing->second.entries  = entries;
+        listing->second.failed   = failed;
+        listing->second.scanning = false;
+
+        if ( ! failed )
+        {
+            watchFolder ( cache, folder, &listing->second );
+        }
+
+        if ( wakeFileBrowser )
+        {
+            (*wakeFileBrowser) ( );
+        }
+    }
+}
+
+/* Marks a folder as stale so it is rescanned the next time it is drawn */
+static void invalidateFolder ( std::string folder )
+{
+    DirectoryCache *cache = &_FileBrowserDirectoryCache;
+    std::lock_guard<std::mutex> guard ( cache->lock );
+
+    auto listing = cache->folders.find ( normaliseFolder ( folder ) );
+
+    if ( listing != cache->folders.end ( ) )
+    {
+        listing->second.stale = true;
+    }
+}
+
+/* Returns the cached listing of folder, which may be out of date or NULL while it is scanned in the background */
+static std::shared_ptr<const std::vector<ImGui::Ext::FileBrowserEntry>> getListing ( std::string folder, bool rescan,
+        bool *failed )
+{
+    DirectoryCache *cache = &_FileBrowserDirectoryCache;
+    std::lock_guard<std::mutex> guard ( cache->lock );
+    FolderListing *listing;
+
+    if ( ! cache->worker.joinable ( ) )
+    {
+#ifdef __linux__
+        cache->inotifyFd = inotify_init1 ( IN_NONBLOCK | IN_CLOEXEC );
+#endif
+        cache->worker = std::thread ( directoryWorker, cache );
+    }
+
+    folder  = normaliseFolder ( folder );
+    listing = &cache->folders [ folder ];
+
+    listing->lastUsed = ++cache->clock;
+
+    listing->stale = listing->stale || rescan;
+
+    if ( listing->stale && ! listing->scanning )
+    {
+        listing->stale    = false;
+        listing->scanning = true;
+        cache->queue.push_back ( folder );
+        cache->wake.notify_one ( );
+    }
+
+    *failed = listing->failed;
+
+    if ( cache->folders.size ( ) > FILEBROWSER_MAX_CACHED_FOLDERS )
+    {
+        auto oldest = cache->folders.end ( );
+
+        for ( auto it = cache->folders.begin ( ); it != cache->folders.end ( ); it++ )
+        {
+            if ( ! it->second.scanning && ( oldest == cache->folders.end ( )
+            ||   it->second.lastUsed < oldest->second.lastUsed ) )
+            {
+                oldest = it;
+            }
+        }
+
+        if ( oldest != cache->folders.end ( ) && oldest->first != folder )
+        {
+            unwatchFolder ( cache, &oldest->second );
+            cache->folders.erase ( oldest );
+        }
+    }
+
+    return cache->folders [ folder ].entries;
+}
+
+/***********************************************************************************************************************
+ * Thumbnail cache
+ *
+ * Thumbnails are made by a pool of worker threads, most recently requested first, and kept on disk keyed by path,
+ * modification time and size. Finished thumbnails are uploaded on the UI thread a few per frame.
+ **********************************************************************************************************************/
+
+#define FILEBROWSER_MAX_THUMBNAILS          1024
+#define FILEBROWSER_MAX_THUMBNAIL_JOBS      256
+#define FILEBROWSER_THUMBNAIL_UPLOADS       8
+#define FILEBROWSER_MAX_THUMBNAIL_WORKERS   4
+
+const uint32_t THUMBNAIL_MAGIC = 0x45545042; /* "BPTE" */
+
+typedef struct Thumbnail
+{
+    ImTextureID tex = NULL;
+    bool pending    = false;
+    bool failed     = false;
+    uint64_t lastUsed = 0;
+} Thumbnail;
+
+typedef struct ThumbnailJob
+{
+    std::string key;
+    std::string path;
+    int size;
+    ImGui::Ext::FileBrowserThumbnailer thumbnailer;
+} ThumbnailJob;
+
+typedef struct ThumbnailResult
+{
+    std::string key;
+    int size;
+    std::vector<uint32_t> pixels;
+    bool ok;
+} ThumbnailResult;
+
+typedef struct ThumbnailCache
+{
+    std::map<std::string, Thumbnail> thumbnails;
+    std::deque<ThumbnailJob> jobs;
+    std::vector<ThumbnailResult> results;
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stop = false;
+    uint64_t clock = 0;
+
+    ~ThumbnailCache ( );
+} ThumbnailCache;
+
+ThumbnailCache _FileBrowserThumbnailCache;
+
+ThumbnailCache::~ThumbnailCache ( )
+{
+    {
+        std::lock_guard<std::mutex> guard ( lock );
+        stop = true;
+    }
+
+    wake.notify_all ( );
+
+    for ( std::thread &worker : workers )
+    {
+        worker.join ( );
+    }
+}
+
+ImTextureID sdlImpl_uploadThumbnail ( const uint32_t *pixels, int size )
+{
+    GLuint glTex;
+
+    glGenTextures ( 1,  &glTex );
+    glBindTexture ( GL_TEXTURE_2D, glTex );
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+    glTexImage2D ( GL_TEXTURE_2D, 0, GL_RGBA, size, size, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels );
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return (ImTextureID)(intptr_t)glTex;
+}
+
+void sdlImpl_freeThumbnail ( ImTextureID tex )
+{
+    GLuint glTex = (GLuint)((intptr_t)tex);
+    glDeleteTextures ( 1, &glTex );
+}
+
+ImTextureID (*uploadThumbnail)( const uint32_t*, int ) = &sdlImpl_uploadThumbnail;
+void (*freeThumbnail)( ImTextureID ) = &sdlImpl_freeThumbnail;
+
+
+static std::string thumbnailKey ( const ImGui::Ext::FileBrowserEntry *e, int size )
+{
+    return e->path + "|" + std::to_string ( e->mtime ) + "|" + std::to_string ( e->size ) + "|"
+         + std::to_string ( size );
+}
+
+static std::string thumbnailCachePath ( const std::string &key )
+{
+    const char *cacheHome = std::getenv ( "XDG_CACHE_HOME" ), *home = std::getenv ( "HOME" );
+    std::stringstream path;
+
+    if ( cacheHome && cacheHome [ 0 ] )
+    {
+        path << cacheHome;
+    }
+    else if ( home && home [ 0 ] )
+    {
+        path << home << "/.cache";
+    }
+    else
+    {
+        return "";
+    }
+
+    path << "/envelope/thumbnails/" << std::hex << std::hash<std::string> ( ) ( key ) << ".thumb";
+
+    return path.str ( );
+}
+
+static bool readDiskThumbnail ( const std::string &file, int size, uint32_t *pixels )
+{
+    uint32_t header [ 2 ];
+    bool ok = false;
+    FILE *thumb;
+
+    if ( file.length ( ) == 0 || ! ( thumb = fopen ( file.c_str ( ), "rb" ) ) )
+    {
+        return false;
+    }
+
+    if ( fread ( header, sizeof ( uint32_t ), 2, thumb ) == 2 && header [ 0 ] == THUMBNAIL_MAGIC
+    &&   header [ 1 ] == (uint32_t) size )
+    {
+        ok = fread ( pixels, sizeof ( uint32_t ), size * size, thumb ) == (size_t) ( size * size );
+    }
+
+    fclose ( thumb );
+
+    return ok;
+}
+
+static void writeDiskThumbnail ( const std::string &file, int size, const uint32_t *pixels )
+{
+    uint32_t header [ 2 ] = { THUMBNAIL_MAGIC, (uint32_t) size };
+    std::string temp = file + ".tmp";
+    std::error_code err;
+    FILE *thumb;
+
+    if ( file.length ( ) == 0 )
+    {
+        return;
+    }
+
+    std::filesystem::create_directories ( std::filesystem::path ( file ).parent_path ( ), err );
+
+    if ( ! ( thumb = fopen ( temp.c_str ( ), "wb" ) ) )
+    {
+        return;
+    }
+
+    fwrite ( header, sizeof ( uint32_t ), 2, thumb );
+    fwrite ( pixels, sizeof ( uint32_t ), size * size, thumb );
+    fclose ( thumb );
+
+    /* Written under a temporary name so that other editors never read half a thumbnail */
+    std::filesystem::rename ( temp, file, err );
+}
+
+static void thumbnailWorker ( ThumbnailCache *cache )
+{
+    ThumbnailJob job;
+    ThumbnailResult result;
+    std::string file;
+
+    for ( ;; )
+    {
+        {
+            std::unique_lock<std::mutex> guard ( cache->lock );
+
+            cache->wake.wait ( guard, [cache] { return cache->stop || ! cache->jobs.empty ( ); } );
+
+            if ( cache->stop )
+            {
+                return;
+            }
+
+            job = cache->jobs.front ( );
+            cache->jobs.pop_front ( );
+        }
+
+        file = thumbnailCachePath ( job.key );
+
+        result.key  = job.key;
+        result.size = job.size;
+        result.pixels.resize ( job.size * job.size );
+        result.ok   = readDiskThumbnail ( file, job.size, result.pixels.data ( ) );
+
+        if ( ! result.ok && ( result.ok = job.thumbnailer ( job.path, job.size, result.pixels.data ( ) ) ) )
+        {
+            writeDiskThumbnail ( file, job.size, result.pixels.data ( ) );
+        }
+
+        {
+            std::lock_guard<std::mutex> guard ( cache->lock );
+            cache->results.push_back ( std::move ( result ) );
+        }
+
+        if ( wakeFileBrowser )
+        {
+            (*wakeFileBrowser) ( );
+        }
+    }
+}
+
+/* Returns the thumbnail for e if it is ready, otherwise queues it and returns NULL */
+static ImTextureID requestThumbnail ( const ImGui::Ext::FileBrowserEntry *e, int size,
+        ImGui::Ext::FileBrowserThumbnailer thumbnailer )
+{
+    ThumbnailCache *cache = &_FileBrowserThumbnailCache;
+    std::lock_guard<std::mutex> guard ( cache->lock );
+    std::string key = thumbnailKey ( e, size );
+    Thumbnail *thumb = &cache->thumbnails [ key ];
+    ThumbnailJob job;
+    unsigned int i, nWorkers;
+
+    thumb->lastUsed = ++cache->clock;
+
+    if ( thumb->tex || thumb->pending || thumb->failed )
+    {
+        return thumb->tex;
+    }
+
+    if ( cache->workers.empty ( ) )
+    {
+        nWorkers = std::max ( 1u, std::min ( std::thread::hardware_concurrency ( ) - 1,
+                (unsigned int) FILEBROWSER_MAX_THUMBNAIL_WORKERS ) );
+
+        for ( i = 0; i < nWorkers; i++ )
+        {
+            cache->workers.push_back ( std::thread ( thumbnailWorker, cache ) );
+        }
+    }
+
+    job.key         = key;
+    job.path        = e->path;
+    job.size        = size;
+    job.thumbnailer = thumbnailer;
+
+    /* Newest first, items that were scrolled past a while ago are dropped and requested again if they come back */
+    cache->jobs.push_front ( job );
+    thumb->pending = true;
+
+    while ( cache->jobs.size ( ) > FILEBROWSER_MAX_THUMBNAIL_JOBS )
+    {
+        cache->thumbnails [ cache->jobs.back ( ).key ].pending = false;
+        cache->jobs.pop_back ( );
+    }
+
+    cache->wake.notify_one ( );
+
+    return NULL;
+}
+
+/* Uploads a few finished thumbnails and evicts the least recently drawn ones, call once per frame */
+static void uploadThumbnails ( )
+{
+    ThumbnailCache *cache = &_FileBrowserThumbnailCache;
+    std::lock_guard<std::mutex> guard ( cache->lock );
+    int uploads = 0;
+
+    while ( ! cache->results.empty ( ) && uploads < FILEBROWSER_THUMBNAIL_UPLOADS )
+    {
+        ThumbnailResult &result = cache->results.back ( );
+        Thumbnail *thumb = &cache->thumbnails [ result.key ];
+
+        thumb->pending = false;
+        thumb->failed  = ! result.ok;
+
+        if ( result.ok && ! thumb->tex )
+        {
+            thumb->tex = (*uploadThumbnail) ( result.pixels.data ( ), result.size );
+            uploads++;
+        }
+
+        cache->results.pop_back ( );
+    }
+
+    if ( cache->thumbnails.size ( ) > FILEBROWSER_MAX_THUMBNAILS )
+    {
+        std::vector<std::pair<uint64_t, std::string>> byAge;
+
+        for ( auto &thumb : cache->thumbnails )
+        {
+            if ( ! thumb.second.pending )
+            {
+                byAge.push_back ( std::make_pair ( thumb.second.lastUsed, thumb.first ) );
+            }
+        }
+
+        std::sort ( byAge.begin ( ), byAge.end ( ) );
+
+        for ( auto it = byAge.begin ( );
+              it != byAge.end ( ) && cache->thumbnails.size ( ) > FILEBROWSER_MAX_THUMBNAILS / 2; it++ )
+        {
+            if ( cache->thumbnails [ it->second ].tex )
+            {
+                (*freeThumbnail) ( cache->thumbnails [ it->second ].tex );
+            }
+
+            cache->thumbnails.erase ( it->second );
+        }
+    }
+}
+
 bool ImGui::Ext::FileBrowser ( ImGui::Ext::FileBrowserContext *context, const std::string startFolder )
 {
     int i = 0, j = 0, iconSizePixels = context->dpi * context->iconSizeInches, nCols, col, row;
@@ -98,7 +748,8 @@ bool ImGui::Ext::FileBrowser ( ImGui::Ext::FileBrowserContext *context, const st
     ImVec2 iconSize = ImVec2 ( iconSizePixels, iconSizePixels );
     std::stringstream pathSplitStream;
     std::string folder, workingPath;
-    bool usingRegex = context->filter.length ( ) > 0, ret = false;
+    bool usingRegex = context->filter.length ( ) > 0, ret = false, failed;
+    std::shared_ptr<const std::vector<FileBrowserEntry>> listing;
     const char* listItems [ 2 ] = { "folder", "file" };
 
     if ( ! context->_iconMapInit )
@@ -110,6 +761,8 @@ bool ImGui::Ext::FileBrowser ( ImGui::Ext::FileBrowserContext *context, const st
 
     }
 
+    uploadThumbnails ( );
+
     /* If the currentFolder variable hasn't been initialised then initialise it */
     if ( context->currentFolder.length() == 0 )
     {
@@ -128,8 +781,8 @@ bool ImGui::Ext::FileBrowser ( ImGui::Ext::FileBrowserContext *context, const st
         }
     }
 
-    /* If there is a pattern regex and we haven't compiled it yet, then compile it */
-    if ( ! context->_regex_compiled )
+    /* If there is a pattern regex and we haven't compiled it since it last changed, then compile it */
+    if ( ! context->_regex_compiled || context->filter != context->_entriesFilter )
     {
         if ( usingRegex )
         {
@@ -185,6 +838,13 @@ bool ImGui::Ext::FileBrowser ( ImGui::Ext::FileBrowserContext *context, const st
         ImGui::OpenPopup ( "NewFileFolder" );
     }
 
+    ImGui::SameLine ( );
+
+    if ( ImGui::SmallButton ( "rescan" ) )
+    {
+        context->_rescan = true;
+    }
+
     if ( ImGui::BeginPopup ( "NewFileFolder" ) )
     {
         ImGui::Combo ( "type", &context->_listSelection, listItems, 2 );
@@ -210,6 +870,7 @@ bool ImGui::Ext::FileBrowser ( ImGui::Ext::FileBrowserContext *context, const st
             }
 
             std::cout << context->fileNameInput << std::endl;
+            invalidateFolder ( workingPath );
             ImGui::CloseCurrentPopup ( );
         }
 
@@ -241,6 +902,7 @@ bool ImGui::Ext::FileBrowser ( ImGui::Ext::FileBrowserContext *context, const st
                     context->fileCreated = true;
                 }
             }
+            invalidateFolder ( workingPath );
             ImGui::CloseCurrentPopup ( );
         }
 
@@ -253,104 +915,122 @@ bool ImGui::Ext::FileBrowser ( ImGui::Ext::FileBrowserContext *context, const st
 
     ImGui::BeginChild ( "FileIcons" );
 
-    try{
-        nCols =  ImGui::GetWindowWidth ( ) /  ( iconSizePixels * 2 );
-        yAdjust = ImGui::GetCursorPosY ( );
+    listing = getListing ( context->currentFolder, context->_rescan, &failed );
+    context->_rescan = false;
 
-        /* For each item in this folder */
-        for ( std::filesystem::directory_entry e : std::filesystem::directory_iterator ( context->currentFolder ))
-        {
-            /* If it matches our filter */
-            if (
-                ( ( std::regex_match ( e.path ( ).filename ( ).generic_string ( ), context->_compiled ) )
-                     || !usingRegex || e.is_directory () )
+    if ( failed )
+    {
+        /* probably didn't have permission
+         * TODO: check each folder for permission, don't bother letting the user click on those */
 
-                && ( ! context->showHidden && e.path ( ).filename ( ).generic_string ( ).c_str( )[0] != '.'
-                     || context->showHidden )
+        //Go back up a directory
+        context->currentFolder = context->currentFolder.substr
+                (0,
+                context->currentFolder.substr(0, context->currentFolder.find_last_of ( '/' ) - 1).find_last_of ( '/' ));
+    }
 
-                && ( ( ( context->type == FOLDER ) && e.is_directory ( ) ) || ! (context->type == FOLDER) )
-            )
+    /* Filtering is only redone when the listing or the filter settings change */
+    if ( listing != context->_listing || context->showHidden != context->_entriesShowHidden
+    ||   context->type != context->_entriesType || context->filter != context->_entriesFilter )
+    {
+        context->_listing           = listing;
+        context->_entriesShowHidden = context->showHidden;
+        context->_entriesType       = context->type;
+        context->_entriesFilter     = context->filter;
+        context->_entries.clear ( );
+
+        if ( listing )
+        {
+            for ( const FileBrowserEntry &e : *listing )
             {
-                /* Work out where it is in the grid */
-                col = j % nCols;
-                row = j / nCols;
+                /* If it matches our filter */
+                if (
+                    ( !usingRegex || e.isDirectory || std::regex_match ( e.name, context->_compiled ) )
 
-                ImGui::PushID ( i++ + j++ );
+                    && ( context->showHidden || e.name [ 0 ] != '.' )
 
-                if ( e.is_directory ())
-                {
-                    /* Draw folder icon and process folder click if clicked */
-                    ImGui::SetCursorPos ( ImVec2 ( col * (iconSizePixels * 2) + iconSizePixels / 2,
-                            yAdjust + row * iconSizePixels ) );
-                    if ( ImGui::ImageButton ( context->iconMap[ "folder" ], iconSize ))
-                    {
-                        context->currentFolder = e.path ( ).generic_string ( );
-                        ret = true;
-                        context->fileCreated = false;
-                    }
-                }
-                else
+                    && ( context->type != FOLDER || e.isDirectory )
+                )
                 {
-                    /* Draw file icon depending on extension and process file if clicked */
-
-                    ImTextureID icon;
-                    std::string ext = e.path ( ).filename ( ).extension ( );
-
-                    if ( ext.length ( ) > 0 )
-                    {
-                        ext = e.path ( ).filename ( ).extension ( ).generic_string ( ).substr ( 1 );
-
-                        /* Extensions in our map are lowercase so lowercase this extension */
-                        std::for_each(ext.begin(), ext.end(), [](char & c)
-                        {
-                            c = std::tolower(c);
-                        });
-                    }
-
-                    icon = context->iconMap.find ( ext ) != context->iconMap.end ( )
-                            ? context->iconMap [ ext ]
-                            : context->iconMap [ "default" ];
-
-                    ImGui::SetCursorPos ( ImVec2 ( col * (iconSizePixels * 2) + iconSizePixels / 2,
-                                                   yAdjust + row * iconSizePixels ) );
-
-                    if ( ImGui::ImageButton ( icon, iconSize ) )
-                    {
-                        context->selectedFile = e.path ( );
-                        ret = true;
-                        context->fileCreated = false;
-                    }
+                    context->_entries.push_back ( &e );
                 }
+            }
+        }
+    }
 
-                /* Draw file name */
+    nCols =  ImGui::GetWindowWidth ( ) /  ( iconSizePixels * 2 );
+    yAdjust = ImGui::GetCursorPosY ( );
 
-                ImGui::SetCursorPosX ( col * (iconSizePixels * 2) + iconSizePixels / 2 );
-                PushTextWrapPos ( ImGui::GetCursorPosX ( ) + 1.5 * iconSizePixels );
-                ImGui::Text ( "%s", e.path ( ).filename ( ).c_str ( ) );
-                PopTextWrapPos ();
+    /* For each item in this folder */
+    for ( const FileBrowserEntry *e : context->_entries )
+    {
+        /* Work out where it is in the grid */
+        col = j % nCols;
+        row = j / nCols;
 
-                ImGui::PopID ();
+        ImGui::PushID ( i++ + j++ );
 
-                maxTextHeight = fmax ( maxTextHeight, ImGui::CalcTextSize ( e.path ( ).filename ( ).c_str ( ),
-                                                                            NULL, false, 1.5 * iconSizePixels).y );
+        if ( e->isDirectory )
+        {
+            /* Draw folder icon and process folder click if clicked */
+            ImGui::SetCursorPos ( ImVec2 ( col * (iconSizePixels * 2) + iconSizePixels / 2,
+                    yAdjust + row * iconSizePixels ) );
+            if ( ImGui::ImageButton ( context->iconMap[ "folder" ], iconSize ))
+            {
+                context->currentFolder = e->path;
+                ret = true;
+                context->fileCreated = false;
+            }
+        }
+        else
+        {
+            /* Draw file icon depending on extension and process file if clicked */
 
-                if ( col == (nCols - 1) )
-                {
-                    yAdjust += maxTextHeight + 10;
-                    maxTextHeight = 0;
-                }
+            ImTextureID icon = NULL;
+
+            ImGui::SetCursorPos ( ImVec2 ( col * (iconSizePixels * 2) + iconSizePixels / 2,
+                                           yAdjust + row * iconSizePixels ) );
+
+            /* Only thumbnails that are on screen are made */
+            auto thumbnailer = context->thumbnailers.find ( e->ext );
+
+            if ( thumbnailer != context->thumbnailers.end ( ) && ImGui::IsRectVisible ( iconSize ) )
+            {
+                icon = requestThumbnail ( e, iconSizePixels, thumbnailer->second );
+            }
+
+            if ( ! icon )
+            {
+                icon = context->iconMap.find ( e->ext ) != context->iconMap.end ( )
+                        ? context->iconMap [ e->ext ]
+                        : context->iconMap [ "default" ];
+            }
+
+            if ( ImGui::ImageButton ( icon, iconSize ) )
+            {
+                context->selectedFile = e->path;
+                ret = true;
+                context->fileCreated = false;
             }
         }
-    }
-    catch ( std::filesystem::filesystem_error )
-    {
-        /* probably didn't have permission
-         * TODO: check each folder for permission, don't bother letting the user click on those */
 
-        //Go back up a directory
-        context->currentFolder = context->currentFolder.substr
-                (0,
-                context->currentFolder.substr(0, context->currentFolder.find_last_of ( '/' ) - 1).find_last_of ( '/' ));
+        /* Draw file name */
+
+        ImGui::SetCursorPosX ( col * (iconSizePixels * 2) + iconSizePixels / 2 );
+        PushTextWrapPos ( ImGui::GetCursorPosX ( ) + 1.5 * iconSizePixels );
+        ImGui::Text ( "%s", e->name.c_str ( ) );
+        PopTextWrapPos ();
+
+        ImGui::PopID ();
+
+        maxTextHeight = fmax ( maxTextHeight, ImGui::CalcTextSize ( e->name.c_str ( ),
+                                                                    NULL, false, 1.5 * iconSizePixels).y );
+
+        if ( col == (nCols - 1) )
+        {
+            yAdjust += maxTextHeight + 10;
+            maxTextHeight = 0;
+        }
     }
 
     ImGui::EndChild ( );
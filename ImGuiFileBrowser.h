@@ -5,8 +5,12 @@
 #define ENVELOPE_IMGUIFILEBROWSER_H
 
 #include <imgui.h>
+#include <cstdint>
 #include <map>
 #include <regex>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace ImGui
 {
@@ -19,6 +23,36 @@ namespace ImGui
             FOLDER
         } FileBrowserType;
 
+        /**
+         * @struct FileBrowserEntry
+         *
+         * A file or folder found when scanning a folder
+         *
+         * @var FileBrowserEntry::name the file name
+         * @var FileBrowserEntry::path the full path
+         * @var FileBrowserEntry::ext the extension in lowercase without the dot
+         * @var FileBrowserEntry::isDirectory whether this is a folder
+         * @var FileBrowserEntry::mtime the last modification time
+         * @var FileBrowserEntry::size the file size in bytes
+         */
+        typedef struct FileBrowserEntry
+        {
+            std::string name;
+            std::string path;
+            std::string ext;
+            bool isDirectory;
+            int64_t mtime;
+            uintmax_t size;
+        } FileBrowserEntry;
+
+        /**
+         * Renders a size x size RGBA thumbnail of the file at path into pixels.
+         * Called from worker threads so must not touch ImGui or the GPU
+         *
+         * @returns false if no thumbnail could be made
+         */
+        typedef bool ( *FileBrowserThumbnailer ) ( const std::string &path, int size, uint32_t *pixels );
+
         /**
          * @struct FileBrowserContext
          *
@@ -27,24 +61,31 @@ namespace ImGui
          * ALWAYS ZERO INITIALISE ( i.e new FileBrowserContext() NOT new FileBrowserContext )
          *
          * @var FileBrowserContext::type Whether (files and folders) or just folders should be shown
-         * @var FileBrowserContext::filter the filter to apply to the files in the browser, uses regex
+         * @var FileBrowserContext::filter the filter to apply to the files in the browser, uses regex. It can be
+         * changed between frames
          * @var FileBrowserContext::dimensions the width and height of the FileBrowser child window
          * @var FileBrowserContext::currentFolder the current folder in view
          * @var FileBrowserContext::selectedFile the file the user has currently selected
          * @var FileBrowserContext::iconMap a mapping of file extensions to ImGui textures, supply your own if you wish
+         * @var FileBrowserContext::thumbnailers a mapping of lowercase file extensions to thumbnailers, files with a
+         * thumbnailer are shown with a preview instead of an icon once it has been generated
          * @var FileBrowserContext::iconSizeInches the icon size in inches
          * @var FileBrowserContext::dpi the screen dpi
          * @var FileBrowserContext::showHidden Whether to show hidden files
          * @var FileBrowserContext::filecreated Whether the return value indicates a file creation
+         *
+         * Folders are scanned on a background thread and cached, on Linux they are rescanned when inotify reports a
+         * change, otherwise when the user presses the rescan button or creates a file
          */
         typedef struct FileBrowserContext
         {
             FileBrowserType type = FILE;
-            const std::string filter;
+            std::string filter;
             ImVec2 dimensions = ImVec2( 0.0f,  400 );
             std::string currentFolder;
             std::string selectedFile;
             std::map<std::string, ImTextureID> iconMap;
+            std::map<std::string, FileBrowserThumbnailer> thumbnailers;
             float iconSizeInches = 3.0/8;
             float dpi = 96;
             std::regex _compiled;
@@ -54,6 +95,12 @@ namespace ImGui
             bool _iconMapInit = false;
             int _listSelection = 0;
             char fileNameInput [ 512 ];
+            bool _rescan = false;
+            std::shared_ptr<const std::vector<FileBrowserEntry>> _listing;
+            std::vector<const FileBrowserEntry*> _entries;
+            bool _entriesShowHidden = false;
+            FileBrowserType _entriesType = FILE;
+            std::string _entriesFilter;
         } FileBrowserContext;
 
         /**
@@ -75,4 +122,10 @@ namespace ImGui
     }
 }
 
+/**
+ * Called from the background workers when a listing or thumbnail changes. An app that waits for events before
+ * drawing a frame should point this at a function that wakes it. Any thread may call it
+ */
+extern void (*wakeFileBrowser) ( );
+
 #endif
\ No newline at end of file
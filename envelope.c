@@ -22,6 +22,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <pcre2posix.h>
 
@@ -53,8 +54,22 @@ void PCRE2regfree(regex_t *);
 #include <math.h>
 
 
+void free_breakpoint_chain ( breakpoint *bp );
+static void update_segments ( breakpoint *bp, double start, double end );
+static void notify_changed ( envelope* env, double start, double end );
+static void free_value_index ( struct value_index *node );
+void free_integral_index ( struct integral_index *index );
+void free_crossing_index ( struct crossing_index *index );
+
+
 int check_sanity ( breakpoint *bp )
 {
+    /* Nothing in the file matched */
+    if ( !bp )
+    {
+        return -1;
+    }
+
     while ( bp->next )
     {
         if ( bp->time > bp->next->time
@@ -74,7 +89,12 @@ int check_sanity ( breakpoint *bp )
 
 int load_breakpoints ( const char* file, envelope *env )
 {
-    int i, j, size, interp_array_size = 3, params_allocated = 0;
+    return load_breakpoints_progress ( file, env, NULL, NULL );
+}
+
+int load_breakpoints_progress ( const char* file, envelope *env, io_progress_callback progress, void *user )
+{
+    int i, j, size, interp_array_size = 3, params_allocated = 0, lines = 0;
     long long filesz;
     const int ngroups = 5;
     char *file_buffer, *token, *last_token, *interp_params, *tmp;
@@ -82,7 +102,7 @@ int load_breakpoints ( const char* file, envelope *env )
     regex_t bp_regex;
     regmatch_t groups[ngroups];
     breakpoint* top = NULL, *current;
-    double *interp_param_array, *tmp1;
+    double *interp_param_array, *tmp1, param;
     struct stat buf;
 
     if ( stat( file, &buf ) )
@@ -106,8 +126,23 @@ int load_breakpoints ( const char* file, envelope *env )
     regcomp ( &bp_regex, bp_regex_pattern, REG_EXTENDED);
 
 
-    while ( fgets (file_buffer, filesz, bp_file) )
+    while ( fgets (file_buffer, filesz + 1, bp_file) )
     {
+        if ( progress && ++lines % 1024 == 0 && progress ( (double)ftell ( bp_file ) / filesz, user ) )
+        {
+            /* Cancelled, env is left as it was */
+            if ( top )
+            {
+                free_breakpoint_chain ( top );
+            }
+
+            regfree ( &bp_regex );
+            fclose ( bp_file );
+            free ( file_buffer );
+
+            return -1;
+        }
+
         if ( ! regexec ( &bp_regex, file_buffer, ngroups, groups, 0 ) )
         {
             if ( !top )
@@ -132,20 +167,12 @@ int load_breakpoints ( const char* file, envelope *env )
                 {
                     case 1:
                         current->time = atof ( tmp );
-                        env->minTime = fmin ( env->minTime, current->time );
-                        env->maxTime = fmax ( env->maxTime, current->time );
                         break;
                     case 2:
                         current->value = atof ( tmp );
-                        env->minVal = fmin ( env->minVal, current->value );
-                        env->maxVal = fmax ( env->maxVal, current->value );
                         break;
                     case 3:
                         current->interpType = atoi ( tmp );
-                        if ( current->interpType < USER_DEFINED )
-                        {
-                            current->interpCallback = interp_functions [ current->interpType ];
-                        }
                         break;
                     case 4:
                         interp_params = malloc ( size + 1 );
@@ -156,29 +183,29 @@ int load_breakpoints ( const char* file, envelope *env )
                 free ( tmp );
             }
 
-            token = strtok ( interp_params, " \t\r\n\v\f" );
-            last_token = 0;
-
+            interp_array_size  = 3;
             interp_param_array = malloc ( interp_array_size * sizeof ( double ) );
             i = 0;
 
-            while ( token != NULL )
-            {
-                last_token = ( last_token == 0 ? interp_params : last_token + 1);
+            /* strtod rather than strtok so that loading is reentrant */
+            token = interp_params;
+            param = strtod ( token, &last_token );
 
-                if ( i >= interp_array_size - 1 )
+            while ( last_token != token )
+            {
+                if ( i >= interp_array_size )
                 {
-                    tmp1 = malloc( sizeof ( double ) * ++interp_array_size);
-                    memcpy ( tmp1, interp_param_array, interp_array_size - 1 );
+                    interp_array_size *= 2;
+                    tmp1 = malloc ( sizeof ( double ) * interp_array_size );
+                    memcpy ( tmp1, interp_param_array, sizeof ( double ) * i );
                     free ( interp_param_array );
                     interp_param_array = tmp1;
                 }
 
-                interp_param_array [ i ] = atof ( last_token );
+                interp_param_array [ i ] = param;
 
-                last_token = token;
-
-                token = strtok ( NULL, " \t\r\n\v\f" );
+                token = last_token;
+                param = strtod ( token, &last_token );
 
                 i++;
             }
@@ -189,38 +216,86 @@ int load_breakpoints ( const char* file, envelope *env )
                 params_allocated = 0;
             }
 
-            current->interp_params = interp_param_array;
-            current->nInterp_params = i;
+            memcpy ( set_interp_params ( current, i ), interp_param_array, i * sizeof ( double ) );
+            free ( interp_param_array );
         }
-        memset (file_buffer, 0, filesz );
     }
 
-    env->first = top;
+    env->first     = top;
+    env->scaled    = 0;
+    env->loop      = LOOP_OFF;
+    env->loopStart = NULL;
+    env->loopEnd   = NULL;
+    env_update_bounds ( env );
+    env_changed ( env, -INFINITY, INFINITY );
 
     /* Clean up */
     regfree ( &bp_regex );
     fclose ( bp_file );
     free ( file_buffer );
-    free ( interp_param_array );
 
     return check_sanity ( env->first );
 }
 
 int save_breakpoints ( const char* file, const envelope *env )
 {
-    int i;
-    FILE *bp_file = fopen ( file, "w+" );
-    breakpoint *current_bp = env->first;
+    return save_breakpoints_progress ( file, env, NULL, NULL );
+}
+
+int save_breakpoints_progress ( const char* file, const envelope *env, io_progress_callback progress, void *user )
+{
+    int i, n = 0, written = 0;
+    char *temp_file;
+    FILE *bp_file;
+    breakpoint *current_bp;
+    envelope *baked;
+
+    if ( env->scaled )
+    {
+        baked = copy_envelope ( env );
+        env_apply_gain ( baked );
+        i = save_breakpoints_progress ( file, baked, progress, user );
+        free_env ( baked );
+
+        return i;
+    }
+
+    /* Written under a temporary name and moved into place so a cancelled or failed save leaves the old file intact */
+    temp_file = malloc ( strlen ( file ) + 5 );
+    sprintf ( temp_file, "%s.tmp", file );
+
+    bp_file = fopen ( temp_file, "w+" );
+
+    if ( !bp_file )
+    {
+        free ( temp_file );
+        return -1;
+    }
+
+    for ( current_bp = env->first; current_bp; current_bp = current_bp->next )
+    {
+        n++;
+    }
+
+    current_bp = env->first;
 
     while ( current_bp )
     {
+        if ( progress && ++written % 1024 == 0 && progress ( (double)written / n, user ) )
+        {
+            fclose ( bp_file );
+            remove ( temp_file );
+            free ( temp_file );
+            return -1;
+        }
+
         fprintf ( bp_file, "%f ", current_bp->time );
         fprintf ( bp_file, "%f ", current_bp->value);
         fprintf ( bp_file, "%d", current_bp->interpType);
 
         for ( i = 0; i < current_bp->nInterp_params; i++ )
         {
-            fprintf ( bp_file, " %f", current_bp->interp_params[i] );
+            fprintf ( bp_file, " %f", INTERP_PARAMS ( current_bp ) [ i ] );
         }
 
         fprintf ( bp_file, "\n");
@@ -228,58 +303,109 @@ int save_breakpoints ( const char* file, const envelope *env )
         current_bp = current_bp->next;
     }
 
-    fclose ( bp_file );
+    if ( fclose ( bp_file ) || rename ( temp_file, file ) )
+    {
+        remove ( temp_file );
+        free ( temp_file );
+        return -1;
+    }
+
+    free ( temp_file );
+
+    return 0;
 }
 
-void env_seek ( envelope *env )
+static int looping ( const envelope *env )
+{
+    return env->loop != LOOP_OFF && ( env->type != ADSR || !((const ADSR_envelope*)env)->inRelease );
+}
+
+/* Where t falls once it has been wrapped round the loop, worked out directly however many times round it is */
+static double loop_time ( const envelope *env, double t )
 {
-    int first_iteration = 1;
-    double t = env->timeNow;
+    double start, end, length, phase;
 
-    if ( !env->first )
+    if ( !looping ( env ) || t <= env->loopEnd->time )
     {
-        return;
+        return t;
     }
 
-    if ( !env->current )
+    start  = env->loopStart->time;
+    end    = env->loopEnd->time;
+    length = end - start;
+
+    if ( length <= 0 )
     {
-        env->current = env->first;
+        return end;
     }
 
-    if ( t < env->first->time )
+    if ( env->loop == LOOP_PING_PONG )
     {
-        env->current = env->first;
-        return;
+        /* Back from the end, then forwards from the start */
+        phase = fmod ( t - end, 2 * length );
+        return phase <= length ? end - phase : start + phase - length;
     }
 
-    if ( env->current->next && ( t >= env->current->time && t <= env->current->next->time ) )
+    return start + fmod ( t - start, length );
+}
+
+/* Where env_seek starts looking for t when it isn't in or next to the current segment */
+static breakpoint* seek_start ( envelope *env, double t )
+{
+    if ( env->type == ADSR && ((ADSR_envelope*)env)->inRelease )
     {
-        return;
+        return ((ADSR_envelope*)env)->release;
     }
-    else
+
+    /* Going round a loop lands after its start, so there's no need to go back to the beginning of the chain */
+    if ( looping ( env ) && t >= env->loopStart->time )
     {
-        if ( env->current->next ) env->current = env->current->next;
+        return env->loopStart;
+    }
 
-        if ( env->current->next &&  t >= env->current->time && t <= env->current->next->time )
-        {
-            /* If it is, as it should be in most cases, then we just go to the next one */
-            return;
-        }
-        else
+    return env->first;
+}
+
+/* The segment of env at t, looked for from bp, which may be NULL. Only reads env, so cursors can share it */
+static breakpoint* find_segment ( envelope *env, breakpoint *bp, double t )
+{
+    if ( t < env->first->time || !bp )
+    {
+        bp = seek_start ( env, t );
+
+        if ( t < bp->time )
         {
-            /* Otherwise we start back at the beginning of the chain and work through until we find the correct
-             * breakpoint */
-            do
-            {
-                env->current = ( !first_iteration ? env->current->next : ( env->type != ADSR ||
-                        ((ADSR_envelope*)env)->_t == 0 ) ? env->first :
-                        ((ADSR_envelope*)env)->release );
-                first_iteration = 0;
-            } while ( env->current->next && !(t >= env->current->time && t <= env->current->next->time) );
+            return bp;
         }
     }
 
-    return;
+    /* Back to the first segment that reaches t, one segment at a time */
+    for ( ; bp->prev && t <= bp->time; bp = bp->prev );
+
+    if ( t < bp->time )
+    {
+        /* A chain whose links back haven't been set, or the start of the release chain */
+        bp = seek_start ( env, t );
+    }
+    else if ( looping ( env ) && t >= env->loopStart->time && bp->time < env->loopStart->time )
+    {
+        bp = env->loopStart;
+    }
+
+    while ( bp->next && t > bp->next->time )
+    {
+        bp = bp->next;
+    }
+
+    return bp;
+}
+
+void env_seek ( envelope *env )
+{
+    if ( env->first )
+    {
+        env->current = find_segment ( env, env->current, env->timeNow );
+    }
 }
 
 void env_set_time ( envelope *env, const double t )
@@ -288,15 +414,294 @@ void env_set_time ( envelope *env, const double t )
     env_seek ( env );
 }
 
+/* Whether env is evaluated at the times it is given, an ADSR_envelope is until it is triggered or released */
+static int plain_times ( const envelope *env )
+{
+    const ADSR_envelope *adsr = (const ADSR_envelope*) env;
+
+    return env->type != ADSR || ( !adsr->released && adsr->_on == 0 && isnan ( adsr->onLevel ) );
+}
+
+/*
+ * v, the value at t on the stretch of chain from 'from' to 'to', moved so the stretch starts at level and still ends
+ * at to's value. Flat stretches fade from level over their length instead
+ */
+static double moved_start ( const breakpoint *from, const breakpoint *to, double level, double v, double t )
+{
+    double length = to->time - from->time;
+
+    if ( from->value != to->value )
+    {
+        return to->value + ( v - to->value ) * ( level - to->value ) / ( from->value - to->value );
+    }
+
+    return length > 0 && t < to->time ? v + ( level - from->value ) * ( to->time - fmax ( t, from->time ) ) / length : v;
+}
+
+/*
+ * An ADSR_envelope's value at t, before scaling. Up to the release the chain is read from the last trigger, with the
+ * attack starting from the level it was triggered at, from the release on the release chain is read from the release
+ * and starts from the level it was released at. Crossing over moves the cursor between the chains
+ */
+static double ADSR_value ( ADSR_envelope *env, double t )
+{
+    breakpoint *attack = env->first->next;
+    double v;
+    int release = env->released && t >= env->_t;
+
+    if ( release != env->inRelease )
+    {
+        env->inRelease = release;
+        env->current   = release ? env->release : env->first;
+    }
+
+    if ( release )
+    {
+        env_set_time ( (envelope*) env, t - env->_t );
+        v = interp_functions [ env->current->interpType ] ( env->current, env->timeNow );
+
+        return moved_start ( env->release, env->releaseEnd, env->releaseLevel, v, env->timeNow );
+    }
+
+    env_set_time ( (envelope*) env, loop_time ( (envelope*) env, t - env->_on ) );
+    v = interp_functions [ env->current->interpType ] ( env->current, env->timeNow );
+
+    if ( attack && !isnan ( env->onLevel ) && t - env->_on < attack->time )
+    {
+        v = moved_start ( env->first, attack, env->onLevel, v, t - env->_on );
+    }
+
+    return v;
+}
+
 double value_at ( envelope *env, const double t )
 {
-    env_set_time ( env, t );
-    return env->current->interpCallback ( env->current, t );
+    double value;
+
+    if ( !plain_times ( env ) )
+    {
+        value = ADSR_value ( (ADSR_envelope*) env, t );
+        return env->scaled ? value * env->gain + env->offset : value;
+    }
+
+    env_set_time ( env, loop_time ( env, t ) );
+    value = interp_functions [ env->current->interpType ] ( env->current, env->timeNow );
+
+    return env->scaled ? value * env->gain + env->offset : value;
+}
+
+void env_cursor_init ( env_cursor *cursor, envelope *env )
+{
+    cursor->env     = env;
+    cursor->current = env->current;
+}
+
+double env_cursor_value_at ( env_cursor *cursor, double t )
+{
+    envelope *env = cursor->env;
+    double value;
+
+    if ( !plain_times ( env ) )
+    {
+        return value_at ( env, t );
+    }
+
+    t = loop_time ( env, t );
+    cursor->current = find_segment ( env, cursor->current, t );
+    value = interp_functions [ cursor->current->interpType ] ( cursor->current, t );
+
+    return env->scaled ? value * env->gain + env->offset : value;
 }
 
 double env_current_value ( envelope *env )
 {
-    return env->current->interpCallback ( env->current, env->timeNow );
+    double value = interp_functions [ env->current->interpType ] ( env->current, env->timeNow );
+
+    return env->scaled ? value * env->gain + env->offset : value;
+}
+
+/* The value the segment from bp holds between from and to, which are within it, NAN if it doesn't hold one */
+static double segment_constant ( const breakpoint *bp, double from, double to )
+{
+    const breakpoint *next = bp->next;
+    double mid;
+
+    if ( !next || to <= bp->time )
+    {
+        /* Held after the last breakpoint or before the first */
+        return bp->value;
+    }
+
+    switch ( bp->interpType )
+    {
+        case NEAREST_NEIGHBOUR:
+            /* Constant unless the step half way along is between from and to */
+            mid = ( bp->time + next->time ) / 2;
+
+            if ( bp->value == next->value || to < mid )
+            {
+                return bp->value;
+            }
+
+            return from > mid ? next->value : NAN;
+
+        case QUADRATIC_BEZIER:
+            if ( bp->nInterp_params < 2 )
+            {
+                return bp->value;
+            }
+
+            return bp->value == next->value && INTERP_PARAMS ( bp ) [ 1 ] == bp->value ? bp->value : NAN;
+
+        case LINEAR:
+        case EXPONENTIAL:
+            return bp->value == next->value ? bp->value : NAN;
+
+        default:
+            return NAN;
+    }
+}
+
+int env_constant_over ( envelope *env, double start, double end, double *value )
+{
+    breakpoint *bp;
+    double held = NAN, v;
+
+    if ( !env->first )
+    {
+        *value = 0;
+        return 1;
+    }
+
+    if ( !plain_times ( env ) || ( looping ( env ) && end > env->loopEnd->time ) )
+    {
+        return 0;
+    }
+
+    env_set_time ( env, start );
+
+    /* Through every segment up to end, they all have to hold the same value */
+    for ( bp = env->current; ; bp = bp->next )
+    {
+        v = segment_constant ( bp, fmax ( start, bp->time ), bp->next ? fmin ( end, bp->next->time ) : end );
+
+        if ( isnan ( v ) || ( !isnan ( held ) && v != held ) )
+        {
+            return 0;
+        }
+
+        held = v;
+
+        if ( !bp->next || end <= bp->next->time )
+        {
+            break;
+        }
+    }
+
+    *value = env->scaled ? held * env->gain + env->offset : held;
+
+    return 1;
+}
+
+/*
+ * render_block for blocks that don't go forwards through the chain, because they are rendered backwards or wrap round
+ * a loop. Each sample seeks, which moves the cursor one segment at a time either way
+ */
+static void render_seeking ( envelope *env, double start, double interval, int n, float *out )
+{
+    int i;
+
+    for ( i = 0; i < n; i++ )
+    {
+        env->timeNow = loop_time ( env, start + i * interval );
+        env_seek ( env );
+        out [ i ] = (float) interp_functions [ env->current->interpType ] ( env->current, env->timeNow );
+    }
+}
+
+void render_block ( envelope *env, double start, double interval, int n, float *out )
+{
+    breakpoint *bp;
+    double t, end;
+    int i = 0;
+
+    if ( !env->first )
+    {
+        memset ( out, 0, n * sizeof ( float ) );
+        return;
+    }
+
+    if ( !plain_times ( env ) )
+    {
+        /* A triggered or released ADSR_envelope, whose chains are short */
+        for ( i = 0; i < n; i++ )
+        {
+            out [ i ] = (float) ADSR_value ( (ADSR_envelope*) env, start + i * interval );
+        }
+
+        if ( env->scaled )
+        {
+            for ( i = 0; i < n; i++ )
+            {
+                out [ i ] = (float) ( out [ i ] * env->gain + env->offset );
+            }
+        }
+
+        return;
+    }
+
+    /* One seek for the whole block, after that the samples are walked through the chain in order */
+    env_set_time ( env, loop_time ( env, start ) );
+    bp = env->current;
+
+    if ( interval < 0 || ( looping ( env ) && start + ( n - 1 ) * interval > env->loopEnd->time ) )
+    {
+        render_seeking ( env, start, interval, n, out );
+        bp = env->current;
+        i  = n;
+    }
+
+    while ( i < n )
+    {
+        t = start + i * interval;
+
+        while ( bp->next && t > bp->next->time && t >= bp->time )
+        {
+            bp = bp->next;
+        }
+
+        if ( bp->next && t >= bp->time )
+        {
+            end = bp->next->time;
+        }
+        else if ( bp->next )
+        {
+            /* Before the start of the chain */
+            end = bp->time;
+        }
+        else
+        {
+            end = INFINITY;
+        }
+
+        do
+        {
+            out [ i ] = (float) interp_functions [ bp->interpType ] ( bp, t );
+            i++;
+            t = start + i * interval;
+        } while ( i < n && t <= end );
+    }
+
+    if ( env->scaled )
+    {
+        for ( i = 0; i < n; i++ )
+        {
+            out [ i ] = (float) ( out [ i ] * env->gain + env->offset );
+        }
+    }
+
+    env->current = bp;
+    env->timeNow = loop_time ( env, start + ( n - 1 ) * interval );
 }
 
 ADSR_envelope* create_ADSR_envelope ( const double attack, const double decay, const double sustain,
@@ -318,112 +723,113 @@ ADSR_envelope* create_ADSR_envelope ( const double attack, const double decay, c
     first->time = 0;
     first->value = 0;
     first->interpType = LINEAR;
-    first->interpCallback = linear_interp;
     first->next = second;
 
     second->time = attack;
     second->value = 1;
     second->interpType = QUADRATIC_BEZIER;
-    second->interpCallback = quadratic_bezier_interp;
-    second->nInterp_params = 2;
-    second->interp_params = calloc (2,  sizeof (double) );
-    second->interp_params [ 0 ] = attack;
-    second->interp_params [ 1 ] = sustain;
+    set_interp_params ( second, 2 );
+    INTERP_PARAMS ( second ) [ 0 ] = attack;
+    INTERP_PARAMS ( second ) [ 1 ] = sustain;
     second->next = sustain_bp;
 
     sustain_bp->time = attack + decay;
     sustain_bp->value = sustain;
     sustain_bp->interpType = NEAREST_NEIGHBOUR;
-    sustain_bp->interpCallback = nearest_interp;
 
     release_bp->time = 0;
     release_bp->value = sustain;
     release_bp->interpType = QUADRATIC_BEZIER;
-    release_bp->interpCallback = quadratic_bezier_interp;
-    release_bp->nInterp_params = 2;
-    release_bp->interp_params = calloc (2,  sizeof (double) );
-    release_bp->interp_params [ 0 ] = 0;
-    release_bp->interp_params [ 1 ] = 0;
+    set_interp_params ( release_bp, 2 );
+    INTERP_PARAMS ( release_bp ) [ 0 ] = 0;
+    INTERP_PARAMS ( release_bp ) [ 1 ] = 0;
     release_bp->next = end;
 
     end->time = release;
     end->value = 0;
     end->interpType = LINEAR;
-    end->interpCallback = linear_interp;
 
     created->release = release_bp;
+    created->releaseEnd = end;
+    created->onLevel = NAN;
     created->first = first;
     created->current = first;
 
+    update_segments ( first, -INFINITY, INFINITY );
+    update_segments ( release_bp, -INFINITY, INFINITY );
+
     return created;
 }
 
 
 void ADSR_release ( ADSR_envelope *env, double t )
 {
-    breakpoint *current;
+    env->releaseLevel = ADSR_value ( env, t );
+    env->_t           = t;
+    env->released     = 1;
 
-    env->current = env->release;
-    current = env->current;
+    notify_changed ( (envelope*) env, t, INFINITY );
+}
 
-    env->_t = t;
 
-    while ( current )
+void ADSR_trigger ( ADSR_envelope *env, double t )
+{
+    /* Until its first trigger the gate was never opened by a note, so legato has nothing to carry on from */
+    if ( env->trigger == ADSR_LEGATO && !env->released && !isnan ( env->onLevel ) )
     {
-        current->time += t;
-        if ( current->nInterp_params > 0 )
-        {
-            current->interp_params[ 0 ] += t;
-        }
-        current = current->next;
+        return;
     }
+
+    env->onLevel  = ADSR_value ( env, t );
+    env->_on      = t;
+    env->released = 0;
+
+    notify_changed ( (envelope*) env, t, INFINITY );
 }
 
 
 void ADSR_reset ( ADSR_envelope *env )
 {
-    env->current = env->first;
-
-    breakpoint *current;
-
-    current = env->release;
-
-    while ( current )
+    if ( !plain_times ( (envelope*) env ) )
     {
-        current->time -= env->_t;
-        if ( current->nInterp_params > 0 )
-        {
-            current->interp_params[ 0 ] -= env->_t;
-        }
-        current = current->next;
+        notify_changed ( (envelope*) env, fmin ( env->_on, env->released ? env->_t : INFINITY ), INFINITY );
     }
 
-    env->_t = 0;
+    env->current   = env->first;
+    env->inRelease = 0;
+    env->released  = 0;
+    env->_t        = 0;
+    env->_on       = 0;
+    env->onLevel   = NAN;
 }
 
 
 void free_breakpoint_chain ( breakpoint *bp )
 {
-    if ( ! bp->next )
-    {
-        free ( bp );
-        return;
-    }
+    breakpoint *next;
 
-    if ( bp->interp_params )
+    /* Not recursive, chains can be long enough to overflow the stack */
+    while ( bp )
     {
-        free ( bp->interp_params );
-    }
-
-    free_breakpoint_chain ( bp->next );
-    free ( bp );
+        next = bp->next;
 
-    return;
+        free_interp_params ( bp );
+        free ( bp );
+        bp = next;
+    }
 }
 
 
 void free_env ( envelope *env )
 {
+    env_listener *listener, *next;
+
+    for ( listener = env->listeners; listener; listener = next )
+    {
+        next = listener->next;
+        free ( listener );
+    }
+
     if ( env->type == ADSR )
     {
         if ( ((ADSR_envelope*)env)->release )
@@ -437,15 +843,97 @@ void free_env ( envelope *env )
         free_breakpoint_chain ( env->first );
     }
 
+    free_value_index ( env->values );
+    free_integral_index ( env->integral );
+    free_crossing_index ( env->crossings );
     free ( env );
     return;
 }
 
 
-double linear_interp ( breakpoint *bp, double time )
+breakpoint* copy_breakpoint_chain ( const breakpoint *bp )
+{
+    breakpoint *top = NULL, *current = NULL, *copy;
+
+    while ( bp )
+    {
+        copy = malloc ( sizeof ( breakpoint ) );
+        memcpy ( copy, bp, sizeof ( breakpoint ) );
+
+        copy->next = NULL;
+        copy->prev = current;
+
+        /* Inline parameters came along with the rest, a block of their own has to be copied */
+        if ( bp->nInterp_params > BP_INLINE_PARAMS )
+        {
+            copy->params.heap_params = malloc ( bp->nInterp_params * sizeof ( double ) );
+            memcpy ( copy->params.heap_params, bp->params.heap_params, bp->nInterp_params * sizeof ( double ) );
+        }
+
+        if ( !top )
+        {
+            top = copy;
+        }
+        else
+        {
+            current->next = copy;
+        }
+
+        current = copy;
+        bp = bp->next;
+    }
+
+    return top;
+}
+
+
+envelope* copy_envelope ( const envelope *env )
 {
-    double t1, t2, v1, v2, m;
+    envelope *copy;
+    const breakpoint *bp;
+    breakpoint *copied;
+
+    if ( env->type == ADSR )
+    {
+        copy = calloc ( 1, sizeof ( ADSR_envelope ) );
+        memcpy ( copy, env, sizeof ( ADSR_envelope ) );
+        ((ADSR_envelope*)copy)->release   = copy_breakpoint_chain ( ((ADSR_envelope*)env)->release );
+        ((ADSR_envelope*)copy)->inRelease = 0;
+
+        for ( copied = ((ADSR_envelope*)copy)->release; copied && copied->next; copied = copied->next );
+
+        ((ADSR_envelope*)copy)->releaseEnd = copied;
+    }
+    else
+    {
+        copy = calloc ( 1, sizeof ( envelope ) );
+        memcpy ( copy, env, sizeof ( envelope ) );
+    }
+
+    copy->first   = copy_breakpoint_chain ( env->first );
+    copy->current = copy->first;
+    copy->listeners = NULL;
+    copy->changed   = 0;
+    copy->values    = NULL;
+    copy->integral  = NULL;
+    copy->crossings = NULL;
+
+    if ( env->loop != LOOP_OFF )
+    {
+        /* The loop's breakpoints are at the same places in the copied chain */
+        for ( bp = env->first, copied = copy->first; bp; bp = bp->next, copied = copied->next )
+        {
+            copy->loopStart = bp == env->loopStart ? copied : copy->loopStart;
+            copy->loopEnd   = bp == env->loopEnd ? copied : copy->loopEnd;
+        }
+    }
 
+    return copy;
+}
+
+
+double linear_interp ( breakpoint *bp, double time )
+{
     if ( time < bp->time )
     {
         return bp->value;
@@ -458,14 +946,7 @@ double linear_interp ( breakpoint *bp, double time )
             return bp->next->value;
         }
 
-        t1 = bp->time;
-        t2 = bp->next->time;
-        v1 = bp->value;
-        v2 = bp->next->value;
-
-        m = (v2 - v1) / (t2 - t1);
-
-        return v1 + m * (time - t1);
+        return bp->value + bp->slope * ( time - bp->time );
     }
     else
     {
@@ -500,52 +981,77 @@ double quadratic_bezier ( double p0, double p1, double p2, double t)
 }
 
 
-double quadratic_bezier_interp ( breakpoint *bp, double time )
+/* The curve parameter at which a quadratic bezier from t0 to t2 with its control point at t1 reaches time, NAN if it
+ * doesn't */
+double bezier_time_parameter ( double t0, double t1, double t2, double time )
 {
-    double t, a, b, c, determinant, roots [ 2 ];
-
-    if ( ( !bp->next || bp->nInterp_params < 2 ) || time < bp->time )
-    {
-        return bp->value;
-    }
+    double a, b, c, determinant, roots [ 2 ];
 
     /* Quadratic formula */
 
-    a = (bp->time + bp->next->time - 2 * bp->interp_params [ 0 ]);
-    b = 2 * (bp->interp_params [ 0 ] - bp->time);
-    c = (bp->time - time);
+    a = (t0 + t2 - 2 * t1);
+    b = 2 * (t1 - t0);
+    c = (t0 - time);
 
     determinant =  b*b - 4 * a * c ;
 
     if ( determinant < 0 )
     {
         /* This should never happen */
-        return linear_interp ( bp, time );
+        return NAN;
+    }
+
+    if ( fabs ( a ) < 1e-12 * fabs ( b ) )
+    {
+        /* The control point is half way between the ends so time is linear in t */
+        return -c / b;
     }
 
     roots [ 0 ] = (-b + sqrt ( determinant )) / (2 * a);
     roots [ 1 ] = (-b - sqrt ( determinant )) / (2 * a);
 
-    if ( abs (roots [ 0 ] - roots [ 1 ] ) < 0.0000001 )
+    if ( fabs (roots [ 0 ] - roots [ 1 ] ) < 0.0000001 )
     {
-        t = roots [ 0 ];
+        return roots [ 0 ];
     }
     else if ( roots [ 0 ] >= 0 && roots [ 0 ] <= 1 )
     {
-        t = roots [ 0 ];
+        return roots [ 0 ];
     }
     else
     {
-        t = roots [ 1 ];
+        return roots [ 1 ];
     }
+}
 
-    return quadratic_bezier (bp->value, bp->interp_params[1], bp->next->value, t);
+/* The curve parameter at which a quadratic bezier segment reaches time, NAN if it doesn't */
+double quadratic_bezier_parameter ( const breakpoint *bp, double time )
+{
+    return bezier_time_parameter ( bp->time, INTERP_PARAMS ( bp ) [ 0 ], bp->next->time, time );
 }
 
-double exponential_interp ( breakpoint* bp, double time )
+
+double quadratic_bezier_interp ( breakpoint *bp, double time )
 {
-    double t1, t2, v1, v2, n;
+    double t;
+
+    if ( ( !bp->next || bp->nInterp_params < 2 ) || time < bp->time )
+    {
+        return bp->value;
+    }
+
+    t = quadratic_bezier_parameter ( bp, time );
+
+    if ( isnan ( t ) )
+    {
+        return linear_interp ( bp, time );
+    }
 
+    return quadratic_bezier (bp->value, INTERP_PARAMS ( bp ) [ 1 ], bp->next->value, t);
+}
+
+double exponential_interp ( breakpoint* bp, double time )
+{
     if ( time < bp->time )
     {
         return bp->value;
@@ -558,126 +1064,1079 @@ double exponential_interp ( breakpoint* bp, double time )
             return bp->next->value;
         }
 
-        t1 = bp->time;
-        t2 = bp->next->time;
-        v1 = bp->value;
-        v2 = bp->next->value;
+        if ( bp->value < 0.0001 || bp->next->value < 0.0001 ) return linear_interp ( bp, time );
+
+        /* v1 * ( v2 / v1 ) ^ n */
+        return bp->value * exp ( bp->log_ratio * ( time - bp->time ) * bp->inv_duration );
+    }
+    else
+    {
+        return bp->value;
+    }
+}
+
+void update_segment ( breakpoint *bp )
+{
+    breakpoint *next = bp->next;
+
+    if ( next )
+    {
+        next->prev = bp;
+    }
+
+    if ( !next || next->time <= bp->time )
+    {
+        bp->slope        = 0;
+        bp->inv_duration = 0;
+        bp->log_ratio    = 0;
+        return;
+    }
+
+    bp->inv_duration = 1 / ( next->time - bp->time );
+    bp->slope        = ( next->value - bp->value ) * bp->inv_duration;
+    bp->log_ratio    = bp->value >= 0.0001 && next->value >= 0.0001 ? log ( next->value / bp->value ) : 0;
+}
+
+/* Updates every segment in the chain from bp that overlaps start to end */
+static void update_segments ( breakpoint *bp, double start, double end )
+{
+    while ( bp && bp->next && bp->next->time < start )
+    {
+        bp = bp->next;
+    }
+
+    while ( bp && bp->time <= end )
+    {
+        update_segment ( bp );
+        bp = bp->next;
+    }
+}
+
+/*
+ * A treap of breakpoint values, a search tree on value kept balanced by giving each node a random priority and keeping
+ * higher priorities above lower ones. Breakpoints with the same value share a node
+ */
+typedef struct value_index
+{
+    double             value;
+    int                count;
+    uint32_t           priority;
+    struct value_index *left;
+    struct value_index *right;
+} value_index;
+
+static uint32_t index_priority ( const value_index *node )
+{
+    /* Any well mixed number will do, hashing the address keeps this reentrant */
+    uint64_t x = (uintptr_t) node;
+
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+
+    return (uint32_t) x;
+}
+
+static value_index* rotate_right ( value_index *node )
+{
+    value_index *top = node->left;
+
+    node->left = top->right;
+    top->right = node;
+
+    return top;
+}
+
+static value_index* rotate_left ( value_index *node )
+{
+    value_index *top = node->right;
+
+    node->right = top->left;
+    top->left   = node;
+
+    return top;
+}
+
+static value_index* index_add ( value_index *node, double value )
+{
+    if ( !node )
+    {
+        node = calloc ( 1, sizeof ( value_index ) );
+        node->value    = value;
+        node->count    = 1;
+        node->priority = index_priority ( node );
+    }
+    else if ( value < node->value )
+    {
+        node->left = index_add ( node->left, value );
+
+        if ( node->left->priority > node->priority )
+        {
+            node = rotate_right ( node );
+        }
+    }
+    else if ( value > node->value )
+    {
+        node->right = index_add ( node->right, value );
+
+        if ( node->right->priority > node->priority )
+        {
+            node = rotate_left ( node );
+        }
+    }
+    else
+    {
+        node->count++;
+    }
+
+    return node;
+}
 
-        if ( v1 < 0.0001 || v2 < 0.0001 ) return linear_interp ( bp, time );
+/* Rotates node down below its higher priority child until it has one child to replace it with */
+static value_index* index_unlink ( value_index *node )
+{
+    value_index *top;
 
-        n = ( time - t1 ) / ( t2 - t1 );
+    if ( !node->left || !node->right )
+    {
+        top = node->left ? node->left : node->right;
+        free ( node );
+        return top;
+    }
 
-        return v1 * pow ( v2 / v1, n );
+    if ( node->left->priority > node->right->priority )
+    {
+        top = rotate_right ( node );
+        top->right = index_unlink ( node );
     }
     else
     {
-        return bp->value;
+        top = rotate_left ( node );
+        top->left = index_unlink ( node );
+    }
+
+    return top;
+}
+
+static value_index* index_remove ( value_index *node, double value )
+{
+    if ( !node )
+    {
+        return NULL;
+    }
+
+    if ( value < node->value )
+    {
+        node->left = index_remove ( node->left, value );
+    }
+    else if ( value > node->value )
+    {
+        node->right = index_remove ( node->right, value );
+    }
+    else if ( value == node->value && --node->count == 0 )
+    {
+        return index_unlink ( node );
+    }
+
+    return node;
+}
+
+static void free_value_index ( value_index *node )
+{
+    if ( node )
+    {
+        free_value_index ( node->left );
+        free_value_index ( node->right );
+        free ( node );
+    }
+}
+
+static double scaled_value ( const envelope *env, double value )
+{
+    return env->scaled ? value * env->gain + env->offset : value;
+}
+
+/*
+ * Updates the index of values and the value bounds after a breakpoint's value has changed from removed to added,
+ * either may be NAN for a breakpoint that was inserted or deleted. The chain has to have been changed already, if
+ * the index hasn't been built yet it is built from the chain
+ */
+static void track_value ( envelope *env, double removed, double added )
+{
+    value_index *low, *high;
+    breakpoint *bp;
+
+    if ( !env->values && env->first )
+    {
+        for ( bp = env->first; bp; bp = bp->next )
+        {
+            env->values = index_add ( env->values, bp->value );
+        }
+    }
+    else
+    {
+        if ( !isnan ( removed ) )
+        {
+            env->values = index_remove ( env->values, removed );
+        }
+
+        if ( !isnan ( added ) )
+        {
+            env->values = index_add ( env->values, added );
+        }
+    }
+
+    if ( env->values )
+    {
+        for ( low = env->values; low->left; low = low->left );
+        for ( high = env->values; high->right; high = high->right );
+
+        env->minVal = scaled_value ( env, low->value );
+        env->maxVal = scaled_value ( env, high->value );
     }
 }
 
 void insert_breakpoint ( envelope* env, breakpoint* bp )
 {
     breakpoint* current = env->current;
-    double current_time = env->timeNow;
+    double current_time = env->timeNow, start = -INFINITY;
 
     env_set_time ( env, bp->time );
 
     if ( bp->time >= env->current->time )
     {
+        start = env->current->time;
         bp->next = env->current->next;
+        bp->prev = env->current;
         env->current->next = bp;
     }
     else
     {
         bp->next = env->current;
+        bp->prev = NULL;
         env->current = bp;
         env->first = bp;
     }
 
+    if ( bp->next )
+    {
+        bp->next->prev = bp;
+    }
+
     env->current = current;
     env->timeNow = current_time;
-}
 
-/*TODO: This doesn't handle envelopes with negative values*/
-void normalise_envelope ( envelope* env )
-{
-    double max = 0, coefficient;
-    breakpoint* current = env->first;
+    track_value ( env, NAN, bp->value );
+    env->minTime = env->first->time;
 
-    while ( current )
+    if ( !bp->next )
     {
-        max = fmax ( max, current->value );
-        current = current->next;
+        env->maxTime = bp->time;
     }
 
-    coefficient = 1.0f / max;
+    env_changed ( env, start, bp->next ? bp->next->time : INFINITY );
+}
+
+/* The breakpoint before bp in env's main chain, NULL if bp is first or isn't in the chain */
+static breakpoint* previous_breakpoint ( envelope* env, breakpoint* bp )
+{
+    breakpoint *prev;
 
-    current = env->first;
+    if ( bp->prev && bp->prev->next == bp )
+    {
+        return bp->prev;
+    }
 
-    while ( current )
+    if ( env->current && env->current->next == bp )
     {
-        current->value *= coefficient;
-        current = current->next;
+        return env->current;
     }
 
-    env->maxVal = 1;
+    for ( prev = env->first; prev && prev->next != bp; prev = prev->next );
+
+    return prev;
 }
 
-void plot_envelope ( envelope* env, int width, int height, float* yvals )
+void delete_breakpoint ( envelope* env, breakpoint* bp )
 {
-    double interval, step, time;
-    int i;
+    breakpoint *prev = previous_breakpoint ( env, bp );
+    double start, end, value = bp->value;
 
-    interval = ( env->maxTime - env->minTime ) / (double)width;
-    step     = height / ( env->maxVal - env->minVal );
+    if ( !prev && env->first != bp )
+    {
+        return;
+    }
 
-    for ( i = 0; i < width; i++ )
+    start = prev ? prev->time : -INFINITY;
+    end   = bp->next ? bp->next->time : INFINITY;
+
+    if ( prev )
     {
-        time = i * interval;
+        prev->next = bp->next;
+    }
+    else
+    {
+        env->first = bp->next;
+    }
 
-        yvals [ i ] = value_at ( env, time ) * step;
+    if ( bp->next )
+    {
+        bp->next->prev = prev;
     }
-}
 
+    if ( env->current == bp )
+    {
+        env->current = prev ? prev : env->first;
+    }
 
-void plot_ADSR_envelope ( ADSR_envelope *env, double sustain_time, int width, int height, float* yvals )
-{
-    double old_t, old_time;
-    ADSR_envelope e;
+    if ( env->loop != LOOP_OFF && ( bp == env->loopStart || bp == env->loopEnd ) )
+    {
+        /* Everything after the loop comes back */
+        env->loop      = LOOP_OFF;
+        env->loopStart = NULL;
+        env->loopEnd   = NULL;
+        end            = INFINITY;
+    }
 
+    free_interp_params ( bp );
+    free ( bp );
 
-    if ( env->_t == 0 )
-    {
-        memcpy ( &e, env, sizeof ( ADSR_envelope ));
+    track_value ( env, value, NAN );
 
-        ADSR_release ( &e, sustain_time );
-        e.current = e.first;
+    if ( env->first )
+    {
+        env->minTime = env->first->time;
+    }
 
-        while ( e.current->next )
-        {
-            e.current = e.current->next;
-        }
+    if ( isinf ( end ) && prev )
+    {
+        env->maxTime = prev->time;
+    }
 
-        e.current->next = e.release;
+    env_changed ( env, start, end );
+}
 
-        plot_envelope ( (envelope*)&e, width, height, yvals );
+void move_breakpoint ( envelope* env, breakpoint* bp, double time, double value )
+{
+    breakpoint *prev = previous_breakpoint ( env, bp );
+    double old;
 
-        e.current->next = NULL;
-        ADSR_reset ( &e );
+    if ( prev )
+    {
+        time = fmax ( time, prev->time );
     }
-    else
+
+    if ( bp->next )
     {
-        old_t = env->_t;
-        old_time = env->timeNow;
+        time = fmin ( time, bp->next->time );
+    }
+
+    old   = bp->value;
+    bp->time  = time;
+    bp->value = value;
+
+    track_value ( env, old, value );
 
-        ADSR_reset ( env );
+    env->minTime = env->first->time;
 
-        plot_ADSR_envelope ( env, sustain_time, width, height, yvals );
+    if ( !bp->next )
+    {
+        env->maxTime = time;
+    }
+
+    env_changed ( env, prev ? prev->time : -INFINITY, bp->next ? bp->next->time : INFINITY );
+}
 
-        ADSR_release ( env, old_t );
+void env_add_listener ( envelope* env, env_change_callback callback, void *user )
+{
+    env_listener *listener;
 
-        env_set_time ((envelope*)env, old_time);
+    for ( listener = env->listeners; listener; listener = listener->next )
+    {
+        if ( listener->callback == callback && listener->user == user )
+        {
+            return;
+        }
     }
+
+    listener = malloc ( sizeof ( env_listener ) );
+    listener->callback = callback;
+    listener->user     = user;
+    listener->next     = env->listeners;
+    env->listeners     = listener;
 }
 
-interp_callback interp_functions[4] =  { linear_interp, nearest_interp, quadratic_bezier_interp, exponential_interp };
+void env_remove_listener ( envelope* env, env_change_callback callback, void *user )
+{
+    env_listener **listener, *removed;
+
+    for ( listener = &env->listeners; *listener; listener = &(*listener)->next )
+    {
+        if ( (*listener)->callback == callback && (*listener)->user == user )
+        {
+            removed = *listener;
+            *listener = removed->next;
+            free ( removed );
+            return;
+        }
+    }
+}
+
+/* Records a change and tells the listeners, without touching the breakpoints */
+static void notify_changed ( envelope* env, double start, double end )
+{
+    env_listener *listener, *next;
+
+    free_integral_index ( env->integral );
+    free_crossing_index ( env->crossings );
+    env->integral  = NULL;
+    env->crossings = NULL;
+
+    /* A change inside the loop changes every time round it */
+    if ( env->loop != LOOP_OFF && start <= env->loopEnd->time && end >= env->loopStart->time )
+    {
+        end = INFINITY;
+    }
+
+    if ( env->changed )
+    {
+        env->changedStart = fmin ( env->changedStart, start );
+        env->changedEnd   = fmax ( env->changedEnd,   end   );
+    }
+    else
+    {
+        env->changed      = 1;
+        env->changedStart = start;
+        env->changedEnd   = end;
+    }
+
+    /* A listener may remove itself */
+    for ( listener = env->listeners; listener; listener = next )
+    {
+        next = listener->next;
+        listener->callback ( env, start, end, listener->user );
+    }
+}
+
+void env_changed ( envelope* env, double start, double end )
+{
+    breakpoint *from = env->first;
+
+    /* Edits are usually near the cursor, an ADSR_envelope's cursor may be in the release chain */
+    if ( env->type != ADSR && env->current && env->current->time <= start )
+    {
+        from = env->current;
+    }
+
+    update_segments ( from, start, end );
+    notify_changed ( env, start, end );
+}
+
+int env_take_changes ( envelope* env, double *start, double *end )
+{
+    if ( !env->changed )
+    {
+        return 0;
+    }
+
+    *start = env->changedStart;
+    *end   = env->changedEnd;
+    env->changed = 0;
+
+    return 1;
+}
+
+void env_update_bounds ( envelope* env )
+{
+    breakpoint *bp;
+    double low, high;
+
+    free_value_index ( env->values );
+    env->values = NULL;
+
+    if ( !env->first )
+    {
+        return;
+    }
+
+    low  = env->first->value;
+    high = env->first->value;
+
+    for ( bp = env->first; bp->next; bp = bp->next )
+    {
+        low  = fmin ( low,  bp->next->value );
+        high = fmax ( high, bp->next->value );
+    }
+
+    env->minTime = env->first->time;
+    env->maxTime = bp->time;
+    env->minVal  = scaled_value ( env, low );
+    env->maxVal  = scaled_value ( env, high );
+}
+
+void env_set_loop ( envelope* env, breakpoint* start, breakpoint* end, loop_mode mode )
+{
+    double from = env->loop != LOOP_OFF ? env->loopEnd->time : INFINITY;
+
+    if ( mode == LOOP_OFF || !start || !end || end->time < start->time )
+    {
+        env->loop      = LOOP_OFF;
+        env->loopStart = NULL;
+        env->loopEnd   = NULL;
+    }
+    else
+    {
+        env->loop      = mode;
+        env->loopStart = start;
+        env->loopEnd   = end;
+        from           = fmin ( from, end->time );
+    }
+
+    /* Only what comes after the end of the loop, old or new, is different */
+    if ( !isinf ( from ) )
+    {
+        notify_changed ( env, from, INFINITY );
+    }
+}
+
+void normalise_envelope ( envelope* env )
+{
+    double gain, offset;
+
+    if ( env->minVal >= 0 )
+    {
+        /* Only scaled, which keeps 0 where it was and exponential segments the same shape */
+        if ( env->maxVal <= 0 )
+        {
+            return;
+        }
+
+        gain   = 1 / env->maxVal;
+        offset = 0;
+    }
+    else
+    {
+        gain   = 1 / ( env->maxVal - env->minVal );
+        offset = -env->minVal * gain;
+    }
+
+    env->offset = env->scaled ? env->offset * gain + offset : offset;
+    env->gain   = env->scaled ? env->gain * gain : gain;
+    env->scaled = 1;
+    env->minVal = env->minVal * gain + offset;
+    env->maxVal = env->maxVal * gain + offset;
+
+    notify_changed ( env, -INFINITY, INFINITY );
+}
+
+void env_apply_gain ( envelope* env )
+{
+    breakpoint *bp;
+    int i;
+
+    if ( !env->scaled )
+    {
+        return;
+    }
+
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        bp->value = bp->value * env->gain + env->offset;
+
+        /* Control points are ( time, value ) pairs */
+        for ( i = 1; bp->interpType == QUADRATIC_BEZIER && i < bp->nInterp_params; i += 2 )
+        {
+            INTERP_PARAMS ( bp ) [ i ] = INTERP_PARAMS ( bp ) [ i ] * env->gain + env->offset;
+        }
+    }
+
+    env->scaled = 0;
+    free_value_index ( env->values );
+    env->values = NULL;
+
+    env_changed ( env, -INFINITY, INFINITY );
+}
+
+/*
+ * A point the curve of a segment passes through, or a corner of a region the curve is known to lie inside. The
+ * vertical distance from a straight line to a segment is largest at one of these
+ */
+typedef struct simplify_witness
+{
+    double time;
+    double value;
+    int    bp;
+} simplify_witness;
+
+static int add_witness ( simplify_witness *witnesses, int n, double time, double value, int bp )
+{
+    witnesses [ n ].time  = time;
+    witnesses [ n ].value = value;
+    witnesses [ n ].bp    = bp;
+
+    return n + 1;
+}
+
+/* Adds witnesses for the inside of the segment from bps [ k ], returns -1 if the segment can't be bounded */
+static int segment_witnesses ( breakpoint **bps, int k, simplify_witness *witnesses, int n )
+{
+    breakpoint *bp = bps [ k ], *next = bps [ k + 1 ];
+    double t1 = bp->time, t2 = next->time, v1 = bp->value, v2 = next->value, d1, d2, tx;
+
+    if ( t2 == t1 )
+    {
+        return n;
+    }
+
+    switch ( bp->interpType )
+    {
+        case LINEAR:
+            return n;
+
+        case NEAREST_NEIGHBOUR:
+            /* Jumps from v1 to v2 half way along */
+            n = add_witness ( witnesses, n, ( t1 + t2 ) / 2, v1, k );
+            return add_witness ( witnesses, n, ( t1 + t2 ) / 2, v2, k );
+
+        case QUADRATIC_BEZIER:
+            if ( bp->nInterp_params < 2 )
+            {
+                return add_witness ( witnesses, n, t2, v1, k );
+            }
+
+            /* The curve lies inside the triangle of its control points */
+            return add_witness ( witnesses, n, INTERP_PARAMS ( bp ) [ 0 ], INTERP_PARAMS ( bp ) [ 1 ], k );
+
+        case EXPONENTIAL:
+            if ( v1 < 0.0001 || v2 < 0.0001 || v1 == v2 )
+            {
+                return n;
+            }
+
+            /* The curve is convex so it lies inside the triangle made by its chord and its tangents at each end */
+            d1 = v1 * log ( v2 / v1 ) / ( t2 - t1 );
+            d2 = v2 * log ( v2 / v1 ) / ( t2 - t1 );
+            tx = ( v2 - v1 - d2 * t2 + d1 * t1 ) / ( d1 - d2 );
+
+            return add_witness ( witnesses, n, tx, v1 + d1 * ( tx - t1 ), k );
+
+        default:
+            return -1;
+    }
+}
+
+int simplify_envelope ( envelope *env, double max_error )
+{
+    breakpoint **bps, *bp, *next;
+    simplify_witness *witnesses;
+    int *first_witness, *stack, *keep;
+    int n = 0, nWitnesses = 0, top = 0, removed = 0, i, j, k, end, worst, fixed, vertical;
+    double m, error, worst_error;
+
+    /* max_error is in the units the envelope produces, the breakpoints haven't had the gain applied */
+    if ( env->scaled )
+    {
+        max_error /= env->gain;
+    }
+
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        n++;
+    }
+
+    if ( n < 3 )
+    {
+        return 0;
+    }
+
+    bps           = malloc ( n * sizeof ( breakpoint* ) );
+    first_witness = malloc ( ( n + 1 ) * sizeof ( int ) );
+    keep          = calloc ( n, sizeof ( int ) );
+    stack         = malloc ( 2 * n * sizeof ( int ) );
+    witnesses     = malloc ( 3 * n * sizeof ( simplify_witness ) );
+
+    for ( bp = env->first, i = 0; bp; bp = bp->next, i++ )
+    {
+        bps  [ i ] = bp;
+        keep [ i ] = env->loop != LOOP_OFF && ( bp == env->loopStart || bp == env->loopEnd );
+    }
+
+    keep [ 0 ] = keep [ n - 1 ] = 1;
+
+    /* Every breakpoint is a witness followed by the witnesses for the inside of the segment after it. The breakpoints
+     * either side of a segment that can't be bounded always stay */
+    for ( i = 0; i < n; i++ )
+    {
+        first_witness [ i ] = nWitnesses;
+        nWitnesses = add_witness ( witnesses, nWitnesses, bps [ i ]->time, bps [ i ]->value, i );
+
+        if ( i < n - 1 )
+        {
+            fixed = segment_witnesses ( bps, i, witnesses, nWitnesses );
+
+            if ( fixed < 0 )
+            {
+                keep [ i ] = keep [ i + 1 ] = 1;
+            }
+            else
+            {
+                nWitnesses = fixed;
+            }
+        }
+    }
+
+    first_witness [ n ] = nWitnesses;
+
+    /* Douglas-Peucker between each pair of breakpoints that have to stay */
+    for ( i = 0; i < n - 1; i = end )
+    {
+        for ( end = i + 1; !keep [ end ]; end++ );
+
+        stack [ top++ ] = i;
+        stack [ top++ ] = end;
+
+        while ( top > 0 )
+        {
+            k = stack [ --top ];
+            fixed = stack [ --top ];
+
+            if ( k - fixed < 2 )
+            {
+                continue;
+            }
+
+            /* Breakpoints at the same time as each other are never merged, there's no line through them */
+            vertical = bps [ k ]->time == bps [ fixed ]->time;
+            m = vertical ? 0 : ( bps [ k ]->value - bps [ fixed ]->value ) / ( bps [ k ]->time - bps [ fixed ]->time );
+            worst = -1;
+            worst_error = -1;
+
+            for ( j = first_witness [ fixed ] + 1; j < first_witness [ k ]; j++ )
+            {
+                error = vertical ? INFINITY : fabs ( witnesses [ j ].value - bps [ fixed ]->value
+                                                   - m * ( witnesses [ j ].time - bps [ fixed ]->time ) );
+
+                if ( error > worst_error )
+                {
+                    worst_error = error;
+                    worst = witnesses [ j ].bp;
+
+                    /* Split inside a segment at whichever end isn't already the end of the range */
+                    if ( worst == fixed )
+                    {
+                        worst++;
+                    }
+                }
+            }
+
+            if ( worst_error > max_error )
+            {
+                keep [ worst ] = 1;
+
+                stack [ top++ ] = fixed;
+                stack [ top++ ] = worst;
+                stack [ top++ ] = worst;
+                stack [ top++ ] = k;
+            }
+        }
+    }
+
+    /* Rebuild the chain, a breakpoint that now skips over others becomes a straight line */
+    for ( i = 0; i < n - 1; i = j )
+    {
+        for ( j = i + 1; !keep [ j ]; j++ )
+        {
+            free_interp_params ( bps [ j ] );
+            free ( bps [ j ] );
+            removed++;
+        }
+
+        bp = bps [ i ];
+        next = bps [ j ];
+
+        if ( bp->next != next )
+        {
+            set_interp_params ( bp, 0 );
+            bp->interpType     = LINEAR;
+            bp->next           = next;
+        }
+    }
+
+    env->current = env->first;
+
+    if ( removed > 0 )
+    {
+        /* The whole chain has been walked already, so working the bounds out again costs little */
+        env_update_bounds ( env );
+        env_changed ( env, bps [ 0 ]->time, bps [ n - 1 ]->time );
+    }
+
+    free ( bps );
+    free ( first_witness );
+    free ( keep );
+    free ( stack );
+    free ( witnesses );
+
+    return removed;
+}
+
+/*
+ * Tries to join samples first and last with one segment of the given type. bp and next are set up as the segment,
+ * with bp's parameters inline. Returns 1 if every sample in between is within tolerance of the segment
+ */
+static int fit_segment ( const double *times, const double *values, int first, int last, interp_t type,
+                         double tolerance, breakpoint *bp, breakpoint *next )
+{
+    double u, w, sw = 0, swr = 0, duration = times [ last ] - times [ first ];
+    int k;
+
+    bp->time           = times [ first ];
+    bp->value          = values [ first ];
+    bp->interpType     = type;
+    bp->nInterp_params = 0;
+    bp->next           = next;
+    next->time         = times [ last ];
+    next->value        = values [ last ];
+    next->next         = NULL;
+    update_segment ( bp );
+
+    if ( type == EXPONENTIAL && ( values [ first ] < 0.0001 || values [ last ] < 0.0001 ) )
+    {
+        /* Would be a straight line anyway */
+        return 0;
+    }
+
+    if ( type == QUADRATIC_BEZIER )
+    {
+        if ( duration <= 0 )
+        {
+            return 0;
+        }
+
+        /* With the control point half way along time is linear in the curve parameter, so the value of the control
+         * point that best fits the samples is a least squares fit of one weight */
+        for ( k = first + 1; k < last; k++ )
+        {
+            u   = ( times [ k ] - times [ first ] ) / duration;
+            w   = 2 * u * ( 1 - u );
+            sw  += w * w;
+            swr += w * ( values [ k ] - ( 1 - u ) * ( 1 - u ) * values [ first ] - u * u * values [ last ] );
+        }
+
+        bp->params.inline_params [ 0 ] = times [ first ] + duration / 2;
+        bp->params.inline_params [ 1 ] = sw > 0 ? swr / sw : ( values [ first ] + values [ last ] ) / 2;
+        bp->nInterp_params = 2;
+    }
+
+    for ( k = first + 1; k < last; k++ )
+    {
+        if ( fabs ( interp_functions [ bp->interpType ] ( bp, times [ k ] ) - values [ k ] ) > tolerance )
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Finds the simplest segment type that joins samples first and last, returns 0 if none do */
+static int fit_range ( const double *times, const double *values, int first, int last, double tolerance,
+                       breakpoint *bp, breakpoint *next )
+{
+    static const interp_t types [ ] = { LINEAR, EXPONENTIAL, QUADRATIC_BEZIER };
+    int i;
+
+    for ( i = 0; i < 3; i++ )
+    {
+        if ( fit_segment ( times, values, first, last, types [ i ], tolerance, bp, next ) )
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+envelope* fit_envelope ( const double *times, const double *values, int n, double tolerance )
+{
+    envelope *env;
+    breakpoint *bp, *last = NULL, segment, end;
+    int first = 0, good, bad, step, mid;
+
+    if ( n < 1 )
+    {
+        return NULL;
+    }
+
+    env = calloc ( 1, sizeof ( envelope ) );
+    env->minTime = times [ 0 ];
+    env->maxTime = times [ n - 1 ];
+    env->minVal  = values [ 0 ];
+    env->maxVal  = values [ 0 ];
+
+    while ( 1 )
+    {
+        bp = calloc ( 1, sizeof ( breakpoint ) );
+
+        if ( last )
+        {
+            last->next = bp;
+        }
+        else
+        {
+            env->first = bp;
+        }
+
+        last = bp;
+
+        env->minVal = fmin ( env->minVal, values [ first ] );
+        env->maxVal = fmax ( env->maxVal, values [ first ] );
+
+        if ( first == n - 1 )
+        {
+            bp->time           = times [ first ];
+            bp->value          = values [ first ];
+            bp->interpType     = LINEAR;
+            break;
+        }
+
+        /* Gallop forward until a segment doesn't fit, then binary search for the longest one that does. Each search
+         * costs O ( length log length ) so fitting everything is O ( n log n ) */
+        good = first + 1;
+        bad  = n;
+
+        for ( step = 2; first + step < n; step *= 2 )
+        {
+            if ( !fit_range ( times, values, first, first + step, tolerance, &segment, &end ) )
+            {
+                bad = first + step;
+                break;
+            }
+
+            good = first + step;
+        }
+
+        if ( bad == n && good < n - 1 )
+        {
+            if ( fit_range ( times, values, first, n - 1, tolerance, &segment, &end ) )
+            {
+                good = n - 1;
+            }
+            else
+            {
+                bad = n - 1;
+            }
+        }
+
+        while ( bad - good > 1 )
+        {
+            mid = good + ( bad - good ) / 2;
+
+            if ( fit_range ( times, values, first, mid, tolerance, &segment, &end ) )
+            {
+                good = mid;
+            }
+            else
+            {
+                bad = mid;
+            }
+        }
+
+        fit_range ( times, values, first, good, tolerance, &segment, &end );
+
+        bp->time           = segment.time;
+        bp->value          = segment.value;
+        bp->interpType     = segment.interpType;
+        memcpy ( set_interp_params ( bp, segment.nInterp_params ), segment.params.inline_params,
+                 segment.nInterp_params * sizeof ( double ) );
+
+        first = good;
+    }
+
+    update_segments ( env->first, -INFINITY, INFINITY );
+    env->current = env->first;
+
+    return env;
+}
+
+void plot_envelope ( envelope* env, int width, int height, float* yvals )
+{
+    plot_envelope_range ( env, 0, env->maxTime - env->minTime, width, height, yvals );
+}
+
+void plot_envelope_range ( envelope* env, double start, double end, int width, int height, float* yvals )
+{
+    double interval, step, time;
+    int i;
+
+    interval = ( end - start ) / (double)width;
+    step     = height / ( env->maxVal - env->minVal );
+
+    for ( i = 0; i < width; i++ )
+    {
+        time = start + i * interval;
+
+        yvals [ i ] = ( value_at ( env, time ) - env->minVal ) * step;
+    }
+}
+
+
+void plot_ADSR_envelope ( ADSR_envelope *env, double sustain_time, int width, int height, float* yvals )
+{
+    ADSR_envelope e;
+
+    /* A copy of the state, gate held from 0 and released at sustain_time, sharing the breakpoints */
+    memcpy ( &e, env, sizeof ( ADSR_envelope ) );
+    e.current   = e.first;
+    e.inRelease = 0;
+    e.released  = 0;
+    e._on       = 0;
+    e.onLevel   = NAN;
+
+    e.releaseLevel = ADSR_value ( &e, sustain_time );
+    e._t           = sustain_time;
+    e.released     = 1;
+
+    plot_envelope_range ( (envelope*) &e, 0, sustain_time + e.releaseEnd->time - e.release->time, width, height, yvals );
+}
+
+interp_callback interp_functions [ MAX_INTERP_TYPES ] =
+        { linear_interp, nearest_interp, quadratic_bezier_interp, exponential_interp };
+
+static int nInterp_functions = USER_DEFINED;
+
+int register_interp ( interp_callback callback )
+{
+    if ( nInterp_functions == MAX_INTERP_TYPES )
+    {
+        return -1;
+    }
+
+    interp_functions [ nInterp_functions ] = callback;
+
+    return nInterp_functions++;
+}
+
+double* set_interp_params ( breakpoint *bp, int n )
+{
+    free_interp_params ( bp );
+
+    if ( n > BP_INLINE_PARAMS )
+    {
+        bp->params.heap_params = malloc ( n * sizeof ( double ) );
+    }
+
+    bp->nInterp_params = n;
+
+    return INTERP_PARAMS ( bp );
+}
+
+void free_interp_params ( breakpoint *bp )
+{
+    if ( bp->nInterp_params > BP_INLINE_PARAMS )
+    {
+        free ( bp->params.heap_params );
+    }
+
+    bp->nInterp_params = 0;
+}
@@ -26,6 +26,8 @@
 #ifndef ENVELOPE_ENVELOPE_H
 #define ENVELOPE_ENVELOPE_H
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -41,18 +43,60 @@ typedef enum interp
 } interp_t;
 
 
+/**
+ * The number of interpolation parameters a breakpoint holds without allocating, enough for a bezier's control point
+ */
+#define BP_INLINE_PARAMS 2
+
+/**
+ * The number of interpolation types, built in and registered with register_interp
+ */
+#define MAX_INTERP_TYPES 16
+
 typedef struct breakpoint
 {
     double              time;
-    interp_t            interpType;
-    double              *interp_params;
-    int                 nInterp_params;
     double              value;
+    /**
+     * The interpolation parameters, inline when there are no more than BP_INLINE_PARAMS and otherwise in a block of
+     * their own. Which one is in use goes by nInterp_params, so read them with INTERP_PARAMS and set them with
+     * set_interp_params
+     */
+    union
+    {
+        double          inline_params [ BP_INLINE_PARAMS ];
+        double          *heap_params;
+    } params;
     struct breakpoint   *next;
 
-    double ( *interpCallback ) ( struct breakpoint*, double );
+    /**
+     * Derived from this breakpoint and the next so that interpolating doesn't divide. Kept up to date by every
+     * function that changes the chain, call env_changed after changing times or values directly
+     */
+    double              slope;
+    double              inv_duration;
+    /**
+     * log ( next->value / value ), 0 unless both values are positive
+     */
+    double              log_ratio;
+    /**
+     * The breakpoint before this one, NULL for the first. Set along with the fields above, so that the cursor can step
+     * backwards as cheaply as forwards
+     */
+    struct breakpoint   *prev;
+    int                 nInterp_params;
+    /**
+     * An interp_t, indexes interp_functions, a registered type for USER_DEFINED and after
+     */
+    uint8_t             interpType;
 } breakpoint;
 
+/**
+ * A breakpoint's interpolation parameters, wherever they are kept
+ */
+#define INTERP_PARAMS( bp ) ( (bp)->nInterp_params > BP_INLINE_PARAMS ? (bp)->params.heap_params \
+                                                                      : (bp)->params.inline_params )
+
 /**
  * User interpolation callback should return a double
  * Start and end times and values can be retrieved from the breakpoint
@@ -65,7 +109,39 @@ double nearest_interp          ( breakpoint *bp, double time );
 double quadratic_bezier_interp ( breakpoint *bp, double time );
 double exponential_interp      ( breakpoint *bp, double time );
 
-extern interp_callback interp_functions[4];
+/**
+ * The interpolation function for each interpType
+ */
+extern interp_callback interp_functions [ MAX_INTERP_TYPES ];
+
+/***********************************************************************
+ * Adds a user interpolation function. Not thread safe, register
+ * functions before using them from several threads
+ *
+ * @return the interpType for breakpoints that use it, USER_DEFINED or
+ * after, -1 if MAX_INTERP_TYPES have been registered
+ ***********************************************************************/
+int    register_interp         ( interp_callback callback );
+
+/***********************************************************************
+ * Makes room for n interpolation parameters in bp and sets its
+ * nInterp_params, inline if there are no more than BP_INLINE_PARAMS.
+ * Frees any parameters bp had, their values aren't kept
+ *
+ * @return INTERP_PARAMS ( bp )
+ ***********************************************************************/
+double* set_interp_params      ( breakpoint *bp, int n );
+
+/**
+ * Frees bp's interpolation parameters, unless they are inline
+ */
+void   free_interp_params      ( breakpoint *bp );
+
+/**
+ * Works out bp's slope, inv_duration and log_ratio from it and the next breakpoint, and links the next breakpoint
+ * back to it
+ */
+void   update_segment          ( breakpoint *bp );
 
 typedef enum envelope_type
 {
@@ -73,6 +149,49 @@ typedef enum envelope_type
     ADSR
 } envelope_type;
 
+/**
+ * What ADSR_trigger does while the gate is held
+ */
+typedef enum adsr_trigger
+{
+    /**
+     * Starts the attack again, from the current level
+     */
+    ADSR_RETRIGGER,
+    /**
+     * Carries on, only the first trigger after creation or ADSR_reset and triggers after the release start the
+     * attack again
+     */
+    ADSR_LEGATO
+} adsr_trigger;
+
+/**
+ * How an envelope repeats the segments between its loop breakpoints, see env_set_loop
+ */
+typedef enum loop_mode
+{
+    LOOP_OFF,
+    LOOP_FORWARD,
+    LOOP_PING_PONG
+} loop_mode;
+
+struct envelope;
+struct value_index;
+struct integral_index;
+struct crossing_index;
+
+/**
+ * Called after an envelope changes, values between start and end may be different. start and end may be infinite
+ */
+typedef void ( *env_change_callback ) ( struct envelope *env, double start, double end, void *user );
+
+typedef struct env_listener
+{
+    env_change_callback  callback;
+    void                 *user;
+    struct env_listener  *next;
+} env_listener;
+
 typedef struct envelope
 {
     breakpoint    *first;
@@ -81,6 +200,9 @@ typedef struct envelope
      */
     breakpoint    *current;
     double        timeNow;
+    /**
+     * The first and last breakpoints' times and the lowest and highest breakpoint values, after any gain
+     */
     double        minTime;
     double        maxTime;
     double        minVal;
@@ -89,6 +211,43 @@ typedef struct envelope
      * Whether this is a simple or an ADSR envelope
      */
     envelope_type type;
+    /**
+     * Told about every change made through the API
+     */
+    env_listener  *listeners;
+    /**
+     * The range of times changed since env_take_changes last cleared it, if changed is set
+     */
+    int           changed;
+    double        changedStart;
+    double        changedEnd;
+    /**
+     * If scaled is set every value the envelope produces is multiplied by gain and has offset added, see
+     * normalise_envelope. The breakpoints keep their own values
+     */
+    int           scaled;
+    double        gain;
+    double        offset;
+    /**
+     * The breakpoints' values in order, for keeping minVal and maxVal up to date. Built by the first change that
+     * needs it
+     */
+    struct value_index *values;
+    /**
+     * Running totals of the area under the envelope for envelope_integral, built when first needed and dropped by
+     * any change
+     */
+    struct integral_index *integral;
+    /**
+     * The range of values each segment covers for time_at_value, built and dropped the same way
+     */
+    struct crossing_index *crossings;
+    /**
+     * Set by env_set_loop. Past loopEnd the envelope goes round the segments from loopStart again
+     */
+    loop_mode     loop;
+    breakpoint    *loopStart;
+    breakpoint    *loopEnd;
 } envelope;
 
 typedef  struct ADSR_envelope
@@ -101,10 +260,53 @@ typedef  struct ADSR_envelope
     double        minVal;
     double        maxVal;
     envelope_type type;
+    env_listener  *listeners;
+    int           changed;
+    double        changedStart;
+    double        changedEnd;
+    int           scaled;
+    double        gain;
+    double        offset;
+    struct value_index *values;
+    struct integral_index *integral;
+    struct crossing_index *crossings;
+    loop_mode     loop;
+    breakpoint    *loopStart;
+    breakpoint    *loopEnd;
+    /**
+     * The release, from its own time 0. It is moved to start at the level the envelope was released from
+     */
     breakpoint    *release;
+    breakpoint    *releaseEnd;
+    /**
+     * The time of the release, if released is set
+     */
     double        _t;
+    int           released;
+    double        releaseLevel;
+    /**
+     * The time of the last ADSR_trigger, which the envelope's times count from until the release, and the level the
+     * attack starts from, NAN to start from the first breakpoint's
+     */
+    double        _on;
+    double        onLevel;
+    adsr_trigger  trigger;
+    /**
+     * Set while the cursor is in the release
+     */
+    int           inRelease;
 } ADSR_envelope;
 
+/**
+ * A position in an envelope of its own, so that several threads can read one envelope at once without moving its
+ * cursor. The envelope mustn't be changed while they do
+ */
+typedef struct env_cursor
+{
+    envelope      *env;
+    breakpoint    *current;
+} env_cursor;
+
 
 /***********************************************************************
  * Reads breakpoint data from a file
@@ -123,7 +325,36 @@ typedef  struct ADSR_envelope
 int    load_breakpoints ( const char* file,  envelope *env       );
 
 
+/***********************************************************************
+ * Writes an envelope's breakpoints to a file in the format read by
+ * load_breakpoints
+ *
+ * @param file The file to write to
+ * @param env The envelope to save
+ * @return 0 on success, -1 on failure
+ ***********************************************************************/
 int    save_breakpoints ( const char* file,  const envelope *env );
+
+/**
+ * Progress callback for loading and saving, progress is between 0 and 1
+ * Return non-zero to cancel
+ */
+typedef int ( *io_progress_callback ) ( double progress, void *user );
+
+/***********************************************************************
+ * As load_breakpoints, calling progress periodically while loading.
+ * If progress cancels env is left untouched and -1 is returned
+ *
+ * Safe to call from another thread as long as nothing else uses env
+ ***********************************************************************/
+int    load_breakpoints_progress ( const char* file, envelope *env, io_progress_callback progress, void *user );
+
+/***********************************************************************
+ * As save_breakpoints, calling progress periodically while saving.
+ * The file is only replaced once it has been completely written
+ ***********************************************************************/
+int    save_breakpoints_progress ( const char* file, const envelope *env, io_progress_callback progress,
+                                   void *user );
 void   set_time         ( envelope *env,     const double t      );
 
 /**********************************************************************
@@ -135,9 +366,53 @@ void   set_time         ( envelope *env,     const double t      );
  *********************************************************************/
 double value_at         ( envelope *env,     const double t      );
 
+/**
+ * Starts a cursor at env's own cursor
+ */
+void   env_cursor_init  ( env_cursor *cursor, envelope *env );
+
+/**********************************************************************
+ * Gets the value of the cursor's envelope at a time, as value_at does
+ * but moving the cursor instead of the envelope's own. A triggered or
+ * released ADSR_envelope is read with value_at, so only one thread can
+ * read one of those
+ *
+ * @param cursor
+ * @param t time
+ * @return
+ *********************************************************************/
+double env_cursor_value_at ( env_cursor *cursor, double t );
+
+/**********************************************************************
+ * Renders n evenly spaced values of an envelope, the same as calling
+ * value_at for each of start, start + interval, ... but the chain is
+ * only searched once for the whole block
+ *
+ * @param env
+ * @param start    the time of the first value
+ * @param interval the time between values, negative to render
+ *                 backwards
+ * @param n        the number of values to write to out
+ * @param out
+ *********************************************************************/
+void   render_block     ( envelope *env, double start, double interval, int n, float *out );
+
+
+/**********************************************************************
+ * Whether the envelope holds one value from start to end, because the
+ * segments between them are flat, halves of nearest neighbour segments
+ * or outside the breakpoints. Leaves the cursor at start
+ *
+ * @param value set to the value if it is constant
+ * @return 1 if it is constant, else 0
+ *********************************************************************/
+int    env_constant_over ( envelope *env, double start, double end, double *value );
 
 /********************************************************
- * Enters the release phase for an ADSR envelope
+ * Enters the release phase for an ADSR envelope. The
+ * release starts from the level the envelope is at when
+ * it happens, wherever that is. The breakpoints aren't
+ * touched
  *
  * @param env The envelope to switch to release
  * @param t   The time at which the release occurred
@@ -145,8 +420,22 @@ double value_at         ( envelope *env,     const double t      );
 void   ADSR_release     ( ADSR_envelope *env, double t );
 
 
+/********************************************************
+ * Opens the gate of an ADSR envelope at t. Until the
+ * release the envelope's times count from t, and the
+ * attack starts from the level it was at. In ADSR_LEGATO
+ * mode a trigger while an earlier trigger's gate is held
+ * does nothing
+ *
+ * @param env The envelope to trigger
+ * @param t   The time of the trigger
+ *******************************************************/
+void   ADSR_trigger     ( ADSR_envelope *env, double t );
+
+
 /*************************************************
- * Resets an ADSR envelope after the release phase
+ * Resets an ADSR envelope after the release phase,
+ * back to how it was created, gate held from 0
  *
  * @param env The envelope to reset
  ************************************************/
@@ -160,6 +449,15 @@ void   ADSR_reset       ( ADSR_envelope *env );
  ***************************************************************/
 void   free_env ( envelope *env );
 
+/***************************************************************
+ * Makes a deep copy of an envelope, including the release
+ * chain of an ADSR_envelope. Free the copy with free_env
+ *
+ * @param env The envelope to copy
+ * @return The copy
+ ***************************************************************/
+envelope* copy_envelope ( const envelope *env );
+
 /***************************************************************
  * Inserts a breakpoint into the chain at the given time
  *
@@ -169,12 +467,138 @@ void   free_env ( envelope *env );
  ***************************************************************/
 void insert_breakpoint ( envelope* env, breakpoint* bp );
 
+/***************************************************************
+ * Removes a breakpoint from the chain and frees it
+ *
+ * @param env
+ * @param bp a breakpoint in env's chain
+ ***************************************************************/
+void delete_breakpoint ( envelope* env, breakpoint* bp );
+
+/***************************************************************
+ * Moves a breakpoint. The time is limited to between the
+ * breakpoints either side so the chain stays in order
+ *
+ * @param env
+ * @param bp a breakpoint in env's chain
+ * @param time
+ * @param value
+ ***************************************************************/
+void move_breakpoint ( envelope* env, breakpoint* bp, double time, double value );
+
+/***************************************************************
+ * Registers a callback for changes to env. Registering the same
+ * callback and user twice has no effect. Listeners aren't
+ * copied by copy_envelope and are freed by free_env
+ ***************************************************************/
+void env_add_listener ( envelope* env, env_change_callback callback, void *user );
+void env_remove_listener ( envelope* env, env_change_callback callback, void *user );
+
+/***************************************************************
+ * Records that values between start and end have changed, brings
+ * the segments between them up to date and tells the listeners.
+ * Call this after changing a breakpoint's fields directly
+ ***************************************************************/
+void env_changed ( envelope* env, double start, double end );
+
+/***************************************************************
+ * Works minTime, maxTime, minVal and maxVal out again from the
+ * breakpoints. Inserting, deleting and moving breakpoints keep
+ * them up to date, call this after changing values directly
+ ***************************************************************/
+void env_update_bounds ( envelope* env );
+
+/***************************************************************
+ * Gets the range of times changed since the last call, for
+ * caches that would rather check than listen
+ *
+ * @return 1 and sets start and end if anything changed, else 0
+ ***************************************************************/
+int  env_take_changes ( envelope* env, double *start, double *end );
+
+/***************************************************************
+ * Scales the envelope's output to between 0 and 1 in constant
+ * time. Envelopes that never go below 0 are only scaled, others
+ * are also offset. The breakpoints aren't changed, the gain is
+ * applied as values are read and when the envelope is saved
+ ***************************************************************/
 void normalise_envelope ( envelope* env );
 
+/***************************************************************
+ * Writes the gain set by normalise_envelope into the breakpoints
+ * and clears it. Exponential segments of an envelope that was
+ * offset aren't quite the same shape afterwards
+ ***************************************************************/
+void env_apply_gain ( envelope* env );
+
+/***************************************************************
+ * Makes the envelope go round the segments from start to end
+ * again once it reaches end, forever for a simple envelope and
+ * until ADSR_release for an ADSR_envelope, a sustain loop. Later
+ * times are wrapped into the loop arithmetically and the cursor
+ * goes straight back to start, so a looping envelope costs no
+ * more to evaluate than one that isn't.
+ *
+ * LOOP_FORWARD jumps back to start, LOOP_PING_PONG runs back to
+ * start then forwards again. Breakpoints after end aren't reached
+ * while looping. Deleting start or end stops the loop.
+ * envelope_integral and time_at_value don't follow loops
+ *
+ * @param env
+ * @param start a breakpoint in env's main chain
+ * @param end a breakpoint in env's main chain, start or after it
+ * @param mode LOOP_OFF to stop looping
+ ***************************************************************/
+void env_set_loop ( envelope* env, breakpoint* start, breakpoint* end, loop_mode mode );
+
+/***************************************************************
+ * Removes breakpoints without moving the envelope more than
+ * max_error away from where it was at any time.
+ *
+ * Douglas-Peucker on the breakpoints. Runs of segments are
+ * replaced by straight lines, the error of a curved segment is
+ * bounded by its control point, the corner made by its tangents
+ * or the step in it, so the bound holds for every built in
+ * interpolation type. Breakpoints either side of USER_DEFINED
+ * segments are kept.
+ *
+ * @param env
+ * @param max_error the largest change in value allowed
+ * @return the number of breakpoints removed
+ ***************************************************************/
+int simplify_envelope ( envelope* env, double max_error );
+
+/***************************************************************
+ * Builds an envelope that passes within tolerance of every
+ * sample. Each segment is LINEAR, EXPONENTIAL or
+ * QUADRATIC_BEZIER, whichever is simplest and fits, and is made
+ * as long as it can be. O ( n log n )
+ *
+ * @param times the sample times, in ascending order
+ * @param values
+ * @param n the number of samples
+ * @param tolerance the largest difference allowed between a
+ * sample and the envelope
+ * @return a new envelope to free with free_env, NULL if n < 1
+ ***************************************************************/
+envelope* fit_envelope ( const double *times, const double *values, int n, double tolerance );
+
 ADSR_envelope* create_ADSR_envelope ( const double attack, const double decay, const double sustain,
         const double release );
 
 void plot_envelope ( envelope* env, int width, int height, float* yvals );
+
+/***************************************************************
+ * Plots the envelope between two times, scaled as plot_envelope
+ *
+ * @param env
+ * @param start The time of the first column
+ * @param end   The time just after the last column
+ * @param width The number of columns to write to yvals
+ * @param height
+ * @param yvals
+ ***************************************************************/
+void plot_envelope_range ( envelope* env, double start, double end, int width, int height, float* yvals );
 void plot_ADSR_envelope ( ADSR_envelope *env, double sustain_time, int width, int height, float* yvals );
 
 #ifdef __cplusplus
@@ -8,6 +8,17 @@
 #include "ImGuiEnvelopeEditor.h"
 #include "envelope.h"
 
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <sys/resource.h>
+
+/* ImGui needs a few frames after an event before the UI settles */
+#define IDLE_SETTLE_FRAMES   3
+/* How often to redraw while a text field wants the cursor to blink */
+#define IDLE_BLINK_MS        500
+#define CPU_REPORT_INTERVAL  5.0
+
 typedef enum states
 {
     DEFAULT = 0,
@@ -15,15 +26,40 @@ typedef enum states
     OPEN_DIALOG_OPEN = 2
 } states;
 
-states save_file ( std::string path, ImGui::Ext::EnvelopeEditorContext *ctx );
+/**
+ * A load or save running on a background thread
+ *
+ * When loading env is the new envelope, swapped in once it has loaded completely.
+ * When saving env is a snapshot of the envelope so it can be edited while it is written
+ */
+typedef struct file_job
+{
+    std::thread worker;
+    std::atomic<double> progress;
+    std::atomic<bool> cancel;
+    std::atomic<bool> done;
+    bool active = false;
+    bool loading;
+    int result;
+    std::string path;
+    envelope *env;
+} file_job;
+
+states save_file ( std::string path, ImGui::Ext::EnvelopeEditorContext *ctx, file_job *job );
 void   new_file  (ImGui::Ext::EnvelopeEditorContext *ctx );
-void   open_file ( std::string path, ImGui::Ext::EnvelopeEditorContext *ctx );
+void   open_file ( std::string path, file_job *job );
+void   finish_file_job ( file_job *job, ImGui::Ext::EnvelopeEditorContext *ctx );
+void   report_cpu_use  ( int frames );
+void   wake_main_loop  ( );
 
 int main ( int argc, char** argv )
 {
     const char* glsl_version = "#version 130";
     std::string save_path = "";
-    bool darkmode = true, running = true, saved = true, popupOpened = false;
+    bool darkmode = true, running = true, saved = true, popupOpened = false, idle = true, cpuReport = false;
+    int i, framesToDraw = IDLE_SETTLE_FRAMES, framesDrawn = 0, timeout;
+    int simplifyRemoved = -1;
+    double simplifyTolerance = 0.001;
     float dpi;
     SDL_Window* window;
     SDL_GLContext gl_context;
@@ -33,14 +69,32 @@ int main ( int argc, char** argv )
     int err;
     ImGui::Ext::FileBrowserContext fileBrowserCtx = {};
     ImGui::Ext::EnvelopeEditorContext envelopeEditorContext = {};
+    file_job fileJob;
 
     states state = DEFAULT;
 
+    /* --no-idle redraws every vsync as the editor used to, --cpu-report logs CPU use so the two can be compared */
+    for ( i = 1; i < argc; i++ )
+    {
+        if ( strcmp ( argv [ i ], "--no-idle" ) == 0 )
+        {
+            idle = false;
+        }
+        else if ( strcmp ( argv [ i ], "--cpu-report" ) == 0 )
+        {
+            cpuReport = true;
+        }
+    }
+
     if ( SDL_Init ( SDL_INIT_EVENTS | SDL_INIT_VIDEO ) != 0)
     {
         SDL_Log ("Unable to initialize SDL: %s", SDL_GetError ( ) );
     }
 
+    /* The widgets' background workers wake the main loop the same way the file jobs do */
+    wakeEditor      = wake_main_loop;
+    wakeFileBrowser = wake_main_loop;
+
 
     SDL_GL_SetAttribute ( SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_FORWARD_COMPATIBLE_FLAG );
     SDL_GL_SetAttribute ( SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE );
@@ -97,31 +151,69 @@ int main ( int argc, char** argv )
     envelopeEditorContext.dpi = dpi;
     fileBrowserCtx.dpi = dpi;
     fileBrowserCtx.type = ImGui::Ext::FileBrowserType::FILE;
+    fileBrowserCtx.thumbnailers [ "bp" ] = &ImGui::Ext::EnvelopeThumbnail;
 
     io.Fonts->AddFontFromFileTTF ( "Ubuntu-L.ttf", 12 * 0.0138897638 * dpi );
 
     glEnable ( GL_MULTISAMPLE ); //Enable antialiasing
     glEnable ( GL_DITHER );
 
+    SDL_GetCurrentDisplayMode ( 0, &DM );
+
     while ( running )
     {
-        SDL_GetCurrentDisplayMode ( 0, &DM );
-
-        while ( SDL_PollEvent( &event ) )
+        /* When idle block until something happens. Input, background jobs finishing (they push an SDL_USEREVENT) and
+         * the text cursor blinking are the only things that change what's on screen */
+        if ( ! idle || framesToDraw > 0 )
         {
-            ImGui_ImplSDL2_ProcessEvent ( &event );
+            timeout = 0;
+        }
+        else
+        {
+            timeout = io.WantTextInput ? IDLE_BLINK_MS : 1000;
+        }
 
-            if (event.type == SDL_QUIT)
-            {
-                running = false;
-            }
-            else if ( event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE
-                     && event.window.windowID == SDL_GetWindowID ( window ) )
+        if ( SDL_WaitEventTimeout ( &event, timeout ) )
+        {
+            do
             {
-                running = false;
-            }
+                ImGui_ImplSDL2_ProcessEvent ( &event );
+
+                if (event.type == SDL_QUIT)
+                {
+                    running = false;
+                }
+                else if ( event.type == SDL_WINDOWEVENT && event.window.event == SDL_WINDOWEVENT_CLOSE
+                         && event.window.windowID == SDL_GetWindowID ( window ) )
+                {
+                    running = false;
+                }
+                else if ( event.type == SDL_WINDOWEVENT )
+                {
+                    SDL_GetCurrentDisplayMode ( 0, &DM );
+                }
+            } while ( SDL_PollEvent ( &event ) );
+
+            framesToDraw = IDLE_SETTLE_FRAMES;
+        }
+        else if ( io.WantTextInput )
+        {
+            framesToDraw = 1;
         }
 
+        if ( cpuReport )
+        {
+            report_cpu_use ( framesDrawn );
+        }
+
+        if ( idle && framesToDraw == 0 )
+        {
+            continue;
+        }
+
+        framesToDraw = framesToDraw > 0 ? framesToDraw - 1 : 0;
+        framesDrawn++;
+
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplSDL2_NewFrame(window);
         ImGui::NewFrame();
@@ -144,25 +236,44 @@ int main ( int argc, char** argv )
                      | ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoResize |ImGuiWindowFlags_MenuBar
                      | ( saved ? 0 : ImGuiWindowFlags_UnsavedDocument));
 
+        if ( fileJob.active )
+        {
+            if ( fileJob.done )
+            {
+                finish_file_job ( &fileJob, &envelopeEditorContext );
+            }
+            else
+            {
+                ImGui::ProgressBar ( fileJob.progress, ImVec2 ( 0.25 * DM.w, 0 ),
+                                     fileJob.loading ? "Loading" : "Saving" );
+                ImGui::SameLine ( );
+
+                if ( ImGui::Button ( "Cancel##FileJob" ) )
+                {
+                    fileJob.cancel = true;
+                }
+            }
+        }
+
 
         if ( ImGui::BeginMenuBar ( ) )
         {
             if ( ImGui::BeginMenu ( "File" ) )
             {
-                if ( ImGui::MenuItem ( "Open..", "Ctrl+O" ) && state == DEFAULT )
+                if ( ImGui::MenuItem ( "Open..", "Ctrl+O" ) && state == DEFAULT && ! fileJob.active )
                 {
                     state = OPEN_DIALOG_OPEN;
                     popupOpened = false;
                 }
                 if ( ImGui::MenuItem ( "New", "Ctrl+N" ) && state == DEFAULT )
                 { new_file ( &envelopeEditorContext ); }
-                if ( ImGui::MenuItem ( "Save", "Ctrl+S" ) && state == DEFAULT )
+                if ( ImGui::MenuItem ( "Save", "Ctrl+S" ) && state == DEFAULT && ! fileJob.active )
                 {
-                    state = save_file ( save_path, &envelopeEditorContext );
+                    state = save_file ( save_path, &envelopeEditorContext, &fileJob );
                     if ( state == SAVE_AS_DIALOG_OPEN )
                     { popupOpened = false; }
                 }
-                if ( ImGui::MenuItem ( "Save as", "Ctrl+Shift+S" ) && state == DEFAULT )
+                if ( ImGui::MenuItem ( "Save as", "Ctrl+Shift+S" ) && state == DEFAULT && ! fileJob.active )
                 {
                     state = SAVE_AS_DIALOG_OPEN;
                     popupOpened = false;
@@ -172,7 +283,7 @@ int main ( int argc, char** argv )
             ImGui::EndMenuBar ( );
         }
 
-        if ( state == DEFAULT && (ImGui::IsKeyDown ( SDL_SCANCODE_LCTRL )
+        if ( state == DEFAULT && ! fileJob.active && (ImGui::IsKeyDown ( SDL_SCANCODE_LCTRL )
         ||   ImGui::IsKeyDown ( SDL_SCANCODE_RCTRL )))
         {
             if ( ImGui::IsKeyDown ( SDL_SCANCODE_LSHIFT )
@@ -187,7 +298,7 @@ int main ( int argc, char** argv )
             {
                 if ( ImGui::IsKeyPressed ( SDL_SCANCODE_S, false ) )
                 {
-                    state = save_file ( save_path, &envelopeEditorContext );
+                    state = save_file ( save_path, &envelopeEditorContext, &fileJob );
                 }
                 else if ( ImGui::IsKeyPressed ( SDL_SCANCODE_O, false ) )
                 {
@@ -221,7 +332,7 @@ int main ( int argc, char** argv )
                     ImGui::Ext::FileBrowser ( &fileBrowserCtx );
                     if ( ImGui::Button ( "Open" ) )
                     {
-                        open_file ( fileBrowserCtx.selectedFile, &envelopeEditorContext );
+                        open_file ( fileBrowserCtx.selectedFile, &fileJob );
                         save_path = fileBrowserCtx.selectedFile;
                         ImGui::CloseCurrentPopup ( );
                     }
@@ -253,7 +364,7 @@ int main ( int argc, char** argv )
                     if ( ( ImGui::Ext::FileBrowser ( &fileBrowserCtx ) && fileBrowserCtx.fileCreated )
                     ||     ImGui::Button ( "Save" ) )
                     {
-                        save_file ( fileBrowserCtx.selectedFile, &envelopeEditorContext );
+                        save_file ( fileBrowserCtx.selectedFile, &envelopeEditorContext, &fileJob );
                         save_path = fileBrowserCtx.selectedFile;
                         ImGui::CloseCurrentPopup ( );
                     }
@@ -278,10 +389,27 @@ int main ( int argc, char** argv )
 
         if ( envelopeEditorContext.env )
         {
-            if ( ImGui::InputDouble ( "Max time ", &envelopeEditorContext.env->maxTime ) )
+            if ( ImGui::InputDouble ( "Max time ", &envelopeEditorContext._viewMaxTime ) )
             {
                 envelopeEditorContext._updatePlot = true;
-                envelopeEditorContext.env->maxTime = fmax ( envelopeEditorContext.env->maxTime, 0 );
+                envelopeEditorContext._viewMaxTime = fmax ( envelopeEditorContext._viewMaxTime,
+                                                            envelopeEditorContext.env->maxTime );
+            }
+
+            ImGui::InputDouble ( "Tolerance ", &simplifyTolerance );
+            simplifyTolerance = fmax ( simplifyTolerance, 0 );
+            ImGui::SameLine ( );
+
+            if ( ImGui::Button ( "Simplify" ) && ! fileJob.active )
+            {
+                simplifyRemoved = simplify_envelope ( envelopeEditorContext.env, simplifyTolerance );
+                envelopeEditorContext._updateNodes = true;
+            }
+
+            if ( simplifyRemoved >= 0 )
+            {
+                ImGui::SameLine ( );
+                ImGui::Text ( "Removed %d breakpoints", simplifyRemoved );
             }
 
             ImGui::Ext::EnvelopeEditor ( &envelopeEditorContext );
@@ -308,6 +436,13 @@ int main ( int argc, char** argv )
         SDL_GL_SwapWindow ( window );
     }
 
+    if ( fileJob.active )
+    {
+        fileJob.cancel = true;
+        fileJob.worker.join ( );
+        finish_file_job ( &fileJob, &envelopeEditorContext );
+    }
+
     ImGui_ImplOpenGL3_Shutdown ( );
     ImGui_ImplSDL2_Shutdown ( );
     ImGui::Ext::EnvelopeEditorFreeContext ( &envelopeEditorContext );
@@ -319,7 +454,109 @@ int main ( int argc, char** argv )
     return 0;
 }
 
-states save_file ( std::string path, ImGui::Ext::EnvelopeEditorContext *ctx )
+void wake_main_loop ( )
+{
+    SDL_Event wake = {};
+
+    wake.type = SDL_USEREVENT;
+    SDL_PushEvent ( &wake );
+}
+
+/* Logs the CPU time used by the whole process, all threads included, every CPU_REPORT_INTERVAL seconds */
+void report_cpu_use ( int frames )
+{
+    static double lastWall = 0, lastCpu = 0;
+    static int lastFrames = 0;
+    struct rusage usage;
+    double wall, cpu;
+
+    wall = (double) SDL_GetPerformanceCounter ( ) / SDL_GetPerformanceFrequency ( );
+
+    if ( wall - lastWall < CPU_REPORT_INTERVAL )
+    {
+        return;
+    }
+
+    getrusage ( RUSAGE_SELF, &usage );
+
+    cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+
+    if ( lastWall > 0 )
+    {
+        SDL_Log ( "CPU %.1f%% of one core, %.1f frames/s", 100 * ( cpu - lastCpu ) / ( wall - lastWall ),
+                  ( frames - lastFrames ) / ( wall - lastWall ) );
+    }
+
+    lastWall   = wall;
+    lastCpu    = cpu;
+    lastFrames = frames;
+}
+
+int file_job_progress ( double progress, void *user )
+{
+    file_job *job = (file_job*) user;
+
+    job->progress = progress;
+    wake_main_loop ( );
+
+    return job->cancel;
+}
+
+void start_file_job ( file_job *job, std::string path, envelope *env, bool loading )
+{
+    job->active   = true;
+    job->loading  = loading;
+    job->path     = path;
+    job->env      = env;
+    job->progress = 0;
+    job->cancel   = false;
+    job->done     = false;
+
+    job->worker = std::thread ( [job] ( )
+    {
+        job->result = job->loading
+                    ? load_breakpoints_progress ( job->path.c_str ( ), job->env, file_job_progress, job )
+                    : save_breakpoints_progress ( job->path.c_str ( ), job->env, file_job_progress, job );
+        job->done = true;
+        wake_main_loop ( );
+    } );
+}
+
+/* Called on the UI thread once the worker is done. A successful load replaces the edited envelope in one go */
+void finish_file_job ( file_job *job, ImGui::Ext::EnvelopeEditorContext *ctx )
+{
+    if ( job->worker.joinable ( ) )
+    {
+        job->worker.join ( );
+    }
+
+    if ( job->loading && job->result == 0 )
+    {
+        if ( ctx->env )
+        {
+            free_env ( ctx->env );
+        }
+
+        ctx->env          = job->env;
+        ctx->_updatePlot  = true;
+        ctx->_updateNodes = true;
+    }
+    else
+    {
+        // The save snapshot, or a load that failed or was cancelled
+        free_env ( job->env );
+    }
+
+    if ( job->result != 0 && ! job->cancel )
+    {
+        SDL_Log ( "Unable to %s %s", job->loading ? "load" : "save", job->path.c_str ( ) );
+    }
+
+    job->env    = NULL;
+    job->active = false;
+}
+
+states save_file ( std::string path, ImGui::Ext::EnvelopeEditorContext *ctx, file_job *job )
 {
 
     if ( path.length ( ) == 0 )
@@ -327,7 +564,10 @@ states save_file ( std::string path, ImGui::Ext::EnvelopeEditorContext *ctx )
         return SAVE_AS_DIALOG_OPEN;
     }
 
-    if ( ctx->env ) save_breakpoints ( path.c_str( ), ctx->env );
+    if ( ctx->env && ! job->active )
+    {
+        start_file_job ( job, path, copy_envelope ( ctx->env ), false );
+    }
 
     return DEFAULT;
 }
@@ -352,21 +592,24 @@ void new_file ( ImGui::Ext::EnvelopeEditorContext *ctx )
     ctx->env->first->time  = 0;
     ctx->env->first->value = 1;
     ctx->env->first->interpType = LINEAR;
-    ctx->env->first->interpCallback = interp_functions [ LINEAR ];
     ctx->env->current = ctx->env->first;
 
     ctx->env->first->next->time  = 1;
     ctx->env->first->next->value = 0;
     ctx->env->first->next->interpType = LINEAR;
-    ctx->env->first->next->interpCallback = interp_functions [ LINEAR ];
+    update_segment ( ctx->env->first );
+
+    ctx->_updatePlot  = true;
+    ctx->_updateNodes = true;
+    ctx->_viewEnv     = NULL;
 }
 
-void open_file ( std::string path, ImGui::Ext::EnvelopeEditorContext *ctx )
+void open_file ( std::string path, file_job *job )
 {
-    if ( ctx->env == NULL )
+    if ( job->active )
     {
-        ctx->env = ( envelope* ) calloc ( 1, sizeof ( envelope ) );
+        return;
     }
 
-    load_breakpoints ( path.c_str( ), ctx->env );
-}
\ No newline at end of file
+    start_file_job ( job, path, ( envelope* ) calloc ( 1, sizeof ( envelope ) ), true );
+}
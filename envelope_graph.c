@@ -0,0 +1,407 @@
+
+/**
+ * envelope_graph.c Copyright Tom Merchant (mailto:tom@tmerchant.com) 2019
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "envelope_graph.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+
+static env_node* new_node ( env_node_type type, env_node *a, env_node *b, env_node *c )
+{
+    env_node *node = calloc ( 1, sizeof ( env_node ) );
+
+    node->type  = type;
+    node->refs  = 1;
+    node->scale = 1;
+    node->a     = a;
+    node->b     = b;
+    node->c     = c;
+
+    /* a is evaluated straight into the output, each input after it needs a block to itself */
+    node->scratch = a ? a->scratch : 0;
+    node->scratch = b ? fmax ( node->scratch, 1 + b->scratch ) : node->scratch;
+    node->scratch = c ? fmax ( node->scratch, 2 + c->scratch ) : node->scratch;
+
+    return node;
+}
+
+static int is_constant ( const env_node *node )
+{
+    return node->type == ENV_NODE_CONSTANT;
+}
+
+env_node* env_graph_constant ( double value )
+{
+    env_node *node = new_node ( ENV_NODE_CONSTANT, NULL, NULL, NULL );
+
+    node->value = value;
+
+    return node;
+}
+
+env_node* env_graph_time ( void )
+{
+    return new_node ( ENV_NODE_TIME, NULL, NULL, NULL );
+}
+
+env_node* env_graph_envelope ( envelope *env )
+{
+    env_node *node = new_node ( ENV_NODE_ENVELOPE, NULL, NULL, NULL );
+
+    node->env = env;
+
+    return node;
+}
+
+env_node* env_graph_retain ( env_node *node )
+{
+    node->refs++;
+    return node;
+}
+
+void env_graph_free ( env_node *node )
+{
+    if ( !node || --node->refs > 0 )
+    {
+        return;
+    }
+
+    env_graph_free ( node->a );
+    env_graph_free ( node->b );
+    env_graph_free ( node->c );
+
+    free ( node );
+}
+
+env_node* env_graph_affine ( env_node *a, double scale, double offset )
+{
+    env_node *node;
+
+    if ( scale == 1 && offset == 0 )
+    {
+        return a;
+    }
+
+    if ( is_constant ( a ) )
+    {
+        node = env_graph_constant ( a->value * scale + offset );
+        env_graph_free ( a );
+        return node;
+    }
+
+    if ( a->type == ENV_NODE_AFFINE )
+    {
+        /* ( x * s1 + o1 ) * s2 + o2 = x * s1 * s2 + o1 * s2 + o2 */
+        node = env_graph_affine ( env_graph_retain ( a->a ), a->scale * scale, a->offset * scale + offset );
+        env_graph_free ( a );
+        return node;
+    }
+
+    node = new_node ( ENV_NODE_AFFINE, a, NULL, NULL );
+    node->scale  = scale;
+    node->offset = offset;
+
+    return node;
+}
+
+env_node* env_graph_add ( env_node *a, env_node *b )
+{
+    env_node *node;
+
+    if ( is_constant ( a ) && is_constant ( b ) )
+    {
+        node = env_graph_constant ( a->value + b->value );
+    }
+    else if ( is_constant ( a ) )
+    {
+        node = env_graph_affine ( env_graph_retain ( b ), 1, a->value );
+    }
+    else if ( is_constant ( b ) )
+    {
+        node = env_graph_affine ( env_graph_retain ( a ), 1, b->value );
+    }
+    else
+    {
+        return new_node ( ENV_NODE_ADD, a, b, NULL );
+    }
+
+    env_graph_free ( a );
+    env_graph_free ( b );
+
+    return node;
+}
+
+env_node* env_graph_multiply ( env_node *a, env_node *b )
+{
+    env_node *node;
+
+    if ( is_constant ( a ) && is_constant ( b ) )
+    {
+        node = env_graph_constant ( a->value * b->value );
+    }
+    else if ( is_constant ( a ) )
+    {
+        node = env_graph_affine ( env_graph_retain ( b ), a->value, 0 );
+    }
+    else if ( is_constant ( b ) )
+    {
+        node = env_graph_affine ( env_graph_retain ( a ), b->value, 0 );
+    }
+    else
+    {
+        return new_node ( ENV_NODE_MULTIPLY, a, b, NULL );
+    }
+
+    env_graph_free ( a );
+    env_graph_free ( b );
+
+    return node;
+}
+
+env_node* env_graph_clamp ( env_node *a, double min, double max )
+{
+    env_node *node;
+
+    if ( is_constant ( a ) )
+    {
+        node = env_graph_constant ( fmin ( fmax ( a->value, min ), max ) );
+        env_graph_free ( a );
+        return node;
+    }
+
+    node = new_node ( ENV_NODE_CLAMP, a, NULL, NULL );
+    node->min = min;
+    node->max = max;
+
+    return node;
+}
+
+env_node* env_graph_warp ( env_node *a, env_node *time )
+{
+    env_node *node;
+
+    if ( is_constant ( a ) || time->type == ENV_NODE_TIME )
+    {
+        env_graph_free ( time );
+        return a;
+    }
+
+    if ( is_constant ( time ) )
+    {
+        node = env_graph_constant ( env_graph_value_at ( a, time->value ) );
+        env_graph_free ( a );
+        env_graph_free ( time );
+        return node;
+    }
+
+    node = new_node ( ENV_NODE_WARP, a, time, NULL );
+
+    /* The time is worked out a value at a time, not in a block */
+    node->scratch = a->scratch;
+
+    return node;
+}
+
+env_node* env_graph_crossfade ( env_node *a, env_node *b, env_node *mix )
+{
+    double m;
+
+    if ( !is_constant ( mix ) )
+    {
+        return new_node ( ENV_NODE_CROSSFADE, a, b, mix );
+    }
+
+    m = mix->value;
+    env_graph_free ( mix );
+
+    if ( m == 0 )
+    {
+        env_graph_free ( b );
+        return a;
+    }
+
+    if ( m == 1 )
+    {
+        env_graph_free ( a );
+        return b;
+    }
+
+    return env_graph_add ( env_graph_affine ( a, 1 - m, 0 ), env_graph_affine ( b, m, 0 ) );
+}
+
+double env_graph_value_at ( env_node *node, double t )
+{
+    double a, b, m;
+
+    switch ( node->type )
+    {
+        case ENV_NODE_CONSTANT:
+            return node->value;
+        case ENV_NODE_TIME:
+            return t;
+        case ENV_NODE_ENVELOPE:
+            return node->env->first ? value_at ( node->env, t ) : 0;
+        case ENV_NODE_ADD:
+            return env_graph_value_at ( node->a, t ) + env_graph_value_at ( node->b, t );
+        case ENV_NODE_MULTIPLY:
+            return env_graph_value_at ( node->a, t ) * env_graph_value_at ( node->b, t );
+        case ENV_NODE_AFFINE:
+            return env_graph_value_at ( node->a, t ) * node->scale + node->offset;
+        case ENV_NODE_CLAMP:
+            return fmin ( fmax ( env_graph_value_at ( node->a, t ), node->min ), node->max );
+        case ENV_NODE_WARP:
+            return env_graph_value_at ( node->a, env_graph_value_at ( node->b, t ) );
+        case ENV_NODE_CROSSFADE:
+            a = env_graph_value_at ( node->a, t );
+            b = env_graph_value_at ( node->b, t );
+            m = env_graph_value_at ( node->c, t );
+            return a + ( b - a ) * m;
+    }
+
+    return 0;
+}
+
+/*
+ * Writes node * scale + offset to out, so that affine nodes cost nothing and the parent's affine is applied in the
+ * same loop as its own operation. scratch holds node->scratch blocks of n values
+ */
+static void render_node ( env_node *node, double start, double interval, int n, float *out, double scale,
+                          double offset, float *scratch )
+{
+    float *tmp1 = scratch, *tmp2;
+    double v;
+    int i;
+
+    switch ( node->type )
+    {
+        case ENV_NODE_CONSTANT:
+            v = node->value * scale + offset;
+
+            for ( i = 0; i < n; i++ )
+            {
+                out [ i ] = (float) v;
+            }
+            return;
+
+        case ENV_NODE_TIME:
+            for ( i = 0; i < n; i++ )
+            {
+                out [ i ] = (float) ( ( start + i * interval ) * scale + offset );
+            }
+            return;
+
+        case ENV_NODE_ENVELOPE:
+            if ( interval > 0 )
+            {
+                render_block ( node->env, start, interval, n, out );
+            }
+            else
+            {
+                for ( i = 0; i < n; i++ )
+                {
+                    out [ i ] = (float) env_graph_value_at ( node, start + i * interval );
+                }
+            }
+
+            if ( scale != 1 || offset != 0 )
+            {
+                for ( i = 0; i < n; i++ )
+                {
+                    out [ i ] = (float) ( out [ i ] * scale + offset );
+                }
+            }
+            return;
+
+        case ENV_NODE_AFFINE:
+            render_node ( node->a, start, interval, n, out, node->scale * scale, node->offset * scale + offset,
+                          scratch );
+            return;
+
+        case ENV_NODE_ADD:
+            render_node ( node->a, start, interval, n, out, scale, offset, scratch );
+            render_node ( node->b, start, interval, n, tmp1, scale, 0, scratch + n );
+
+            for ( i = 0; i < n; i++ )
+            {
+                out [ i ] += tmp1 [ i ];
+            }
+            return;
+
+        case ENV_NODE_MULTIPLY:
+            render_node ( node->a, start, interval, n, out, 1, 0, scratch );
+            render_node ( node->b, start, interval, n, tmp1, scale, 0, scratch + n );
+
+            for ( i = 0; i < n; i++ )
+            {
+                out [ i ] = (float) ( out [ i ] * tmp1 [ i ] + offset );
+            }
+            return;
+
+        case ENV_NODE_CLAMP:
+            render_node ( node->a, start, interval, n, out, 1, 0, scratch );
+
+            for ( i = 0; i < n; i++ )
+            {
+                out [ i ] = (float) ( fmin ( fmax ( out [ i ], node->min ), node->max ) * scale + offset );
+            }
+            return;
+
+        case ENV_NODE_WARP:
+            if ( node->b->type == ENV_NODE_AFFINE && node->b->a->type == ENV_NODE_TIME )
+            {
+                /* A linear time warp is just a different start and interval */
+                render_node ( node->a, start * node->b->scale + node->b->offset, interval * node->b->scale, n, out,
+                              scale, offset, scratch );
+                return;
+            }
+
+            for ( i = 0; i < n; i++ )
+            {
+                v = env_graph_value_at ( node->b, start + i * interval );
+                out [ i ] = (float) ( env_graph_value_at ( node->a, v ) * scale + offset );
+            }
+            return;
+
+        case ENV_NODE_CROSSFADE:
+            render_node ( node->a, start, interval, n, out, 1, 0, scratch );
+            render_node ( node->b, start, interval, n, tmp1, 1, 0, scratch + n );
+            tmp2 = scratch + n;
+            render_node ( node->c, start, interval, n, tmp2, 1, 0, scratch + 2 * n );
+
+            for ( i = 0; i < n; i++ )
+            {
+                out [ i ] = (float) ( ( out [ i ] + ( tmp1 [ i ] - out [ i ] ) * tmp2 [ i ] ) * scale + offset );
+            }
+            return;
+    }
+}
+
+void env_graph_render ( env_node *node, double start, double interval, int n, float *out )
+{
+    float *scratch = NULL;
+
+    if ( node->scratch > 0 )
+    {
+        scratch = malloc ( (size_t) node->scratch * n * sizeof ( float ) );
+    }
+
+    render_node ( node, start, interval, n, out, 1, 0, scratch );
+
+    free ( scratch );
+}
@@ -0,0 +1,148 @@
+
+/**
+ * envelope_graph.h
+ *
+ * Combines envelopes into expressions (A * B, A driving the time of B, ...) that are evaluated a block at a time.
+ * Constants are folded and chains of offsets and scales are fused when the graph is built, so a composed modulator
+ * costs about one pass over the output per envelope in it.
+ *
+ *  LICENSE:
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#ifndef ENVELOPE_ENVELOPE_GRAPH_H
+#define ENVELOPE_ENVELOPE_GRAPH_H
+
+#include "envelope.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum env_node_type
+{
+    ENV_NODE_CONSTANT  = 0,
+    ENV_NODE_TIME      = 1,
+    ENV_NODE_ENVELOPE  = 2,
+    ENV_NODE_ADD       = 3,
+    ENV_NODE_MULTIPLY  = 4,
+    ENV_NODE_AFFINE    = 5,
+    ENV_NODE_CLAMP     = 6,
+    ENV_NODE_WARP      = 7,
+    ENV_NODE_CROSSFADE = 8
+} env_node_type;
+
+/**
+ * A node in an envelope expression. Nodes are reference counted, the functions that build a node from other nodes
+ * take over the caller's reference to them, use env_graph_retain to use a node in more than one place
+ */
+typedef struct env_node
+{
+    env_node_type   type;
+    int             refs;
+    /**
+     * The number of temporary blocks needed to evaluate this node
+     */
+    int             scratch;
+
+    /**
+     * ENV_NODE_CONSTANT's value, ENV_NODE_AFFINE's and ENV_NODE_CLAMP's are a * scale + offset clamped to min, max
+     */
+    double          value;
+    double          scale;
+    double          offset;
+    double          min;
+    double          max;
+
+    /**
+     * ENV_NODE_ENVELOPE's envelope, not owned by the node
+     */
+    envelope        *env;
+
+    /**
+     * Inputs. ENV_NODE_WARP evaluates a at the times given by b, ENV_NODE_CROSSFADE goes from a to b as c goes from
+     * 0 to 1
+     */
+    struct env_node *a;
+    struct env_node *b;
+    struct env_node *c;
+} env_node;
+
+
+env_node* env_graph_constant  ( double value );
+
+/**
+ * The time the graph is being evaluated at, use with env_graph_warp to build a new time axis
+ */
+env_node* env_graph_time      ( void );
+
+/**
+ * Reads an envelope. Evaluating the graph moves env's cursor, so an envelope shouldn't be evaluated by two threads
+ * at once
+ */
+env_node* env_graph_envelope  ( envelope *env );
+
+env_node* env_graph_add       ( env_node *a, env_node *b );
+env_node* env_graph_multiply  ( env_node *a, env_node *b );
+
+/**
+ * a * scale + offset
+ */
+env_node* env_graph_affine    ( env_node *a, double scale, double offset );
+env_node* env_graph_clamp     ( env_node *a, double min, double max );
+
+/*******************************************************************************
+ * Evaluates a at the time given by time, e.g.
+ * env_graph_warp ( a, env_graph_affine ( env_graph_time ( ), 2, 0 ) )
+ * plays a at double speed. Warps by an affine function of time are evaluated a
+ * block at a time, any other warp evaluates a one value at a time
+ ******************************************************************************/
+env_node* env_graph_warp      ( env_node *a, env_node *time );
+
+/**
+ * a * ( 1 - mix ) + b * mix
+ */
+env_node* env_graph_crossfade ( env_node *a, env_node *b, env_node *mix );
+
+env_node* env_graph_retain    ( env_node *node );
+
+/**
+ * Releases a reference to node, freeing it and its inputs once nothing uses it
+ */
+void      env_graph_free      ( env_node *node );
+
+/*******************************************************************************
+ * Evaluates a graph at a single time
+ ******************************************************************************/
+double    env_graph_value_at  ( env_node *node, double t );
+
+/*******************************************************************************
+ * Evaluates a graph at n evenly spaced times, as render_block
+ *
+ * @param node
+ * @param start    the time of the first value
+ * @param interval the time between values
+ * @param n        the number of values to write to out
+ * @param out
+ ******************************************************************************/
+void      env_graph_render    ( env_node *node, double start, double interval, int n, float *out );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ENVELOPE_ENVELOPE_GRAPH_H
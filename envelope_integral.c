@@ -0,0 +1,331 @@
+
+/**
+ * envelope_integral.c Copyright Tom Merchant (mailto:tom@tmerchant.com) 2019
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "envelope_integral.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+/**
+ * The number of panels Simpson's rule uses for a USER_DEFINED segment, must be even
+ */
+#define USER_SEGMENT_PANELS 64
+
+/* From envelope.c */
+double quadratic_bezier           ( double p0, double p1, double p2, double t );
+double quadratic_bezier_parameter ( const breakpoint *bp, double time );
+
+typedef struct integral_index
+{
+    int        n;
+    breakpoint **bps;
+    double     *times;
+    /**
+     * The area from the first breakpoint to each breakpoint, without the envelope's gain
+     */
+    double     *area;
+} integral_index;
+
+void free_integral_index ( integral_index *index )
+{
+    if ( index )
+    {
+        free ( index->bps );
+        free ( index->times );
+        free ( index->area );
+        free ( index );
+    }
+}
+
+static double linear_area ( const breakpoint *bp, double d )
+{
+    return d * ( bp->value + 0.5 * bp->slope * d );
+}
+
+/* value * d time / d u at curve parameter u */
+static double bezier_area_term ( const breakpoint *bp, double u )
+{
+    double c = INTERP_PARAMS ( bp ) [ 0 ];
+
+    return quadratic_bezier ( bp->value, INTERP_PARAMS ( bp ) [ 1 ], bp->next->value, u )
+         * 2 * ( ( 1 - u ) * ( c - bp->time ) + u * ( bp->next->time - c ) );
+}
+
+/* The area under the segment from bp to x, which is no later than the next breakpoint */
+static double segment_area ( breakpoint *bp, double x )
+{
+    breakpoint *next = bp->next;
+    double d = x - bp->time, mid, k, s, h, sum;
+    int i;
+
+    if ( d <= 0 )
+    {
+        return 0;
+    }
+
+    switch ( bp->interpType )
+    {
+        case LINEAR:
+            return linear_area ( bp, d );
+
+        case NEAREST_NEIGHBOUR:
+            mid = ( bp->time + next->time ) / 2;
+            return bp->value * ( fmin ( x, mid ) - bp->time ) + next->value * fmax ( x - mid, 0 );
+
+        case EXPONENTIAL:
+            if ( bp->value < 0.0001 || next->value < 0.0001 )
+            {
+                return linear_area ( bp, d );
+            }
+
+            /* v1 * e ^ ( k * u ) for u from 0 to d */
+            k = bp->log_ratio * bp->inv_duration;
+            return k == 0 ? bp->value * d : bp->value * expm1 ( k * d ) / k;
+
+        case QUADRATIC_BEZIER:
+            if ( bp->nInterp_params < 2 )
+            {
+                return bp->value * d;
+            }
+
+            s = quadratic_bezier_parameter ( bp, x );
+
+            if ( isnan ( s ) )
+            {
+                return linear_area ( bp, d );
+            }
+
+            /* Over the curve parameter the area is the integral of a cubic, which two point Gauss-Legendre
+             * quadrature gets exactly */
+            return s / 2 * ( bezier_area_term ( bp, s / 2 * ( 1 - 1 / sqrt ( 3 ) ) )
+                           + bezier_area_term ( bp, s / 2 * ( 1 + 1 / sqrt ( 3 ) ) ) );
+
+        default:
+            h   = d / USER_SEGMENT_PANELS;
+            sum = interp_functions [ bp->interpType ] ( bp, bp->time ) + interp_functions [ bp->interpType ] ( bp, x );
+
+            for ( i = 1; i < USER_SEGMENT_PANELS; i++ )
+            {
+                sum += ( i % 2 ? 4 : 2 ) * interp_functions [ bp->interpType ] ( bp, bp->time + i * h );
+            }
+
+            return sum * h / 3;
+    }
+}
+
+static integral_index* get_integral_index ( envelope *env )
+{
+    integral_index *index = env->integral;
+    breakpoint *bp;
+    int i, n = 0;
+
+    if ( index )
+    {
+        return index;
+    }
+
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        n++;
+    }
+
+    index        = calloc ( 1, sizeof ( integral_index ) );
+    index->n     = n;
+    index->bps   = malloc ( n * sizeof ( breakpoint* ) );
+    index->times = malloc ( n * sizeof ( double ) );
+    index->area  = malloc ( n * sizeof ( double ) );
+
+    for ( bp = env->first, i = 0; bp; bp = bp->next, i++ )
+    {
+        index->bps   [ i ] = bp;
+        index->times [ i ] = bp->time;
+        index->area  [ i ] = i == 0 ? 0 : index->area [ i - 1 ] + segment_area ( index->bps [ i - 1 ], bp->time );
+    }
+
+    env->integral = index;
+
+    return index;
+}
+
+/* The area from the first breakpoint to breakpoint i, with the gain */
+static double total_at ( const envelope *env, const integral_index *index, int i )
+{
+    if ( !env->scaled )
+    {
+        return index->area [ i ];
+    }
+
+    return env->gain * index->area [ i ] + env->offset * ( index->times [ i ] - index->times [ 0 ] );
+}
+
+/* The area from the first breakpoint to t, negative before it */
+static double total ( const envelope *env, const integral_index *index, double t )
+{
+    int low = -1, high = index->n, mid, i;
+    double area;
+
+    /* The last breakpoint at or before t */
+    while ( high - low > 1 )
+    {
+        mid = low + ( high - low ) / 2;
+
+        if ( index->times [ mid ] <= t )
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    /* Before the first breakpoint and after the last the envelope holds its value */
+    i = low < 0 ? 0 : low;
+    area = index->area [ i ] + ( low < 0 || low == index->n - 1 ? index->bps [ i ]->value * ( t - index->times [ i ] )
+                                                               : segment_area ( index->bps [ i ], t ) );
+
+    if ( !env->scaled )
+    {
+        return area;
+    }
+
+    return env->gain * area + env->offset * ( t - index->times [ 0 ] );
+}
+
+double envelope_integral ( envelope *env, double t0, double t1 )
+{
+    integral_index *index;
+
+    if ( !env->first )
+    {
+        return 0;
+    }
+
+    index = get_integral_index ( env );
+
+    return total ( env, index, t1 ) - total ( env, index, t0 );
+}
+
+double envelope_mean ( envelope *env, double t0, double t1 )
+{
+    if ( t0 == t1 )
+    {
+        return env->first ? value_at ( env, t0 ) : 0;
+    }
+
+    return envelope_integral ( env, t0, t1 ) / ( t1 - t0 );
+}
+
+double envelope_time_at_integral ( envelope *env, double t0, double area )
+{
+    integral_index *index;
+    breakpoint *bp;
+    double target, base, rate, lo, hi, x, step, f, gain = 1, offset = 0;
+    int low = -1, high, mid, i;
+
+    if ( !env->first )
+    {
+        return NAN;
+    }
+
+    if ( env->scaled )
+    {
+        gain   = env->gain;
+        offset = env->offset;
+    }
+
+    index  = get_integral_index ( env );
+    target = total ( env, index, t0 ) + area;
+    high   = index->n;
+
+    /* The last breakpoint whose running total hasn't passed the target, the totals only rise */
+    while ( high - low > 1 )
+    {
+        mid = low + ( high - low ) / 2;
+
+        if ( total_at ( env, index, mid ) <= target )
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    if ( low < 0 || low == index->n - 1 )
+    {
+        /* Before the first breakpoint or after the last, where the envelope holds its value */
+        i    = low < 0 ? 0 : low;
+        base = total_at ( env, index, i );
+        rate = gain * index->bps [ i ]->value + offset;
+
+        if ( rate <= 0 )
+        {
+            return target == base ? index->times [ i ] : NAN;
+        }
+
+        return index->times [ i ] + ( target - base ) / rate;
+    }
+
+    /* Somewhere in this segment, found by Newton's method kept inside a shrinking bracket */
+    bp   = index->bps [ low ];
+    base = total_at ( env, index, low );
+    lo   = bp->time;
+    hi   = bp->next->time;
+    x    = lo + ( hi - lo ) * ( target - base ) / ( total_at ( env, index, low + 1 ) - base );
+
+    for ( i = 0; i < 100; i++ )
+    {
+        f = gain * segment_area ( bp, x ) + offset * ( x - bp->time ) - ( target - base );
+
+        if ( f == 0 )
+        {
+            break;
+        }
+
+        if ( f > 0 )
+        {
+            hi = x;
+        }
+        else
+        {
+            lo = x;
+        }
+
+        rate = gain * interp_functions [ bp->interpType ] ( bp, x ) + offset;
+        step = rate > 0 ? f / rate : NAN;
+
+        if ( x - step > lo && x - step < hi )
+        {
+            x -= step;
+        }
+        else
+        {
+            step = x - ( lo + hi ) / 2;
+            x    = ( lo + hi ) / 2;
+        }
+
+        if ( fabs ( step ) <= 1e-14 * ( 1 + fabs ( x ) ) )
+        {
+            break;
+        }
+    }
+
+    return x;
+}
@@ -0,0 +1,68 @@
+
+/**
+ * envelope_integral.h
+ *
+ * The area under an envelope between two times, its average over them, and the inverse, the time at which a given
+ * area has built up. For envelopes used as tempo or rate curves, where the area is the position reached.
+ *
+ * The area under every segment has a closed form, so a table of running totals at each breakpoint answers each of
+ * these in O ( log n ). The table is built by the first query after the envelope changes.
+ *
+ *  LICENSE:
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#ifndef ENVELOPE_ENVELOPE_INTEGRAL_H
+#define ENVELOPE_ENVELOPE_INTEGRAL_H
+
+#include "envelope.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/***********************************************************************
+ * The area under the envelope from t0 to t1, negative if t1 < t0.
+ * The envelope holds its first value before its first breakpoint and
+ * its last value after its last, as value_at does. USER_DEFINED
+ * segments are integrated numerically. Only the main chain of an
+ * ADSR_envelope is used.
+ *
+ * Builds the table of running totals if the envelope has changed, so
+ * an envelope shouldn't be queried by two threads at once
+ ***********************************************************************/
+double envelope_integral ( envelope *env, double t0, double t1 );
+
+/**
+ * The average value from t0 to t1, the value at t0 if they're the same
+ */
+double envelope_mean     ( envelope *env, double t0, double t1 );
+
+/***********************************************************************
+ * The time t at which envelope_integral ( env, t0, t ) reaches area,
+ * before t0 if area is negative. The envelope must not be negative
+ * over the times searched
+ *
+ * @return the time, or NAN if the area is never reached
+ ***********************************************************************/
+double envelope_time_at_integral ( envelope *env, double t0, double area );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ENVELOPE_ENVELOPE_INTEGRAL_H
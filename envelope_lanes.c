@@ -0,0 +1,164 @@
+
+/**
+ * envelope_lanes.c Copyright Tom Merchant (mailto:tom@tmerchant.com) 2019
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "envelope_lanes.h"
+#include "envelope_workers.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+typedef struct lane
+{
+    envelope *env;
+    /**
+     * Set while the lane's block is filled with value
+     */
+    int      held;
+    double   value;
+} lane;
+
+struct lane_group
+{
+    int             blockSize;
+    int             nLanes;
+    int             capacity;
+    lane            *lanes;
+    float           *blocks;
+
+    /* The block being rendered, the lanes are split up for it between the workers */
+    double          start;
+    double          interval;
+    worker_pool     workers;
+};
+
+/* Renders lanes first to last - 1, returning how many were written */
+static int render_lanes ( lane_group *group, int first, int last )
+{
+    double end = group->start + ( group->blockSize - 1 ) * group->interval, value;
+    float *out;
+    lane *l;
+    int i, j, written = 0;
+
+    for ( i = first; i < last; i++ )
+    {
+        l   = &group->lanes [ i ];
+        out = group->blocks + (size_t) i * group->blockSize;
+
+        /* Blocks rendered backwards run from end up to start */
+        if ( !env_constant_over ( l->env, fmin ( group->start, end ), fmax ( group->start, end ), &value ) )
+        {
+            render_block ( l->env, group->start, group->interval, group->blockSize, out );
+            l->held = 0;
+            written++;
+        }
+        else if ( !l->held || l->value != value )
+        {
+            for ( j = 0; j < group->blockSize; j++ )
+            {
+                out [ j ] = (float) value;
+            }
+
+            l->held  = 1;
+            l->value = value;
+            written++;
+        }
+    }
+
+    return written;
+}
+
+/* Part p of the lanes, the caller renders part 0 and worker i part i + 1 */
+static int render_part ( void *user, int p )
+{
+    lane_group *group = user;
+    int parts = group->workers.parts;
+
+    return render_lanes ( group, (int) ( (long) group->nLanes * p / parts ),
+                                 (int) ( (long) group->nLanes * ( p + 1 ) / parts ) );
+}
+
+lane_group* create_lane_group ( int block_size )
+{
+    lane_group *group = calloc ( 1, sizeof ( lane_group ) );
+
+    group->blockSize = block_size;
+    worker_pool_init ( &group->workers, render_part, group );
+
+    return group;
+}
+
+void free_lane_group ( lane_group *group )
+{
+    worker_pool_destroy ( &group->workers );
+
+    free ( group->lanes );
+    free ( group->blocks );
+    free ( group );
+}
+
+int lane_group_add ( lane_group *group, envelope *env )
+{
+    if ( group->nLanes == group->capacity )
+    {
+        group->capacity = group->capacity ? 2 * group->capacity : 16;
+        group->lanes    = realloc ( group->lanes, group->capacity * sizeof ( lane ) );
+        group->blocks   = realloc ( group->blocks, (size_t) group->capacity * group->blockSize * sizeof ( float ) );
+    }
+
+    group->lanes [ group->nLanes ].env  = env;
+    group->lanes [ group->nLanes ].held = 0;
+    memset ( group->blocks + (size_t) group->nLanes * group->blockSize, 0, group->blockSize * sizeof ( float ) );
+
+    return group->nLanes++;
+}
+
+void lane_group_remove ( lane_group *group, int lane )
+{
+    int last = --group->nLanes;
+
+    if ( lane != last )
+    {
+        group->lanes [ lane ] = group->lanes [ last ];
+        memcpy ( group->blocks + (size_t) lane * group->blockSize, group->blocks + (size_t) last * group->blockSize,
+                 group->blockSize * sizeof ( float ) );
+    }
+}
+
+int lane_group_count ( const lane_group *group )
+{
+    return group->nLanes;
+}
+
+void lane_group_set_threads ( lane_group *group, int threads )
+{
+    worker_pool_set_threads ( &group->workers, threads );
+}
+
+int lane_group_render ( lane_group *group, double start, double interval )
+{
+    group->start    = start;
+    group->interval = interval;
+
+    return worker_pool_run ( &group->workers, group->nLanes / LANES_PER_THREAD );
+}
+
+const float* lane_group_block ( const lane_group *group, int lane )
+{
+    return group->blocks + (size_t) lane * group->blockSize;
+}
@@ -0,0 +1,100 @@
+
+/**
+ * envelope_lanes.h
+ *
+ * Renders many envelopes, automation lanes, at one transport time a block at a time.
+ *
+ * Each lane keeps its own cursor, which render_block moves along from where the last block left it. A lane that is
+ * constant over a block is filled without interpolating, and left alone altogether if it was already holding that
+ * value. Large groups are split between worker threads.
+ *
+ *  LICENSE:
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#ifndef ENVELOPE_ENVELOPE_LANES_H
+#define ENVELOPE_ENVELOPE_LANES_H
+
+#include "envelope.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Groups with fewer lanes than this for each thread are rendered on fewer threads
+ */
+#define LANES_PER_THREAD 32
+
+typedef struct lane_group lane_group;
+
+/***********************************************************************
+ * Creates an empty group, free it with free_lane_group
+ *
+ * @param block_size the number of values rendered for each lane
+ ***********************************************************************/
+lane_group* create_lane_group ( int block_size );
+
+/**
+ * Stops the group's threads and frees it, not its envelopes
+ */
+void   free_lane_group ( lane_group *group );
+
+/***********************************************************************
+ * Adds an envelope to the group. The group doesn't own it, but it
+ * mustn't be used elsewhere while the group is rendering, and it can
+ * only be in a group once
+ *
+ * @return the lane's index
+ ***********************************************************************/
+int    lane_group_add ( lane_group *group, envelope *env );
+
+/***********************************************************************
+ * Removes a lane. The last lane is moved into its place and takes its
+ * index
+ ***********************************************************************/
+void   lane_group_remove ( lane_group *group, int lane );
+
+int    lane_group_count ( const lane_group *group );
+
+/***********************************************************************
+ * Sets the number of threads rendering uses, including the one calling
+ * lane_group_render. 1, the default, renders on the calling thread
+ ***********************************************************************/
+void   lane_group_set_threads ( lane_group *group, int threads );
+
+/***********************************************************************
+ * Renders a block of every lane, as render_block would
+ *
+ * @param group
+ * @param start    the transport time of the first value
+ * @param interval the time between values
+ * @return the number of lanes whose blocks were written, lanes that
+ * are still holding the value they held last block aren't
+ ***********************************************************************/
+int    lane_group_render ( lane_group *group, double start, double interval );
+
+/**
+ * A lane's values from the last lane_group_render, valid until lanes are added or removed
+ */
+const float* lane_group_block ( const lane_group *group, int lane );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ENVELOPE_ENVELOPE_LANES_H
@@ -0,0 +1,618 @@
+
+/**
+ * envelope_multi.c Copyright Tom Merchant (mailto:tom@tmerchant.com) 2019
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "envelope_multi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* From envelope.c */
+double bezier_time_parameter ( double t0, double t1, double t2, double time );
+
+/* A breakpoint and its values and log ratios in one allocation */
+static multi_breakpoint* new_breakpoint ( int channels )
+{
+    multi_breakpoint *bp = calloc ( 1, sizeof ( multi_breakpoint ) + 2 * channels * sizeof ( double ) );
+
+    bp->values    = (double*) ( bp + 1 );
+    bp->log_ratio = bp->values + channels;
+
+    return bp;
+}
+
+static void free_multi_chain ( multi_breakpoint *bp )
+{
+    multi_breakpoint *next;
+
+    while ( bp )
+    {
+        next = bp->next;
+        free ( bp->interp_params );
+        free ( bp );
+        bp = next;
+    }
+}
+
+/* As update_segment */
+static void update_multi_segment ( multi_breakpoint *bp, int channels )
+{
+    multi_breakpoint *next = bp->next;
+    int k;
+
+    if ( !next || next->time <= bp->time )
+    {
+        bp->inv_duration = 0;
+        memset ( bp->log_ratio, 0, channels * sizeof ( double ) );
+        return;
+    }
+
+    bp->inv_duration = 1 / ( next->time - bp->time );
+
+    for ( k = 0; k < channels; k++ )
+    {
+        bp->log_ratio [ k ] = bp->values [ k ] >= 0.0001 && next->values [ k ] >= 0.0001
+                            ? log ( next->values [ k ] / bp->values [ k ] ) : 0;
+    }
+}
+
+multi_envelope* create_multi_envelope ( int channels )
+{
+    multi_envelope *env = calloc ( 1, sizeof ( multi_envelope ) );
+
+    env->channels = channels;
+    env->frame    = calloc ( 3 * channels, sizeof ( double ) );
+
+    return env;
+}
+
+void free_multi_env ( multi_envelope *env )
+{
+    free_multi_chain ( env->first );
+    free ( env->frame );
+    free ( env );
+}
+
+multi_breakpoint* multi_insert_breakpoint ( multi_envelope *env, double time, interp_t type, const double *values )
+{
+    multi_breakpoint *bp = new_breakpoint ( env->channels ), *prev = NULL, *next = env->first;
+
+    bp->time       = time;
+    bp->interpType = type;
+    memcpy ( bp->values, values, env->channels * sizeof ( double ) );
+
+    /* Starting from the cursor, which is left on the new breakpoint, so building an envelope in order is linear */
+    if ( env->current && env->current->time <= time )
+    {
+        prev = env->current;
+        next = prev->next;
+    }
+
+    while ( next && next->time <= time )
+    {
+        prev = next;
+        next = next->next;
+    }
+
+    bp->next = next;
+
+    if ( prev )
+    {
+        prev->next = bp;
+        update_multi_segment ( prev, env->channels );
+    }
+    else
+    {
+        env->first = bp;
+    }
+
+    update_multi_segment ( bp, env->channels );
+
+    env->current = bp;
+
+    env->minTime = env->first->time;
+    env->maxTime = next ? env->maxTime : time;
+
+    return bp;
+}
+
+void multi_set_bezier ( multi_envelope *env, multi_breakpoint *bp, double time, const double *values )
+{
+    free ( bp->interp_params );
+
+    bp->interpType          = QUADRATIC_BEZIER;
+    bp->nInterp_params      = env->channels + 1;
+    bp->interp_params       = malloc ( bp->nInterp_params * sizeof ( double ) );
+    bp->interp_params [ 0 ] = time;
+    memcpy ( bp->interp_params + 1, values, env->channels * sizeof ( double ) );
+}
+
+/* Reads the next number on a line, whole says whether it was written without a decimal point */
+static int read_number ( const char **line, double *x, int *whole )
+{
+    const char *start = *line;
+    char *end;
+
+    *x = strtod ( start, &end );
+
+    if ( end == start )
+    {
+        return 0;
+    }
+
+    *whole = 1;
+
+    for ( ; start < end; start++ )
+    {
+        if ( *start == '.' || *start == 'e' || *start == 'E' )
+        {
+            *whole = 0;
+        }
+    }
+
+    *line = end;
+
+    return 1;
+}
+
+/* Reads one line into a breakpoint, returns the number of channels on it or 0 if it isn't a breakpoint */
+static int read_line ( const char *line, double *numbers, int capacity, int *nValues, int *type, int *nParams )
+{
+    double x;
+    int whole, n = 0;
+
+    *type = -1;
+
+    while ( n < capacity && read_number ( &line, &x, &whole ) )
+    {
+        if ( *type < 0 && whole && n >= 2 )
+        {
+            if ( x < LINEAR || x > EXPONENTIAL )
+            {
+                return 0;
+            }
+
+            *type    = (int) x;
+            *nValues = n - 1;
+        }
+        else if ( whole && n < 2 )
+        {
+            return 0;
+        }
+        else
+        {
+            numbers [ n++ ] = x;
+        }
+    }
+
+    while ( *line == ' ' || *line == '\t' || *line == '\r' || *line == '\n' )
+    {
+        line++;
+    }
+
+    if ( *type < 0 || *line )
+    {
+        return 0;
+    }
+
+    *nParams = n - 1 - *nValues;
+
+    return *nValues;
+}
+
+int load_multi_breakpoints ( const char* file, multi_envelope *env )
+{
+    FILE *bp_file = fopen ( file, "r" );
+    long filesz;
+    char *line;
+    double *numbers = NULL;
+    size_t capacity = 0, length;
+    int channels = 0, nValues = 0, type, nParams, retval = 0;
+    multi_breakpoint *top = NULL, *current = NULL, *bp;
+
+    if ( !bp_file )
+    {
+        return -1;
+    }
+
+    fseek ( bp_file, 0L, SEEK_END );
+    filesz = ftell ( bp_file );
+    rewind ( bp_file );
+
+    line = malloc ( filesz + 1 );
+
+    while ( fgets ( line, filesz + 1, bp_file ) )
+    {
+        /* A line can't hold more numbers than half its length, grown to fit the longest line so far */
+        length = strlen ( line ) / 2 + 1;
+
+        if ( length > capacity )
+        {
+            capacity = length;
+            numbers  = realloc ( numbers, capacity * sizeof ( double ) );
+        }
+
+        if ( !read_line ( line, numbers, (int) capacity, &nValues, &type, &nParams ) )
+        {
+            continue;
+        }
+
+        if ( !channels )
+        {
+            channels = nValues;
+        }
+        else if ( nValues != channels )
+        {
+            retval = -1;
+            break;
+        }
+
+        bp             = new_breakpoint ( channels );
+        bp->time       = numbers [ 0 ];
+        bp->interpType = type;
+        memcpy ( bp->values, numbers + 1, channels * sizeof ( double ) );
+
+        if ( nParams > 0 )
+        {
+            bp->nInterp_params = nParams;
+            bp->interp_params  = malloc ( nParams * sizeof ( double ) );
+            memcpy ( bp->interp_params, numbers + 1 + channels, nParams * sizeof ( double ) );
+        }
+
+        if ( current )
+        {
+            if ( bp->time < current->time
+            || ( current->interpType == QUADRATIC_BEZIER && current->nInterp_params < channels + 1 ) )
+            {
+                retval = -1;
+            }
+
+            current->next = bp;
+            update_multi_segment ( current, channels );
+        }
+        else
+        {
+            top = bp;
+        }
+
+        current = bp;
+    }
+
+    fclose ( bp_file );
+    free ( line );
+    free ( numbers );
+
+    if ( !top || retval )
+    {
+        free_multi_chain ( top );
+        return -1;
+    }
+
+    update_multi_segment ( current, channels );
+
+    free_multi_chain ( env->first );
+    free ( env->frame );
+
+    env->channels = channels;
+    env->frame    = calloc ( 3 * channels, sizeof ( double ) );
+    env->first    = top;
+    env->current  = top;
+    env->timeNow  = 0;
+    env->minTime  = top->time;
+    env->maxTime  = current->time;
+
+    return 0;
+}
+
+int save_multi_breakpoints ( const char* file, const multi_envelope *env )
+{
+    char *temp_file;
+    FILE *bp_file;
+    multi_breakpoint *bp;
+    int i;
+
+    /* Written under a temporary name and moved into place as save_breakpoints does */
+    temp_file = malloc ( strlen ( file ) + 5 );
+    sprintf ( temp_file, "%s.tmp", file );
+
+    bp_file = fopen ( temp_file, "w+" );
+
+    if ( !bp_file )
+    {
+        free ( temp_file );
+        return -1;
+    }
+
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        fprintf ( bp_file, "%f", bp->time );
+
+        for ( i = 0; i < env->channels; i++ )
+        {
+            fprintf ( bp_file, " %f", bp->values [ i ] );
+        }
+
+        fprintf ( bp_file, " %d", bp->interpType );
+
+        for ( i = 0; i < bp->nInterp_params; i++ )
+        {
+            fprintf ( bp_file, " %f", bp->interp_params [ i ] );
+        }
+
+        fprintf ( bp_file, "\n" );
+    }
+
+    if ( fclose ( bp_file ) || rename ( temp_file, file ) )
+    {
+        remove ( temp_file );
+        free ( temp_file );
+        return -1;
+    }
+
+    free ( temp_file );
+
+    return 0;
+}
+
+/* As env_seek, the breakpoint whose segment t is in */
+static multi_breakpoint* multi_seek ( multi_envelope *env, double t )
+{
+    multi_breakpoint *bp = env->current;
+
+    if ( !bp || t < env->first->time )
+    {
+        return env->first;
+    }
+
+    if ( t < bp->time )
+    {
+        bp = env->first;
+    }
+
+    while ( bp->next && t > bp->next->time )
+    {
+        bp = bp->next;
+    }
+
+    return bp;
+}
+
+/*
+ * Every channel's value at t on the segment from bp. How far along the segment t is only depends on the times, so it
+ * is worked out once and the loops over the channels are simple enough to vectorise
+ */
+static void segment_frame ( const multi_breakpoint *bp, int channels, double t, double *out )
+{
+    const multi_breakpoint *next = bp->next;
+    const double *v1 = bp->values, *v2, *c;
+    double u, s;
+    int k;
+
+    if ( !next || t < bp->time || ( bp->interpType == QUADRATIC_BEZIER && bp->nInterp_params < channels + 1 ) )
+    {
+        memcpy ( out, v1, channels * sizeof ( double ) );
+        return;
+    }
+
+    v2 = next->values;
+
+    if ( next->time == bp->time )
+    {
+        memcpy ( out, v2, channels * sizeof ( double ) );
+        return;
+    }
+
+    u = ( t - bp->time ) * bp->inv_duration;
+
+    switch ( bp->interpType )
+    {
+        case NEAREST_NEIGHBOUR:
+            memcpy ( out, fabs ( bp->time - t ) < fabs ( next->time - t ) ? v1 : v2, channels * sizeof ( double ) );
+            break;
+
+        case QUADRATIC_BEZIER:
+            s = bezier_time_parameter ( bp->time, bp->interp_params [ 0 ], next->time, t );
+
+            if ( !isnan ( s ) )
+            {
+                c = bp->interp_params + 1;
+
+                for ( k = 0; k < channels; k++ )
+                {
+                    out [ k ] = ( 1 - s ) * ( ( 1 - s ) * v1 [ k ] + s * c [ k ] ) + s * ( ( 1 - s ) * c [ k ] + s * v2 [ k ] );
+                }
+
+                break;
+            }
+
+            /* Falls back to linear as quadratic_bezier_interp does */
+            for ( k = 0; k < channels; k++ )
+            {
+                out [ k ] = v1 [ k ] + u * ( v2 [ k ] - v1 [ k ] );
+            }
+
+            break;
+
+        case EXPONENTIAL:
+            for ( k = 0; k < channels; k++ )
+            {
+                out [ k ] = v1 [ k ] < 0.0001 || v2 [ k ] < 0.0001 ? v1 [ k ] + u * ( v2 [ k ] - v1 [ k ] )
+                          : v1 [ k ] * exp ( bp->log_ratio [ k ] * u );
+            }
+
+            break;
+
+        default:
+            for ( k = 0; k < channels; k++ )
+            {
+                out [ k ] = v1 [ k ] + u * ( v2 [ k ] - v1 [ k ] );
+            }
+
+            break;
+    }
+}
+
+void multi_value_at ( multi_envelope *env, double t, double *out )
+{
+    if ( !env->first )
+    {
+        memset ( out, 0, env->channels * sizeof ( double ) );
+        return;
+    }
+
+    env->current = multi_seek ( env, t );
+    env->timeNow = t;
+
+    segment_frame ( env->current, env->channels, t, out );
+}
+
+/*
+ * Renders m frames from the segment from bp, the first at t. Linear and exponential segments step every channel along
+ * with a multiply and an add, value = value * ratio + step, so there's no exp per sample
+ */
+static void render_segment ( const multi_breakpoint *bp, int channels, double t, double interval, int m, double *scratch,
+                             float *out )
+{
+    const multi_breakpoint *next = bp->next;
+    double *value = scratch, *ratio = scratch + channels, *step = scratch + 2 * channels, u;
+    int i, k;
+
+    if ( !next || next->time <= bp->time || t < bp->time
+    || ( bp->interpType != LINEAR && bp->interpType != EXPONENTIAL ) )
+    {
+        for ( i = 0; i < m; i++, out += channels )
+        {
+            segment_frame ( bp, channels, t + i * interval, value );
+
+            for ( k = 0; k < channels; k++ )
+            {
+                out [ k ] = (float) value [ k ];
+            }
+        }
+
+        return;
+    }
+
+    u = ( t - bp->time ) * bp->inv_duration;
+
+    for ( k = 0; k < channels; k++ )
+    {
+        if ( bp->interpType == EXPONENTIAL && bp->values [ k ] >= 0.0001 && next->values [ k ] >= 0.0001 )
+        {
+            value [ k ] = bp->values [ k ] * exp ( bp->log_ratio [ k ] * u );
+            ratio [ k ] = exp ( bp->log_ratio [ k ] * interval * bp->inv_duration );
+            step  [ k ] = 0;
+        }
+        else
+        {
+            value [ k ] = bp->values [ k ] + u * ( next->values [ k ] - bp->values [ k ] );
+            ratio [ k ] = 1;
+            step  [ k ] = ( next->values [ k ] - bp->values [ k ] ) * interval * bp->inv_duration;
+        }
+    }
+
+    for ( i = 0; i < m; i++, out += channels )
+    {
+        for ( k = 0; k < channels; k++ )
+        {
+            out   [ k ] = (float) value [ k ];
+            value [ k ] = value [ k ] * ratio [ k ] + step [ k ];
+        }
+    }
+}
+
+void multi_render_block ( multi_envelope *env, double start, double interval, int n, float *out )
+{
+    multi_breakpoint *bp;
+    double t, end;
+    int i = 0, m, channels = env->channels;
+
+    if ( !env->first )
+    {
+        memset ( out, 0, (size_t) n * channels * sizeof ( float ) );
+        return;
+    }
+
+    /* One seek for the whole block, after that the frames are walked through the chain in order */
+    bp = multi_seek ( env, start );
+
+    while ( i < n )
+    {
+        t = start + i * interval;
+
+        while ( bp->next && t > bp->next->time && t >= bp->time )
+        {
+            bp = bp->next;
+        }
+
+        /* As render_block, the run of frames on this segment */
+        end = !bp->next ? INFINITY : t >= bp->time ? bp->next->time : bp->time;
+
+        for ( m = 1; i + m < n && start + ( i + m ) * interval <= end; m++ );
+
+        render_segment ( bp, channels, t, interval, m, env->frame, out + (size_t) i * channels );
+        i += m;
+    }
+
+    env->current = bp;
+    env->timeNow = start + ( n - 1 ) * interval;
+}
+
+envelope* multi_channel ( const multi_envelope *env, int channel )
+{
+    envelope *copy = calloc ( 1, sizeof ( envelope ) );
+    const multi_breakpoint *bp;
+    breakpoint *current = NULL, *created;
+
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        created                 = calloc ( 1, sizeof ( breakpoint ) );
+        created->time           = bp->time;
+        created->value          = bp->values [ channel ];
+        created->interpType     = bp->interpType;
+
+        if ( bp->interpType == QUADRATIC_BEZIER && bp->nInterp_params >= env->channels + 1 )
+        {
+            set_interp_params ( created, 2 );
+            INTERP_PARAMS ( created ) [ 0 ] = bp->interp_params [ 0 ];
+            INTERP_PARAMS ( created ) [ 1 ] = bp->interp_params [ 1 + channel ];
+        }
+
+        if ( current )
+        {
+            current->next = created;
+        }
+        else
+        {
+            copy->first = created;
+        }
+
+        current = created;
+    }
+
+    copy->current = copy->first;
+
+    if ( copy->first )
+    {
+        env_update_bounds ( copy );
+        env_changed ( copy, -INFINITY, INFINITY );
+    }
+
+    return copy;
+}
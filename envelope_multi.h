@@ -0,0 +1,167 @@
+
+/**
+ * envelope_multi.h
+ *
+ * Envelopes with several channels that share their breakpoint times, for modulating a group of parameters (the bands
+ * of a filter bank, say) together.
+ *
+ * Each breakpoint holds a value for every channel, so one seek finds the segment for all of them and the shape of the
+ * segment at a time (how far along it, the bezier parameter) is worked out once and applied to every channel in a
+ * loop the compiler can vectorise. When rendering, linear and exponential segments step each channel along with a
+ * multiply and an add. Channels share interpolation types, only built in types can be used.
+ *
+ *  LICENSE:
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#ifndef ENVELOPE_ENVELOPE_MULTI_H
+#define ENVELOPE_ENVELOPE_MULTI_H
+
+#include "envelope.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct multi_breakpoint
+{
+    double                  time;
+    interp_t                interpType;
+    /**
+     * QUADRATIC_BEZIER's control point, its time then its value in each channel
+     */
+    double                  *interp_params;
+    int                     nInterp_params;
+    /**
+     * The value in each channel
+     */
+    double                  *values;
+    struct multi_breakpoint *next;
+
+    /**
+     * As breakpoint's, log_ratio has one entry per channel
+     */
+    double                  inv_duration;
+    double                  *log_ratio;
+} multi_breakpoint;
+
+typedef struct multi_envelope
+{
+    int              channels;
+    multi_breakpoint *first;
+    /**
+     * The breakpoint at the current time
+     */
+    multi_breakpoint *current;
+    double           timeNow;
+    double           minTime;
+    double           maxTime;
+    /**
+     * Room for three frames while rendering
+     */
+    double           *frame;
+} multi_envelope;
+
+/**
+ * Creates an empty envelope with the given number of channels, free it with free_multi_env
+ */
+multi_envelope* create_multi_envelope ( int channels );
+
+void   free_multi_env ( multi_envelope *env );
+
+/***********************************************************************
+ * Adds a breakpoint, after any others at the same time
+ *
+ * @param env
+ * @param time
+ * @param type a built in interpolation type
+ * @param values one value for each channel
+ * @return the breakpoint, owned by env
+ ***********************************************************************/
+multi_breakpoint* multi_insert_breakpoint ( multi_envelope *env, double time, interp_t type, const double *values );
+
+/***********************************************************************
+ * Makes the segment from bp a quadratic bezier with the given control
+ * point
+ *
+ * @param env
+ * @param bp a breakpoint in env's chain
+ * @param time the control point's time
+ * @param values the control point's value in each channel
+ ***********************************************************************/
+void   multi_set_bezier ( multi_envelope *env, multi_breakpoint *bp, double time, const double *values );
+
+/***********************************************************************
+ * Reads a multi channel envelope from a file in the .bp format, with
+ * a value for each channel on each line
+ *
+ * time value1 value2 ... interp_type interp_param1 ...
+ *
+ * Values are written with a decimal point, the interpolation type
+ * without, which is how the two are told apart. The number of channels
+ * is taken from the first line and every other line must match it. A
+ * file with one channel is an ordinary .bp file
+ *
+ * @param file The file to load the data from
+ * @param env An envelope from create_multi_envelope, its breakpoints
+ * and number of channels are replaced
+ * @return 0 on success, -1 on failure
+ ***********************************************************************/
+int    load_multi_breakpoints ( const char* file, multi_envelope *env );
+
+/***********************************************************************
+ * Writes an envelope in the format read by load_multi_breakpoints
+ *
+ * @return 0 on success, -1 on failure
+ ***********************************************************************/
+int    save_multi_breakpoints ( const char* file, const multi_envelope *env );
+
+/***********************************************************************
+ * Gets the value of every channel at a time
+ *
+ * @param env
+ * @param t time
+ * @param out one value for each channel
+ ***********************************************************************/
+void   multi_value_at ( multi_envelope *env, double t, double *out );
+
+/***********************************************************************
+ * Renders n evenly spaced frames of every channel, as render_block
+ * does for one
+ *
+ * @param env
+ * @param start    the time of the first frame
+ * @param interval the time between frames, must be positive
+ * @param n        the number of frames
+ * @param out      n * channels values, the channels of each frame
+ *                 together
+ ***********************************************************************/
+void   multi_render_block ( multi_envelope *env, double start, double interval, int n, float *out );
+
+/***********************************************************************
+ * Copies one channel out into an ordinary envelope, for editing or for
+ * the functions that take one
+ *
+ * @return a new envelope to free with free_env
+ ***********************************************************************/
+envelope* multi_channel ( const multi_envelope *env, int channel );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ENVELOPE_ENVELOPE_MULTI_H
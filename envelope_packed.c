@@ -0,0 +1,713 @@
+
+/**
+ * envelope_packed.c Copyright Tom Merchant (mailto:tom@tmerchant.com) 2019
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/*
+ * File layout, all integers little endian
+ *
+ * header   "BPK1", u32 block count, f64 quantum, u64 breakpoint count, u64 index offset, i64 last time
+ * blocks   varint count
+ *          varint number of type runs, then a u8 type and a varint length for each run
+ *          count zigzag varint times, the first absolute and the rest deltas, in quanta
+ *          count zigzag varint values, the same
+ *          for each breakpoint a varint parameter count and a zigzag varint for each parameter. A bezier's control
+ *          point is relative to its breakpoint
+ * index    for each block u64 offset, u32 size, u32 count, i64 first time, i64 first value
+ */
+
+#include "envelope_packed.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define PACKED_HEADER_SIZE 40
+#define PACKED_INDEX_SIZE  32
+
+void free_breakpoint_chain ( breakpoint *bp );
+
+typedef struct packed_buffer
+{
+    uint8_t *data;
+    size_t  size;
+    size_t  capacity;
+} packed_buffer;
+
+typedef struct packed_index
+{
+    uint64_t offset;
+    uint32_t size;
+    uint32_t count;
+    int64_t  time;
+    int64_t  value;
+} packed_index;
+
+struct packed_reader
+{
+    FILE          *file;
+    double        quantum;
+    uint32_t      nBlocks;
+    uint64_t      nBreakpoints;
+    int64_t       maxTime;
+    packed_index  *index;
+
+    /* The decoded block. The last breakpoint is followed by tail, the start of the next block */
+    int64_t       block;
+    breakpoint    *bps;
+    size_t        bpCapacity;
+    double        *params;
+    size_t        paramCapacity;
+    uint8_t       *data;
+    size_t        dataCapacity;
+    breakpoint    tail;
+    envelope      env;
+};
+
+
+/***********************************************************************************************************************
+ * Encoding
+ **********************************************************************************************************************/
+
+static void reserve ( packed_buffer *buf, size_t extra )
+{
+    if ( buf->size + extra > buf->capacity )
+    {
+        buf->capacity = ( buf->size + extra ) * 2;
+        buf->data     = realloc ( buf->data, buf->capacity );
+    }
+}
+
+static void put_varint ( packed_buffer *buf, uint64_t v )
+{
+    reserve ( buf, 10 );
+
+    while ( v >= 0x80 )
+    {
+        buf->data [ buf->size++ ] = (uint8_t) ( v | 0x80 );
+        v >>= 7;
+    }
+
+    buf->data [ buf->size++ ] = (uint8_t) v;
+}
+
+static uint64_t zigzag ( int64_t v )
+{
+    return ( (uint64_t) v << 1 ) ^ (uint64_t) ( v >> 63 );
+}
+
+static int64_t unzigzag ( uint64_t v )
+{
+    return (int64_t) ( v >> 1 ) ^ -(int64_t) ( v & 1 );
+}
+
+static void put_u32 ( uint8_t *p, uint32_t v )
+{
+    int i;
+
+    for ( i = 0; i < 4; i++ )
+    {
+        p [ i ] = (uint8_t) ( v >> ( 8 * i ) );
+    }
+}
+
+static void put_u64 ( uint8_t *p, uint64_t v )
+{
+    int i;
+
+    for ( i = 0; i < 8; i++ )
+    {
+        p [ i ] = (uint8_t) ( v >> ( 8 * i ) );
+    }
+}
+
+static uint32_t get_u32 ( const uint8_t *p )
+{
+    return (uint32_t) p [ 0 ] | (uint32_t) p [ 1 ] << 8 | (uint32_t) p [ 2 ] << 16 | (uint32_t) p [ 3 ] << 24;
+}
+
+static uint64_t get_u64 ( const uint8_t *p )
+{
+    return (uint64_t) get_u32 ( p ) | (uint64_t) get_u32 ( p + 4 ) << 32;
+}
+
+static int64_t quantise ( double v, double quantum )
+{
+    return llround ( v / quantum );
+}
+
+/* The reference a parameter is stored relative to */
+static int64_t param_reference ( const breakpoint *bp, int param, double quantum )
+{
+    if ( bp->interpType == QUADRATIC_BEZIER && param < 2 )
+    {
+        return quantise ( param == 0 ? bp->time : bp->value, quantum );
+    }
+
+    return 0;
+}
+
+static void encode_block ( packed_buffer *buf, const breakpoint *first, uint32_t count, double quantum )
+{
+    const breakpoint *bp, *run = first;
+    int64_t previous, q;
+    uint32_t i, length, nRuns = 0;
+    int j;
+
+    put_varint ( buf, count );
+
+    for ( bp = first, i = 0; i < count; i++, bp = bp->next )
+    {
+        if ( i == 0 || bp->interpType != run->interpType )
+        {
+            nRuns++;
+            run = bp;
+        }
+    }
+
+    put_varint ( buf, nRuns );
+
+    for ( run = first, i = 0; i < count; run = bp )
+    {
+        for ( bp = run, length = 0; i < count && bp->interpType == run->interpType; bp = bp->next, i++ )
+        {
+            length++;
+        }
+
+        reserve ( buf, 1 );
+        buf->data [ buf->size++ ] = (uint8_t) run->interpType;
+        put_varint ( buf, length );
+    }
+
+    for ( bp = first, previous = 0, i = 0; i < count; i++, bp = bp->next )
+    {
+        q = quantise ( bp->time, quantum );
+        put_varint ( buf, zigzag ( q - previous ) );
+        previous = q;
+    }
+
+    for ( bp = first, previous = 0, i = 0; i < count; i++, bp = bp->next )
+    {
+        q = quantise ( bp->value, quantum );
+        put_varint ( buf, zigzag ( q - previous ) );
+        previous = q;
+    }
+
+    for ( bp = first, i = 0; i < count; i++, bp = bp->next )
+    {
+        put_varint ( buf, bp->nInterp_params );
+
+        for ( j = 0; j < bp->nInterp_params; j++ )
+        {
+            put_varint ( buf, zigzag ( quantise ( INTERP_PARAMS ( bp ) [ j ], quantum )
+                                       - param_reference ( bp, j, quantum ) ) );
+        }
+    }
+}
+
+int save_breakpoints_packed ( const char* file, const envelope *env, double quantum )
+{
+    packed_buffer block = { 0 }, index = { 0 };
+    uint8_t header [ PACKED_HEADER_SIZE ] = { 0 }, *entry;
+    const breakpoint *bp, *first;
+    uint64_t nBreakpoints = 0, offset = PACKED_HEADER_SIZE, quantumBits;
+    uint32_t count, nBlocks = 0;
+    int64_t maxTime = 0;
+    char *temp_file;
+    FILE *out;
+    envelope *baked;
+    int failed = 0;
+
+    if ( env->scaled )
+    {
+        baked = copy_envelope ( env );
+        env_apply_gain ( baked );
+        failed = save_breakpoints_packed ( file, baked, quantum );
+        free_env ( baked );
+
+        return failed;
+    }
+
+    if ( quantum <= 0 )
+    {
+        quantum = PACKED_DEFAULT_QUANTUM;
+    }
+
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        if ( bp->interpType > EXPONENTIAL )
+        {
+            /* There's no way to store a callback */
+            return -1;
+        }
+    }
+
+    temp_file = malloc ( strlen ( file ) + 5 );
+    sprintf ( temp_file, "%s.tmp", file );
+
+    if ( ! ( out = fopen ( temp_file, "wb" ) ) )
+    {
+        free ( temp_file );
+        return -1;
+    }
+
+    failed |= fwrite ( header, 1, PACKED_HEADER_SIZE, out ) != PACKED_HEADER_SIZE;
+
+    for ( bp = env->first; bp; )
+    {
+        first = bp;
+
+        for ( count = 0; bp && count < PACKED_BLOCK_SIZE; count++, bp = bp->next )
+        {
+            maxTime = quantise ( bp->time, quantum );
+        }
+
+        block.size = 0;
+        encode_block ( &block, first, count, quantum );
+        failed |= fwrite ( block.data, 1, block.size, out ) != block.size;
+
+        reserve ( &index, PACKED_INDEX_SIZE );
+        entry = index.data + index.size;
+        put_u64 ( entry, offset );
+        put_u32 ( entry + 8, (uint32_t) block.size );
+        put_u32 ( entry + 12, count );
+        put_u64 ( entry + 16, (uint64_t) quantise ( first->time, quantum ) );
+        put_u64 ( entry + 24, (uint64_t) quantise ( first->value, quantum ) );
+        index.size += PACKED_INDEX_SIZE;
+
+        offset += block.size;
+        nBreakpoints += count;
+        nBlocks++;
+    }
+
+    failed |= fwrite ( index.data, 1, index.size, out ) != index.size;
+
+    memcpy ( header, "BPK1", 4 );
+    put_u32 ( header + 4, nBlocks );
+    memcpy ( &quantumBits, &quantum, sizeof ( double ) );
+    put_u64 ( header + 8, quantumBits );
+    put_u64 ( header + 16, nBreakpoints );
+    put_u64 ( header + 24, offset );
+    put_u64 ( header + 32, (uint64_t) maxTime );
+
+    failed |= fseek ( out, 0, SEEK_SET ) != 0;
+    failed |= fwrite ( header, 1, PACKED_HEADER_SIZE, out ) != PACKED_HEADER_SIZE;
+    failed |= fclose ( out ) != 0;
+
+    if ( ! failed )
+    {
+        failed = rename ( temp_file, file ) != 0;
+    }
+
+    if ( failed )
+    {
+        remove ( temp_file );
+    }
+
+    free ( temp_file );
+    free ( block.data );
+    free ( index.data );
+
+    return failed ? -1 : 0;
+}
+
+
+/***********************************************************************************************************************
+ * Decoding
+ **********************************************************************************************************************/
+
+static int get_varint ( const uint8_t **p, const uint8_t *end, uint64_t *v )
+{
+    int shift = 0;
+
+    *v = 0;
+
+    while ( *p < end && shift < 64 )
+    {
+        *v |= (uint64_t) ( **p & 0x7f ) << shift;
+
+        if ( ! ( *(*p)++ & 0x80 ) )
+        {
+            return 1;
+        }
+
+        shift += 7;
+    }
+
+    return 0;
+}
+
+/* Decodes a block into the reader's breakpoints, returns the number decoded or -1 if the block is corrupt */
+static int64_t decode_block ( packed_reader *reader, const uint8_t *p, const uint8_t *end )
+{
+    uint64_t count, nRuns, length, nParams, v, i, j, k, paramsUsed = 0;
+    int64_t q = 0;
+    breakpoint *bp;
+    double *params;
+    uint8_t type;
+
+    if ( ! get_varint ( &p, end, &count ) || count == 0 || count > PACKED_BLOCK_SIZE )
+    {
+        return -1;
+    }
+
+    if ( count > reader->bpCapacity )
+    {
+        reader->bpCapacity = count;
+        reader->bps = realloc ( reader->bps, count * sizeof ( breakpoint ) );
+    }
+
+    memset ( reader->bps, 0, count * sizeof ( breakpoint ) );
+
+    if ( ! get_varint ( &p, end, &nRuns ) )
+    {
+        return -1;
+    }
+
+    for ( i = 0, k = 0; i < nRuns; i++ )
+    {
+        if ( p >= end || ( type = *p++ ) > EXPONENTIAL || ! get_varint ( &p, end, &length ) || k + length > count )
+        {
+            return -1;
+        }
+
+        for ( j = 0; j < length; j++, k++ )
+        {
+            reader->bps [ k ].interpType = (interp_t) type;
+        }
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        if ( ! get_varint ( &p, end, &v ) )
+        {
+            return -1;
+        }
+
+        q += unzigzag ( v );
+        reader->bps [ i ].time = q * reader->quantum;
+    }
+
+    for ( i = 0, q = 0; i < count; i++ )
+    {
+        if ( ! get_varint ( &p, end, &v ) )
+        {
+            return -1;
+        }
+
+        q += unzigzag ( v );
+        reader->bps [ i ].value = q * reader->quantum;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        bp = &reader->bps [ i ];
+
+        if ( ! get_varint ( &p, end, &nParams ) || nParams > (uint64_t) ( end - p ) )
+        {
+            return -1;
+        }
+
+        if ( paramsUsed + nParams > reader->paramCapacity )
+        {
+            reader->paramCapacity = ( paramsUsed + nParams ) * 2;
+            reader->params = realloc ( reader->params, reader->paramCapacity * sizeof ( double ) );
+        }
+
+        /* Where they start for now, they're put in place once they've all been read as the array might move */
+        bp->nInterp_params     = (int) nParams;
+        bp->params.heap_params = (double*) (uintptr_t) paramsUsed;
+
+        for ( j = 0; j < nParams; j++ )
+        {
+            if ( ! get_varint ( &p, end, &v ) )
+            {
+                return -1;
+            }
+
+            reader->params [ paramsUsed++ ] = ( unzigzag ( v ) + param_reference ( bp, (int) j, reader->quantum ) )
+                                            * reader->quantum;
+        }
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        bp     = &reader->bps [ i ];
+        params = reader->params + (uintptr_t) bp->params.heap_params;
+
+        /* Left in the reader's array when they don't fit inline */
+        if ( bp->nInterp_params > BP_INLINE_PARAMS )
+        {
+            bp->params.heap_params = params;
+        }
+        else if ( bp->nInterp_params > 0 )
+        {
+            memcpy ( bp->params.inline_params, params, bp->nInterp_params * sizeof ( double ) );
+        }
+
+        bp->next = i + 1 < count ? bp + 1 : NULL;
+    }
+
+    return (int64_t) count;
+}
+
+packed_reader* packed_open ( const char* file )
+{
+    uint8_t header [ PACKED_HEADER_SIZE ], *index = NULL;
+    packed_reader *reader = calloc ( 1, sizeof ( packed_reader ) );
+    uint64_t quantum, indexOffset;
+    uint32_t i;
+
+    if ( ! ( reader->file = fopen ( file, "rb" ) )
+    ||   fread ( header, 1, PACKED_HEADER_SIZE, reader->file ) != PACKED_HEADER_SIZE
+    ||   memcmp ( header, "BPK1", 4 ) != 0 )
+    {
+        packed_close ( reader );
+        return NULL;
+    }
+
+    reader->nBlocks      = get_u32 ( header + 4 );
+    quantum              = get_u64 ( header + 8 );
+    reader->nBreakpoints = get_u64 ( header + 16 );
+    indexOffset          = get_u64 ( header + 24 );
+    reader->maxTime      = (int64_t) get_u64 ( header + 32 );
+    reader->block        = -1;
+
+    memcpy ( &reader->quantum, &quantum, sizeof ( double ) );
+
+    index         = malloc ( (size_t) reader->nBlocks * PACKED_INDEX_SIZE + 1 );
+    reader->index = malloc ( ( reader->nBlocks + 1 ) * sizeof ( packed_index ) );
+
+    if ( ! ( reader->quantum > 0 )
+    ||   fseek ( reader->file, (long) indexOffset, SEEK_SET ) != 0
+    ||   fread ( index, PACKED_INDEX_SIZE, reader->nBlocks, reader->file ) != reader->nBlocks )
+    {
+        free ( index );
+        packed_close ( reader );
+        return NULL;
+    }
+
+    for ( i = 0; i < reader->nBlocks; i++ )
+    {
+        reader->index [ i ].offset = get_u64 ( index + i * PACKED_INDEX_SIZE );
+        reader->index [ i ].size   = get_u32 ( index + i * PACKED_INDEX_SIZE + 8 );
+        reader->index [ i ].count  = get_u32 ( index + i * PACKED_INDEX_SIZE + 12 );
+        reader->index [ i ].time   = (int64_t) get_u64 ( index + i * PACKED_INDEX_SIZE + 16 );
+        reader->index [ i ].value  = (int64_t) get_u64 ( index + i * PACKED_INDEX_SIZE + 24 );
+    }
+
+    free ( index );
+
+    return reader;
+}
+
+void packed_close ( packed_reader *reader )
+{
+    if ( reader->file )
+    {
+        fclose ( reader->file );
+    }
+
+    free ( reader->index );
+    free ( reader->bps );
+    free ( reader->params );
+    free ( reader->data );
+    free ( reader );
+}
+
+double packed_max_time ( const packed_reader *reader )
+{
+    return reader->maxTime * reader->quantum;
+}
+
+static int load_block ( packed_reader *reader, uint32_t block )
+{
+    packed_index *entry = &reader->index [ block ];
+    int64_t count, i;
+
+    if ( reader->block == block )
+    {
+        return 0;
+    }
+
+    reader->block = -1;
+
+    if ( entry->size > reader->dataCapacity )
+    {
+        reader->dataCapacity = entry->size;
+        reader->data = realloc ( reader->data, entry->size );
+    }
+
+    if ( fseek ( reader->file, (long) entry->offset, SEEK_SET ) != 0
+    ||   fread ( reader->data, 1, entry->size, reader->file ) != entry->size
+    ||   ( count = decode_block ( reader, reader->data, reader->data + entry->size ) ) != entry->count )
+    {
+        return -1;
+    }
+
+    /* Finish the last segment with the start of the next block */
+    if ( block + 1 < reader->nBlocks )
+    {
+        memset ( &reader->tail, 0, sizeof ( breakpoint ) );
+        reader->tail.time  = reader->index [ block + 1 ].time * reader->quantum;
+        reader->tail.value = reader->index [ block + 1 ].value * reader->quantum;
+        reader->bps [ count - 1 ].next = &reader->tail;
+    }
+
+    for ( i = 0; i < count; i++ )
+    {
+        update_segment ( &reader->bps [ i ] );
+    }
+
+    memset ( &reader->env, 0, sizeof ( envelope ) );
+    reader->env.first   = reader->bps;
+    reader->env.current = reader->bps;
+    reader->block       = block;
+
+    return 0;
+}
+
+/* The block that time t falls in */
+static uint32_t find_block ( const packed_reader *reader, double t )
+{
+    uint32_t low = 0, high = reader->nBlocks, mid;
+
+    while ( high - low > 1 )
+    {
+        mid = low + ( high - low ) / 2;
+
+        if ( reader->index [ mid ].time * reader->quantum <= t )
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+int packed_render ( packed_reader *reader, double start, double interval, int n, float *out )
+{
+    uint32_t block;
+    double t, end;
+    int i = 0, m;
+
+    if ( reader->nBlocks == 0 )
+    {
+        memset ( out, 0, n * sizeof ( float ) );
+        return 0;
+    }
+
+    while ( i < n )
+    {
+        t = start + i * interval;
+        block = find_block ( reader, t );
+
+        if ( load_block ( reader, block ) != 0 )
+        {
+            return -1;
+        }
+
+        if ( block + 1 < reader->nBlocks )
+        {
+            end = reader->index [ block + 1 ].time * reader->quantum;
+            m   = (int) fmin ( n, ceil ( ( end - start ) / interval ) ) - i;
+            m   = m < 1 ? 1 : m;
+        }
+        else
+        {
+            m = n - i;
+        }
+
+        render_block ( &reader->env, t, interval, m, out + i );
+        i += m;
+    }
+
+    return 0;
+}
+
+int load_breakpoints_packed ( const char* file, envelope *env )
+{
+    packed_reader *reader = packed_open ( file );
+    breakpoint *top = NULL, *last = NULL, *bp;
+    uint32_t block;
+    uint32_t i;
+
+    if ( ! reader )
+    {
+        return -1;
+    }
+
+    for ( block = 0; block < reader->nBlocks; block++ )
+    {
+        if ( load_block ( reader, block ) != 0 )
+        {
+            if ( top )
+            {
+                free_breakpoint_chain ( top );
+            }
+
+            packed_close ( reader );
+            return -1;
+        }
+
+        for ( i = 0; i < reader->index [ block ].count; i++ )
+        {
+            bp = malloc ( sizeof ( breakpoint ) );
+            memcpy ( bp, &reader->bps [ i ], sizeof ( breakpoint ) );
+            bp->next = NULL;
+            bp->prev = last;
+
+            /* Inline parameters came along with the rest, the reader's own array has to be copied */
+            if ( bp->nInterp_params > BP_INLINE_PARAMS )
+            {
+                bp->params.heap_params = malloc ( bp->nInterp_params * sizeof ( double ) );
+                memcpy ( bp->params.heap_params, reader->bps [ i ].params.heap_params,
+                         bp->nInterp_params * sizeof ( double ) );
+            }
+
+            if ( last )
+            {
+                last->next = bp;
+            }
+            else
+            {
+                top = bp;
+            }
+
+            last = bp;
+        }
+    }
+
+    env->first     = top;
+    env->current   = top;
+    env->timeNow   = 0;
+    env->scaled    = 0;
+    env->loop      = LOOP_OFF;
+    env->loopStart = NULL;
+    env->loopEnd   = NULL;
+    env_update_bounds ( env );
+
+    env_changed ( env, -INFINITY, INFINITY );
+    packed_close ( reader );
+
+    return 0;
+}
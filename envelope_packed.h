@@ -0,0 +1,98 @@
+
+/**
+ * envelope_packed.h
+ *
+ * A compact binary alternative to the .bp text format for long envelopes.
+ *
+ * Times, values and interpolation parameters are quantised to a fixed step, delta encoded and stored as variable
+ * length integers, and interpolation types are run length encoded. Breakpoints are grouped into blocks that can each
+ * be decoded on their own, with an index of the blocks at the end of the file, so a packed_reader can render any part
+ * of an envelope while only holding one block in memory.
+ *
+ *  LICENSE:
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#ifndef ENVELOPE_ENVELOPE_PACKED_H
+#define ENVELOPE_ENVELOPE_PACKED_H
+
+#include "envelope.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The default quantisation step, times and values are stored to within half of this
+ */
+#define PACKED_DEFAULT_QUANTUM 1e-6
+
+/**
+ * The number of breakpoints in each block
+ */
+#define PACKED_BLOCK_SIZE 1024
+
+typedef struct packed_reader packed_reader;
+
+/***********************************************************************
+ * Writes an envelope's breakpoints to a packed file. Only the main
+ * chain is written, not the release chain of an ADSR_envelope.
+ * The file is only replaced once it has been completely written
+ *
+ * @param file The file to write to
+ * @param env The envelope to save
+ * @param quantum The quantisation step, PACKED_DEFAULT_QUANTUM if <= 0
+ * @return 0 on success, -1 on failure
+ ***********************************************************************/
+int    save_breakpoints_packed ( const char* file, const envelope *env, double quantum );
+
+/***********************************************************************
+ * Reads a whole packed file into env, as load_breakpoints
+ *
+ * @param file The file to read
+ * @param env An envelope that already exists
+ * @return 0 on success, -1 on failure
+ ***********************************************************************/
+int    load_breakpoints_packed ( const char* file, envelope *env );
+
+/***********************************************************************
+ * Opens a packed file for streaming
+ *
+ * @return the reader or NULL if the file couldn't be read
+ ***********************************************************************/
+packed_reader* packed_open ( const char* file );
+
+void   packed_close  ( packed_reader *reader );
+
+/***********************************************************************
+ * Renders n values from a packed file as render_block would from the
+ * loaded envelope, decoding blocks as they are needed
+ *
+ * @return 0 on success, -1 if the file couldn't be read
+ ***********************************************************************/
+int    packed_render ( packed_reader *reader, double start, double interval, int n, float *out );
+
+/**
+ * The length of the envelope in a packed file
+ */
+double packed_max_time ( const packed_reader *reader );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ENVELOPE_ENVELOPE_PACKED_H
@@ -0,0 +1,89 @@
+
+/**
+ * envelope_plot.c Copyright Tom Merchant (mailto:tom@tmerchant.com) 2019
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "envelope_plot.h"
+#include "envelope_workers.h"
+
+#include <stdlib.h>
+
+struct plot_pool
+{
+    /* The plot being drawn, its columns are split up between the workers */
+    envelope        *env;
+    double          start;
+    double          interval;
+    double          step;
+    int             width;
+    float           *yvals;
+    worker_pool     workers;
+};
+
+/* Part p of the columns, the caller plots part 0 and worker i part i + 1 */
+static int plot_part ( void *user, int p )
+{
+    plot_pool *pool = user;
+    int i, first = (int) ( (long) pool->width * p / pool->workers.parts ),
+           last  = (int) ( (long) pool->width * ( p + 1 ) / pool->workers.parts );
+    env_cursor cursor;
+
+    env_cursor_init ( &cursor, pool->env );
+
+    for ( i = first; i < last; i++ )
+    {
+        pool->yvals [ i ] = ( env_cursor_value_at ( &cursor, pool->start + i * pool->interval ) - pool->env->minVal )
+                          * pool->step;
+    }
+
+    return last - first;
+}
+
+plot_pool* create_plot_pool ( int threads )
+{
+    plot_pool *pool = calloc ( 1, sizeof ( plot_pool ) );
+
+    worker_pool_init ( &pool->workers, plot_part, pool );
+    worker_pool_set_threads ( &pool->workers, threads );
+
+    return pool;
+}
+
+void free_plot_pool ( plot_pool *pool )
+{
+    worker_pool_destroy ( &pool->workers );
+    free ( pool );
+}
+
+void plot_envelope_parallel ( plot_pool *pool, envelope *env, double start, double end, int width, int height,
+                              float *yvals )
+{
+    /* Short enough not to be worth splitting, and if it has been triggered it can only be read by one thread */
+    if ( env->type == ADSR )
+    {
+        plot_envelope_range ( env, start, end, width, height, yvals );
+        return;
+    }
+
+    pool->env      = env;
+    pool->start    = start;
+    pool->interval = ( end - start ) / (double) width;
+    pool->step     = height / ( env->maxVal - env->minVal );
+    pool->width    = width;
+    pool->yvals    = yvals;
+
+    worker_pool_run ( &pool->workers, width / PLOT_COLUMNS_PER_THREAD );
+}
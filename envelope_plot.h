@@ -0,0 +1,75 @@
+
+/**
+ * envelope_plot.h
+ *
+ * Plots envelopes on several threads, for exports thousands of columns wide and for batches of thumbnails.
+ *
+ * The columns are split into one run for each thread, and each thread reads the envelope with an env_cursor of its
+ * own and writes its columns straight into the plot. The envelope itself isn't moved, so it mustn't be changed while
+ * it is being plotted but can be read elsewhere through other cursors.
+ *
+ *  LICENSE:
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#ifndef ENVELOPE_ENVELOPE_PLOT_H
+#define ENVELOPE_ENVELOPE_PLOT_H
+
+#include "envelope.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Plots narrower than this for each thread are plotted on fewer threads
+ */
+#define PLOT_COLUMNS_PER_THREAD 512
+
+typedef struct plot_pool plot_pool;
+
+/***********************************************************************
+ * Creates the threads plots are shared between, free them with
+ * free_plot_pool
+ *
+ * @param threads the number of threads, including the one plotting
+ ***********************************************************************/
+plot_pool* create_plot_pool ( int threads );
+
+void   free_plot_pool ( plot_pool *pool );
+
+/***********************************************************************
+ * Plots the envelope between two times, as plot_envelope_range does.
+ * ADSR_envelopes are plotted on the calling thread. One plot at a
+ * time for each pool
+ *
+ * @param pool
+ * @param env
+ * @param start The time of the first column
+ * @param end   The time just after the last column
+ * @param width The number of columns to write to yvals
+ * @param height
+ * @param yvals
+ ***********************************************************************/
+void   plot_envelope_parallel ( plot_pool *pool, envelope *env, double start, double end, int width, int height,
+                                float *yvals );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ENVELOPE_ENVELOPE_PLOT_H
@@ -0,0 +1,459 @@
+
+/**
+ * envelope_polyline.c Copyright Tom Merchant (mailto:tom@tmerchant.com) 2019
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "envelope_polyline.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+/*
+ * A stretch of the output that one segment covers. Going round a loop a segment covers several, ping pong loops run
+ * them backwards every other time. direction is 1 forwards, -1 backwards and 0 for the flat stretches either side of
+ * the chain
+ */
+typedef struct piece
+{
+    breakpoint *bp;
+    double     start;
+    double     end;
+    double     chainStart;
+    int        direction;
+} piece;
+
+typedef struct tessellator
+{
+    envelope     *env;
+    env_polyline *line;
+    double       start;
+    double       end;
+    double       left;
+    double       top;
+    double       xScale;
+    double       yScale;
+    /**
+     * A third of the tolerance, for halving curves, for the width of the columns points are gathered in and for
+     * dropping vertices
+     */
+    double       tolerance;
+
+    /* The points in the current column, of which only the first, last, lowest and highest can be seen. seq counts
+     * them so the lowest and highest can be passed on in the order they came */
+    long         column;
+    int          count;
+    double       fx, fy, lx, ly, minX, minY, maxX, maxY;
+    int          minSeq, maxSeq;
+
+    /* The last vertex written and the newest point that hasn't been. Every point since the vertex is within tolerance
+     * of a line from it in a direction between lo and hi, and reach is the furthest any of them got from it */
+    int          anchored;
+    int          pending;
+    double       ax, ay, px, py;
+    double       lo, hi, reach;
+} tessellator;
+
+static void push_vertex ( env_polyline *line, double x, double y )
+{
+    if ( line->n == line->capacity )
+    {
+        line->capacity = line->capacity ? 2 * line->capacity : 256;
+        line->points   = realloc ( line->points, 2 * line->capacity * sizeof ( float ) );
+    }
+
+    line->points [ 2 * line->n ]     = (float) x;
+    line->points [ 2 * line->n + 1 ] = (float) y;
+    line->n++;
+}
+
+static void set_anchor ( tessellator *ts, double x, double y )
+{
+    push_vertex ( ts->line, x, y );
+
+    ts->anchored = 1;
+    ts->pending  = 0;
+    ts->ax       = x;
+    ts->ay       = y;
+    ts->lo       = -INFINITY;
+    ts->hi       = INFINITY;
+    ts->reach    = 0;
+}
+
+/* Adds a point to the line, writing the pending point as a vertex once this one can't share a line with it */
+static void line_to ( tessellator *ts, double x, double y )
+{
+    double d, angle, width, lo = ts->lo, hi = ts->hi;
+
+    if ( !ts->anchored )
+    {
+        set_anchor ( ts, x, y );
+        return;
+    }
+
+    d = hypot ( x - ts->ax, y - ts->ay );
+
+    if ( d > ts->tolerance )
+    {
+        /* x never goes back, so the directions stay between straight up and straight down and can't wrap round */
+        angle = atan2 ( y - ts->ay, x - ts->ax );
+        width = asin ( ts->tolerance / d );
+        lo    = fmax ( lo, angle - width );
+        hi    = fmin ( hi, angle + width );
+    }
+
+    /* Coming back towards the vertex would cut off the points that went further */
+    if ( lo > hi || d + ts->tolerance < ts->reach )
+    {
+        set_anchor ( ts, ts->px, ts->py );
+        line_to ( ts, x, y );
+        return;
+    }
+
+    ts->lo      = lo;
+    ts->hi      = hi;
+    ts->reach   = fmax ( ts->reach, d );
+    ts->px      = x;
+    ts->py      = y;
+    ts->pending = 1;
+}
+
+/* Passes on the points of the current column that can be seen */
+static void flush_column ( tessellator *ts )
+{
+    int first = ts->minSeq < ts->maxSeq;
+
+    if ( ts->count == 0 )
+    {
+        return;
+    }
+
+    line_to ( ts, ts->fx, ts->fy );
+
+    if ( ts->minSeq > 0 && ts->minSeq < ts->count - 1 && first )
+    {
+        line_to ( ts, ts->minX, ts->minY );
+    }
+
+    if ( ts->maxSeq > 0 && ts->maxSeq < ts->count - 1 )
+    {
+        line_to ( ts, ts->maxX, ts->maxY );
+    }
+
+    if ( ts->minSeq > 0 && ts->minSeq < ts->count - 1 && !first )
+    {
+        line_to ( ts, ts->minX, ts->minY );
+    }
+
+    if ( ts->count > 1 )
+    {
+        line_to ( ts, ts->lx, ts->ly );
+    }
+
+    ts->count = 0;
+}
+
+/* Gathers points a column at a time, zoomed out on a dense envelope most of them are inside the line already */
+static void add_point ( tessellator *ts, double x, double y )
+{
+    long column = (long) floor ( ( x - ts->left ) / ts->tolerance );
+
+    if ( ts->count > 0 && column != ts->column )
+    {
+        flush_column ( ts );
+    }
+
+    if ( ts->count == 0 )
+    {
+        ts->column = column;
+        ts->fx     = ts->minX = ts->maxX = x;
+        ts->fy     = ts->minY = ts->maxY = y;
+        ts->minSeq = ts->maxSeq = 0;
+    }
+    else if ( y < ts->minY )
+    {
+        ts->minX   = x;
+        ts->minY   = y;
+        ts->minSeq = ts->count;
+    }
+    else if ( y > ts->maxY )
+    {
+        ts->maxX   = x;
+        ts->maxY   = y;
+        ts->maxSeq = ts->count;
+    }
+
+    ts->lx = x;
+    ts->ly = y;
+    ts->count++;
+}
+
+static double pixel_x ( const tessellator *ts, double t )
+{
+    return ts->left + ( t - ts->start ) * ts->xScale;
+}
+
+static double pixel_y ( const tessellator *ts, double value )
+{
+    return ts->top + ( ts->env->maxVal - value ) * ts->yScale;
+}
+
+static double piece_value ( const tessellator *ts, const piece *p, double t )
+{
+    double time  = p->direction ? p->chainStart + ( t - p->start ) * p->direction : p->chainStart,
+           value = interp_functions [ p->bp->interpType ] ( p->bp, time );
+
+    return ts->env->scaled ? value * ts->env->gain + ts->env->offset : value;
+}
+
+/* Adds the points strictly between t0 and t1 that bring the curve within tolerance */
+static void subdivide ( tessellator *ts, const piece *p, double t0, double x0, double y0, double t1, double x1,
+                        double y1, int depth )
+{
+    double t = ( t0 + t1 ) / 2, x = pixel_x ( ts, t ), y = pixel_y ( ts, piece_value ( ts, p, t ) ),
+           length = hypot ( x1 - x0, y1 - y0 ), off;
+
+    off = length > 0 ? fabs ( ( x - x0 ) * ( y1 - y0 ) - ( y - y0 ) * ( x1 - x0 ) ) / length
+                     : hypot ( x - x0, y - y0 );
+
+    if ( off <= ts->tolerance || depth >= POLYLINE_MAX_DEPTH )
+    {
+        return;
+    }
+
+    subdivide ( ts, p, t0, x0, y0, t, x, y, depth + 1 );
+    add_point ( ts, x, y );
+    subdivide ( ts, p, t, x, y, t1, x1, y1, depth + 1 );
+}
+
+static void add_piece ( tessellator *ts, const piece *p )
+{
+    double u0 = fmax ( p->start, ts->start ), u1 = fmin ( p->end, ts->end ), x0, y0, x1, y1, middle;
+
+    if ( u1 <= u0 )
+    {
+        return;
+    }
+
+    x0 = pixel_x ( ts, u0 );
+    y0 = pixel_y ( ts, piece_value ( ts, p, u0 ) );
+    x1 = pixel_x ( ts, u1 );
+    y1 = pixel_y ( ts, piece_value ( ts, p, u1 ) );
+
+    add_point ( ts, x0, y0 );
+
+    if ( p->direction != 0 && p->bp->next && p->bp->interpType == NEAREST_NEIGHBOUR )
+    {
+        /* Flat to halfway along the segment, then straight up or down */
+        middle = p->start + ( ( p->bp->time + p->bp->next->time ) / 2 - p->chainStart ) * p->direction;
+
+        if ( u0 < middle && middle < u1 )
+        {
+            add_point ( ts, pixel_x ( ts, middle ), y0 );
+            add_point ( ts, pixel_x ( ts, middle ), y1 );
+        }
+    }
+    else if ( p->direction != 0 && p->bp->next && p->bp->interpType != LINEAR )
+    {
+        subdivide ( ts, p, u0, x0, y0, u1, x1, y1, 0 );
+    }
+
+    add_point ( ts, x1, y1 );
+}
+
+static void add_segment ( tessellator *ts, breakpoint *bp, double offset, int direction )
+{
+    piece p;
+
+    p.bp        = bp;
+    p.direction = direction;
+
+    if ( direction < 0 )
+    {
+        p.start      = offset - bp->next->time;
+        p.end        = offset - bp->time;
+        p.chainStart = bp->next->time;
+    }
+    else
+    {
+        p.start      = offset + bp->time;
+        p.end        = offset + bp->next->time;
+        p.chainStart = bp->time;
+    }
+
+    add_piece ( ts, &p );
+}
+
+static void add_flat ( tessellator *ts, breakpoint *bp, double chain_time, double start, double end )
+{
+    piece p = { bp, start, end, chain_time, 0 };
+
+    add_piece ( ts, &p );
+}
+
+/* The chain up to the end of the loop, or all of it */
+static void add_chain ( tessellator *ts )
+{
+    envelope *env = ts->env;
+    breakpoint *bp = env->first, *stop = env->loop != LOOP_OFF ? env->loopEnd : NULL;
+    env_cursor cursor;
+
+    add_flat ( ts, bp, bp->time, -INFINITY, bp->time );
+
+    /* A view of a long envelope starts from the segment it opens on rather than the beginning of the chain */
+    if ( ts->start > bp->time )
+    {
+        env_cursor_init ( &cursor, env );
+        env_cursor_value_at ( &cursor, stop ? fmin ( ts->start, stop->time ) : ts->start );
+        bp = cursor.current;
+    }
+
+    for ( ; bp->next && bp != stop && bp->time <= ts->end; bp = bp->next )
+    {
+        if ( bp->next->time >= ts->start )
+        {
+            add_segment ( ts, bp, 0, 1 );
+        }
+    }
+
+    if ( !stop )
+    {
+        add_flat ( ts, bp, bp->time, bp->time, INFINITY );
+    }
+}
+
+/* Every time round the loop that the range reaches */
+static void add_loop ( tessellator *ts )
+{
+    envelope *env = ts->env;
+    breakpoint *bp, **segments = NULL;
+    double loopStart = env->loopStart->time, loopEnd = env->loopEnd->time, length = loopEnd - loopStart, offset;
+    long k;
+    int i, n = 0, capacity = 0;
+
+    if ( length <= 0 )
+    {
+        add_flat ( ts, env->loopEnd, loopEnd, loopEnd, INFINITY );
+        return;
+    }
+
+    for ( bp = env->loopStart; bp != env->loopEnd; bp = bp->next )
+    {
+        if ( n == capacity )
+        {
+            capacity = capacity ? 2 * capacity : 16;
+            segments = realloc ( segments, capacity * sizeof ( breakpoint* ) );
+        }
+
+        segments [ n++ ] = bp;
+    }
+
+    if ( env->loop == LOOP_PING_PONG )
+    {
+        /* Back from the end of the loop, then forwards from its start */
+        for ( k = (long) fmax ( 0, floor ( ( ts->start - loopEnd ) / ( 2 * length ) ) );
+              loopEnd + 2 * k * length < ts->end; k++ )
+        {
+            offset = loopEnd + 2 * k * length;
+
+            for ( i = n - 1; i >= 0; i-- )
+            {
+                add_segment ( ts, segments [ i ], offset + loopEnd, -1 );
+            }
+
+            for ( i = 0; i < n; i++ )
+            {
+                add_segment ( ts, segments [ i ], offset + length - loopStart, 1 );
+            }
+        }
+    }
+    else
+    {
+        for ( k = (long) fmax ( 0, floor ( ( ts->start - loopEnd ) / length ) ); loopEnd + k * length < ts->end; k++ )
+        {
+            for ( i = 0; i < n; i++ )
+            {
+                add_segment ( ts, segments [ i ], loopEnd + k * length - loopStart, 1 );
+            }
+        }
+    }
+
+    free ( segments );
+}
+
+int tessellate_envelope ( envelope *env, double start, double end, float left, float top, float width,
+                          float height, float tolerance, env_polyline *line )
+{
+    tessellator ts = { 0 };
+    double t, step;
+    int i, columns;
+
+    line->n = 0;
+
+    if ( !env->first || !( end > start ) )
+    {
+        return 0;
+    }
+
+    ts.env       = env;
+    ts.line      = line;
+    ts.start     = start;
+    ts.end       = end;
+    ts.left      = left;
+    ts.top       = top;
+    ts.xScale    = width / ( end - start );
+    ts.yScale    = env->maxVal > env->minVal ? height / ( env->maxVal - env->minVal ) : 0;
+    ts.tolerance = tolerance / 3;
+
+    if ( env->type == ADSR )
+    {
+        /* Its gate decides where it is, so it is sampled as plot_envelope samples it */
+        columns = (int) ceilf ( width );
+        step    = ( end - start ) / columns;
+
+        for ( i = 0; i <= columns; i++ )
+        {
+            t = i < columns ? start + i * step : end;
+            add_point ( &ts, pixel_x ( &ts, t ), pixel_y ( &ts, value_at ( env, t ) ) );
+        }
+    }
+    else
+    {
+        add_chain ( &ts );
+
+        if ( env->loop != LOOP_OFF )
+        {
+            add_loop ( &ts );
+        }
+    }
+
+    flush_column ( &ts );
+
+    if ( ts.pending )
+    {
+        push_vertex ( line, ts.px, ts.py );
+    }
+
+    return line->n;
+}
+
+void free_polyline ( env_polyline *line )
+{
+    free ( line->points );
+
+    line->points   = NULL;
+    line->n        = 0;
+    line->capacity = 0;
+}
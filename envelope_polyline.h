@@ -0,0 +1,88 @@
+
+/**
+ * envelope_polyline.h
+ *
+ * Traces envelopes as polylines in pixels, for drawing with ImDrawList::AddPolyline and for vector exports.
+ *
+ * Rather than a vertex for every column, linear segments are given their end points and nearest neighbour segments
+ * their steps, while curved segments are halved until the middle of each piece is within tolerance of a straight line.
+ * Points are then gathered into columns a fraction of a pixel wide, keeping the first, last, lowest and highest of
+ * each, and vertices within tolerance of the line through their neighbours are dropped. Long straight runs come down
+ * to their corners and dense recordings zoomed out to at most four vertices a column.
+ *
+ *  LICENSE:
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#ifndef ENVELOPE_ENVELOPE_POLYLINE_H
+#define ENVELOPE_ENVELOPE_POLYLINE_H
+
+#include "envelope.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The most times a curved segment is halved, so a user defined interpolation with a jump in it can't run away
+ */
+#define POLYLINE_MAX_DEPTH 16
+
+/**
+ * A polyline, zero initialise it and reuse it between traces to keep its memory
+ */
+typedef struct env_polyline
+{
+    /**
+     * n x, y pairs, laid out as an array of ImVec2
+     */
+    float *points;
+    int   n;
+    int   capacity;
+} env_polyline;
+
+/***********************************************************************
+ * Traces the envelope between two times as a polyline. Loops are
+ * followed as value_at follows them. ADSR_envelopes are sampled once a
+ * pixel through value_at, which moves their cursor
+ *
+ * @param env
+ * @param start  The time at the left edge
+ * @param end    The time at the right edge, after start
+ * @param left   The x of the left edge in pixels
+ * @param top    The y of the top edge in pixels
+ * @param width
+ * @param height maxVal is drawn at the top and minVal at the bottom,
+ * y goes down the screen as it does for ImGui and SVG
+ * @param tolerance How far in pixels the line may stray from the
+ * envelope, above 0
+ * @param line   Overwritten with the vertices
+ * @return the number of vertices
+ ***********************************************************************/
+int    tessellate_envelope ( envelope *env, double start, double end, float left, float top, float width,
+                             float height, float tolerance, env_polyline *line );
+
+/**
+ * Frees a polyline's vertices, leaving it empty for reuse
+ */
+void   free_polyline ( env_polyline *line );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ENVELOPE_ENVELOPE_POLYLINE_H
@@ -0,0 +1,311 @@
+
+/**
+ * envelope_pool.c Copyright Tom Merchant (mailto:tom@tmerchant.com) 2019
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "envelope_pool.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct pool_entry
+{
+    envelope          *env;
+    uint64_t          hash;
+    int               refs;
+    /**
+     * What env takes, counting each breakpoint and any parameters that aren't inline
+     */
+    size_t            bytes;
+    struct pool_entry *next;
+    /**
+     * The next entry in the same bucket of envBuckets
+     */
+    struct pool_entry *envNext;
+} pool_entry;
+
+struct envelope_pool
+{
+    /**
+     * Entries by the hash of their contents, for interning, and by their envelope, for releasing. The contents of an
+     * envelope may have been changed by the time it is released, so it can't be found by them
+     */
+    pool_entry **buckets;
+    pool_entry **envBuckets;
+    int        nBuckets;
+    int        shapes;
+    int        references;
+    size_t     bytes;
+    size_t     bytesSaved;
+};
+
+static uint64_t hash_word ( uint64_t hash, uint64_t word )
+{
+    hash ^= word;
+    hash *= 0x9E3779B97F4A7C15ull;
+
+    return hash ^ ( hash >> 32 );
+}
+
+/* Numerically equal values hash the same, so 0 and -0 are folded together */
+static uint64_t hash_double ( uint64_t hash, double v )
+{
+    uint64_t word;
+
+    v = v == 0 ? 0 : v;
+    memcpy ( &word, &v, sizeof ( word ) );
+
+    return hash_word ( hash, word );
+}
+
+static uint64_t hash_pointer ( const envelope *env )
+{
+    return hash_word ( 0, (uint64_t) (uintptr_t) env );
+}
+
+static uint64_t hash_envelope ( const envelope *env, size_t *bytes )
+{
+    const breakpoint *bp;
+    uint64_t hash = hash_word ( 0, (uint64_t) env->loop );
+    int i, n = 0;
+
+    *bytes = sizeof ( envelope );
+
+    if ( env->scaled )
+    {
+        hash = hash_double ( hash_double ( hash, env->gain ), env->offset );
+    }
+
+    for ( bp = env->first; bp; bp = bp->next, n++ )
+    {
+        hash = hash_double ( hash_double ( hash, bp->time ), bp->value );
+        hash = hash_word ( hash, (uint64_t) bp->interpType << 32 | (uint32_t) bp->nInterp_params );
+
+        for ( i = 0; i < bp->nInterp_params; i++ )
+        {
+            hash = hash_double ( hash, INTERP_PARAMS ( bp ) [ i ] );
+        }
+
+        if ( env->loop != LOOP_OFF && ( bp == env->loopStart || bp == env->loopEnd ) )
+        {
+            hash = hash_word ( hash, (uint64_t) n );
+        }
+
+        *bytes += sizeof ( breakpoint );
+
+        if ( bp->nInterp_params > BP_INLINE_PARAMS )
+        {
+            *bytes += bp->nInterp_params * sizeof ( double );
+        }
+    }
+
+    return hash;
+}
+
+/* Whether two envelopes have the same breakpoints, loop and scaling */
+static int same_envelope ( const envelope *a, const envelope *b )
+{
+    const breakpoint *p, *q;
+    int i;
+
+    if ( a->type != SIMPLE || b->type != SIMPLE || a->loop != b->loop || a->scaled != b->scaled ||
+         ( a->scaled && ( a->gain != b->gain || a->offset != b->offset ) ) )
+    {
+        return 0;
+    }
+
+    for ( p = a->first, q = b->first; p && q; p = p->next, q = q->next )
+    {
+        if ( p->time != q->time || p->value != q->value || p->interpType != q->interpType ||
+             p->nInterp_params != q->nInterp_params ||
+             ( p == a->loopStart ) != ( q == b->loopStart ) || ( p == a->loopEnd ) != ( q == b->loopEnd ) )
+        {
+            return 0;
+        }
+
+        for ( i = 0; i < p->nInterp_params; i++ )
+        {
+            if ( INTERP_PARAMS ( p ) [ i ] != INTERP_PARAMS ( q ) [ i ] )
+            {
+                return 0;
+            }
+        }
+    }
+
+    return !p && !q;
+}
+
+static void grow_buckets ( envelope_pool *pool )
+{
+    pool_entry **buckets, **envBuckets, *entry, *next;
+    int i, n = pool->nBuckets ? 2 * pool->nBuckets : 64;
+
+    buckets    = calloc ( n, sizeof ( pool_entry* ) );
+    envBuckets = calloc ( n, sizeof ( pool_entry* ) );
+
+    for ( i = 0; i < pool->nBuckets; i++ )
+    {
+        for ( entry = pool->buckets [ i ]; entry; entry = next )
+        {
+            next = entry->next;
+            entry->next = buckets [ entry->hash % n ];
+            buckets [ entry->hash % n ] = entry;
+
+            entry->envNext = envBuckets [ hash_pointer ( entry->env ) % n ];
+            envBuckets [ hash_pointer ( entry->env ) % n ] = entry;
+        }
+    }
+
+    free ( pool->buckets );
+    free ( pool->envBuckets );
+    pool->buckets    = buckets;
+    pool->envBuckets = envBuckets;
+    pool->nBuckets   = n;
+}
+
+envelope_pool* create_envelope_pool ( void )
+{
+    envelope_pool *pool = calloc ( 1, sizeof ( envelope_pool ) );
+
+    grow_buckets ( pool );
+
+    return pool;
+}
+
+void free_envelope_pool ( envelope_pool *pool )
+{
+    pool_entry *entry, *next;
+    int i;
+
+    for ( i = 0; i < pool->nBuckets; i++ )
+    {
+        for ( entry = pool->buckets [ i ]; entry; entry = next )
+        {
+            next = entry->next;
+            free_env ( entry->env );
+            free ( entry );
+        }
+    }
+
+    free ( pool->buckets );
+    free ( pool->envBuckets );
+    free ( pool );
+}
+
+envelope* envelope_pool_intern ( envelope_pool *pool, envelope *env )
+{
+    pool_entry *entry;
+    size_t bytes;
+    uint64_t hash = hash_envelope ( env, &bytes );
+
+    for ( entry = pool->buckets [ hash % pool->nBuckets ]; entry; entry = entry->next )
+    {
+        if ( entry->hash == hash && same_envelope ( entry->env, env ) )
+        {
+            free_env ( env );
+
+            entry->refs++;
+            pool->references++;
+            pool->bytesSaved += entry->bytes;
+
+            return entry->env;
+        }
+    }
+
+    if ( pool->shapes >= pool->nBuckets )
+    {
+        grow_buckets ( pool );
+    }
+
+    entry        = calloc ( 1, sizeof ( pool_entry ) );
+    entry->env   = env;
+    entry->hash  = hash;
+    entry->refs  = 1;
+    entry->bytes = bytes;
+    entry->next  = pool->buckets [ hash % pool->nBuckets ];
+    pool->buckets [ hash % pool->nBuckets ] = entry;
+
+    entry->envNext = pool->envBuckets [ hash_pointer ( env ) % pool->nBuckets ];
+    pool->envBuckets [ hash_pointer ( env ) % pool->nBuckets ] = entry;
+
+    pool->shapes++;
+    pool->references++;
+    pool->bytes += bytes;
+
+    return env;
+}
+
+envelope* envelope_pool_load ( envelope_pool *pool, const char *file )
+{
+    envelope *env = calloc ( 1, sizeof ( envelope ) );
+
+    if ( load_breakpoints ( file, env ) )
+    {
+        free_env ( env );
+        return NULL;
+    }
+
+    return envelope_pool_intern ( pool, env );
+}
+
+void envelope_pool_release ( envelope_pool *pool, envelope *env )
+{
+    pool_entry **envLink, **link, *entry;
+
+    for ( envLink = &pool->envBuckets [ hash_pointer ( env ) % pool->nBuckets ]; *envLink;
+          envLink = &(*envLink)->envNext )
+    {
+        if ( (*envLink)->env == env )
+        {
+            break;
+        }
+    }
+
+    entry = *envLink;
+
+    if ( ! entry )
+    {
+        return;
+    }
+
+    pool->references--;
+
+    if ( --entry->refs > 0 )
+    {
+        pool->bytesSaved -= entry->bytes;
+        return;
+    }
+
+    /* Unlinked by the hash it was interned with */
+    for ( link = &pool->buckets [ entry->hash % pool->nBuckets ]; *link != entry; link = &(*link)->next );
+
+    *link    = entry->next;
+    *envLink = entry->envNext;
+    pool->shapes--;
+    pool->bytes -= entry->bytes;
+
+    free_env ( env );
+    free ( entry );
+}
+
+void envelope_pool_get_stats ( const envelope_pool *pool, envelope_pool_stats *stats )
+{
+    stats->shapes     = pool->shapes;
+    stats->references = pool->references;
+    stats->bytes      = pool->bytes;
+    stats->bytesSaved = pool->bytesSaved;
+}
@@ -0,0 +1,101 @@
+
+/**
+ * envelope_pool.h
+ *
+ * Shares envelopes with the same contents, for preset libraries where many presets use the same shapes.
+ *
+ * Envelopes put in a pool are hashed on their breakpoints, loop and scaling. One that matches an envelope already
+ * there is freed and the one already there is handed back instead, with its count of references raised.
+ *
+ * Pooled envelopes mustn't be changed, every holder would see the change, copy_envelope one to make changes. Read them
+ * through an env_cursor of your own rather than value_at, integral or the crossing searches, which move the envelope's
+ * cursor and build its caches, so that holders on other threads don't write to it at once.
+ *
+ *  LICENSE:
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#ifndef ENVELOPE_ENVELOPE_POOL_H
+#define ENVELOPE_ENVELOPE_POOL_H
+
+#include <stddef.h>
+#include "envelope.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct envelope_pool envelope_pool;
+
+typedef struct envelope_pool_stats
+{
+    /**
+     * The different envelopes held
+     */
+    int    shapes;
+    /**
+     * The envelopes handed out and not yet released
+     */
+    int    references;
+    /**
+     * The memory the pool's envelopes take, and what unshared copies of every reference would have taken on top
+     */
+    size_t bytes;
+    size_t bytesSaved;
+} envelope_pool_stats;
+
+/**
+ * Creates an empty pool, free it with free_envelope_pool
+ */
+envelope_pool* create_envelope_pool ( void );
+
+/**
+ * Frees the pool and every envelope in it, whether or not they have been released
+ */
+void   free_envelope_pool ( envelope_pool *pool );
+
+/***********************************************************************
+ * Puts an envelope in the pool. ADSR_envelopes, which carry the state
+ * of their gate, aren't shared and are handed back as they are
+ *
+ * @param pool
+ * @param env an envelope the pool takes ownership of, it is freed if
+ * the pool already holds one the same
+ * @return the pool's envelope, release it with envelope_pool_release
+ ***********************************************************************/
+envelope* envelope_pool_intern ( envelope_pool *pool, envelope *env );
+
+/***********************************************************************
+ * Loads a .bp file as load_breakpoints does and puts it in the pool
+ *
+ * @return the pool's envelope, NULL if the file couldn't be loaded
+ ***********************************************************************/
+envelope* envelope_pool_load ( envelope_pool *pool, const char *file );
+
+/***********************************************************************
+ * Gives back an envelope from the pool, which frees it once every
+ * reference to it has been released
+ ***********************************************************************/
+void   envelope_pool_release ( envelope_pool *pool, envelope *env );
+
+void   envelope_pool_get_stats ( const envelope_pool *pool, envelope_pool_stats *stats );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ENVELOPE_ENVELOPE_POOL_H
@@ -0,0 +1,763 @@
+
+/**
+ * envelope_render renders envelopes to audio rate sample data, or draws them as SVG, without the editor
+ *
+ * usage: envelope_render [options] <file.bp | directory> ...
+ *        envelope_render [options] --adsr A,D,S,R
+ */
+
+#include "envelope.h"
+#include "envelope_polyline.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+/* Samples rendered by each job, big enough that copying the envelope for a worker doesn't matter */
+#define RENDER_CHUNK_SAMPLES 65536
+
+typedef enum output_format
+{
+    FORMAT_F32 = 0,
+    FORMAT_WAV = 1,
+    FORMAT_CSV = 2,
+    FORMAT_SVG = 3
+} output_format;
+
+/**
+ * A note for an ADSR envelope, the envelope is triggered at on and released at off
+ */
+typedef struct gate
+{
+    double on;
+    double off;
+} gate;
+
+typedef struct render_options
+{
+    double rate = 48000;
+    double duration = 0;
+    double simplify = -1;
+    output_format format = FORMAT_WAV;
+    std::string output;
+    int threads = 0;
+    bool quiet = false;
+    bool help = false;
+    double size [ 2 ] = { 1024, 256 };
+    double tolerance = 0.25;
+    bool adsr = false;
+    double adsrParams [ 4 ];
+    std::vector<gate> gates;
+    std::vector<std::string> inputs;
+} render_options;
+
+/**
+ * A fixed set of worker threads, jobs are given the index of the worker running them
+ */
+typedef struct render_pool
+{
+    std::vector<std::thread> workers;
+    std::deque<std::function<void ( int )>> jobs;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    int running = 0;
+    bool stop = false;
+} render_pool;
+
+static void pool_worker ( render_pool *pool, int index )
+{
+    std::function<void ( int )> job;
+
+    for ( ;; )
+    {
+        {
+            std::unique_lock<std::mutex> guard ( pool->lock );
+
+            pool->wake.wait ( guard, [pool] { return pool->stop || ! pool->jobs.empty ( ); } );
+
+            if ( pool->jobs.empty ( ) )
+            {
+                return;
+            }
+
+            job = std::move ( pool->jobs.front ( ) );
+            pool->jobs.pop_front ( );
+            pool->running++;
+        }
+
+        job ( index );
+
+        std::lock_guard<std::mutex> guard ( pool->lock );
+
+        if ( --pool->running == 0 && pool->jobs.empty ( ) )
+        {
+            pool->idle.notify_all ( );
+        }
+    }
+}
+
+static void pool_start ( render_pool *pool, int threads )
+{
+    int i;
+
+    for ( i = 0; i < threads; i++ )
+    {
+        pool->workers.emplace_back ( pool_worker, pool, i );
+    }
+}
+
+static void pool_submit ( render_pool *pool, std::function<void ( int )> job )
+{
+    {
+        std::lock_guard<std::mutex> guard ( pool->lock );
+        pool->jobs.push_back ( std::move ( job ) );
+    }
+
+    pool->wake.notify_one ( );
+}
+
+static void pool_wait ( render_pool *pool )
+{
+    std::unique_lock<std::mutex> guard ( pool->lock );
+
+    pool->idle.wait ( guard, [pool] { return pool->running == 0 && pool->jobs.empty ( ); } );
+}
+
+static void pool_stop ( render_pool *pool )
+{
+    {
+        std::lock_guard<std::mutex> guard ( pool->lock );
+        pool->stop = true;
+    }
+
+    pool->wake.notify_all ( );
+
+    for ( std::thread &worker : pool->workers )
+    {
+        worker.join ( );
+    }
+
+    pool->workers.clear ( );
+}
+
+/***********************************************************************************************************************
+ * Rendering
+ **********************************************************************************************************************/
+
+/**
+ * Renders samples first to first + count - 1 into out. For an ADSR envelope the gates are followed, each note restarts
+ * the envelope and releases it at the note's off time. env must belong to the calling thread
+ */
+static void render_chunk ( envelope *env, const render_options *opts, long first, long count, float *out )
+{
+    ADSR_envelope *adsr = (ADSR_envelope*) env;
+    double t, on, boundary, releaseAt;
+    long i = first, end = first + count, n;
+    size_t note;
+    bool released;
+
+    if ( env->type != ADSR || opts->gates.empty ( ) )
+    {
+        render_block ( env, first / opts->rate, 1 / opts->rate, (int) count, out );
+        return;
+    }
+
+    while ( i < end )
+    {
+        t = i / opts->rate;
+
+        /* The gates are sorted on their on times so the current note is the last one to have started */
+        note = std::upper_bound ( opts->gates.begin ( ), opts->gates.end ( ), t,
+                [] ( double time, const gate &g ) { return time < g.on; } ) - opts->gates.begin ( );
+
+        if ( note == 0 )
+        {
+            /* Before the first note, hold the envelope at its start */
+            on        = opts->gates [ 0 ].on;
+            boundary  = on;
+            released  = false;
+            releaseAt = 0;
+        }
+        else
+        {
+            const gate &g = opts->gates [ note - 1 ];
+
+            on        = g.on;
+            releaseAt = g.off - g.on;
+            released  = t >= g.off;
+            boundary  = note < opts->gates.size ( ) ? opts->gates [ note ].on : INFINITY;
+
+            if ( ! released )
+            {
+                boundary = fmin ( boundary, g.off );
+            }
+        }
+
+        if ( adsr->released && ( ! released || adsr->_t != releaseAt ) )
+        {
+            ADSR_reset ( adsr );
+        }
+
+        if ( released && ! adsr->released )
+        {
+            ADSR_release ( adsr, releaseAt );
+        }
+
+        n = std::isinf ( boundary ) ? end - i : std::min ( end, (long) ceil ( boundary * opts->rate ) ) - i;
+        n = std::max ( n, 1L );
+
+        render_block ( env, t - on, 1 / opts->rate, (int) n, out + ( i - first ) );
+
+        i += n;
+    }
+}
+
+/**
+ * Renders the whole of env into samples, splitting it into chunks across the pool
+ */
+static void render_envelope ( render_pool *pool, envelope *env, const render_options *opts,
+                              std::vector<float> &samples )
+{
+    std::vector<envelope*> copies ( pool->workers.size ( ), NULL );
+    long first, total = (long) samples.size ( );
+
+    for ( first = 0; first < total; first += RENDER_CHUNK_SAMPLES )
+    {
+        pool_submit ( pool, [env, opts, first, total, &copies, &samples] ( int worker )
+        {
+            /* Rendering moves the cursor and an ADSR's gate state, so each worker has its own copy */
+            if ( ! copies [ worker ] )
+            {
+                copies [ worker ] = copy_envelope ( env );
+            }
+
+            render_chunk ( copies [ worker ], opts, first, std::min ( (long) RENDER_CHUNK_SAMPLES, total - first ),
+                           &samples [ first ] );
+        } );
+    }
+
+    pool_wait ( pool );
+
+    for ( envelope *copy : copies )
+    {
+        if ( copy )
+        {
+            free_env ( copy );
+        }
+    }
+}
+
+/***********************************************************************************************************************
+ * Output
+ **********************************************************************************************************************/
+
+static void put_u16 ( FILE *file, uint16_t v )
+{
+    uint8_t bytes [ 2 ] = { (uint8_t) v, (uint8_t) ( v >> 8 ) };
+    fwrite ( bytes, 1, 2, file );
+}
+
+static void put_u32 ( FILE *file, uint32_t v )
+{
+    uint8_t bytes [ 4 ] = { (uint8_t) v, (uint8_t) ( v >> 8 ), (uint8_t) ( v >> 16 ), (uint8_t) ( v >> 24 ) };
+    fwrite ( bytes, 1, 4, file );
+}
+
+static void put_f32 ( FILE *file, const std::vector<float> &samples )
+{
+    uint32_t bits;
+
+    for ( float sample : samples )
+    {
+        memcpy ( &bits, &sample, sizeof ( bits ) );
+        put_u32 ( file, bits );
+    }
+}
+
+/* Mono 32 bit IEEE float WAV */
+static void write_wav ( FILE *file, const std::vector<float> &samples, double rate )
+{
+    uint32_t dataSize = (uint32_t) ( samples.size ( ) * 4 );
+
+    fwrite ( "RIFF", 1, 4, file );
+    put_u32 ( file, 4 + 26 + 12 + 8 + dataSize );
+    fwrite ( "WAVE", 1, 4, file );
+
+    fwrite ( "fmt ", 1, 4, file );
+    put_u32 ( file, 18 );
+    put_u16 ( file, 3 );
+    put_u16 ( file, 1 );
+    put_u32 ( file, (uint32_t) rate );
+    put_u32 ( file, (uint32_t) rate * 4 );
+    put_u16 ( file, 4 );
+    put_u16 ( file, 32 );
+    put_u16 ( file, 0 );
+
+    fwrite ( "fact", 1, 4, file );
+    put_u32 ( file, 4 );
+    put_u32 ( file, (uint32_t) samples.size ( ) );
+
+    fwrite ( "data", 1, 4, file );
+    put_u32 ( file, dataSize );
+    put_f32 ( file, samples );
+}
+
+static void write_csv ( FILE *file, const std::vector<float> &samples, double rate )
+{
+    size_t i;
+
+    fprintf ( file, "time,value\n" );
+
+    for ( i = 0; i < samples.size ( ); i++ )
+    {
+        fprintf ( file, "%.9g,%.9g\n", i / rate, samples [ i ] );
+    }
+}
+
+/* The envelope as a line stretched over the picture, maxVal at the top and minVal at the bottom */
+static void write_svg ( FILE *file, const env_polyline *line, const render_options *opts )
+{
+    int i;
+
+    fprintf ( file, "<svg xmlns=\"http://www.w3.org/2000/svg\" width=\"%g\" height=\"%g\" viewBox=\"0 0 %g %g\">\n",
+              opts->size [ 0 ], opts->size [ 1 ], opts->size [ 0 ], opts->size [ 1 ] );
+    fprintf ( file, "<polyline fill=\"none\" stroke=\"black\" stroke-width=\"1\" points=\"" );
+
+    for ( i = 0; i < line->n; i++ )
+    {
+        fprintf ( file, "%s%.2f,%.2f", i ? " " : "", line->points [ 2 * i ], line->points [ 2 * i + 1 ] );
+    }
+
+    fprintf ( file, "\"/>\n</svg>\n" );
+}
+
+static int write_output ( const std::string &path, const std::vector<float> &samples, const env_polyline *line,
+                          const render_options *opts )
+{
+    FILE *file = fopen ( path.c_str ( ), opts->format == FORMAT_CSV || opts->format == FORMAT_SVG ? "w" : "wb" );
+    int error;
+
+    if ( ! file )
+    {
+        fprintf ( stderr, "envelope_render: can't write %s\n", path.c_str ( ) );
+        return -1;
+    }
+
+    switch ( opts->format )
+    {
+        case FORMAT_F32:
+            put_f32 ( file, samples );
+            break;
+        case FORMAT_WAV:
+            write_wav ( file, samples, opts->rate );
+            break;
+        case FORMAT_CSV:
+            write_csv ( file, samples, opts->rate );
+            break;
+        case FORMAT_SVG:
+            write_svg ( file, line, opts );
+            break;
+    }
+
+    error = ferror ( file );
+
+    if ( fclose ( file ) != 0 || error )
+    {
+        fprintf ( stderr, "envelope_render: error writing %s\n", path.c_str ( ) );
+        return -1;
+    }
+
+    return 0;
+}
+
+static std::string output_path ( const render_options *opts, const std::string &input, size_t nInputs )
+{
+    static const char *extensions [ ] = { ".f32", ".wav", ".csv", ".svg" };
+    std::filesystem::path path ( input );
+    std::error_code error;
+
+    path.replace_extension ( extensions [ opts->format ] );
+
+    if ( opts->output.empty ( ) )
+    {
+        return path.string ( );
+    }
+
+    if ( nInputs == 1 && ! std::filesystem::is_directory ( opts->output, error ) )
+    {
+        return opts->output;
+    }
+
+    return ( std::filesystem::path ( opts->output ) / path.filename ( ) ).string ( );
+}
+
+/***********************************************************************************************************************
+ * Command line
+ **********************************************************************************************************************/
+
+static void usage ( )
+{
+    fprintf ( stderr,
+        "usage: envelope_render [options] <file.bp | directory> ...\n"
+        "       envelope_render [options] --adsr A,D,S,R\n"
+        "\n"
+        "  -r, --rate HZ             sample rate, default 48000\n"
+        "  -d, --duration SECONDS    length to render, defaults to the length of each envelope\n"
+        "  -f, --format FORMAT       f32 raw little endian float32, wav float WAV, csv time,value CSV\n"
+        "                            or svg line drawing, default wav\n"
+        "  -s, --simplify ERROR      remove breakpoints first, moving the envelope by no more than ERROR\n"
+        "  -o, --output PATH         output file, or directory when rendering several files\n"
+        "  -j, --threads N           worker threads, defaults to the number of cores\n"
+        "      --size WxH            the size of svg pictures in pixels, default 1024x256\n"
+        "      --tolerance PX        how far an svg line may stray from the envelope, default 0.25\n"
+        "  -q, --quiet               only report errors\n"
+        "  -h, --help                show this message\n"
+        "      --adsr A,D,S,R        render an ADSR envelope instead of files\n"
+        "      --gate ON:OFF,...     note on and off times in seconds for --adsr, default 0:A+D\n" );
+}
+
+static bool parse_doubles ( const char *arg, char separator, double *values, int n )
+{
+    char *end;
+    int i;
+
+    for ( i = 0; i < n; i++ )
+    {
+        values [ i ] = strtod ( arg, &end );
+
+        if ( end == arg || ( i < n - 1 && *end != separator ) )
+        {
+            return false;
+        }
+
+        arg = end + 1;
+    }
+
+    return *end == '\0' || *end == ',';
+}
+
+static bool parse_gates ( const char *arg, std::vector<gate> &gates )
+{
+    double times [ 2 ];
+    const char *next;
+
+    while ( arg )
+    {
+        if ( ! parse_doubles ( arg, ':', times, 2 ) || times [ 1 ] <= times [ 0 ] )
+        {
+            return false;
+        }
+
+        gates.push_back ( { times [ 0 ], times [ 1 ] } );
+
+        next = strchr ( arg, ',' );
+        arg  = next ? next + 1 : NULL;
+    }
+
+    std::sort ( gates.begin ( ), gates.end ( ), [] ( const gate &a, const gate &b ) { return a.on < b.on; } );
+
+    return true;
+}
+
+static bool parse_args ( int argc, char **argv, render_options *opts )
+{
+    int i;
+
+    for ( i = 1; i < argc; i++ )
+    {
+        std::string arg = argv [ i ];
+        const char *value = i + 1 < argc ? argv [ i + 1 ] : NULL;
+
+        if ( arg == "-q" || arg == "--quiet" )
+        {
+            opts->quiet = true;
+            continue;
+        }
+
+        if ( arg == "-h" || arg == "--help" )
+        {
+            opts->help = true;
+            return true;
+        }
+
+        if ( arg [ 0 ] != '-' )
+        {
+            opts->inputs.push_back ( arg );
+            continue;
+        }
+
+        if ( ! value )
+        {
+            fprintf ( stderr, "envelope_render: %s needs a value\n", arg.c_str ( ) );
+            return false;
+        }
+
+        i++;
+
+        if ( arg == "-r" || arg == "--rate" )
+        {
+            opts->rate = atof ( value );
+        }
+        else if ( arg == "-d" || arg == "--duration" )
+        {
+            opts->duration = atof ( value );
+        }
+        else if ( arg == "-s" || arg == "--simplify" )
+        {
+            opts->simplify = atof ( value );
+        }
+        else if ( arg == "-o" || arg == "--output" )
+        {
+            opts->output = value;
+        }
+        else if ( arg == "-j" || arg == "--threads" )
+        {
+            opts->threads = atoi ( value );
+        }
+        else if ( arg == "-f" || arg == "--format" )
+        {
+            if ( strcmp ( value, "f32" ) == 0 )      opts->format = FORMAT_F32;
+            else if ( strcmp ( value, "wav" ) == 0 ) opts->format = FORMAT_WAV;
+            else if ( strcmp ( value, "csv" ) == 0 ) opts->format = FORMAT_CSV;
+            else if ( strcmp ( value, "svg" ) == 0 ) opts->format = FORMAT_SVG;
+            else
+            {
+                fprintf ( stderr, "envelope_render: unknown format %s\n", value );
+                return false;
+            }
+        }
+        else if ( arg == "--size" )
+        {
+            if ( ! parse_doubles ( value, 'x', opts->size, 2 ) || opts->size [ 0 ] <= 0 || opts->size [ 1 ] <= 0 )
+            {
+                fprintf ( stderr, "envelope_render: --size expects WIDTHxHEIGHT\n" );
+                return false;
+            }
+        }
+        else if ( arg == "--tolerance" )
+        {
+            opts->tolerance = atof ( value );
+        }
+        else if ( arg == "--adsr" )
+        {
+            opts->adsr = true;
+
+            if ( ! parse_doubles ( value, ',', opts->adsrParams, 4 ) )
+            {
+                fprintf ( stderr, "envelope_render: --adsr expects attack,decay,sustain,release\n" );
+                return false;
+            }
+        }
+        else if ( arg == "--gate" )
+        {
+            if ( ! parse_gates ( value, opts->gates ) )
+            {
+                fprintf ( stderr, "envelope_render: --gate expects on:off[,on:off...]\n" );
+                return false;
+            }
+        }
+        else
+        {
+            fprintf ( stderr, "envelope_render: unknown option %s\n", arg.c_str ( ) );
+            return false;
+        }
+    }
+
+    if ( opts->rate <= 0 )
+    {
+        fprintf ( stderr, "envelope_render: the sample rate must be positive\n" );
+        return false;
+    }
+
+    if ( opts->tolerance <= 0 )
+    {
+        fprintf ( stderr, "envelope_render: the tolerance must be positive\n" );
+        return false;
+    }
+
+    /* An ADSR is only defined by its gates, which a picture has no way to show */
+    if ( opts->adsr && opts->format == FORMAT_SVG )
+    {
+        fprintf ( stderr, "envelope_render: svg can't be used with --adsr\n" );
+        return false;
+    }
+
+    if ( opts->adsr == ! opts->inputs.empty ( ) )
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/* Expands directories into the .bp files they contain */
+static std::vector<std::string> collect_inputs ( const std::vector<std::string> &inputs )
+{
+    std::vector<std::string> files, folder;
+    std::error_code error;
+
+    for ( const std::string &input : inputs )
+    {
+        if ( ! std::filesystem::is_directory ( input, error ) )
+        {
+            files.push_back ( input );
+            continue;
+        }
+
+        folder.clear ( );
+
+        for ( const auto &entry : std::filesystem::directory_iterator ( input, error ) )
+        {
+            if ( entry.is_regular_file ( error ) && entry.path ( ).extension ( ) == ".bp" )
+            {
+                folder.push_back ( entry.path ( ).string ( ) );
+            }
+        }
+
+        std::sort ( folder.begin ( ), folder.end ( ) );
+        files.insert ( files.end ( ), folder.begin ( ), folder.end ( ) );
+    }
+
+    return files;
+}
+
+int main ( int argc, char **argv )
+{
+    render_options opts;
+    render_pool pool;
+    std::vector<std::string> files;
+    std::vector<float> samples;
+    env_polyline line = { NULL, 0, 0 };
+    envelope *env;
+    double duration, seconds, totalSeconds = 0;
+    long totalSamples = 0;
+    size_t i;
+    int status = 0, removed;
+
+    if ( ! parse_args ( argc, argv, &opts ) )
+    {
+        usage ( );
+        return 2;
+    }
+
+    if ( opts.help )
+    {
+        usage ( );
+        return 0;
+    }
+
+    if ( opts.threads <= 0 )
+    {
+        opts.threads = std::max ( 1u, std::thread::hardware_concurrency ( ) );
+    }
+
+    files = opts.adsr ? std::vector<std::string> { "adsr" } : collect_inputs ( opts.inputs );
+
+    if ( opts.adsr && opts.gates.empty ( ) )
+    {
+        /* Hold the note until the envelope reaches its sustain level */
+        opts.gates.push_back ( { 0, opts.adsrParams [ 0 ] + opts.adsrParams [ 1 ] } );
+    }
+
+    pool_start ( &pool, opts.threads );
+
+    for ( i = 0; i < files.size ( ); i++ )
+    {
+        if ( opts.adsr )
+        {
+            env = (envelope*) create_ADSR_envelope ( opts.adsrParams [ 0 ], opts.adsrParams [ 1 ],
+                                                     opts.adsrParams [ 2 ], opts.adsrParams [ 3 ] );
+            env->maxTime = opts.gates.back ( ).off + opts.adsrParams [ 3 ];
+        }
+        else
+        {
+            env = (envelope*) calloc ( 1, sizeof ( envelope ) );
+
+            if ( load_breakpoints ( files [ i ].c_str ( ), env ) != 0 || ! env->first )
+            {
+                fprintf ( stderr, "envelope_render: can't load %s\n", files [ i ].c_str ( ) );
+                free_env ( env );
+                status = 1;
+                continue;
+            }
+        }
+
+        if ( opts.simplify >= 0 )
+        {
+            removed = simplify_envelope ( env, opts.simplify );
+
+            if ( ! opts.quiet )
+            {
+                printf ( "%s: removed %d breakpoints\n", files [ i ].c_str ( ), removed );
+            }
+        }
+
+        duration = opts.duration > 0 ? opts.duration : env->maxTime;
+
+        if ( duration <= 0 )
+        {
+            fprintf ( stderr, "envelope_render: %s has no length, use --duration\n", files [ i ].c_str ( ) );
+            free_env ( env );
+            status = 1;
+            continue;
+        }
+
+        auto start = std::chrono::steady_clock::now ( );
+
+        if ( opts.format == FORMAT_SVG )
+        {
+            samples.clear ( );
+            tessellate_envelope ( env, 0, duration, 0, 0, (float) opts.size [ 0 ], (float) opts.size [ 1 ],
+                                  (float) opts.tolerance, &line );
+        }
+        else
+        {
+            samples.assign ( (size_t) ceil ( duration * opts.rate ), 0.0f );
+            render_envelope ( &pool, env, &opts, samples );
+        }
+
+        seconds = std::chrono::duration<double> ( std::chrono::steady_clock::now ( ) - start ).count ( );
+        totalSeconds += seconds;
+        totalSamples += (long) samples.size ( );
+
+        free_env ( env );
+
+        if ( write_output ( output_path ( &opts, files [ i ], files.size ( ) ), samples, &line, &opts ) != 0 )
+        {
+            status = 1;
+            continue;
+        }
+
+        if ( ! opts.quiet && opts.format == FORMAT_SVG )
+        {
+            printf ( "%s: %d vertices in %.3f ms\n", files [ i ].c_str ( ), line.n, seconds * 1000 );
+        }
+        else if ( ! opts.quiet )
+        {
+            printf ( "%s: %zu samples in %.3f ms\n", files [ i ].c_str ( ), samples.size ( ), seconds * 1000 );
+        }
+    }
+
+    pool_stop ( &pool );
+    free_polyline ( &line );
+
+    if ( ! opts.quiet && totalSeconds > 0 && totalSamples > 0 )
+    {
+        printf ( "rendered %ld samples on %d threads at %.0f samples/sec\n", totalSamples, opts.threads,
+                 totalSamples / totalSeconds );
+    }
+
+    return status;
+}
@@ -0,0 +1,384 @@
+
+/**
+ * envelope_search.c Copyright Tom Merchant (mailto:tom@tmerchant.com) 2019
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "envelope_search.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+/**
+ * The number of samples taken across a USER_DEFINED segment when looking for a crossing
+ */
+#define USER_SEGMENT_SAMPLES 64
+
+/* From envelope.c */
+double quadratic_bezier ( double p0, double p1, double p2, double t );
+
+/*
+ * A tree over the segments, each node holding the lowest and highest values reached by the segments below it. The
+ * envelope is continuous apart from jumps that segments cover, so any run of segments whose values span v has a
+ * segment that reaches v
+ */
+typedef struct crossing_index
+{
+    int        n;
+    int        size;
+    breakpoint **bps;
+    double     *times;
+    double     *low;
+    double     *high;
+} crossing_index;
+
+void free_crossing_index ( crossing_index *index )
+{
+    if ( index )
+    {
+        free ( index->bps );
+        free ( index->times );
+        free ( index->low );
+        free ( index->high );
+        free ( index );
+    }
+}
+
+/* The lowest and highest values on the segment from bp */
+static void segment_range ( const breakpoint *bp, double *low, double *high )
+{
+    const breakpoint *next = bp->next;
+    double a, s, v;
+
+    *low  = fmin ( bp->value, next->value );
+    *high = fmax ( bp->value, next->value );
+
+    if ( bp->interpType == QUADRATIC_BEZIER && bp->nInterp_params >= 2 )
+    {
+        /* The value is a quadratic in the curve parameter, which may turn inside the segment */
+        a = bp->value - 2 * INTERP_PARAMS ( bp ) [ 1 ] + next->value;
+        s = a != 0 ? ( bp->value - INTERP_PARAMS ( bp ) [ 1 ] ) / a : -1;
+
+        if ( s > 0 && s < 1 )
+        {
+            v     = quadratic_bezier ( bp->value, INTERP_PARAMS ( bp ) [ 1 ], next->value, s );
+            *low  = fmin ( *low, v );
+            *high = fmax ( *high, v );
+        }
+    }
+    else if ( bp->interpType > EXPONENTIAL )
+    {
+        *low  = -INFINITY;
+        *high = INFINITY;
+    }
+}
+
+static crossing_index* get_crossing_index ( envelope *env )
+{
+    crossing_index *index = env->crossings;
+    breakpoint *bp;
+    int i, n = 0;
+
+    if ( index )
+    {
+        return index;
+    }
+
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        n++;
+    }
+
+    index        = calloc ( 1, sizeof ( crossing_index ) );
+    index->n     = n;
+    index->bps   = malloc ( n * sizeof ( breakpoint* ) );
+    index->times = malloc ( n * sizeof ( double ) );
+
+    for ( index->size = 1; index->size < n - 1; index->size *= 2 );
+
+    index->low  = malloc ( 2 * index->size * sizeof ( double ) );
+    index->high = malloc ( 2 * index->size * sizeof ( double ) );
+
+    for ( bp = env->first, i = 0; bp; bp = bp->next, i++ )
+    {
+        index->bps   [ i ] = bp;
+        index->times [ i ] = bp->time;
+    }
+
+    for ( i = 0; i < index->size; i++ )
+    {
+        if ( i < n - 1 )
+        {
+            segment_range ( index->bps [ i ], &index->low [ index->size + i ], &index->high [ index->size + i ] );
+        }
+        else
+        {
+            index->low  [ index->size + i ] = INFINITY;
+            index->high [ index->size + i ] = -INFINITY;
+        }
+    }
+
+    for ( i = index->size - 1; i > 0; i-- )
+    {
+        index->low  [ i ] = fmin ( index->low  [ 2 * i ], index->low  [ 2 * i + 1 ] );
+        index->high [ i ] = fmax ( index->high [ 2 * i ], index->high [ 2 * i + 1 ] );
+    }
+
+    env->crossings = index;
+
+    return index;
+}
+
+/* The first segment from from on, below node which covers segments l to r - 1, whose values span v. -1 if none do */
+static int first_segment ( const crossing_index *index, int node, int l, int r, int from, double v )
+{
+    int mid, found;
+
+    if ( r <= from || index->low [ node ] > v || index->high [ node ] < v )
+    {
+        return -1;
+    }
+
+    if ( r - l == 1 )
+    {
+        return l;
+    }
+
+    mid   = l + ( r - l ) / 2;
+    found = first_segment ( index, 2 * node, l, mid, from, v );
+
+    return found >= 0 ? found : first_segment ( index, 2 * node + 1, mid, r, from, v );
+}
+
+/* The first time at or after from that a USER_DEFINED segment reaches v, by sampling then bisecting */
+static double sampled_crossing ( breakpoint *bp, double v, double from )
+{
+    double a = fmax ( from, bp->time ), b = bp->next->time, x0 = a, x1, f0, f1, mid;
+    int i, j;
+
+    f0 = interp_functions [ bp->interpType ] ( bp, a ) - v;
+
+    if ( f0 == 0 )
+    {
+        return a;
+    }
+
+    for ( i = 1; i <= USER_SEGMENT_SAMPLES; i++ )
+    {
+        x1 = a + ( b - a ) * i / USER_SEGMENT_SAMPLES;
+        f1 = interp_functions [ bp->interpType ] ( bp, x1 ) - v;
+
+        if ( f1 == 0 || ( f0 < 0 ) != ( f1 < 0 ) )
+        {
+            for ( j = 0; j < 60 && f1 != 0; j++ )
+            {
+                mid = ( x0 + x1 ) / 2;
+
+                if ( ( interp_functions [ bp->interpType ] ( bp, mid ) - v < 0 ) == ( f0 < 0 ) )
+                {
+                    x0 = mid;
+                }
+                else
+                {
+                    x1 = mid;
+                }
+            }
+
+            return x1;
+        }
+
+        x0 = x1;
+        f0 = f1;
+    }
+
+    return NAN;
+}
+
+/* The first time at or after from that the segment from bp reaches v, NAN if it doesn't */
+static double segment_crossing ( breakpoint *bp, double v, double from )
+{
+    breakpoint *next = bp->next;
+    double t1 = bp->time, t2 = next->time, x, mid, low, high, a, b, c, d, s [ 2 ];
+    int i;
+
+    segment_range ( bp, &low, &high );
+
+    if ( v < low || v > high )
+    {
+        return NAN;
+    }
+
+    if ( t2 <= t1 )
+    {
+        /* A jump */
+        return t1 >= from ? t1 : NAN;
+    }
+
+    switch ( bp->interpType )
+    {
+        case NEAREST_NEIGHBOUR:
+            mid = ( t1 + t2 ) / 2;
+
+            if ( v == bp->value && from < mid )
+            {
+                return fmax ( from, t1 );
+            }
+
+            return from <= mid ? mid : v == next->value && from <= t2 ? from : NAN;
+
+        case QUADRATIC_BEZIER:
+            if ( bp->nInterp_params < 2 )
+            {
+                return v == bp->value && from <= t2 ? fmax ( from, t1 ) : NAN;
+            }
+
+            /* Solve value ( s ) = v, then find the times of the roots in order. v is in range so a negative
+             * discriminant is only rounding */
+            a = bp->value - 2 * INTERP_PARAMS ( bp ) [ 1 ] + next->value;
+            b = 2 * ( INTERP_PARAMS ( bp ) [ 1 ] - bp->value );
+            c = bp->value - v;
+
+            if ( fabs ( a ) < 1e-12 * fabs ( b ) )
+            {
+                s [ 0 ] = s [ 1 ] = -c / b;
+            }
+            else
+            {
+                d = sqrt ( fmax ( b * b - 4 * a * c, 0 ) );
+                s [ 0 ] = ( -b - d ) / ( 2 * a );
+                s [ 1 ] = ( -b + d ) / ( 2 * a );
+
+                if ( s [ 0 ] > s [ 1 ] )
+                {
+                    d = s [ 0 ];
+                    s [ 0 ] = s [ 1 ];
+                    s [ 1 ] = d;
+                }
+            }
+
+            for ( i = 0; i < 2; i++ )
+            {
+                if ( s [ i ] >= -1e-9 && s [ i ] <= 1 + 1e-9 )
+                {
+                    x = quadratic_bezier ( t1, INTERP_PARAMS ( bp ) [ 0 ], t2, fmin ( fmax ( s [ i ], 0 ), 1 ) );
+
+                    if ( x >= from )
+                    {
+                        return x;
+                    }
+                }
+            }
+
+            return NAN;
+
+        case LINEAR:
+        case EXPONENTIAL:
+            if ( bp->value == next->value )
+            {
+                x = fmax ( from, t1 );
+                return x <= t2 ? x : NAN;
+            }
+
+            if ( bp->interpType == EXPONENTIAL && bp->value >= 0.0001 && next->value >= 0.0001 )
+            {
+                x = t1 + log ( v / bp->value ) / ( bp->log_ratio * bp->inv_duration );
+            }
+            else
+            {
+                x = t1 + ( v - bp->value ) / bp->slope;
+            }
+
+            /* Rounding may put it just outside */
+            x = fmin ( fmax ( x, t1 ), t2 );
+
+            return x >= from ? x : NAN;
+
+        default:
+            return sampled_crossing ( bp, v, from );
+    }
+}
+
+double time_at_value ( envelope *env, double v, double t_from )
+{
+    crossing_index *index;
+    double x;
+    int low = -1, high, mid, segment;
+
+    if ( !env->first )
+    {
+        return NAN;
+    }
+
+    if ( env->scaled )
+    {
+        /* Searched for in the breakpoints' own units */
+        v = ( v - env->offset ) / env->gain;
+    }
+
+    index = get_crossing_index ( env );
+    high  = index->n;
+
+    /* The last breakpoint at or before t_from */
+    while ( high - low > 1 )
+    {
+        mid = low + ( high - low ) / 2;
+
+        if ( index->times [ mid ] <= t_from )
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    /* Before the first breakpoint and after the last the envelope holds its value */
+    if ( low < 0 || low == index->n - 1 )
+    {
+        if ( v == index->bps [ low < 0 ? 0 : low ]->value )
+        {
+            return t_from;
+        }
+
+        if ( low >= 0 )
+        {
+            return NAN;
+        }
+
+        low     = 0;
+        t_from  = index->times [ 0 ];
+    }
+
+    x = segment_crossing ( index->bps [ low ], v, t_from );
+
+    if ( !isnan ( x ) )
+    {
+        return x;
+    }
+
+    /* Every segment the tree finds reaches v, apart from USER_DEFINED ones that can't be bounded */
+    for ( segment = low + 1; ( segment = first_segment ( index, 1, 0, index->size, segment, v ) ) >= 0; segment++ )
+    {
+        x = segment_crossing ( index->bps [ segment ], v, t_from );
+
+        if ( !isnan ( x ) )
+        {
+            return x;
+        }
+    }
+
+    return NAN;
+}
@@ -0,0 +1,59 @@
+
+/**
+ * envelope_search.h
+ *
+ * Finds when an envelope reaches a value, for threshold detection on long envelopes without sampling them.
+ *
+ * The range of values each segment covers is kept in a tree, so segments that can't reach the value are skipped
+ * O ( log n ) at a time, and the time inside the segment that does is solved for directly. The tree is built by the
+ * first search after the envelope changes.
+ *
+ *  LICENSE:
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#ifndef ENVELOPE_ENVELOPE_SEARCH_H
+#define ENVELOPE_ENVELOPE_SEARCH_H
+
+#include "envelope.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/***********************************************************************
+ * The first time at or after t_from at which the envelope reaches v,
+ * either passing through it or jumping over it, as a nearest
+ * neighbour segment does half way along. USER_DEFINED segments are
+ * sampled, so a crossing and back between samples can be missed.
+ * Only the main chain of an ADSR_envelope is searched.
+ *
+ * Builds its tree if the envelope has changed, so an envelope
+ * shouldn't be searched by two threads at once
+ *
+ * @param env
+ * @param v the value to look for
+ * @param t_from the time to start looking from
+ * @return the time, or NAN if the envelope never reaches v
+ ***********************************************************************/
+double time_at_value ( envelope *env, double v, double t_from );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ENVELOPE_ENVELOPE_SEARCH_H
@@ -0,0 +1,164 @@
+/**
+ * envelope_workers.c Copyright Tom Merchant (mailto:tom@tmerchant.com) 2019
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#include "envelope_workers.h"
+
+#include <stdlib.h>
+
+static void* worker_run ( void *arg )
+{
+    worker *self = arg;
+    worker_pool *pool = self->pool;
+    int counted;
+
+    pthread_mutex_lock ( &pool->lock );
+
+    for ( ;; )
+    {
+        while ( pool->generation == self->seen && !pool->quit )
+        {
+            pthread_cond_wait ( &pool->work, &pool->lock );
+        }
+
+        if ( pool->quit )
+        {
+            break;
+        }
+
+        self->seen = pool->generation;
+
+        if ( self->index + 1 < pool->parts )
+        {
+            pthread_mutex_unlock ( &pool->lock );
+            counted = pool->part ( pool->user, self->index + 1 );
+            pthread_mutex_lock ( &pool->lock );
+
+            pool->counted += counted;
+        }
+
+        if ( --pool->busy == 0 )
+        {
+            pthread_cond_signal ( &pool->done );
+        }
+    }
+
+    pthread_mutex_unlock ( &pool->lock );
+
+    return NULL;
+}
+
+static void stop_workers ( worker_pool *pool )
+{
+    int i;
+
+    pthread_mutex_lock ( &pool->lock );
+    pool->quit = 1;
+    pthread_cond_broadcast ( &pool->work );
+    pthread_mutex_unlock ( &pool->lock );
+
+    for ( i = 0; i < pool->nWorkers; i++ )
+    {
+        pthread_join ( pool->workers [ i ].thread, NULL );
+    }
+
+    free ( pool->workers );
+    pool->workers  = NULL;
+    pool->nWorkers = 0;
+    pool->quit     = 0;
+}
+
+void worker_pool_init ( worker_pool *pool, worker_part_callback part, void *user )
+{
+    pool->part       = part;
+    pool->user       = user;
+    pool->parts      = 1;
+    pool->counted    = 0;
+    pool->nWorkers   = 0;
+    pool->workers    = NULL;
+    pool->generation = 0;
+    pool->busy       = 0;
+    pool->quit       = 0;
+
+    pthread_mutex_init ( &pool->lock, NULL );
+    pthread_cond_init ( &pool->work, NULL );
+    pthread_cond_init ( &pool->done, NULL );
+}
+
+void worker_pool_destroy ( worker_pool *pool )
+{
+    stop_workers ( pool );
+
+    pthread_mutex_destroy ( &pool->lock );
+    pthread_cond_destroy ( &pool->work );
+    pthread_cond_destroy ( &pool->done );
+}
+
+void worker_pool_set_threads ( worker_pool *pool, int threads )
+{
+    int i;
+
+    stop_workers ( pool );
+
+    if ( threads <= 1 )
+    {
+        return;
+    }
+
+    pool->nWorkers = threads - 1;
+    pool->workers  = calloc ( pool->nWorkers, sizeof ( worker ) );
+
+    for ( i = 0; i < pool->nWorkers; i++ )
+    {
+        pool->workers [ i ].pool  = pool;
+        pool->workers [ i ].index = i;
+        pool->workers [ i ].seen  = pool->generation;
+        pthread_create ( &pool->workers [ i ].thread, NULL, worker_run, &pool->workers [ i ] );
+    }
+}
+
+int worker_pool_run ( worker_pool *pool, int parts )
+{
+    int counted;
+
+    pool->parts = parts < 1 ? 1 : parts > pool->nWorkers + 1 ? pool->nWorkers + 1 : parts;
+
+    if ( pool->parts == 1 )
+    {
+        return pool->part ( pool->user, 0 );
+    }
+
+    pthread_mutex_lock ( &pool->lock );
+    pool->counted = 0;
+    pool->busy    = pool->nWorkers;
+    pool->generation++;
+    pthread_cond_broadcast ( &pool->work );
+    pthread_mutex_unlock ( &pool->lock );
+
+    counted = pool->part ( pool->user, 0 );
+
+    pthread_mutex_lock ( &pool->lock );
+
+    while ( pool->busy > 0 )
+    {
+        pthread_cond_wait ( &pool->done, &pool->lock );
+    }
+
+    counted += pool->counted;
+    pthread_mutex_unlock ( &pool->lock );
+
+    return counted;
+}
@@ -0,0 +1,104 @@
+/**
+ * envelope_workers.h
+ *
+ * The worker threads lane groups and plot pools split their work between. Internal to the library.
+ *
+ * A job is split into parts, the calling thread does part 0 and worker i part i + 1. Workers sleep until the
+ * generation changes, do their part and count themselves off, and the caller waits until every worker has.
+ *
+ *  LICENSE:
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#pragma once
+
+#ifndef ENVELOPE_ENVELOPE_WORKERS_H
+#define ENVELOPE_ENVELOPE_WORKERS_H
+
+#include <pthread.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Does part p of the current job, returning a count that is summed over the parts
+ */
+typedef int ( *worker_part_callback ) ( void *user, int p );
+
+typedef struct worker_pool worker_pool;
+
+typedef struct worker
+{
+    worker_pool *pool;
+    int         index;
+    /**
+     * The last job the worker has seen
+     */
+    unsigned    seen;
+    pthread_t   thread;
+} worker;
+
+struct worker_pool
+{
+    worker_part_callback part;
+    void                 *user;
+    /**
+     * The parts the current job is split into
+     */
+    int                  parts;
+    int                  counted;
+
+    int                  nWorkers;
+    worker               *workers;
+    pthread_mutex_t      lock;
+    pthread_cond_t       work;
+    pthread_cond_t       done;
+    unsigned             generation;
+    int                  busy;
+    int                  quit;
+};
+
+/**
+ * Sets up a pool without any workers, jobs run on the calling thread until worker_pool_set_threads
+ */
+void   worker_pool_init ( worker_pool *pool, worker_part_callback part, void *user );
+
+/**
+ * Stops the workers and frees what the pool holds, not the pool itself
+ */
+void   worker_pool_destroy ( worker_pool *pool );
+
+/***********************************************************************
+ * Replaces the workers with threads - 1 new ones
+ *
+ * @param pool
+ * @param threads the number of threads, including the calling one
+ ***********************************************************************/
+void   worker_pool_set_threads ( worker_pool *pool, int threads );
+
+/***********************************************************************
+ * Does a job split into parts, no more than one part for each thread.
+ * part is called with p from 0 to parts - 1, 0 on the calling thread
+ *
+ * @return the sum of what part returned
+ ***********************************************************************/
+int    worker_pool_run ( worker_pool *pool, int parts );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ENVELOPE_ENVELOPE_WORKERS_H
@@ -0,0 +1,944 @@
+
+/**
+ * Benchmarks for the envelope library
+ *
+ * usage: envelope_bench [benchmark ...], runs every benchmark if none are named
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "../envelope.h"
+#include "../envelope_packed.h"
+#include "../envelope_integral.h"
+#include "../envelope_search.h"
+#include "../envelope_multi.h"
+#include "../envelope_lanes.h"
+#include "../envelope_pool.h"
+#include "../envelope_plot.h"
+#include "../envelope_polyline.h"
+
+typedef struct benchmark
+{
+    const char *name;
+    void ( *run ) ( void );
+} benchmark;
+
+static double now ( void )
+{
+    struct timespec ts;
+
+    clock_gettime ( CLOCK_MONOTONIC, &ts );
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long file_size ( const char *file )
+{
+    struct stat st;
+
+    return stat ( file, &st ) == 0 ? (long) st.st_size : -1;
+}
+
+/* Something like a recorded controller, a slow random walk sampled every millisecond with some jitter */
+static envelope* recorded_envelope ( int n )
+{
+    envelope *env = calloc ( 1, sizeof ( envelope ) );
+    breakpoint *bp, *last = NULL;
+    double value = 0.5;
+    int i;
+
+    srand ( 1 );
+
+    for ( i = 0; i < n; i++ )
+    {
+        bp = calloc ( 1, sizeof ( breakpoint ) );
+        bp->time  = i * 0.001 + ( rand ( ) % 100 ) * 1e-6;
+        value     = fmin ( fmax ( value + ( rand ( ) % 2001 - 1000 ) * 1e-5, 0 ), 1 );
+        bp->value = value;
+
+        switch ( i % 16 )
+        {
+            case 5:
+                bp->interpType = QUADRATIC_BEZIER;
+                set_interp_params ( bp, 2 );
+                INTERP_PARAMS ( bp ) [ 0 ] = bp->time + 0.0004;
+                INTERP_PARAMS ( bp ) [ 1 ] = value;
+                break;
+            case 11:
+                bp->interpType = EXPONENTIAL;
+                break;
+            default:
+                bp->interpType = LINEAR;
+                break;
+        }
+
+
+        if ( last )
+        {
+            last->next = bp;
+            update_segment ( last );
+        }
+        else
+        {
+            env->first = bp;
+        }
+
+        last = bp;
+    }
+
+    env->current = env->first;
+    env->maxTime = last->time;
+    env->maxVal  = 1;
+
+    return env;
+}
+
+static void bench_packed ( void )
+{
+    const int n = 1000000, samples = 4 * n;
+    envelope *env = recorded_envelope ( n ), *loaded;
+    packed_reader *reader;
+    float *out = malloc ( samples * sizeof ( float ) );
+    double start, bpLoad, packedLoad, streamed, interval;
+
+    save_breakpoints ( "bench.bp", env );
+    save_breakpoints_packed ( "bench.bpk", env, 0 );
+
+    loaded = calloc ( 1, sizeof ( envelope ) );
+    start = now ( );
+    load_breakpoints ( "bench.bp", loaded );
+    bpLoad = now ( ) - start;
+    free_env ( loaded );
+
+    loaded = calloc ( 1, sizeof ( envelope ) );
+    start = now ( );
+    load_breakpoints_packed ( "bench.bpk", loaded );
+    packedLoad = now ( ) - start;
+    free_env ( loaded );
+
+    reader = packed_open ( "bench.bpk" );
+    interval = packed_max_time ( reader ) / samples;
+    start = now ( );
+    packed_render ( reader, 0, interval, samples, out );
+    streamed = now ( ) - start;
+    packed_close ( reader );
+
+    printf ( "packed: %d breakpoints\n", n );
+    printf ( "  .bp   %10ld bytes  %5.2f bytes/breakpoint  load %8.1f ms\n", file_size ( "bench.bp" ),
+             (double) file_size ( "bench.bp" ) / n, bpLoad * 1000 );
+    printf ( "  .bpk  %10ld bytes  %5.2f bytes/breakpoint  load %8.1f ms\n", file_size ( "bench.bpk" ),
+             (double) file_size ( "bench.bpk" ) / n, packedLoad * 1000 );
+    printf ( "  streaming render of %d samples from .bpk %.1f ms, %.0f samples/sec\n", samples, streamed * 1000,
+             samples / streamed );
+
+    remove ( "bench.bp" );
+    remove ( "bench.bpk" );
+    free_env ( env );
+    free ( out );
+}
+
+/* linear_interp and exponential_interp as they were before segments were cached, to compare against */
+static double uncached_linear ( breakpoint *bp, double time )
+{
+    if ( time < bp->time || !bp->next )
+    {
+        return bp->value;
+    }
+
+    if ( bp->next->time == bp->time )
+    {
+        return bp->next->value;
+    }
+
+    return bp->value + ( bp->next->value - bp->value ) / ( bp->next->time - bp->time ) * ( time - bp->time );
+}
+
+static double uncached_exponential ( breakpoint *bp, double time )
+{
+    if ( time < bp->time || !bp->next )
+    {
+        return bp->value;
+    }
+
+    if ( bp->next->time == bp->time )
+    {
+        return bp->next->value;
+    }
+
+    if ( bp->value < 0.0001 || bp->next->value < 0.0001 ) return uncached_linear ( bp, time );
+
+    return bp->value * pow ( bp->next->value / bp->value, ( time - bp->time ) / ( bp->next->time - bp->time ) );
+}
+
+/* ns per value_at call with every segment of the given type, sampled 16 times per segment */
+static double time_value_at ( envelope *env, interp_t type )
+{
+    const int samples = 16000000;
+    double start, interval = env->maxTime / samples, sum = 0;
+    breakpoint *bp;
+    int i;
+
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        bp->interpType = type;
+    }
+
+    start = now ( );
+
+    for ( i = 0; i < samples; i++ )
+    {
+        sum += value_at ( env, i * interval );
+    }
+
+    start = now ( ) - start;
+
+    /* So the loop isn't optimised away */
+    if ( sum == -1 )
+    {
+        printf ( "\n" );
+    }
+
+    return start * 1e9 / samples;
+}
+
+static void bench_value_at ( void )
+{
+    envelope *env = recorded_envelope ( 1000000 );
+    double linear, linearOld, exponential, exponentialOld;
+
+    /* The old versions as user types, which are called the same way */
+    linearOld      = time_value_at ( env, (interp_t) register_interp ( uncached_linear ) );
+    linear         = time_value_at ( env, LINEAR );
+    exponentialOld = time_value_at ( env, (interp_t) register_interp ( uncached_exponential ) );
+    exponential    = time_value_at ( env, EXPONENTIAL );
+
+    printf ( "value_at: ns per call, uncached -> cached segments\n" );
+    printf ( "  linear       %6.2f -> %6.2f\n", linearOld, linear );
+    printf ( "  exponential  %6.2f -> %6.2f\n", exponentialOld, exponential );
+
+    free_env ( env );
+}
+
+static void bench_integral ( void )
+{
+    const int n = 1000000, queries = 1000000;
+    envelope *env = recorded_envelope ( n );
+    double start, build, forward, inverse, t0, sum = 0;
+    int i;
+
+    start = now ( );
+    envelope_integral ( env, 0, 0 );
+    build = now ( ) - start;
+
+    srand ( 2 );
+    start = now ( );
+
+    for ( i = 0; i < queries; i++ )
+    {
+        t0   = env->maxTime * rand ( ) / RAND_MAX;
+        sum += envelope_integral ( env, t0, t0 + 0.5 );
+    }
+
+    forward = now ( ) - start;
+    start   = now ( );
+
+    for ( i = 0; i < queries; i++ )
+    {
+        t0   = env->maxTime * rand ( ) / RAND_MAX;
+        sum += envelope_time_at_integral ( env, t0, 0.25 );
+    }
+
+    inverse = now ( ) - start;
+
+    printf ( "integral: %d breakpoints, index built in %.1f ms\n", n, build * 1000 );
+    printf ( "  envelope_integral          %6.0f ns per query\n", forward * 1e9 / queries );
+    printf ( "  envelope_time_at_integral  %6.0f ns per query\n", inverse * 1e9 / queries );
+
+    /* So the loops aren't optimised away */
+    if ( sum == -1 )
+    {
+        printf ( "\n" );
+    }
+
+    free_env ( env );
+}
+
+/* What time_at_value replaces, stepping through the envelope until it passes v */
+static double scanned_time_at_value ( envelope *env, double v, double t_from, double step )
+{
+    double t, last = value_at ( env, t_from ), value;
+
+    for ( t = t_from + step; t <= env->maxTime; t += step )
+    {
+        value = value_at ( env, t );
+
+        if ( ( last <= v && v <= value ) || ( value <= v && v <= last ) )
+        {
+            return t;
+        }
+
+        last = value;
+    }
+
+    return NAN;
+}
+
+static void bench_search ( void )
+{
+    const int n = 1000000, queries = 100000, scans = 100;
+    envelope *env = recorded_envelope ( n );
+    double start, build, search, scan, t0, sum = 0;
+    int i;
+
+    start = now ( );
+    time_at_value ( env, 0.5, 0 );
+    build = now ( ) - start;
+
+    srand ( 3 );
+    start = now ( );
+
+    for ( i = 0; i < queries; i++ )
+    {
+        t0   = env->maxTime * rand ( ) / RAND_MAX;
+        sum += time_at_value ( env, 0.1 + 0.8 * rand ( ) / RAND_MAX, t0 );
+    }
+
+    search = now ( ) - start;
+    start  = now ( );
+
+    for ( i = 0; i < scans; i++ )
+    {
+        t0   = env->maxTime * rand ( ) / RAND_MAX;
+        sum += scanned_time_at_value ( env, 0.1 + 0.8 * rand ( ) / RAND_MAX, t0, 0.0001 );
+    }
+
+    scan = now ( ) - start;
+
+    printf ( "search: %d breakpoints, index built in %.1f ms\n", n, build * 1000 );
+    printf ( "  time_at_value             %9.0f ns per query\n", search * 1e9 / queries );
+    printf ( "  scanning in 0.1 ms steps  %9.0f ns per query\n", scan * 1e9 / scans );
+
+    if ( sum == -1 )
+    {
+        printf ( "\n" );
+    }
+
+    free_env ( env );
+}
+
+static void bench_multi ( void )
+{
+    const int n = 100000, channels = 8, frames = 512, blocks = 2000;
+    multi_envelope *env = create_multi_envelope ( channels );
+    envelope *separate [ 8 ];
+    double values [ 8 ], start, multi, single, t;
+    float *out = malloc ( frames * channels * sizeof ( float ) );
+    int i, k;
+
+    /* Eight bands following the same breakpoint times */
+    srand ( 4 );
+
+    for ( i = 0; i < n; i++ )
+    {
+        for ( k = 0; k < channels; k++ )
+        {
+            values [ k ] = 0.1 + 0.8 * rand ( ) / RAND_MAX;
+        }
+
+        multi_insert_breakpoint ( env, i * 0.001, i % 4 == 3 ? EXPONENTIAL : LINEAR, values );
+    }
+
+    for ( k = 0; k < channels; k++ )
+    {
+        separate [ k ] = multi_channel ( env, k );
+    }
+
+    start = now ( );
+
+    for ( i = 0, t = 0; i < blocks; i++, t += frames / 48000.0 )
+    {
+        multi_render_block ( env, t, 1 / 48000.0, frames, out );
+    }
+
+    multi = now ( ) - start;
+    start = now ( );
+
+    for ( i = 0, t = 0; i < blocks; i++, t += frames / 48000.0 )
+    {
+        for ( k = 0; k < channels; k++ )
+        {
+            render_block ( separate [ k ], t, 1 / 48000.0, frames, out + k * frames );
+        }
+    }
+
+    single = now ( ) - start;
+
+    printf ( "multi: %d channels, %d frame blocks, ns per frame of every channel\n", channels, frames );
+    printf ( "  %d envelopes  %6.1f\n", channels, single * 1e9 / ( blocks * frames ) );
+    printf ( "  multi_envelope %5.1f\n", multi * 1e9 / ( blocks * frames ) );
+
+    for ( k = 0; k < channels; k++ )
+    {
+        free_env ( separate [ k ] );
+    }
+
+    free_multi_env ( env );
+    free ( out );
+}
+
+static void bench_loop ( void )
+{
+    const int n = 100000, samples = 1000000;
+    envelope *env = recorded_envelope ( n );
+    breakpoint *start = env->first, *end;
+    double begin, wrapped, looped, loopStart, loopEnd, t, sum = 0;
+    int i;
+
+    /* Looping the last second, about a thousand breakpoints, for ten times the envelope's length at a 1 kHz control
+     * rate */
+    while ( start->time < env->maxTime - 1 )
+    {
+        start = start->next;
+    }
+
+    for ( end = start; end->next; end = end->next );
+
+    loopStart = start->time;
+    loopEnd   = end->time;
+
+    /* What a caller had to do before, wrapping the time itself so every cycle seeks back to the start of the loop */
+    begin = now ( );
+
+    for ( i = 0; i < samples; i++ )
+    {
+        t = i / 1000.0;
+        t = t > loopEnd ? loopStart + fmod ( t - loopStart, loopEnd - loopStart ) : t;
+        sum += value_at ( env, t );
+    }
+
+    wrapped = now ( ) - begin;
+
+    env_set_loop ( env, start, end, LOOP_FORWARD );
+    begin = now ( );
+
+    for ( i = 0; i < samples; i++ )
+    {
+        sum += value_at ( env, i / 1000.0 );
+    }
+
+    looped = now ( ) - begin;
+
+    printf ( "loop: %d breakpoints, %.0f s looping the last second, ns per value_at\n", n, samples / 1000.0 );
+    printf ( "  wrapped by the caller  %6.1f\n", wrapped * 1e9 / samples );
+    printf ( "  env_set_loop           %6.1f\n", looped * 1e9 / samples );
+
+    if ( sum == -1 )
+    {
+        printf ( "\n" );
+    }
+
+    free_env ( env );
+}
+
+/* ns per value_at, starting at start and moving by step, plus a random amount up to jitter either way */
+static double time_scrub ( envelope *env, double start, double step, double jitter, int samples )
+{
+    double begin, t = start, sum = 0;
+    int i;
+
+    srand ( 6 );
+    begin = now ( );
+
+    for ( i = 0; i < samples; i++ )
+    {
+        sum += value_at ( env, t );
+        t   += step + jitter * ( 2.0 * rand ( ) / RAND_MAX - 1 );
+    }
+
+    begin = now ( ) - begin;
+
+    return sum == -1 ? 0 : begin * 1e9 / samples;
+}
+
+static void bench_seek ( void )
+{
+    const int n = 1000000, samples = 1000000, unlinkedSamples = 200, frames = 512;
+    envelope *env = recorded_envelope ( n ), *unlinked = copy_envelope ( env );
+    breakpoint *bp;
+    float *out = malloc ( frames * sizeof ( float ) );
+    double start, end = env->maxTime, forward, reverse, jitter, block, oldReverse, oldJitter;
+    int i;
+
+    /* Without the links back every step backwards goes back to the start of the chain, as it used to */
+    for ( bp = unlinked->first; bp; bp = bp->next )
+    {
+        bp->prev = NULL;
+    }
+
+    forward = time_scrub ( env, 0, end / samples, 0, samples );
+    reverse = time_scrub ( env, end, -end / samples, 0, samples );
+    jitter  = time_scrub ( env, end / 2, 0, 0.002, samples );
+
+    oldReverse = time_scrub ( unlinked, end, -end / samples, 0, unlinkedSamples );
+    oldJitter  = time_scrub ( unlinked, end / 2, 0, 0.002, unlinkedSamples );
+
+    start = now ( );
+
+    for ( i = 0; i < samples / frames; i++ )
+    {
+        render_block ( env, end - i * frames * 0.0001, -0.0001, frames, out );
+    }
+
+    block = ( now ( ) - start ) * 1e9 / ( samples / frames * frames );
+
+    printf ( "seek: %d breakpoints, ns per value_at, without -> with links back\n", n );
+    printf ( "  forward         %12.1f\n", forward );
+    printf ( "  reverse         %12.1f -> %6.1f\n", oldReverse, reverse );
+    printf ( "  jitter          %12.1f -> %6.1f\n", oldJitter, jitter );
+    printf ( "  reverse blocks  %12s    %6.1f per sample\n", "", block );
+
+    free_env ( env );
+    free_env ( unlinked );
+    free ( out );
+}
+
+/* ns per lane per block rendering a group on the given number of threads */
+static double time_lanes ( lane_group *group, int threads, int blocks, int frames, int *written )
+{
+    double start;
+    int i;
+
+    lane_group_set_threads ( group, threads );
+    *written = 0;
+    start = now ( );
+
+    for ( i = 0; i < blocks; i++ )
+    {
+        *written += lane_group_render ( group, i * frames / 48000.0, 1 / 48000.0 );
+    }
+
+    return ( now ( ) - start ) * 1e9 / ( (double) blocks * lane_group_count ( group ) );
+}
+
+static void bench_lanes ( void )
+{
+    const int n = 512, frames = 256, blocks = 500;
+    envelope *recorded = recorded_envelope ( 10000 ), *lanes [ 512 ];
+    breakpoint *bp;
+    lane_group *group = create_lane_group ( frames );
+    double start, separate, one, four, t;
+    int i, j, k, written;
+    float sum = 0;
+
+    /* Half moving all the time, a quarter stepping and a quarter that never move */
+    for ( k = 0; k < n; k++ )
+    {
+        lanes [ k ] = copy_envelope ( recorded );
+
+        for ( bp = lanes [ k ]->first; k % 2 && bp; bp = bp->next )
+        {
+            bp->interpType = NEAREST_NEIGHBOUR;
+            bp->value      = k % 4 == 3 ? 0.5 : bp->value;
+        }
+
+        env_changed ( lanes [ k ], -INFINITY, INFINITY );
+        lane_group_add ( group, lanes [ k ] );
+    }
+
+    /* A value_at for every lane at every sample */
+    start = now ( );
+
+    for ( i = 0; i < blocks; i++ )
+    {
+        for ( k = 0; k < n; k++ )
+        {
+            for ( j = 0, t = i * frames / 48000.0; j < frames; j++, t += 1 / 48000.0 )
+            {
+                sum += (float) value_at ( lanes [ k ], t );
+            }
+        }
+    }
+
+    separate = ( now ( ) - start ) * 1e9 / ( (double) blocks * n );
+
+    one  = time_lanes ( group, 1, blocks, frames, &written );
+    printf ( "lanes: %d lanes, %d frame blocks, ns per lane per block\n", n, frames );
+    printf ( "  value_at          %8.0f\n", separate );
+    printf ( "  lane group        %8.0f, %.0f%% of lanes written\n", one, 100.0 * written / ( blocks * n ) );
+
+    four = time_lanes ( group, 4, blocks, frames, &written );
+    printf ( "  4 threads         %8.0f\n", four );
+
+    if ( sum == -1 )
+    {
+        printf ( "\n" );
+    }
+
+    free_lane_group ( group );
+
+    for ( k = 0; k < n; k++ )
+    {
+        free_env ( lanes [ k ] );
+    }
+
+    free_env ( recorded );
+}
+
+/* What ADSR_release used to do, move every breakpoint of the release chain to the release time */
+static void shift_chain ( breakpoint *bp, double t )
+{
+    for ( ; bp; bp = bp->next )
+    {
+        bp->time += t;
+
+        if ( bp->nInterp_params > 0 )
+        {
+            INTERP_PARAMS ( bp ) [ 0 ] += t;
+        }
+    }
+}
+
+static void bench_gate ( void )
+{
+    const int n = 100000, notes = 100000, oldNotes = 200, frames = 64;
+    ADSR_envelope *adsr = create_ADSR_envelope ( 0.01, 0.1, 0.5, 0.3 );
+    envelope *release = recorded_envelope ( n );
+    breakpoint *bp;
+    float out [ 64 ];
+    double start, gate, oldGate;
+    int i;
+
+    /* A long recorded release in place of the two breakpoint one, which is freed with the recording */
+    bp               = adsr->release;
+    adsr->release    = release->first;
+    release->first   = bp;
+    release->current = bp;
+
+    for ( bp = adsr->release; bp->next; bp = bp->next );
+
+    adsr->releaseEnd = bp;
+
+    start = now ( );
+
+    for ( i = 0; i < notes; i++ )
+    {
+        ADSR_trigger ( adsr, i );
+        render_block ( (envelope*) adsr, i, 0.001, frames, out );
+        ADSR_release ( adsr, i + 0.5 );
+        render_block ( (envelope*) adsr, i + 0.5, 0.001, frames, out );
+    }
+
+    gate = ( now ( ) - start ) * 1e9 / notes;
+
+    start = now ( );
+
+    for ( i = 0; i < oldNotes; i++ )
+    {
+        shift_chain ( adsr->release, i + 0.5 );
+        shift_chain ( adsr->release, -( i + 0.5 ) );
+    }
+
+    oldGate = ( now ( ) - start ) * 1e9 / oldNotes;
+
+    printf ( "gate: %d breakpoint release, ns per note of two %d frame blocks\n", n, frames );
+    printf ( "  moving the release chain   %10.1f, before rendering\n", oldGate );
+    printf ( "  release offset             %10.1f\n", gate );
+
+    free_env ( (envelope*) adsr );
+    free_env ( release );
+}
+
+/* The breakpoint as it was to begin with, with a callback pointer and every parameter in a block of its own */
+typedef struct old_breakpoint
+{
+    double  time;
+    interp_t interpType;
+    double  *interp_params;
+    int     nInterp_params;
+    double  value;
+    void    *next;
+    double  ( *interpCallback ) ( void*, double );
+} old_breakpoint;
+
+/* What malloc takes for a block, glibc's chunk sizes on 64 bit */
+static size_t heap_bytes ( size_t size )
+{
+    size = ( size + 8 + 15 ) & ~(size_t) 15;
+
+    return size < 32 ? 32 : size;
+}
+
+/* loaded is set for envelopes from load_breakpoints, which gave every breakpoint a parameter array of 3 or more */
+static void memory_report ( const char *name, const envelope *env, int loaded )
+{
+    const breakpoint *bp;
+    size_t before = 0, after = 0, capacity;
+    long n = 0;
+
+    for ( bp = env->first; bp; bp = bp->next, n++ )
+    {
+        before += heap_bytes ( sizeof ( old_breakpoint ) );
+        after  += heap_bytes ( sizeof ( breakpoint ) );
+
+        for ( capacity = loaded ? 3 : bp->nInterp_params; capacity < (size_t) bp->nInterp_params; capacity *= 2 );
+
+        if ( capacity > 0 )
+        {
+            before += heap_bytes ( capacity * sizeof ( double ) );
+        }
+
+        if ( bp->nInterp_params > BP_INLINE_PARAMS )
+        {
+            after += heap_bytes ( bp->nInterp_params * sizeof ( double ) );
+        }
+    }
+
+    if ( n > 0 )
+    {
+        printf ( "  %-24s %8ld %8.1f -> %6.1f\n", name, n, (double) before / n, (double) after / n );
+    }
+}
+
+/*
+ * Bytes per breakpoint on the heap, counting malloc's overhead. Files named in ENVELOPE_PRESETS, separated by spaces,
+ * are reported along with the built in envelopes
+ */
+static void bench_memory ( void )
+{
+    const int n = 4000;
+    ADSR_envelope *adsr = create_ADSR_envelope ( 0.01, 0.1, 0.5, 0.3 );
+    envelope *recorded = recorded_envelope ( 100000 ), *drawn, *preset;
+    const char *presets = getenv ( "ENVELOPE_PRESETS" );
+    char *files, *file;
+    double *times = malloc ( n * sizeof ( double ) ), *values = malloc ( n * sizeof ( double ) );
+    int i;
+
+    /* Something drawn by hand, curves fitted to a wobbly line */
+    for ( i = 0; i < n; i++ )
+    {
+        times  [ i ] = i * 0.01;
+        values [ i ] = 0.5 + 0.4 * sin ( i * 0.013 ) * sin ( i * 0.0021 );
+    }
+
+    drawn = fit_envelope ( times, values, n, 0.001 );
+
+    printf ( "memory: heap bytes per breakpoint, %d byte breakpoints with parameters allocated apart -> %d byte "
+             "breakpoints with up to %d inline\n", (int) sizeof ( old_breakpoint ), (int) sizeof ( breakpoint ),
+             BP_INLINE_PARAMS );
+    printf ( "  %-24s %8s\n", "", "count" );
+    memory_report ( "ADSR", (envelope*) adsr, 0 );
+    memory_report ( "recorded", recorded, 0 );
+    memory_report ( "drawn", drawn, 0 );
+
+    if ( presets )
+    {
+        files = strdup ( presets );
+
+        for ( file = strtok ( files, " " ); file; file = strtok ( NULL, " " ) )
+        {
+            preset = calloc ( 1, sizeof ( envelope ) );
+
+            if ( load_breakpoints ( file, preset ) == 0 )
+            {
+                memory_report ( file, preset, 1 );
+            }
+
+            free_env ( preset );
+        }
+
+        free ( files );
+    }
+
+    free_env ( (envelope*) adsr );
+    free_env ( recorded );
+    free_env ( drawn );
+    free ( times );
+    free ( values );
+}
+
+static void bench_pool ( void )
+{
+    const int nShapes = 200, nPresets = 4000, perPreset = 4, n = 64;
+    envelope_pool *pool = create_envelope_pool ( );
+    envelope_pool_stats stats;
+    envelope *recorded = recorded_envelope ( n ), **shapes = malloc ( nShapes * sizeof ( envelope* ) );
+    envelope **held = malloc ( nPresets * perPreset * sizeof ( envelope* ) );
+    breakpoint *bp;
+    double start, interned = 0;
+    int i, k;
+
+    for ( k = 0; k < nShapes; k++ )
+    {
+        shapes [ k ] = copy_envelope ( recorded );
+
+        for ( bp = shapes [ k ]->first; bp; bp = bp->next )
+        {
+            bp->value *= ( k + 1.0 ) / nShapes;
+        }
+
+        env_changed ( shapes [ k ], -INFINITY, INFINITY );
+    }
+
+    /* Each preset's envelopes built as a load would, then interned */
+    for ( i = 0; i < nPresets * perPreset; i++ )
+    {
+        held [ i ] = copy_envelope ( shapes [ (int) ( ( i * 7919L ) % nShapes ) ] );
+
+        start = now ( );
+        held [ i ] = envelope_pool_intern ( pool, held [ i ] );
+        interned += now ( ) - start;
+    }
+
+    envelope_pool_get_stats ( pool, &stats );
+
+    printf ( "pool: %d presets of %d envelopes from %d shapes of %d breakpoints\n", nPresets, perPreset, nShapes, n );
+    printf ( "  intern            %10.1f ns per envelope\n", interned * 1e9 / ( nPresets * perPreset ) );
+    printf ( "  unshared          %10.1f KB\n", ( stats.bytes + stats.bytesSaved ) / 1024.0 );
+    printf ( "  pooled            %10.1f KB, %.1f KB saved\n", stats.bytes / 1024.0, stats.bytesSaved / 1024.0 );
+
+    for ( i = 0; i < nPresets * perPreset; i++ )
+    {
+        envelope_pool_release ( pool, held [ i ] );
+    }
+
+    for ( k = 0; k < nShapes; k++ )
+    {
+        free_env ( shapes [ k ] );
+    }
+
+    free_envelope_pool ( pool );
+    free_env ( recorded );
+    free ( shapes );
+    free ( held );
+}
+
+static void bench_plot ( void )
+{
+    const int width = 8192, plots = 500, threads [ ] = { 2, 4, 8 };
+    envelope *recorded = recorded_envelope ( 2000 );
+    float *yvals = malloc ( width * sizeof ( float ) );
+    plot_pool *pool;
+    double start, one, many;
+    int i, k;
+
+    start = now ( );
+
+    for ( i = 0; i < plots; i++ )
+    {
+        plot_envelope_range ( recorded, 0, recorded->maxTime, width, 1000, yvals );
+    }
+
+    one = ( now ( ) - start ) * 1e3 / plots;
+
+    printf ( "plot: %d columns over %d breakpoints, ms per plot\n", width, 2000 );
+    printf ( "  plot_envelope     %8.3f\n", one );
+
+    for ( k = 0; k < 3; k++ )
+    {
+        pool  = create_plot_pool ( threads [ k ] );
+        start = now ( );
+
+        for ( i = 0; i < plots; i++ )
+        {
+            plot_envelope_parallel ( pool, recorded, 0, recorded->maxTime, width, 1000, yvals );
+        }
+
+        many = ( now ( ) - start ) * 1e3 / plots;
+        printf ( "  %d threads         %8.3f, %.2fx\n", threads [ k ], many, one / many );
+
+        free_plot_pool ( pool );
+    }
+
+    free_env ( recorded );
+    free ( yvals );
+}
+
+static void bench_polyline ( void )
+{
+    const int width = 8192, height = 1000, traces = 200, sizes [ ] = { 2000, 1000000 };
+    const float tolerances [ ] = { 0.25f, 1.0f };
+    env_polyline line = { NULL, 0, 0 };
+    float *yvals = malloc ( width * sizeof ( float ) );
+    envelope *recorded;
+    double start, plotted, traced;
+    int i, j, k;
+
+    printf ( "polyline: %d x %d pixels, us per trace\n", width, height );
+
+    for ( k = 0; k < 2; k++ )
+    {
+        recorded = recorded_envelope ( sizes [ k ] );
+        start    = now ( );
+
+        for ( i = 0; i < traces / ( k + 1 ); i++ )
+        {
+            plot_envelope_range ( recorded, 0, recorded->maxTime, width, height, yvals );
+        }
+
+        plotted = ( now ( ) - start ) * 1e6 / ( traces / ( k + 1 ) );
+        printf ( "  %7d breakpoints, plot_envelope   %9.1f, %d vertices\n", sizes [ k ], plotted, width );
+
+        for ( j = 0; j < 2; j++ )
+        {
+            start = now ( );
+
+            for ( i = 0; i < traces / ( k + 1 ); i++ )
+            {
+                tessellate_envelope ( recorded, 0, recorded->maxTime, 0, 0, width, height, tolerances [ j ], &line );
+            }
+
+            traced = ( now ( ) - start ) * 1e6 / ( traces / ( k + 1 ) );
+            printf ( "  %7d breakpoints, %.2f px         %9.1f, %d vertices\n", sizes [ k ], tolerances [ j ], traced,
+                     line.n );
+        }
+
+        free_env ( recorded );
+    }
+
+    free_polyline ( &line );
+    free ( yvals );
+}
+
+static const benchmark benchmarks [ ] =
+{
+    { "packed",   bench_packed },
+    { "value_at", bench_value_at },
+    { "integral", bench_integral },
+    { "search",   bench_search },
+    { "multi",    bench_multi },
+    { "loop",     bench_loop },
+    { "seek",     bench_seek },
+    { "lanes",    bench_lanes },
+    { "gate",     bench_gate },
+    { "memory",   bench_memory },
+    { "pool",     bench_pool },
+    { "plot",     bench_plot },
+    { "polyline", bench_polyline }
+};
+
+int main ( int argc, char **argv )
+{
+    size_t i;
+    int j, run;
+
+    for ( i = 0; i < sizeof ( benchmarks ) / sizeof ( benchmarks [ 0 ] ); i++ )
+    {
+        run = argc < 2;
+
+        for ( j = 1; j < argc; j++ )
+        {
+            run |= strcmp ( argv [ j ], benchmarks [ i ].name ) == 0;
+        }
+
+        if ( run )
+        {
+            benchmarks [ i ].run ( );
+        }
+    }
+
+    return 0;
+}
@@ -1,9 +1,20 @@
 
 #include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
 #include <setjmp.h>
 #include <cmocka.h>
 #include "../envelope.h"
+#include "../envelope_graph.h"
+#include "../envelope_packed.h"
+#include "../envelope_integral.h"
+#include "../envelope_search.h"
+#include "../envelope_multi.h"
+#include "../envelope_lanes.h"
+#include "../envelope_pool.h"
+#include "../envelope_plot.h"
+#include "../envelope_polyline.h"
 
 static void test_load_save_breakpoints ( void **state )
 {
@@ -11,7 +22,7 @@ static void test_load_save_breakpoints ( void **state )
 
     int retval;
 
-    envelope *env = malloc ( sizeof ( envelope ) );
+    envelope *env = calloc ( 1, sizeof ( envelope ) );
 
 #ifndef _WIN32
     retval = load_breakpoints ( "testdata/test_1.bp", env );
@@ -33,11 +44,1327 @@ static void test_load_save_breakpoints ( void **state )
     free_env ( env );
 }
 
+static int count_progress ( double progress, void *user )
+{
+    assert_in_range ( progress * 1000, 0, 1000 );
+    ++*(int*)user;
+    return 0;
+}
+
+static int cancel_progress ( double progress, void *user )
+{
+    (void) progress;
+    ++*(int*)user;
+    return 1;
+}
+
+static void test_load_save_progress ( void **state )
+{
+    (void) state;
+
+    int i, calls = 0;
+    FILE *bp_file;
+    envelope *env = calloc ( 1, sizeof ( envelope ) ), *cancelled = calloc ( 1, sizeof ( envelope ) );
+
+    bp_file = fopen ( "testdata/test_progress.bp", "w" );
+
+    for ( i = 0; i < 5000; i++ )
+    {
+        fprintf ( bp_file, "%f %f 0\n", i * 0.01, ( i % 100 ) * 0.01 );
+    }
+
+    fclose ( bp_file );
+
+    assert_int_equal ( load_breakpoints_progress ( "testdata/test_progress.bp", env, count_progress, &calls ), 0 );
+    assert_int_equal ( calls, 4 );
+    assert_float_equal ( env->maxTime, 49.99, 1e-9 );
+
+    calls = 0;
+    assert_int_equal ( load_breakpoints_progress ( "testdata/test_progress.bp", cancelled, cancel_progress, &calls ),
+                       -1 );
+    assert_int_equal ( calls, 1 );
+    assert_null ( cancelled->first );
+
+    /* A cancelled save leaves the old file alone */
+    env->first->value = 0.5;
+    assert_int_equal ( save_breakpoints_progress ( "testdata/test_progress.bp", env, cancel_progress, &calls ), -1 );
+    assert_int_equal ( load_breakpoints ( "testdata/test_progress.bp", cancelled ), 0 );
+    assert_float_equal ( cancelled->first->value, 0, 1e-9 );
+    free_env ( cancelled );
+
+    calls = 0;
+    assert_int_equal ( save_breakpoints_progress ( "testdata/test_progress.bp", env, count_progress, &calls ), 0 );
+    assert_int_equal ( calls, 4 );
+
+    cancelled = calloc ( 1, sizeof ( envelope ) );
+    assert_int_equal ( load_breakpoints ( "testdata/test_progress.bp", cancelled ), 0 );
+    assert_float_equal ( cancelled->first->value, 0.5, 1e-9 );
+
+    free_env ( cancelled );
+    free_env ( env );
+}
+
+static void test_load_no_breakpoints ( void **state )
+{
+    (void) state;
+
+    FILE *bp_file;
+    envelope *env = calloc ( 1, sizeof ( envelope ) );
+
+    /* Times and values without a decimal point don't match, so there are no breakpoints */
+    bp_file = fopen ( "testdata/test_no_breakpoints.bp", "w" );
+    fprintf ( bp_file, "0 0 0\n1 1 0\n" );
+    fclose ( bp_file );
+
+    assert_int_equal ( load_breakpoints ( "testdata/test_no_breakpoints.bp", env ), -1 );
+    assert_null ( env->first );
+
+    free_env ( env );
+}
+
+static void test_render_block ( void **state )
+{
+    (void) state;
+
+    int i;
+    float block [ 1000 ];
+    FILE *bp_file;
+    envelope *env = calloc ( 1, sizeof ( envelope ) ), *reference;
+
+    bp_file = fopen ( "testdata/test_render.bp", "w" );
+    fprintf ( bp_file, "0.5 0.1 0\n1.0 0.8 2 1.2 0.2\n2.0 0.4 3\n2.0 0.9 1\n3.0 0.3 0\n4.0 0.6 0\n" );
+    fclose ( bp_file );
+
+    assert_int_equal ( load_breakpoints ( "testdata/test_render.bp", env ), 0 );
+    reference = copy_envelope ( env );
+
+    /* Starts before the first breakpoint and finishes after the last */
+    render_block ( env, -0.25, 0.005, 1000, block );
+
+    for ( i = 0; i < 1000; i++ )
+    {
+        assert_float_equal ( block [ i ], (float) value_at ( reference, -0.25 + i * 0.005 ), 1e-6 );
+    }
+
+    /* The cursor is left where a value_at at the last time would leave it */
+    assert_null ( env->current->next );
+
+    free_env ( reference );
+    free_env ( env );
+}
+
+static void test_envelope_graph ( void **state )
+{
+    (void) state;
+
+    int i;
+    double t, a, b, expected;
+    float block [ 500 ];
+    envelope *env = calloc ( 1, sizeof ( envelope ) ), *reference;
+    env_node *graph, *folded;
+
+    assert_int_equal ( load_breakpoints ( "testdata/test_render.bp", env ), 0 );
+    reference = copy_envelope ( env );
+
+    /* Constants fold away and chains of affine nodes become one */
+    folded = env_graph_add ( env_graph_constant ( 2 ), env_graph_multiply ( env_graph_constant ( 3 ),
+                             env_graph_constant ( 4 ) ) );
+    assert_int_equal ( folded->type, ENV_NODE_CONSTANT );
+    assert_float_equal ( folded->value, 14, 1e-12 );
+    env_graph_free ( folded );
+
+    folded = env_graph_affine ( env_graph_add ( env_graph_envelope ( env ), env_graph_constant ( 1 ) ), 2, 0 );
+    assert_int_equal ( folded->type, ENV_NODE_AFFINE );
+    assert_int_equal ( folded->a->type, ENV_NODE_ENVELOPE );
+    assert_float_equal ( folded->offset, 2, 1e-12 );
+    env_graph_free ( folded );
+
+    /* clamp ( env * env played at half speed ) crossfaded with env by time / 5 */
+    graph = env_graph_crossfade (
+            env_graph_clamp ( env_graph_multiply ( env_graph_envelope ( env ),
+                              env_graph_warp ( env_graph_envelope ( env ),
+                                               env_graph_affine ( env_graph_time ( ), 0.5, 0 ) ) ), 0.1, 0.5 ),
+            env_graph_envelope ( env ),
+            env_graph_affine ( env_graph_time ( ), 0.2, 0 ) );
+
+    env_graph_render ( graph, 0, 0.01, 500, block );
+
+    for ( i = 0; i < 500; i++ )
+    {
+        t = i * 0.01;
+        a = fmin ( fmax ( value_at ( reference, t ) * value_at ( reference, t * 0.5 ), 0.1 ), 0.5 );
+        b = value_at ( reference, t );
+        expected = a + ( b - a ) * t * 0.2;
+
+        assert_float_equal ( block [ i ], expected, 1e-5 );
+        assert_float_equal ( env_graph_value_at ( graph, t ), expected, 1e-5 );
+    }
+
+    env_graph_free ( graph );
+    free_env ( reference );
+    free_env ( env );
+}
+
+static void test_simplify_envelope ( void **state )
+{
+    (void) state;
+
+    int i, removed, count = 0;
+    double t, v, error = 0;
+    FILE *bp_file;
+    breakpoint *bp;
+    envelope *env = calloc ( 1, sizeof ( envelope ) ), *reference;
+
+    /* A slow sine wave sampled far more often than it needs to be, with every type of segment */
+    bp_file = fopen ( "testdata/test_simplify.bp", "w" );
+
+    for ( i = 0; i < 2000; i++ )
+    {
+        t = i * 0.01;
+        v = 1.5 + sin ( t * 0.5 );
+
+        switch ( i % 4 )
+        {
+            case 2:
+                fprintf ( bp_file, "%f %f 2 %f %f\n", t, v, t + 0.005, 1.5 + sin ( ( t + 0.005 ) * 0.5 ) + 0.001 );
+                break;
+            default:
+                fprintf ( bp_file, "%f %f %d\n", t, v, i % 4 );
+                break;
+        }
+    }
+
+    fclose ( bp_file );
+
+    assert_int_equal ( load_breakpoints ( "testdata/test_simplify.bp", env ), 0 );
+    reference = copy_envelope ( env );
+
+    removed = simplify_envelope ( env, 0.01 );
+
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        count++;
+    }
+
+    assert_int_equal ( count + removed, 2000 );
+    assert_true ( count < 200 );
+
+    for ( t = -1; t < 21; t += 0.0007 )
+    {
+        error = fmax ( error, fabs ( value_at ( env, t ) - value_at ( reference, t ) ) );
+    }
+
+    assert_true ( error <= 0.01 + 1e-9 );
+
+    /* Nothing moves with no error allowed, apart from breakpoints in the middle of straight lines */
+    assert_int_equal ( simplify_envelope ( reference, 0 ), 0 );
+
+    free_env ( reference );
+    free_env ( env );
+}
+
+static void test_fit_envelope ( void **state )
+{
+    (void) state;
+
+    int i, count = 0, n = 100000;
+    double *times = malloc ( n * sizeof ( double ) ), *values = malloc ( n * sizeof ( double ) ), t;
+    breakpoint *bp, bezier, end;
+    envelope *env;
+
+    /* An exponential decay, a ramp and a parabola */
+    for ( i = 0; i < n; i++ )
+    {
+        t = times [ i ] = i * 4.0 / n;
+
+        if ( t < 1 )      values [ i ] = 0.9 * pow ( 0.1 / 0.9, t );
+        else if ( t < 2 ) values [ i ] = 0.1 + ( t - 1 ) * 0.5;
+        else              values [ i ] = 0.6 + ( t - 2 ) * ( 4 - t );
+    }
+
+    env = fit_envelope ( times, values, n, 0.001 );
+
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        count++;
+    }
+
+    assert_true ( count < 20 );
+    assert_float_equal ( env->maxTime, times [ n - 1 ], 1e-12 );
+
+    for ( i = 0; i < n; i++ )
+    {
+        assert_float_equal ( value_at ( env, times [ i ] ), values [ i ], 0.001 + 1e-9 );
+    }
+
+    free_env ( env );
+
+    /* A control point half way along used to divide by zero */
+    bezier.time = 1;
+    bezier.value = 0;
+    bezier.params.inline_params [ 0 ] = 1.5;
+    bezier.params.inline_params [ 1 ] = 2;
+    bezier.nInterp_params = 2;
+    bezier.next = &end;
+    end.time = 2;
+    end.value = 0;
+
+    assert_float_equal ( quadratic_bezier_interp ( &bezier, 1.5 ), 1, 1e-12 );
+    assert_float_equal ( quadratic_bezier_interp ( &bezier, 1.25 ), 0.75, 1e-12 );
+
+    free ( times );
+    free ( values );
+}
+
+static void test_packed_breakpoints ( void **state )
+{
+    (void) state;
+
+    int i;
+    float *streamed = malloc ( 100000 * sizeof ( float ) ), *loaded = malloc ( 100000 * sizeof ( float ) );
+    breakpoint *a, *b;
+    envelope *env = calloc ( 1, sizeof ( envelope ) ), *unpacked = calloc ( 1, sizeof ( envelope ) );
+    packed_reader *reader;
+
+    /* Several blocks of every interpolation type */
+    assert_int_equal ( load_breakpoints ( "testdata/test_simplify.bp", env ), 0 );
+    assert_int_equal ( save_breakpoints_packed ( "testdata/test_simplify.bpk", env, 0 ), 0 );
+    assert_int_equal ( load_breakpoints_packed ( "testdata/test_simplify.bpk", unpacked ), 0 );
+
+    for ( a = env->first, b = unpacked->first; a; a = a->next, b = b->next )
+    {
+        assert_non_null ( b );
+        assert_int_equal ( a->interpType, b->interpType );
+        assert_int_equal ( a->nInterp_params, b->nInterp_params );
+        assert_float_equal ( a->time, b->time, PACKED_DEFAULT_QUANTUM );
+        assert_float_equal ( a->value, b->value, PACKED_DEFAULT_QUANTUM );
+
+        for ( i = 0; i < a->nInterp_params; i++ )
+        {
+            assert_float_equal ( INTERP_PARAMS ( a ) [ i ], INTERP_PARAMS ( b ) [ i ], PACKED_DEFAULT_QUANTUM );
+        }
+    }
+
+    assert_null ( b );
+
+    /* Streaming gives the same values as rendering the whole envelope, across block boundaries */
+    reader = packed_open ( "testdata/test_simplify.bpk" );
+    assert_non_null ( reader );
+    assert_float_equal ( packed_max_time ( reader ), unpacked->maxTime, 1e-12 );
+
+    assert_int_equal ( packed_render ( reader, -0.5, 0.000213, 100000, streamed ), 0 );
+    render_block ( unpacked, -0.5, 0.000213, 100000, loaded );
+
+    for ( i = 0; i < 100000; i++ )
+    {
+        assert_float_equal ( streamed [ i ], loaded [ i ], 1e-6 );
+    }
+
+    packed_close ( reader );
+    assert_null ( packed_open ( "testdata/test_simplify.bp" ) );
+
+    free_env ( unpacked );
+    free_env ( env );
+    free ( streamed );
+    free ( loaded );
+}
+
+typedef struct change_log
+{
+    int    calls;
+    double start;
+    double end;
+} change_log;
+
+static void log_change ( envelope *env, double start, double end, void *user )
+{
+    change_log *log = user;
+
+    (void) env;
+    log->calls++;
+    log->start = start;
+    log->end   = end;
+}
+
+static void test_change_listeners ( void **state )
+{
+    (void) state;
+
+    double start, end;
+    change_log log = { 0 };
+    breakpoint *bp;
+    envelope *env = calloc ( 1, sizeof ( envelope ) ), *copy;
+
+    assert_int_equal ( load_breakpoints ( "testdata/test_render.bp", env ), 0 );
+    assert_int_equal ( env_take_changes ( env, &start, &end ), 1 );
+    assert_int_equal ( env_take_changes ( env, &start, &end ), 0 );
+
+    env_add_listener ( env, log_change, &log );
+    env_add_listener ( env, log_change, &log );
+
+    /* Inserting between 1.0 and 2.0 changes that segment */
+    bp = calloc ( 1, sizeof ( breakpoint ) );
+    bp->time = 1.5;
+    bp->value = 0.5;
+    insert_breakpoint ( env, bp );
+
+    assert_int_equal ( log.calls, 1 );
+    assert_float_equal ( log.start, 1.0, 1e-12 );
+    assert_float_equal ( log.end, 2.0, 1e-12 );
+
+    /* Moving can't pass the neighbours */
+    move_breakpoint ( env, bp, 5, 0.25 );
+    assert_int_equal ( log.calls, 2 );
+    assert_float_equal ( bp->time, 2.0, 1e-12 );
+    assert_float_equal ( value_at ( env, 2.0 ), 0.25, 1e-12 );
+
+    delete_breakpoint ( env, bp );
+    assert_int_equal ( log.calls, 3 );
+    assert_float_equal ( log.start, 1.0, 1e-12 );
+
+    /* Deleting the first breakpoint changes everything before the new first */
+    delete_breakpoint ( env, env->first );
+    assert_true ( isinf ( log.start ) );
+    assert_float_equal ( env->first->time, 1.0, 1e-12 );
+
+    assert_int_equal ( env_take_changes ( env, &start, &end ), 1 );
+    assert_true ( isinf ( start ) );
+    assert_float_equal ( end, 2.0, 1e-12 );
+
+    /* Copies don't bring the listeners with them */
+    copy = copy_envelope ( env );
+    normalise_envelope ( copy );
+    assert_int_equal ( log.calls, 4 );
+    free_env ( copy );
+
+    env_remove_listener ( env, log_change, &log );
+    normalise_envelope ( env );
+    assert_int_equal ( log.calls, 4 );
+
+    free_env ( env );
+}
+
+/* Every segment's derived data matches its breakpoints */
+static void assert_segments_current ( const envelope *env )
+{
+    breakpoint *bp, check, next;
+
+    /* The check gets its own copy of the next breakpoint, which update_segment links back to it */
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        check = *bp;
+
+        if ( bp->next )
+        {
+            next       = *bp->next;
+            check.next = &next;
+        }
+
+        update_segment ( &check );
+        assert_float_equal ( bp->slope, check.slope, 1e-12 );
+        assert_float_equal ( bp->inv_duration, check.inv_duration, 1e-12 );
+        assert_float_equal ( bp->log_ratio, check.log_ratio, 1e-12 );
+    }
+}
+
+static void test_segment_cache ( void **state )
+{
+    (void) state;
+
+    breakpoint *bp;
+    double v1, v2, t1, t2;
+    envelope *env = calloc ( 1, sizeof ( envelope ) ), *copy;
+
+    load_breakpoints ( "testdata/test_simplify.bp", env );
+    assert_segments_current ( env );
+
+    for ( bp = env->first; bp->next; bp = bp->next )
+    {
+        if ( bp->interpType == EXPONENTIAL && bp->value > 0.0001 && bp->next->value > 0.0001 )
+        {
+            break;
+        }
+    }
+
+    assert_non_null ( bp->next );
+
+    t1 = bp->time;
+    t2 = bp->next->time;
+    v1 = bp->value;
+    v2 = bp->next->value;
+    assert_float_equal ( value_at ( env, ( t1 + t2 ) / 2 ), v1 * pow ( v2 / v1, 0.5 ), 1e-12 );
+    assert_float_equal ( value_at ( env, t2 ), v2, 1e-12 );
+
+    bp->interpType = LINEAR;
+    assert_float_equal ( value_at ( env, t1 + ( t2 - t1 ) / 4 ), v1 + ( v2 - v1 ) / 4, 1e-12 );
+
+    move_breakpoint ( env, bp, ( t1 + t2 ) / 2, 0.5 );
+    assert_segments_current ( env );
+
+    bp = calloc ( 1, sizeof ( breakpoint ) );
+    bp->time = ( t1 + t2 ) * 0.75;
+    bp->value = 0.25;
+    insert_breakpoint ( env, bp );
+    assert_segments_current ( env );
+    assert_float_equal ( value_at ( env, bp->time ), 0.25, 1e-12 );
+
+    delete_breakpoint ( env, bp );
+    assert_segments_current ( env );
+
+    copy = copy_envelope ( env );
+    assert_segments_current ( copy );
+
+    simplify_envelope ( env, 0.01 );
+    assert_segments_current ( env );
+
+    normalise_envelope ( copy );
+    assert_segments_current ( copy );
+
+    free_env ( copy );
+    free_env ( env );
+}
+
+static void test_envelope_bounds ( void **state )
+{
+    (void) state;
+
+    breakpoint *bp, *high;
+    envelope *env = calloc ( 1, sizeof ( envelope ) ), *saved = calloc ( 1, sizeof ( envelope ) );
+    float block [ 4 ];
+
+    /* 0.1 0.8 0.4 0.9 0.3 0.6 at 0.5 1 2 2 3 4 */
+    load_breakpoints ( "testdata/test_render.bp", env );
+    assert_float_equal ( env->minTime, 0.5, 1e-12 );
+    assert_float_equal ( env->maxTime, 4.0, 1e-12 );
+    assert_float_equal ( env->minVal, 0.1, 1e-12 );
+    assert_float_equal ( env->maxVal, 0.9, 1e-12 );
+
+    high = env->first->next->next->next;
+    move_breakpoint ( env, high, high->time, 0.2 );
+    assert_float_equal ( env->maxVal, 0.8, 1e-12 );
+
+    delete_breakpoint ( env, env->first );
+    assert_float_equal ( env->minVal, 0.2, 1e-12 );
+    assert_float_equal ( env->minTime, 1.0, 1e-12 );
+
+    bp = calloc ( 1, sizeof ( breakpoint ) );
+    bp->time = 5;
+    bp->value = 1.5;
+    insert_breakpoint ( env, bp );
+    assert_float_equal ( env->maxVal, 1.5, 1e-12 );
+    assert_float_equal ( env->maxTime, 5.0, 1e-12 );
+
+    delete_breakpoint ( env, bp );
+    assert_float_equal ( env->maxVal, 0.8, 1e-12 );
+    assert_float_equal ( env->maxTime, 4.0, 1e-12 );
+
+    /* Normalising something that goes below 0 offsets it too */
+    move_breakpoint ( env, high, high->time, -0.5 );
+    assert_float_equal ( env->minVal, -0.5, 1e-12 );
+
+    normalise_envelope ( env );
+    assert_float_equal ( env->minVal, 0, 1e-12 );
+    assert_float_equal ( env->maxVal, 1, 1e-12 );
+    assert_float_equal ( value_at ( env, 1.0 ), 1, 1e-12 );
+    assert_float_equal ( value_at ( env, 3.0 ), 0.8 / 1.3, 1e-12 );
+
+    render_block ( env, 1.0, 1.0, 4, block );
+    assert_float_equal ( block [ 0 ], 1, 1e-6 );
+    assert_float_equal ( block [ 2 ], 0.8 / 1.3, 1e-6 );
+
+    normalise_envelope ( env );
+    assert_float_equal ( value_at ( env, 3.0 ), 0.8 / 1.3, 1e-12 );
+
+    /* Breakpoints moved once normalised are in the envelope's own units, the bounds come back out scaled */
+    move_breakpoint ( env, high, high->time, 1.8 );
+    assert_float_equal ( env->maxVal, 2.3 / 1.3, 1e-12 );
+    assert_float_equal ( env->minVal, 0.8 / 1.3, 1e-12 );
+    move_breakpoint ( env, high, high->time, -0.5 );
+
+    /* The gain is written out when saving */
+    assert_int_equal ( save_breakpoints ( "testdata/test_normalised.bp", env ), 0 );
+    assert_int_equal ( load_breakpoints ( "testdata/test_normalised.bp", saved ), 0 );
+    assert_false ( saved->scaled );
+
+    for ( bp = env->first; bp; bp = bp->next )
+    {
+        assert_float_equal ( value_at ( saved, bp->time ), value_at ( env, bp->time ), 1e-6 );
+    }
+
+    free_env ( saved );
+    free_env ( env );
+}
+
+/* The trapezium rule with a lot of steps */
+static double sampled_integral ( envelope *env, double t0, double t1 )
+{
+    const int n = 200000;
+    double sum = ( value_at ( env, t0 ) + value_at ( env, t1 ) ) / 2, h = ( t1 - t0 ) / n;
+    int i;
+
+    for ( i = 1; i < n; i++ )
+    {
+        sum += value_at ( env, t0 + i * h );
+    }
+
+    return sum * h;
+}
+
+static void test_envelope_integral ( void **state )
+{
+    (void) state;
+
+    int i;
+    double t0, t1, t;
+    envelope *env = calloc ( 1, sizeof ( envelope ) );
+
+    /* Every built in type, with a zero length segment and times either side of the breakpoints */
+    load_breakpoints ( "testdata/test_render.bp", env );
+
+    for ( i = 0; i < 20; i++ )
+    {
+        t0 = -0.5 + i * 0.27;
+        t1 = t0 + 0.1 + i * 0.13;
+
+        /* The trapezium rule is out by up to half a step at the nearest neighbour jump */
+        assert_float_equal ( envelope_integral ( env, t0, t1 ), sampled_integral ( env, t0, t1 ), 1e-5 );
+        assert_float_equal ( envelope_integral ( env, t1, t0 ), -envelope_integral ( env, t0, t1 ), 1e-12 );
+        assert_float_equal ( envelope_mean ( env, t0, t1 ), envelope_integral ( env, t0, t1 ) / ( t1 - t0 ),
+                             1e-12 );
+
+        t = envelope_time_at_integral ( env, t0, envelope_integral ( env, t0, t1 ) );
+        assert_float_equal ( t, t1, 1e-9 );
+    }
+
+    /* Past the end the last value is held */
+    assert_float_equal ( envelope_integral ( env, 4, 6 ), 1.2, 1e-12 );
+    assert_float_equal ( envelope_time_at_integral ( env, 4, 1.2 ), 6, 1e-12 );
+
+    /* Changes are picked up */
+    move_breakpoint ( env, env->first, 0.5, 0.5 );
+    assert_float_equal ( envelope_integral ( env, 0, 0.5 ), 0.25, 1e-12 );
+
+    normalise_envelope ( env );
+    assert_float_equal ( envelope_integral ( env, 0, 3.5 ), sampled_integral ( env, 0, 3.5 ), 1e-5 );
+    t = envelope_time_at_integral ( env, 0.2, 1 );
+    assert_float_equal ( envelope_integral ( env, 0.2, t ), 1, 1e-9 );
+
+    free_env ( env );
+}
+
+/* Checks that env reaches v at t and, as far as sampling can tell, not between t_from and t */
+static void assert_first_crossing ( envelope *env, double v, double t_from, double t )
+{
+    double before = value_at ( env, t - 1e-9 ), after = value_at ( env, t + 1e-9 ), sign, x;
+
+    assert_true ( t >= t_from );
+    assert_true ( fmin ( before, after ) <= v + 1e-6 && fmax ( before, after ) >= v - 1e-6 );
+
+    sign = value_at ( env, t_from ) - v;
+
+    for ( x = t_from; x < t - 1e-6; x += 0.001 )
+    {
+        assert_true ( ( value_at ( env, x ) - v ) * sign > 0 );
+    }
+}
+
+static void test_time_at_value ( void **state )
+{
+    (void) state;
+
+    int i;
+    double t, v, t_from;
+    envelope *env = calloc ( 1, sizeof ( envelope ) ), *sine = calloc ( 1, sizeof ( envelope ) );
+
+    load_breakpoints ( "testdata/test_render.bp", env );
+
+    /* Rising through a bezier, the jump of a zero length segment, and a nearest neighbour step */
+    assert_first_crossing ( env, 0.5, 0.5, time_at_value ( env, 0.5, 0.5 ) );
+    assert_float_equal ( time_at_value ( env, 0.85, 1.5 ), 2.0, 1e-12 );
+    assert_float_equal ( time_at_value ( env, 0.5, 2.1 ), 2.5, 1e-12 );
+    assert_float_equal ( time_at_value ( env, 0.45, 3.0 ), 3.5, 1e-12 );
+
+    /* Held before the first breakpoint and after the last */
+    assert_float_equal ( time_at_value ( env, 0.1, -1 ), -1, 1e-12 );
+    assert_float_equal ( time_at_value ( env, 0.6, 10 ), 10, 1e-12 );
+    assert_true ( isnan ( time_at_value ( env, 0.7, 3.5 ) ) );
+    assert_true ( isnan ( time_at_value ( env, 2, 0 ) ) );
+
+    /* 1.5 + sin ( t / 2 ) with every type of segment */
+    load_breakpoints ( "testdata/test_simplify.bp", sine );
+
+    for ( i = 0; i < 40; i++ )
+    {
+        v      = 0.6 + i * 0.045;
+        t_from = i * 0.37;
+        t      = time_at_value ( sine, v, t_from );
+
+        assert_false ( isnan ( t ) );
+        assert_first_crossing ( sine, v, t_from, t );
+    }
+
+    /* Changes are picked up, and values are in the units the envelope produces */
+    normalise_envelope ( env );
+    t = time_at_value ( env, 0.5, 0 );
+    assert_first_crossing ( env, 0.5, 0, t );
+
+    free_env ( env );
+    free_env ( sine );
+}
+
+static void test_multi_envelope ( void **state )
+{
+    (void) state;
+
+    int i, k;
+    float frames [ 3 * 1000 ], block [ 1000 ];
+    double values [ 3 ];
+    FILE *bp_file;
+    envelope *channel;
+    multi_envelope *env = create_multi_envelope ( 1 ), *loaded = create_multi_envelope ( 1 );
+
+    /* An ordinary .bp file is one channel */
+    assert_int_equal ( load_multi_breakpoints ( "testdata/test_render.bp", env ), 0 );
+    assert_int_equal ( env->channels, 1 );
+    assert_float_equal ( env->maxTime, 4.0, 1e-12 );
+
+    /* Every type of segment, a jump, and a bezier with a control value for each channel */
+    bp_file = fopen ( "testdata/test_multi.bp", "w" );
+    fprintf ( bp_file, "0.5 0.1 0.9 0.3 0\n"
+                       "1.0 0.8 0.2 0.5 2 1.2 0.2 0.7 0.0\n"
+                       "2.0 0.4 0.6 0.0 3\n"
+                       "2.0 0.9 0.1 0.2 1\n"
+                       "3.0 0.3 0.5 0.8 0\n"
+                       "4.0 0.6 0.4 1.0 0\n" );
+    fclose ( bp_file );
+
+    assert_int_equal ( load_multi_breakpoints ( "testdata/test_multi.bp", env ), 0 );
+    assert_int_equal ( env->channels, 3 );
+
+    multi_render_block ( env, -0.25, 0.005, 1000, frames );
+
+    for ( k = 0; k < 3; k++ )
+    {
+        channel = multi_channel ( env, k );
+        render_block ( channel, -0.25, 0.005, 1000, block );
+
+        for ( i = 0; i < 1000; i++ )
+        {
+            assert_float_equal ( frames [ 3 * i + k ], block [ i ], 1e-6 );
+        }
+
+        multi_value_at ( env, 1.3, values );
+        assert_float_equal ( values [ k ], value_at ( channel, 1.3 ), 1e-12 );
+
+        free_env ( channel );
+    }
+
+    /* Saved and loaded again unchanged */
+    assert_int_equal ( save_multi_breakpoints ( "testdata/test_multi_sv.bp", env ), 0 );
+    assert_int_equal ( load_multi_breakpoints ( "testdata/test_multi_sv.bp", loaded ), 0 );
+    multi_render_block ( env, -0.25, 0.005, 1000, frames );
+
+    for ( i = 0; i < 1000; i++ )
+    {
+        multi_value_at ( loaded, -0.25 + i * 0.005, values );
+
+        for ( k = 0; k < 3; k++ )
+        {
+            assert_float_equal ( frames [ 3 * i + k ], values [ k ], 1e-6 );
+        }
+    }
+
+    /* Lines with the wrong number of channels are an error */
+    bp_file = fopen ( "testdata/test_multi_bad.bp", "w" );
+    fprintf ( bp_file, "0.5 0.1 0.9 0\n1.0 0.8 0\n" );
+    fclose ( bp_file );
+
+    assert_int_equal ( load_multi_breakpoints ( "testdata/test_multi_bad.bp", loaded ), -1 );
+    assert_int_equal ( loaded->channels, 3 );
+
+    free_multi_env ( env );
+    free_multi_env ( loaded );
+}
+
+/* Where t falls in an envelope looping from start to end, worked out the slow way */
+static double looped_time ( double t, double start, double end, loop_mode mode )
+{
+    while ( t > end )
+    {
+        t = mode == LOOP_FORWARD ? t - ( end - start ) : 2 * end - t;
+
+        if ( t < start )
+        {
+            t = 2 * start - t;
+        }
+    }
+
+    return t;
+}
+
+static void test_envelope_loop ( void **state )
+{
+    (void) state;
+
+    int i, mode;
+    double t, level;
+    float block [ 2000 ];
+    envelope *env = calloc ( 1, sizeof ( envelope ) ), *reference, *copy;
+    ADSR_envelope *adsr = create_ADSR_envelope ( 0.1, 0.2, 0.5, 0.3 ), *plain = create_ADSR_envelope ( 0.1, 0.2, 0.5, 0.3 );
+
+    load_breakpoints ( "testdata/test_render.bp", env );
+    reference = copy_envelope ( env );
+
+    /* From the bezier at 1.0 round to the nearest neighbour segment at 3.0, over the jump at 2.0 */
+    for ( mode = LOOP_FORWARD; mode <= LOOP_PING_PONG; mode++ )
+    {
+        env_set_loop ( env, env->first->next, env->first->next->next->next->next, mode );
+
+        for ( i = 0; i < 2000; i++ )
+        {
+            t = i * 0.0137;
+            assert_float_equal ( value_at ( env, t ), value_at ( reference, looped_time ( t, 1.0, 3.0, mode ) ), 1e-12 );
+        }
+
+        /* Blocks that start inside the loop and far past it */
+        render_block ( env, 0, 0.0137, 2000, block );
+
+        for ( i = 0; i < 2000; i++ )
+        {
+            assert_float_equal ( block [ i ], (float) value_at ( reference, looped_time ( i * 0.0137, 1.0, 3.0, mode ) ),
+                                 1e-6 );
+        }
+
+        render_block ( env, 1e6, 0.0137, 2000, block );
+
+        for ( i = 0; i < 2000; i++ )
+        {
+            t = looped_time ( 1e6 + i * 0.0137, 1.0, 3.0, mode );
+            assert_float_equal ( block [ i ], (float) value_at ( reference, t ), 1e-5 );
+        }
+    }
+
+    /* Copies keep the loop, deleting its end stops it */
+    copy = copy_envelope ( env );
+    assert_int_equal ( copy->loop, LOOP_PING_PONG );
+    assert_float_equal ( copy->loopEnd->time, 3.0, 1e-12 );
+    delete_breakpoint ( copy, copy->loopEnd );
+    assert_int_equal ( copy->loop, LOOP_OFF );
+    assert_float_equal ( value_at ( copy, 10 ), 0.6, 1e-12 );
+
+    env_set_loop ( env, NULL, NULL, LOOP_OFF );
+    assert_float_equal ( value_at ( env, 10 ), 0.6, 1e-12 );
+
+    /* A sustain loop over the decay holds until the release, which plays as it would have from the looped level */
+    env_set_loop ( (envelope*) adsr, adsr->first->next, adsr->first->next->next, LOOP_FORWARD );
+    assert_float_equal ( value_at ( (envelope*) adsr, 5.05 ), value_at ( (envelope*) plain, 0.25 ), 1e-12 );
+
+    level = value_at ( (envelope*) adsr, 5.1 );
+    ADSR_release ( adsr, 5.1 );
+    ADSR_release ( plain, 5.1 );
+
+    for ( i = 0; i < 40; i++ )
+    {
+        t = 5.1 + i * 0.01;
+        assert_float_equal ( value_at ( (envelope*) adsr, t ), value_at ( (envelope*) plain, t ) * level / 0.5, 1e-12 );
+    }
+
+    free_env ( env );
+    free_env ( reference );
+    free_env ( copy );
+    free_env ( (envelope*) adsr );
+    free_env ( (envelope*) plain );
+}
+
+static void test_reverse_seek ( void **state )
+{
+    (void) state;
+
+    int i;
+    double t;
+    float block [ 1000 ];
+    breakpoint *bp, *added = calloc ( 1, sizeof ( breakpoint ) );
+    envelope *env = calloc ( 1, sizeof ( envelope ) ), *reference;
+
+    load_breakpoints ( "testdata/test_render.bp", env );
+    reference = copy_envelope ( env );
+
+    /* Backwards from after the last breakpoint to before the first */
+    render_block ( env, 4.25, -0.005, 1000, block );
+
+    for ( i = 0; i < 1000; i++ )
+    {
+        assert_float_equal ( block [ i ], (float) value_at ( reference, 4.25 - i * 0.005 ), 1e-6 );
+    }
+
+    /* Scrubbing back and forth */
+    srand ( 5 );
+
+    for ( i = 0, t = 2; i < 1000; i++ )
+    {
+        t = fmin ( fmax ( t + ( rand ( ) % 201 - 100 ) * 0.001, 0 ), 4.5 );
+        assert_float_equal ( value_at ( env, t ), value_at ( reference, t ), 1e-12 );
+    }
+
+    /* The links back survive editing */
+    added->time = 2.5;
+    added->value = 0.7;
+    insert_breakpoint ( env, added );
+    delete_breakpoint ( env, env->first );
+    delete_breakpoint ( env, env->first->next->next );
+
+    assert_null ( env->first->prev );
+
+    for ( bp = env->first; bp->next; bp = bp->next )
+    {
+        assert_true ( bp->next->prev == bp );
+    }
+
+    free_env ( env );
+    free_env ( reference );
+}
+
+static void test_lane_group ( void **state )
+{
+    (void) state;
+
+    const int n = 100;
+    int i, k, block, written, flat = 0;
+    float expected [ 256 ];
+    FILE *bp_file;
+    envelope *sine = calloc ( 1, sizeof ( envelope ) ), *steps = calloc ( 1, sizeof ( envelope ) );
+    envelope *ramp = calloc ( 1, sizeof ( envelope ) ), *lanes [ 100 ], *references [ 100 ];
+    lane_group *group = create_lane_group ( 256 );
+
+    load_breakpoints ( "testdata/test_simplify.bp", sine );
+    load_breakpoints ( "testdata/test_render.bp", steps );
+
+    /* Curves, steps that are flat for a block at a time, and lanes that never move */
+    for ( k = 0; k < n; k++ )
+    {
+        lanes [ k ] = copy_envelope ( k % 3 == 0 ? sine : steps );
+
+        if ( k % 3 == 2 )
+        {
+            while ( lanes [ k ]->first->next )
+            {
+                delete_breakpoint ( lanes [ k ], lanes [ k ]->first->next );
+            }
+
+            flat++;
+        }
+
+        references [ k ] = copy_envelope ( lanes [ k ] );
+        assert_int_equal ( lane_group_add ( group, lanes [ k ] ), k );
+    }
+
+    lane_group_set_threads ( group, 4 );
+
+    for ( block = 0; block < 40; block++ )
+    {
+        written = lane_group_render ( group, block * 0.128, 0.0005 );
+
+        /* Lanes that were already holding their value aren't written again */
+        assert_true ( block == 0 ? written == n : written <= n - flat );
+
+        for ( k = 0; k < n; k++ )
+        {
+            render_block ( references [ k ], block * 0.128, 0.0005, 256, expected );
+
+            for ( i = 0; i < 256; i++ )
+            {
+                assert_float_equal ( lane_group_block ( group, k ) [ i ], expected [ i ], 1e-6 );
+            }
+        }
+    }
+
+    /* The last lane moves into a removed one's place */
+    lane_group_remove ( group, 0 );
+    assert_int_equal ( lane_group_count ( group ), n - 1 );
+    lane_group_set_threads ( group, 1 );
+    lane_group_render ( group, 1, 0.0005 );
+    render_block ( references [ n - 1 ], 1, 0.0005, 256, expected );
+    assert_float_equal ( lane_group_block ( group, 0 ) [ 100 ], expected [ 100 ], 1e-6 );
+
+    free_lane_group ( group );
+
+    /* Backwards from the flat end of a ramp into the ramp */
+    bp_file = fopen ( "testdata/test_lanes.bp", "w" );
+    fprintf ( bp_file, "0.0 0.0 0\n1.0 1.0 0\n2.0 1.0 0\n" );
+    fclose ( bp_file );
+
+    assert_int_equal ( load_breakpoints ( "testdata/test_lanes.bp", ramp ), 0 );
+    group = create_lane_group ( 64 );
+    lane_group_add ( group, ramp );
+    lane_group_render ( group, 1.5, -0.01 );
+    render_block ( ramp, 1.5, -0.01, 64, expected );
+
+    for ( i = 0; i < 64; i++ )
+    {
+        assert_float_equal ( lane_group_block ( group, 0 ) [ i ], expected [ i ], 1e-6 );
+    }
+
+    assert_float_equal ( lane_group_block ( group, 0 ) [ 63 ], 0.87, 1e-6 );
+
+    free_lane_group ( group );
+    free_env ( ramp );
+
+    for ( k = 0; k < n; k++ )
+    {
+        free_env ( lanes [ k ] );
+        free_env ( references [ k ] );
+    }
+
+    free_env ( sine );
+    free_env ( steps );
+}
+
+static void test_ADSR_gate ( void **state )
+{
+    (void) state;
+
+    int i;
+    double t;
+    float block [ 200 ];
+    ADSR_envelope *adsr = create_ADSR_envelope ( 0.1, 0.2, 0.5, 0.3 ), *plain = create_ADSR_envelope ( 0.1, 0.2, 0.5, 0.3 );
+
+    /* Released half way up the attack, the release starts from there and the breakpoints stay where they were */
+    ADSR_release ( adsr, 0.04 );
+    assert_float_equal ( value_at ( (envelope*) adsr, 0.04 ), 0.4, 1e-12 );
+    assert_float_equal ( value_at ( (envelope*) adsr, 0.02 ), 0.2, 1e-12 );
+    assert_float_equal ( value_at ( (envelope*) adsr, 0.34 ), 0, 1e-12 );
+    assert_float_equal ( adsr->release->time, 0, 0 );
+    assert_float_equal ( adsr->release->next->time, 0.3, 0 );
+
+    ADSR_release ( plain, 1 );
+
+    for ( i = 0; i < 30; i++ )
+    {
+        t = i * 0.01;
+        assert_float_equal ( value_at ( (envelope*) adsr, 0.04 + t ), value_at ( (envelope*) plain, 1 + t ) * 0.8, 1e-12 );
+    }
+
+    /* Retriggered during the release, the attack starts from the level it had got to */
+    ADSR_trigger ( plain, 1.1 );
+    assert_float_equal ( value_at ( (envelope*) plain, 1.1 ), 0.5 * pow ( 1 - sqrt ( 1.0 / 3 ), 2 ), 1e-12 );
+    assert_float_equal ( value_at ( (envelope*) plain, 1.2 ), 1, 1e-12 );
+    assert_float_equal ( value_at ( (envelope*) plain, 1.5 ), 0.5, 1e-12 );
+
+    render_block ( (envelope*) plain, 0.9, 0.005, 200, block );
+
+    for ( i = 0; i < 200; i++ )
+    {
+        assert_float_equal ( block [ i ], (float) value_at ( (envelope*) plain, 0.9 + i * 0.005 ), 1e-6 );
+    }
+
+    /* Legato carries on while the gate is held, and retriggers once it has been released */
+    plain->trigger = ADSR_LEGATO;
+    ADSR_trigger ( plain, 1.15 );
+    assert_float_equal ( value_at ( (envelope*) plain, 1.2 ), 1, 1e-12 );
+
+    ADSR_release ( plain, 2 );
+    ADSR_trigger ( plain, 2.1 );
+    assert_float_equal ( value_at ( (envelope*) plain, 2.15 ), 1 + 0.5 * ( 0.5 * pow ( 1 - sqrt ( 1.0 / 3 ), 2 ) - 1 ), 1e-12 );
+
+    /* Reset goes back to the envelope as it was created */
+    ADSR_reset ( plain );
+    assert_float_equal ( value_at ( (envelope*) plain, 0.05 ), 0.5, 1e-12 );
+    assert_float_equal ( value_at ( (envelope*) plain, 5 ), 0.5, 1e-12 );
+
+    /* The first legato note after a reset starts the attack */
+    ADSR_trigger ( plain, 3.0 );
+    assert_float_equal ( plain->_on, 3.0, 0 );
+    assert_float_equal ( value_at ( (envelope*) plain, 3.0 ), 0.5, 1e-12 );
+    assert_float_equal ( value_at ( (envelope*) plain, 3.1 ), 1, 1e-6 );
+
+    ADSR_trigger ( plain, 3.05 );
+    assert_float_equal ( plain->_on, 3.0, 0 );
+
+    free_env ( (envelope*) adsr );
+    free_env ( (envelope*) plain );
+}
+
+static double half_interp ( breakpoint *bp, double time )
+{
+    (void) time;
+
+    return bp->value / 2;
+}
+
+static void test_interp_params ( void **state )
+{
+    (void) state;
+
+    int type;
+    breakpoint *bp;
+    envelope *copy, *other;
+    ADSR_envelope *adsr = create_ADSR_envelope ( 0.1, 0.2, 0.5, 0.3 );
+
+    /* A bezier's control point fits inline, and copies get their own */
+    assert_ptr_equal ( INTERP_PARAMS ( adsr->first->next ), adsr->first->next->params.inline_params );
+    copy = copy_envelope ( (envelope*) adsr );
+    assert_ptr_equal ( INTERP_PARAMS ( copy->first->next ), copy->first->next->params.inline_params );
+    assert_float_equal ( INTERP_PARAMS ( copy->first->next ) [ 1 ], 0.5, 0 );
+    assert_float_equal ( value_at ( copy, 0.2 ), value_at ( (envelope*) adsr, 0.2 ), 0 );
+
+    /* More than that are allocated, and freed when they shrink again */
+    bp = copy->first;
+    set_interp_params ( bp, BP_INLINE_PARAMS + 3 ) [ BP_INLINE_PARAMS + 2 ] = 1;
+    assert_ptr_not_equal ( INTERP_PARAMS ( bp ), bp->params.inline_params );
+    assert_int_equal ( bp->nInterp_params, BP_INLINE_PARAMS + 3 );
+
+    /* Copies of allocated ones get a block of their own */
+    other = copy_envelope ( copy );
+    assert_ptr_not_equal ( INTERP_PARAMS ( other->first ), INTERP_PARAMS ( bp ) );
+    assert_float_equal ( INTERP_PARAMS ( other->first ) [ BP_INLINE_PARAMS + 2 ], 1, 0 );
+    free_env ( other );
+
+    set_interp_params ( bp, 1 );
+    assert_ptr_equal ( INTERP_PARAMS ( bp ), bp->params.inline_params );
+
+    /* User types are looked up by their tag */
+    type = register_interp ( half_interp );
+    assert_true ( type >= USER_DEFINED );
+    copy->first->next->interpType = (interp_t) type;
+    assert_float_equal ( value_at ( copy, 0.15 ), 0.5, 0 );
+
+    free_env ( copy );
+    free_env ( (envelope*) adsr );
+}
+
+static void test_envelope_pool ( void **state )
+{
+    (void) state;
+
+    envelope_pool *pool = create_envelope_pool ( );
+    envelope_pool_stats stats;
+    ADSR_envelope *adsr = create_ADSR_envelope ( 0.1, 0.2, 0.5, 0.3 );
+    const double times [ ] = { 0, 0.1, 0.3, 0.35 }, values [ ] = { 0, 1, 0.5, 0.6 };
+    envelope *shape = fit_envelope ( times, values, 4, 0 ), *a, *b, *c, *d;
+
+    /* Copies are shared, a zero that has become -0 still matches */
+    a = envelope_pool_intern ( pool, copy_envelope ( shape ) );
+    b = copy_envelope ( shape );
+    b->first->value = -0.0;
+    b = envelope_pool_intern ( pool, b );
+    assert_ptr_equal ( a, b );
+
+    /* A different value, or the same breakpoints looped, isn't */
+    c = copy_envelope ( shape );
+    c->first->next->value = 0.9;
+    c = envelope_pool_intern ( pool, c );
+    assert_ptr_not_equal ( a, c );
+
+    d = copy_envelope ( shape );
+    env_set_loop ( d, d->first, d->first->next, LOOP_FORWARD );
+    d = envelope_pool_intern ( pool, d );
+    assert_ptr_not_equal ( a, d );
+
+    envelope_pool_get_stats ( pool, &stats );
+    assert_int_equal ( stats.shapes, 3 );
+    assert_int_equal ( stats.references, 4 );
+    assert_true ( stats.bytesSaved == stats.bytes / 3 );
+
+    /* Shared envelopes last until their last reference goes */
+    envelope_pool_release ( pool, a );
+    assert_float_equal ( value_at ( b, 0.05 ), value_at ( shape, 0.05 ), 0 );
+    envelope_pool_release ( pool, b );
+    envelope_pool_release ( pool, c );
+
+    envelope_pool_get_stats ( pool, &stats );
+    assert_int_equal ( stats.shapes, 1 );
+    assert_int_equal ( stats.references, 1 );
+    assert_true ( stats.bytesSaved == 0 );
+
+    /* A holder that changes a pooled envelope, though it mustn't, can still release it */
+    a = envelope_pool_intern ( pool, copy_envelope ( shape ) );
+    b = envelope_pool_intern ( pool, copy_envelope ( shape ) );
+    normalise_envelope ( a );
+    move_breakpoint ( a, a->first->next->next, 0.3, 0.4 );
+    envelope_pool_release ( pool, a );
+    envelope_pool_release ( pool, b );
+
+    envelope_pool_get_stats ( pool, &stats );
+    assert_int_equal ( stats.shapes, 1 );
+    assert_int_equal ( stats.references, 1 );
+
+    /* An ADSR_envelope has its own gate so it's never shared */
+    assert_ptr_equal ( envelope_pool_intern ( pool, (envelope*) adsr ), adsr );
+    assert_ptr_not_equal ( envelope_pool_intern ( pool, copy_envelope ( (envelope*) adsr ) ), adsr );
+
+    free_envelope_pool ( pool );
+    free_env ( shape );
+}
+
+static void test_plot_parallel ( void **state )
+{
+    (void) state;
+
+    const int n = 2000, width = 5000;
+    double times [ 2000 ], values [ 2000 ];
+    float *expected = malloc ( width * sizeof ( float ) ), *plotted = malloc ( width * sizeof ( float ) );
+    envelope *env;
+    breakpoint *current;
+    env_cursor a, b;
+    plot_pool *pool = create_plot_pool ( 4 );
+    int i, loop;
+
+    for ( i = 0; i < n; i++ )
+    {
+        times  [ i ] = i * 0.01;
+        values [ i ] = sin ( i * 0.05 ) + 0.3 * sin ( i * 0.31 );
+    }
+
+    env = fit_envelope ( times, values, n, 0.01 );
+
+    /* Cursors read the envelope as value_at does, each from where it left off */
+    env_cursor_init ( &a, env );
+    env_cursor_init ( &b, env );
+    value_at ( env, 5 );
+    current = env->current;
+
+    for ( i = 0; i < 500; i++ )
+    {
+        assert_float_equal ( env_cursor_value_at ( &a, i * 0.04 ), value_at ( env, i * 0.04 ), 0 );
+        assert_float_equal ( env_cursor_value_at ( &b, 19.99 - i * 0.04 ), value_at ( env, 19.99 - i * 0.04 ), 0 );
+    }
+
+    /* Plotted in parts, with and without a loop, the same as on one thread and without moving the envelope */
+    for ( loop = 0; loop < 2; loop++ )
+    {
+        if ( loop )
+        {
+            env_set_loop ( env, env->first->next, env->first->next->next->next, LOOP_PING_PONG );
+        }
+
+        plot_envelope_range ( env, 0, 40, width, 100, expected );
+        value_at ( env, 5 );
+        current = env->current;
+
+        plot_envelope_parallel ( pool, env, 0, 40, width, 100, plotted );
+        assert_ptr_equal ( env->current, current );
+
+        for ( i = 0; i < width; i++ )
+        {
+            assert_float_equal ( plotted [ i ], expected [ i ], 0 );
+        }
+    }
+
+    free_plot_pool ( pool );
+    free_env ( env );
+    free ( expected );
+    free ( plotted );
+}
+
+/* How far a point is in pixels from the nearest part of a polyline */
+static double polyline_distance ( const env_polyline *line, double x, double y )
+{
+    double best = INFINITY, dx, dy, u;
+    const float *p;
+    int i;
+
+    for ( i = 0; i + 1 < line->n; i++ )
+    {
+        p  = line->points + 2 * i;
+        dx = p [ 2 ] - p [ 0 ];
+        dy = p [ 3 ] - p [ 1 ];
+        u  = dx || dy ? fmin ( fmax ( ( ( x - p [ 0 ] ) * dx + ( y - p [ 1 ] ) * dy ) / ( dx * dx + dy * dy ), 0 ), 1 ) : 0;
+        best = fmin ( best, hypot ( x - p [ 0 ] - u * dx, y - p [ 1 ] - u * dy ) );
+    }
+
+    return best;
+}
+
+static void test_polyline ( void **state )
+{
+    (void) state;
+
+    const double scale = 1200 / 12.0, range [ 2 ] [ 2 ] = { { 0, 12 }, { 1e6, 1e6 + 12 } };
+    env_polyline line = { NULL, 0, 0 };
+    FILE *bp_file;
+    envelope *env = calloc ( 1, sizeof ( envelope ) );
+    double t, v;
+    int i, mode, r;
+
+    /* Straight lines keep just their corners */
+    bp_file = fopen ( "testdata/test_polyline.bp", "w" );
+    fprintf ( bp_file, "0.0 0.0 0\n1.0 1.0 0\n2.0 0.5 0\n3.0 0.5 0\n" );
+    fclose ( bp_file );
+
+    assert_int_equal ( load_breakpoints ( "testdata/test_polyline.bp", env ), 0 );
+    assert_int_equal ( tessellate_envelope ( env, 0, 4, 10, 20, 400, 100, 0.25f, &line ), 4 );
+
+    for ( i = 0; i < 4; i++ )
+    {
+        assert_float_equal ( line.points [ 2 * i ], 10 + 100 * ( i < 3 ? i : 4 ), 1e-4 );
+        assert_float_equal ( line.points [ 2 * i + 1 ], 20 + 100 * ( 1 - ( i == 0 ? 0 : i == 1 ? 1 : 0.5 ) ), 1e-4 );
+    }
+
+    free_env ( env );
+    env = calloc ( 1, sizeof ( envelope ) );
+
+    /* Curves, a jump and a step, looped and far round the loop, stay within tolerance with fewer vertices than columns */
+    assert_int_equal ( load_breakpoints ( "testdata/test_render.bp", env ), 0 );
+
+    for ( mode = LOOP_OFF; mode <= LOOP_PING_PONG; mode++ )
+    {
+        env_set_loop ( env, mode ? env->first->next : NULL, mode ? env->first->next->next->next->next : NULL, mode );
+
+        for ( r = 0; r < ( mode ? 2 : 1 ); r++ )
+        {
+            tessellate_envelope ( env, range [ r ] [ 0 ], range [ r ] [ 1 ], 0, 0, 1200, 300, 0.5f, &line );
+
+            assert_in_range ( line.n, 2, 300 );
+            assert_float_equal ( line.points [ 0 ], 0, 1e-3 );
+            assert_float_equal ( line.points [ 2 * line.n - 2 ], 1200, 1e-3 );
+
+            for ( i = 1; i < line.n; i++ )
+            {
+                assert_true ( line.points [ 2 * i ] >= line.points [ 2 * i - 2 ] );
+            }
+
+            /* Off the edges, where a jump could be drawn from either side */
+            for ( i = 0; i < 6000; i++ )
+            {
+                t = range [ r ] [ 0 ] + 0.001 + i * 0.002;
+                v = value_at ( env, t );
+                assert_true ( polyline_distance ( &line, ( t - range [ r ] [ 0 ] ) * scale,
+                                                  ( env->maxVal - v ) * 300 / ( env->maxVal - env->minVal ) ) < 0.5 + 1e-3 );
+            }
+        }
+    }
+
+    free_polyline ( &line );
+    assert_null ( line.points );
+    free_env ( env );
+}
+
 int main ()
 {
     const struct CMUnitTest tests[] =
     {
-            cmocka_unit_test( test_load_save_breakpoints )
+            cmocka_unit_test( test_load_save_breakpoints ),
+            cmocka_unit_test( test_load_save_progress ),
+            cmocka_unit_test( test_load_no_breakpoints ),
+            cmocka_unit_test( test_render_block ),
+            cmocka_unit_test( test_envelope_graph ),
+            cmocka_unit_test( test_simplify_envelope ),
+            cmocka_unit_test( test_fit_envelope ),
+            cmocka_unit_test( test_packed_breakpoints ),
+            cmocka_unit_test( test_change_listeners ),
+            cmocka_unit_test( test_segment_cache ),
+            cmocka_unit_test( test_envelope_bounds ),
+            cmocka_unit_test( test_envelope_integral ),
+            cmocka_unit_test( test_time_at_value ),
+            cmocka_unit_test( test_multi_envelope ),
+            cmocka_unit_test( test_envelope_loop ),
+            cmocka_unit_test( test_reverse_seek ),
+            cmocka_unit_test( test_lane_group ),
+            cmocka_unit_test( test_ADSR_gate ),
+            cmocka_unit_test( test_interp_params ),
+            cmocka_unit_test( test_envelope_pool ),
+            cmocka_unit_test( test_plot_parallel ),
+            cmocka_unit_test( test_polyline )
     };
 
     cmocka_set_message_output ( CM_OUTPUT_STDOUT );